@@ -0,0 +1,227 @@
+/*
+ * Pin, data bus and timing side of the HAL: maps the Teensy pin numbers
+ * from scsi_pins.h onto the modeled bus lines and advances simulated
+ * time on every access.
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "sim_hal.h"
+#include "scsi_pins.h"
+
+#undef printf
+
+struct sim_bus sim_bus;
+struct sim_hal_ops sim_hal_ops;
+uint64_t sim_ns;
+uint32_t sim_op_ns = 10;
+int sim_verbose;
+/* a Teensy 4.1 with one PSRAM chip */
+uint8_t external_psram_size = 8;
+
+static void sim_tick(uint32_t ns)
+{
+	sim_ns += ns;
+	sim_target_step();
+}
+
+int digitalReadFast(int pin)
+{
+	const struct sim_bus *b = &sim_bus;
+	int asserted;
+
+	sim_hal_ops.pin_reads++;
+	sim_tick(sim_op_ns);
+
+	switch (pin) {
+	case SELI_PIN: asserted = b->i_sel | b->t_sel; break;
+	case BSYI_PIN: asserted = b->i_bsy | b->t_bsy; break;
+	case RSTI_PIN: asserted = b->i_rst; break;
+	case REQI_PIN: asserted = b->t_req; break;
+	case ACKI_PIN: asserted = b->i_ack; break;
+	case CDI_PIN: asserted = b->t_cd; break;
+	case IOI_PIN: asserted = b->t_io; break;
+	case MSGI_PIN: asserted = b->t_msg; break;
+	case ATNI_PIN: asserted = b->i_atn; break;
+	case DBPI_PIN: asserted = 0; break;
+	case DB0I_PIN: asserted = !!((b->i_data | b->t_data) & 0x01); break;
+	case DB1I_PIN: asserted = !!((b->i_data | b->t_data) & 0x02); break;
+	case DB2I_PIN: asserted = !!((b->i_data | b->t_data) & 0x04); break;
+	case DB3I_PIN: asserted = !!((b->i_data | b->t_data) & 0x08); break;
+	case DB4I_PIN: asserted = !!((b->i_data | b->t_data) & 0x10); break;
+	case DB5I_PIN: asserted = !!((b->i_data | b->t_data) & 0x20); break;
+	case DB6I_PIN: asserted = !!((b->i_data | b->t_data) & 0x40); break;
+	case DB7I_PIN: asserted = !!((b->i_data | b->t_data) & 0x80); break;
+	default:
+		sim_fatal("read of unknown pin %d\n", pin);
+	}
+	/* the receivers invert, an asserted line reads low */
+	return !asserted;
+}
+
+void digitalWriteFast(int pin, int val)
+{
+	struct sim_bus *b = &sim_bus;
+
+	sim_hal_ops.pin_writes++;
+	val = !!val;
+
+	switch (pin) {
+	case SELO_PIN: b->i_sel = val; break;
+	case BSYO_PIN: b->i_bsy = val; break;
+	case RSTO_PIN: b->i_rst = val; break;
+	case ACKO_PIN: b->i_ack = val; break;
+	case ATNO_PIN: b->i_atn = val; break;
+	case REQO_PIN:
+	case CDO_PIN:
+	case IOO_PIN:
+	case MSGO_PIN:
+		if (val)
+			sim_fatal("initiator drives target line on pin %d\n", pin);
+		break;
+	case DBPO_PIN:
+	case LED_PIN:
+		break;
+	case DB0O_PIN: b->i_data = (b->i_data & ~0x01) | (val << 0); break;
+	case DB1O_PIN: b->i_data = (b->i_data & ~0x02) | (val << 1); break;
+	case DB2O_PIN: b->i_data = (b->i_data & ~0x04) | (val << 2); break;
+	case DB3O_PIN: b->i_data = (b->i_data & ~0x08) | (val << 3); break;
+	case DB4O_PIN: b->i_data = (b->i_data & ~0x10) | (val << 4); break;
+	case DB5O_PIN: b->i_data = (b->i_data & ~0x20) | (val << 5); break;
+	case DB6O_PIN: b->i_data = (b->i_data & ~0x40) | (val << 6); break;
+	case DB7O_PIN: b->i_data = (b->i_data & ~0x80) | (val << 7); break;
+	default:
+		sim_fatal("write of unknown pin %d\n", pin);
+	}
+	sim_tick(sim_op_ns);
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+void delayNanoseconds(uint32_t ns)
+{
+	sim_hal_ops.delays++;
+	sim_hal_ops.delay_ns += ns;
+	sim_tick(ns);
+}
+
+void delay(uint32_t ms)
+{
+	sim_hal_ops.delays++;
+	sim_hal_ops.delay_ns += ms * 1000000ULL;
+	sim_ns += ms * 1000000ULL;
+	sim_target_step();
+}
+
+unsigned long millis(void)
+{
+	return sim_ns / 1000000;
+}
+
+unsigned long micros(void)
+{
+	return sim_ns / 1000;
+}
+
+uint8_t scsi_hal_data_read(void)
+{
+	sim_hal_ops.data_reads++;
+	sim_tick(sim_op_ns);
+	return sim_bus.i_data | sim_bus.t_data;
+}
+
+void scsi_hal_data_write(uint8_t data)
+{
+	sim_hal_ops.data_writes++;
+	sim_bus.i_data = data;
+	sim_tick(sim_op_ns);
+}
+
+void scsi_hal_data_release(void)
+{
+	sim_hal_ops.data_writes++;
+	sim_bus.i_data = 0;
+	sim_tick(sim_op_ns);
+}
+
+int scsi_hal_phase_read(void)
+{
+	sim_hal_ops.pin_reads++;
+	sim_tick(sim_op_ns);
+	return (!sim_bus.t_io) | (!sim_bus.t_cd << 1) | (!sim_bus.t_msg << 2);
+}
+
+/* the cycle counter keeps counting across clock changes */
+static uint32_t cpu_hz = 600000000;
+static uint64_t cycles_base, cycles_base_ns;
+int sim_die_temp = 50;
+
+uint32_t scsi_hal_cpu_hz(void)
+{
+	return cpu_hz;
+}
+
+uint32_t scsi_hal_cycles(void)
+{
+	return cycles_base + (sim_ns - cycles_base_ns) * (cpu_hz / 1000000) / 1000;
+}
+
+uint32_t scsi_hal_set_cpu_hz(uint32_t hz)
+{
+	cycles_base += (sim_ns - cycles_base_ns) * (cpu_hz / 1000000) / 1000;
+	cycles_base_ns = sim_ns;
+	cpu_hz = hz;
+	return hz;
+}
+
+int scsi_hal_temp(void)
+{
+	return sim_die_temp;
+}
+
+void (*sim_idle)(void);
+
+/* only the initiator drives RST, the targets never reset the bus */
+void scsi_hal_bus_events_init(void)
+{
+}
+
+int scsi_hal_bus_events(void)
+{
+	return 0;
+}
+
+/* nothing happens until the next target or host event, skip to it */
+void scsi_hal_wait_event(void)
+{
+	if (sim_idle)
+		sim_idle();
+}
+
+int sim_log(const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (!sim_verbose)
+		return 0;
+	va_start(ap, fmt);
+	printf("%12.6f ", sim_ns / 1e9);
+	ret = vprintf(fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void sim_fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "%12.6f ", sim_ns / 1e9);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(2);
+}
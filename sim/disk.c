@@ -0,0 +1,312 @@
+/*
+ * Mechanical timing of a disk drive for the target model: zoned
+ * geometry, a seek curve through the track to track, average and full
+ * stroke times, rotational position taken from the simulated clock and
+ * a read ahead track buffer. Drives with rpm 0 spin at constant linear
+ * velocity like a CD, every sector takes the same time there.
+ *
+ * Streaming into the buffer ignores head and cylinder switches, and
+ * writes go straight to the media and drop the buffer.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "sim.h"
+
+#define NS	1000ULL
+#define MS	1000000ULL
+
+static const struct sim_disk_profile profiles[] = {
+	{
+		.name = "st225n",
+		.desc = "Seagate ST225N, 1987, 21 MB, stepper, 3600 rpm, no buffer",
+		.blocksize = 512,
+		.heads = 4,
+		.rpm = 3600,
+		.track_ns = 20 * MS,
+		.avg_seek_ns = 65 * MS,
+		.max_seek_ns = 150 * MS,
+		.head_ns = 200 * NS,
+		.zones = { { 615, 17 } },
+	}, {
+		.name = "lps105s",
+		.desc = "Quantum ProDrive LPS 105S, 1991, 105 MB, 3662 rpm, 64 KB buffer",
+		.blocksize = 512,
+		.heads = 4,
+		.rpm = 3662,
+		.track_ns = 3 * MS,
+		.avg_seek_ns = 17 * MS,
+		.max_seek_ns = 30 * MS,
+		.head_ns = 1 * MS,
+		.buffer = 64 * 1024,
+		.zones = { { 305, 48 }, { 305, 44 }, { 305, 40 }, { 304, 36 } },
+	}, {
+		.name = "st32550n",
+		.desc = "Seagate Barracuda ST32550N, 1994, 2.1 GB, 7200 rpm, 512 KB buffer",
+		.blocksize = 512,
+		.heads = 11,
+		.rpm = 7200,
+		.track_ns = 600 * NS,
+		.avg_seek_ns = 8 * MS,
+		.max_seek_ns = 19 * MS,
+		.head_ns = 600 * NS,
+		.buffer = 512 * 1024,
+		.zones = { { 585, 128 }, { 585, 120 }, { 585, 112 },
+			   { 585, 104 }, { 585, 96 }, { 585, 88 } },
+	}, {
+		.name = "cdrom4x",
+		.desc = "4x CD-ROM, 1995, 650 MB, constant linear velocity, 256 KB buffer",
+		.type = 5,
+		.blocksize = 2048,
+		.heads = 1,
+		.sector_ns = 3333 * NS,
+		.track_ns = 1 * MS,
+		.avg_seek_ns = 150 * MS,
+		.max_seek_ns = 300 * MS,
+		.buffer = 256 * 1024,
+		/* revolutions of the spiral, inside out */
+		.zones = { { 4120, 10 }, { 4120, 13 }, { 4120, 16 },
+			   { 4120, 19 }, { 4120, 22 } },
+	},
+};
+
+struct sim_disk_stats sim_disk_stats;
+
+/* one per target, the public functions set dr to theirs */
+struct sim_drive {
+	const struct sim_disk_profile *p;
+	uint32_t cylinders;
+	double seek_a, seek_b;		/* ns per sqrt(distance), per distance */
+	uint32_t cyl;			/* where the heads are */
+	uint32_t buf_blocks;
+
+	/*
+	 * read ahead: block b is in the buffer at ra_t + (b - ra_lba + 1) * ra_ns,
+	 * the buffer holds buf_lo up to buf_lo + buf_blocks. Blocks before
+	 * ra_lba are in there already.
+	 */
+	int ra_valid;
+	uint32_t ra_lba, buf_lo;
+	uint64_t ra_t, ra_ns, ra_rev;
+};
+
+static struct sim_drive drives[SIM_TARGETS];
+static int ndrives;
+static struct sim_drive *dr;
+
+struct chs {
+	uint32_t cyl;
+	uint32_t head;
+	uint32_t sector;
+	uint32_t spt;
+};
+
+const struct sim_disk_profile *sim_disk_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+		if (!strcmp(profiles[i].name, name))
+			return profiles + i;
+	return NULL;
+}
+
+void sim_disk_list(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+		fprintf(stderr, "  %-10s %s, %u blocks\n", profiles[i].name, profiles[i].desc,
+			sim_disk_blocks(profiles + i));
+}
+
+uint32_t sim_disk_blocks(const struct sim_disk_profile *d)
+{
+	uint32_t n = 0;
+	int z;
+
+	for (z = 0; z < SIM_DISK_ZONES && d->zones[z].cylinders; z++)
+		n += d->zones[z].cylinders * d->heads * d->zones[z].sectors;
+	return n;
+}
+
+static void locate(uint32_t lba, struct chs *c)
+{
+	uint32_t base = 0;
+	int z;
+
+	for (z = 0; z < SIM_DISK_ZONES && dr->p->zones[z].cylinders; z++) {
+		const struct sim_disk_zone *zn = dr->p->zones + z;
+		uint32_t per_cyl = dr->p->heads * zn->sectors;
+
+		if (lba < zn->cylinders * per_cyl) {
+			c->cyl = base + lba / per_cyl;
+			c->head = lba % per_cyl / zn->sectors;
+			c->sector = lba % zn->sectors;
+			c->spt = zn->sectors;
+			return;
+		}
+		lba -= zn->cylinders * per_cyl;
+		base += zn->cylinders;
+	}
+	sim_fatal("disk: block beyond the last zone\n");
+}
+
+static uint64_t sector_ns(const struct chs *c)
+{
+	return dr->p->rpm ? 60000000000ULL / dr->p->rpm / c->spt : dr->p->sector_ns;
+}
+
+static uint64_t seek_ns(uint32_t from, uint32_t to)
+{
+	uint32_t d = from > to ? from - to : to - from;
+	double t;
+
+	if (!d)
+		return 0;
+	t = dr->p->track_ns + dr->seek_a * sqrt(d - 1) + dr->seek_b * (d - 1);
+	return t < dr->p->track_ns ? dr->p->track_ns : t;
+}
+
+/* when the read ahead stops for lack of buffer space */
+static uint64_t ra_stop(void)
+{
+	return dr->ra_t + (uint64_t)(dr->buf_lo + dr->buf_blocks - dr->ra_lba) * dr->ra_ns;
+}
+
+/* the whole request is or will be in the buffer without moving the heads */
+static int cached(uint32_t lba, uint32_t n)
+{
+	return dr->ra_valid && lba >= dr->buf_lo && lba + n <= dr->buf_lo + dr->buf_blocks;
+}
+
+/*
+ * Reading from the buffer frees the space before, so the read ahead goes
+ * on, after waiting for the platter if it had stopped with a full buffer.
+ */
+static void ra_resume(uint32_t lba, uint64_t at)
+{
+	uint64_t stop = ra_stop();
+
+	if (at > stop) {
+		dr->ra_lba = dr->buf_lo + dr->buf_blocks;
+		dr->ra_t = stop + (at - stop + dr->ra_rev - 1) / dr->ra_rev * dr->ra_rev;
+	}
+	dr->buf_lo = lba;
+}
+
+/*
+ * Completion time of a media access starting at 'at', for reads from
+ * the buffer or with the heads moving. Only updates the drive state
+ * with 'commit', so the scheduler can try out its candidates.
+ */
+static uint64_t disk_access(uint32_t lba, uint32_t n, int write, uint64_t at, int commit)
+{
+	struct chs c;
+	uint64_t t = at, rev, phase, start, sns;
+	uint32_t left = n, head;
+
+	if (!write && cached(lba, n)) {
+		t = dr->ra_t + ((int64_t)lba + n - dr->ra_lba) * (int64_t)dr->ra_ns;
+		if ((int64_t)t < (int64_t)at)
+			t = at;
+		if (commit) {
+			sim_disk_stats.buffer_hits++;
+			ra_resume(lba, at);
+		}
+		return t;
+	}
+
+	locate(lba, &c);
+	t += seek_ns(dr->cyl, c.cyl);
+	if (commit && c.cyl != dr->cyl) {
+		sim_disk_stats.seeks++;
+		sim_disk_stats.seek_ns += t - at;
+	}
+	sns = sector_ns(&c);
+	rev = sns * c.spt;
+	phase = t % rev;
+	start = c.sector * sns;
+	t += (start + rev - phase) % rev;
+	if (commit) {
+		sim_disk_stats.rotate_ns += (start + rev - phase) % rev;
+		dr->ra_valid = !write && dr->buf_blocks;
+		dr->ra_lba = dr->buf_lo = lba;
+		dr->ra_t = t;
+		dr->ra_ns = sns;
+		dr->ra_rev = rev;
+	}
+	start = t;
+
+	head = c.head;
+	while (left) {
+		uint32_t k = c.spt - c.sector < left ? c.spt - c.sector : left;
+
+		t += k * sns;
+		left -= k;
+		if (!left)
+			break;
+		/* on to the next track, skewed so no revolution is lost */
+		lba += k;
+		locate(lba, &c);
+		t += c.head != head ? dr->p->head_ns : dr->p->track_ns;
+		head = c.head;
+		sns = sector_ns(&c);
+	}
+	if (commit) {
+		dr->cyl = c.cyl;
+		sim_disk_stats.accesses++;
+		sim_disk_stats.xfer_ns += t - start;
+	}
+	return t;
+}
+
+uint64_t sim_disk_estimate(struct sim_drive *d, uint32_t lba, uint32_t n, int write, uint64_t at)
+{
+	dr = d;
+	return disk_access(lba, n, write, at, 0);
+}
+
+uint64_t sim_disk_access(struct sim_drive *d, uint32_t lba, uint32_t n, int write, uint64_t at)
+{
+	dr = d;
+	return disk_access(lba, n, write, at, 1);
+}
+
+int sim_disk_cached(struct sim_drive *d, uint32_t lba, uint32_t n)
+{
+	dr = d;
+	return cached(lba, n);
+}
+
+/*
+ * Fit t(d) = track + a * sqrt(d - 1) + b * (d - 1) through the average
+ * seek over a third of the stroke and the full stroke.
+ */
+struct sim_drive *sim_disk_init(const struct sim_disk_profile *d)
+{
+	double xa, xm, A, M, det;
+	int z;
+
+	if (ndrives == SIM_TARGETS)
+		sim_fatal("disk: more than %d drives\n", SIM_TARGETS);
+	dr = drives + ndrives++;
+	dr->p = d;
+	dr->cylinders = 0;
+	for (z = 0; z < SIM_DISK_ZONES && dr->p->zones[z].cylinders; z++)
+		dr->cylinders += dr->p->zones[z].cylinders;
+	dr->buf_blocks = dr->p->buffer / dr->p->blocksize;
+
+	xa = dr->cylinders / 3.0 - 1;
+	xm = dr->cylinders - 2.0;
+	A = (double)dr->p->avg_seek_ns - dr->p->track_ns;
+	M = (double)dr->p->max_seek_ns - dr->p->track_ns;
+	det = sqrt(xa) * xm - sqrt(xm) * xa;
+	dr->seek_a = (A * xm - M * xa) / det;
+	dr->seek_b = (sqrt(xa) * M - sqrt(xm) * A) / det;
+
+	dr->cyl = 0;
+	dr->ra_valid = 0;
+	memset(&sim_disk_stats, 0, sizeof(sim_disk_stats));
+	return dr;
+}
@@ -0,0 +1,630 @@
+/*
+ * Runs the bridge firmware as a USB device of the local machine:
+ * usb.c on the controller model, scsi.c on the bus and target models,
+ * and the model's host side wired to raw_gadget on top of dummy_hcd.
+ * The kernel's uas and usb-storage drivers bind to it like to the real
+ * thing, so fio, dd and mkfs run against the target model's disk.
+ *
+ *	modprobe dummy_hcd && modprobe raw_gadget
+ *	./gadgetsim -c 262144
+ *
+ * One thread per endpoint blocks in the raw_gadget ioctls and passes
+ * one transfer at a time to or from the main thread, which runs the
+ * firmware and all models. Simulated time has nothing to do with wall
+ * time here, the firmware's timeouts run as fast as it gets polled.
+ * See gadget.sh for the workloads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include "sim.h"
+#include "sim_usb.h"
+#include "usb_dev.h"
+#include "usb_desc.h"
+#include "scsi.h"
+#include "scsi_stats.h"
+
+#undef printf
+
+/* newer than some installed headers */
+#define RAW_EVENT_RESET		3
+#define RAW_EVENT_DISCONNECT	4
+
+#define PIPE_BUF	16384
+#define CTRL_BUF	4096
+#define SETUP_TIMEOUT	5
+
+extern const uint8_t usb_config_descriptor_480[];
+extern const uint8_t usb_config_descriptor_12[];
+extern volatile uint8_t usb_configuration;
+
+struct ep_io {
+	struct usb_raw_ep_io io;
+	uint8_t data[PIPE_BUF];
+};
+
+struct pipe {
+	const char *name;
+	uint8_t addr;		/* endpoint address, bit 7: IN */
+	int handle;		/* raw_gadget's, -1 until configured */
+	int full;		/* buf is the main thread's */
+	uint32_t len, off;
+	uint64_t transfers, bytes;
+	pthread_t thread;
+	struct ep_io buf;
+};
+
+static struct pipe pipes[] = {
+	{ "data in",  0x80 | UAS_DIN_ENDPOINT,  -1 },
+	{ "data out", UAS_DOUT_ENDPOINT,        -1 },
+	{ "status",   0x80 | UAS_STAT_ENDPOINT, -1 },
+	{ "command",  UAS_CMD_ENDPOINT,         -1 },
+};
+#define NPIPES (sizeof(pipes) / sizeof(pipes[0]))
+
+/* the control request being handled, owned by the ep0 thread */
+static struct {
+	int pending;		/* waiting to be handed to the firmware */
+	int busy;		/* firmware working on it */
+	int done;
+	int stalled;
+	int reset;
+	struct usb_ctrlrequest req;
+	uint8_t out[CTRL_BUF];	/* data stage from the host */
+	uint32_t out_len;
+	int out_taken;
+	uint8_t in[CTRL_BUF];	/* reply */
+	uint32_t in_len;
+	uint32_t requests, stalls;
+} ctl;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t quit;
+static int fd = -1;
+static int high_speed = 1;
+static int configured;
+
+/* from the core's nonstd.c, for usb_init_serialnumber() */
+char *ultoa(unsigned long val, char *buf, int radix)
+{
+	unsigned digit;
+	int i = 0, j;
+	char t;
+
+	while (1) {
+		digit = val % radix;
+		buf[i] = ((digit < 10) ? '0' + digit : 'A' + digit - 10);
+		val /= radix;
+		if (val == 0)
+			break;
+		i++;
+	}
+	buf[i + 1] = 0;
+	for (j = 0; j < i; j++, i--) {
+		t = buf[j];
+		buf[j] = buf[i];
+		buf[i] = t;
+	}
+	return buf;
+}
+
+static struct pipe *find_pipe(uint8_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < NPIPES; i++)
+		if (pipes[i].addr == addr)
+			return pipes + i;
+	return NULL;
+}
+
+static void finish(int stalled)
+{
+	ctl.busy = 0;
+	ctl.done = 1;
+	ctl.stalled = stalled;
+	pthread_cond_broadcast(&cond);
+}
+
+/* model side, called from the main thread with the firmware running */
+static int host_in(int ep, const uint8_t *data, uint32_t len)
+{
+	struct pipe *p;
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	if (ep == 0) {
+		if (ctl.busy) {
+			if (len > ctl.req.wLength)
+				len = ctl.req.wLength;
+			memcpy(ctl.in, data, len);
+			ctl.in_len = len;
+			finish(0);
+		}
+	} else if ((p = find_pipe(0x80 | ep)) && p->handle >= 0) {
+		if (p->full) {
+			ret = -1;
+		} else {
+			memcpy(p->buf.data, data, len);
+			p->len = len;
+			p->full = 1;
+			pthread_cond_broadcast(&cond);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static int host_out(int ep, uint8_t *data, uint32_t len)
+{
+	struct pipe *p;
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	if (ep == 0) {
+		if (ctl.busy && (ctl.req.bRequestType & USB_DIR_IN)) {
+			/* status stage of a request answered without data */
+			ctl.in_len = 0;
+			finish(0);
+		} else if (ctl.busy && ctl.out_len && !ctl.out_taken) {
+			ret = ctl.out_len < len ? ctl.out_len : len;
+			memcpy(data, ctl.out, ret);
+			ctl.out_taken = 1;
+		}
+	} else if ((p = find_pipe(ep)) && p->full) {
+		ret = p->len - p->off < len ? p->len - p->off : len;
+		memcpy(data, p->buf.data + p->off, ret);
+		p->off += ret;
+		if (p->off == p->len) {
+			p->full = 0;
+			pthread_cond_broadcast(&cond);
+		}
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static const uint8_t *config_descriptor(void)
+{
+	return high_speed ? usb_config_descriptor_480 : usb_config_descriptor_12;
+}
+
+static const struct usb_endpoint_descriptor *ep_descriptor(uint8_t addr)
+{
+	const uint8_t *d = config_descriptor();
+	uint32_t total = d[2] | d[3] << 8, off;
+
+	for (off = 0; off + 2 <= total && d[off]; off += d[off])
+		if (d[off + 1] == USB_DT_ENDPOINT && d[off + 2] == addr)
+			return (const struct usb_endpoint_descriptor *)(d + off);
+	return NULL;
+}
+
+static void *pipe_thread(void *arg)
+{
+	struct pipe *p = arg;
+	int in = p->addr & 0x80, n;
+
+	while (!quit) {
+		pthread_mutex_lock(&lock);
+		while (!quit && p->full != !!in)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+		if (quit)
+			break;
+
+		p->buf.io.ep = p->handle;
+		p->buf.io.flags = 0;
+		p->buf.io.length = in ? p->len : PIPE_BUF;
+		n = ioctl(fd, in ? USB_RAW_IOCTL_EP_WRITE : USB_RAW_IOCTL_EP_READ, &p->buf.io);
+		if (n < 0) {
+			/* endpoints are shut down over a bus reset, data in flight is lost */
+			if (errno != ESHUTDOWN && errno != EINTR)
+				fprintf(stderr, "%s: %s\n", p->name, strerror(errno));
+			usleep(1000);
+			if (!in)
+				continue;
+			n = 0;
+		}
+
+		pthread_mutex_lock(&lock);
+		p->transfers++;
+		p->bytes += n;
+		if (in) {
+			p->full = 0;
+		} else {
+			p->len = n;
+			p->off = 0;
+			p->full = 1;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/*
+ * BOT and UAS use different sets of the same endpoints, so all of them
+ * are enabled with the configuration and SET_INTERFACE only goes to the
+ * firmware. raw_gadget can't disable an endpoint with a request pending.
+ */
+static int enable_endpoints(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NPIPES; i++) {
+		struct pipe *p = pipes + i;
+		const struct usb_endpoint_descriptor *d = ep_descriptor(p->addr);
+		int h;
+
+		if (!d) {
+			fprintf(stderr, "no descriptor for endpoint %02x\n", p->addr);
+			return -1;
+		}
+		h = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, d);
+		if (h < 0) {
+			fprintf(stderr, "enabling endpoint %02x: %s\n", p->addr, strerror(errno));
+			return -1;
+		}
+		pthread_mutex_lock(&lock);
+		p->handle = h;
+		pthread_mutex_unlock(&lock);
+		pthread_create(&p->thread, NULL, pipe_thread, p);
+	}
+	return 0;
+}
+
+/* hand the request to the firmware and wait for it to answer */
+static int forward(const struct usb_ctrlrequest *req)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += SETUP_TIMEOUT;
+
+	pthread_mutex_lock(&lock);
+	ctl.req = *req;
+	ctl.done = 0;
+	ctl.pending = 1;
+	ctl.requests++;
+	while (!ctl.done && !ret)
+		ret = pthread_cond_timedwait(&cond, &lock, &ts);
+	if (!ctl.done) {
+		fprintf(stderr, "no answer to setup %02x %02x %04x %04x %04x\n",
+			req->bRequestType, req->bRequest, req->wValue,
+			req->wIndex, req->wLength);
+		ctl.pending = ctl.busy = 0;
+		ctl.stalled = 1;
+	}
+	if (ctl.stalled) {
+		ctl.stalls++;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static void control(const struct usb_ctrlrequest *req)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[CTRL_BUF];
+	} buf;
+	int in = req->bRequestType & USB_DIR_IN;
+	int set_config = req->bRequestType == 0 && req->bRequest == USB_REQ_SET_CONFIGURATION;
+
+	if (req->wLength > CTRL_BUF) {
+		ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+		return;
+	}
+	if (set_config && req->wValue && !configured) {
+		if (enable_endpoints() < 0) {
+			ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+			return;
+		}
+		configured = 1;
+	}
+
+	/* raw_gadget finishes the status stage with the data, can't stall after it */
+	ctl.out_len = 0;
+	ctl.out_taken = 0;
+	if (!in && req->wLength) {
+		buf.io.ep = 0;
+		buf.io.flags = 0;
+		buf.io.length = req->wLength;
+		if (ioctl(fd, USB_RAW_IOCTL_EP0_READ, &buf.io) < 0)
+			return;
+		memcpy(ctl.out, buf.data, req->wLength);
+		ctl.out_len = req->wLength;
+	}
+
+	if (forward(req) < 0) {
+		if (in || !req->wLength)
+			ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+		return;
+	}
+
+	buf.io.ep = 0;
+	buf.io.flags = 0;
+	if (in) {
+		buf.io.length = ctl.in_len;
+		memcpy(buf.data, ctl.in, ctl.in_len);
+		ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &buf.io);
+	} else if (!req->wLength) {
+		if (set_config && req->wValue) {
+			ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, config_descriptor()[8]);
+			ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+		}
+		buf.io.length = 0;
+		ioctl(fd, USB_RAW_IOCTL_EP0_READ, &buf.io);
+	}
+}
+
+static void *ep0_thread(void *arg)
+{
+	struct {
+		struct usb_raw_event ev;
+		uint8_t data[sizeof(struct usb_ctrlrequest)];
+	} e;
+
+	while (!quit) {
+		e.ev.type = 0;
+		e.ev.length = sizeof(e.data);
+		if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &e) < 0) {
+			if (errno != EINTR)
+				fprintf(stderr, "event: %s\n", strerror(errno));
+			continue;
+		}
+		switch (e.ev.type) {
+		case USB_RAW_EVENT_CONNECT:
+		case RAW_EVENT_RESET:
+			pthread_mutex_lock(&lock);
+			ctl.reset = 1;
+			pthread_mutex_unlock(&lock);
+			break;
+		case RAW_EVENT_DISCONNECT:
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			control((struct usb_ctrlrequest *)e.data);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* main thread: pass resets and setups from the ep0 thread to the model */
+static void control_poll(void)
+{
+	uint64_t setup;
+
+	pthread_mutex_lock(&lock);
+	if (ctl.reset) {
+		ctl.reset = 0;
+		pthread_mutex_unlock(&lock);
+		sim_usb_attach(high_speed);
+		/* let the firmware finish the reset before anything else */
+		sim_usb_run(100000);
+		pthread_mutex_lock(&lock);
+	}
+	if (ctl.pending) {
+		ctl.pending = 0;
+		ctl.busy = 1;
+		memcpy(&setup, &ctl.req, sizeof(setup));
+		pthread_mutex_unlock(&lock);
+		sim_usb_setup(setup);
+		return;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* nothing on its way in and the target has nothing to do */
+static int quiet(void)
+{
+	unsigned int i;
+	int q;
+
+	pthread_mutex_lock(&lock);
+	q = !ctl.pending && !ctl.busy && !ctl.reset;
+	for (i = 0; i < NPIPES; i++)
+		if (!(pipes[i].addr & 0x80) && pipes[i].full)
+			q = 0;
+	pthread_mutex_unlock(&lock);
+	return q && sim_target_idle();
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static void report(void)
+{
+	const struct scsi_stats *s = &scsi_stats;
+	const struct sim_usb_stats *u = &sim_usb_stats;
+	unsigned int i;
+
+	printf("simulated %.3f s, configuration %d, %s\n", sim_ns / 1e9, usb_configuration,
+	       usb_uas_interface_alt ? "uas" : "bot");
+	printf("  control requests %u, stalled %u\n", ctl.requests, ctl.stalls);
+	for (i = 0; i < NPIPES; i++)
+		printf("  %-8s %10llu transfers %14llu bytes\n", pipes[i].name,
+		       (unsigned long long)pipes[i].transfers,
+		       (unsigned long long)pipes[i].bytes);
+	printf("  bridge: commands %u, %llu bytes in, %llu bytes out, tags max %u, frame waits %u\n",
+	       s->commands, (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+	       s->tags_max, s->frame_waits);
+	printf("          check conditions %u, busy %u, short requests %u, unknown tags %u\n",
+	       s->check_conditions, s->busy_status, s->short_requests, s->unknown_tags);
+	printf("  target: commands %u, disconnects %u, max queue %u, queue full %u, aborts %u, resets %u\n",
+	       sim_target_stats.commands, sim_target_stats.disconnects,
+	       sim_target_stats.max_queue, sim_target_stats.queue_full,
+	       sim_target_stats.aborts, sim_target_stats.resets);
+	if (sim_disk_stats.accesses || sim_disk_stats.buffer_hits)
+		printf("  disk: accesses %u, buffer hits %u, seeks %u\n", sim_disk_stats.accesses,
+		       sim_disk_stats.buffer_hits, sim_disk_stats.seeks);
+	printf("  usb: dTDs %u, interrupts %u, primes %u\n", u->dtds, u->interrupts, u->primes);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"usb:\n"
+		"  -d driver    UDC driver (default dummy_udc)\n"
+		"  -u device    UDC device (default dummy_udc.0)\n"
+		"  -F           full speed\n"
+		"  -V           serve the bridge's RAM disk instead of the target\n"
+		"target:\n"
+		"  -i id        SCSI ID (default 0)\n"
+		"  -c blocks    capacity (default 262144, at most the -M drive's)\n"
+		"  -b bytes     block size (default 512)\n"
+		"  -M profile   mechanical disk timing instead of -a/-j, list shows them\n"
+		"  -f           media accesses in arrival order, not shortest seek first\n"
+		"  -I           no IDENTIFY (implies -T)\n"
+		"  -T           no tagged queueing\n"
+		"  -D           never disconnect\n"
+		"  -Q depth     target queue depth (default 32)\n"
+		"  -U           no power on UNIT ATTENTION\n"
+		"  -a ns        media access time (default 0)\n"
+		"  -j ns        random extra access time (default 0)\n"
+		"simulation:\n"
+		"  -S seed      controller model seed\n"
+		"  -v           show firmware console output\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_target_cfg t = {
+		.id = 0,
+		.blocks = 262144,
+		.blocksize = 512,
+		.identify = 1,
+		.tags = 1,
+		.disconnect = 1,
+		.queue_depth = 32,
+		.unit_attention = 1,
+		.sel_ns = 1000,
+		.cmd_ns = 20000,
+		.req_ns = 100,
+	};
+	struct sim_usb_cfg cfg = {
+		.seed = 1,
+		.reg_ns = 20,
+		.prime_ns = 200,
+		.hazard_ns = 100,
+		.irq_ns = 500,
+	};
+	const struct sim_usb_host host = {
+		.in = host_in,
+		.out = host_out,
+	};
+	struct usb_raw_init init;
+	const char *driver = "dummy_udc", *device = "dummy_udc.0";
+	pthread_t ep0;
+	struct timespec nap = { 0, 20000 };
+	int c;
+
+	while ((c = getopt(argc, argv, "d:u:FVi:c:b:M:fITDQ:Ua:j:S:vh")) != -1) {
+		switch (c) {
+		case 'd': driver = optarg; break;
+		case 'u': device = optarg; break;
+		case 'F': high_speed = 0; break;
+		case 'V': scsi_tunables.ramdisk = 1; break;
+		case 'i': t.id = atoi(optarg); break;
+		case 'c': t.blocks = strtoul(optarg, NULL, 0); break;
+		case 'b': t.blocksize = strtoul(optarg, NULL, 0); break;
+		case 'M':
+			if (!strcmp(optarg, "list")) {
+				sim_disk_list();
+				return 0;
+			}
+			t.disk = sim_disk_find(optarg);
+			if (!t.disk) {
+				fprintf(stderr, "unknown disk profile %s, -M list shows them\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f': t.fifo = 1; break;
+		case 'I': t.identify = 0; break;
+		case 'T': t.tags = 0; break;
+		case 'D': t.disconnect = 0; break;
+		case 'Q': t.queue_depth = atoi(optarg); break;
+		case 'U': t.unit_attention = 0; break;
+		case 'a': t.access_ns = strtoul(optarg, NULL, 0); break;
+		case 'j': t.jitter_ns = strtoul(optarg, NULL, 0); break;
+		case 'S': cfg.seed = strtoul(optarg, NULL, 0); break;
+		case 'v': sim_verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (t.disk) {
+		t.blocksize = t.disk->blocksize;
+		if (t.blocks > sim_disk_blocks(t.disk))
+			t.blocks = sim_disk_blocks(t.disk);
+	}
+	if (t.id < 0 || t.id > 6 || !t.blocks || !t.blocksize) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open("/dev/raw-gadget", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/raw-gadget");
+		return 1;
+	}
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = high_speed ? USB_SPEED_HIGH : USB_SPEED_FULL;
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+		perror("raw_gadget init");
+		return 1;
+	}
+
+	/* what startup.c and main.c do */
+	sim_ocotp.offset220 = 0x5c5153;
+	sim_target_init(&t);
+	sim_usb_init(&cfg, &host);
+	scsi_reset();
+	usb_init();
+	scsi_initialize();
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("raw_gadget run");
+		return 1;
+	}
+	pthread_create(&ep0, NULL, ep0_thread, NULL);
+
+	while (!quit) {
+		control_poll();
+		pthread_mutex_lock(&lock);
+		if (ctl.busy && sim_usb_ep0_stalled())
+			finish(1);
+		pthread_mutex_unlock(&lock);
+		usb_msc_poll();
+		sim_usb_run(1000);
+		if (quiet())
+			nanosleep(&nap, NULL);
+	}
+
+	/* the threads are stuck in ioctls, closing the device gets them out */
+	report();
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Runs gadgetsim against the kernel's drivers and puts the disk through
+# dd, mkfs and fio. Needs root, dummy_hcd and raw_gadget.
+#
+#	./gadget.sh [uas|bot] [gadgetsim options]
+#
+# bot keeps uas off the device with a usb-storage quirk, so usb-storage
+# takes the BOT alternate setting.
+
+set -e
+
+MODE=${1:-uas}
+[ $# -gt 0 ] && shift
+VIDPID=16c0:0483
+SIM=$(dirname "$0")/gadgetsim
+LOG=gadget-$MODE.log
+BLOCKS=262144
+
+modprobe dummy_hcd
+modprobe raw_gadget
+modprobe uas || true
+
+case $MODE in
+uas)	QUIRK= ;;
+bot)	QUIRK=$VIDPID:u ;;
+*)	echo "usage: $0 [uas|bot] [gadgetsim options]" >&2; exit 1 ;;
+esac
+echo "$QUIRK" > /sys/module/usb_storage/parameters/quirks
+
+"$SIM" -c $BLOCKS "$@" > "$LOG" 2>&1 &
+PID=$!
+trap 'kill -INT $PID 2>/dev/null; wait $PID; cat "$LOG"' EXIT
+
+# the target model's INQUIRY vendor
+DEV=
+for i in $(seq 1 100); do
+	for d in /sys/block/sd*; do
+		[ -e "$d/device/vendor" ] || continue
+		read -r v < "$d/device/vendor"
+		[ "$v" = SIM ] && DEV=/dev/${d##*/}
+	done
+	[ -n "$DEV" ] && break
+	sleep 0.1
+done
+if [ -z "$DEV" ]; then
+	echo "no disk showed up" >&2
+	exit 1
+fi
+DRIVER=usb-storage
+ls /sys/bus/usb/drivers/uas 2>/dev/null | grep -q : && DRIVER=uas
+echo "$DEV on $DRIVER, $(blockdev --getsize64 "$DEV") bytes"
+if [ "$MODE" = uas ] && [ "$DRIVER" != uas ]; then
+	echo "uas did not bind" >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'umount "$TMP/mnt" 2>/dev/null || true; rm -rf "$TMP"; kill -INT $PID 2>/dev/null; wait $PID; cat "$LOG"' EXIT
+
+echo "dd: write and read back 16 MB"
+dd if=/dev/urandom of="$TMP/pattern" bs=1M count=16 status=none
+dd if="$TMP/pattern" of="$DEV" bs=1M oflag=direct status=none
+dd if="$DEV" of="$TMP/readback" bs=1M count=16 iflag=direct status=none
+cmp "$TMP/pattern" "$TMP/readback"
+
+if command -v fio > /dev/null; then
+	echo "fio: random read/write with verify, queue depth 32"
+	fio --name=verify --filename="$DEV" --direct=1 --ioengine=libaio \
+	    --rw=randrw --bs=4k --iodepth=32 --size=32M --verify=crc32c \
+	    --do_verify=1 --output-format=terse > "$TMP/fio"
+	echo "fio: sequential read 64k, queue depth 8"
+	fio --name=seqread --filename="$DEV" --direct=1 --ioengine=libaio \
+	    --rw=read --bs=64k --iodepth=8 --size=64M --minimal | \
+	    awk -F';' '{ print "  " $7 " KB/s" }'
+else
+	echo "fio not installed, skipped"
+fi
+
+echo "mkfs: ext4 and fsck"
+mkfs.ext4 -q -F "$DEV"
+fsck.ext4 -n -f "$DEV" > /dev/null
+mkdir "$TMP/mnt"
+mount "$DEV" "$TMP/mnt"
+cp "$TMP/pattern" "$TMP/mnt/"
+umount "$TMP/mnt"
+mount "$DEV" "$TMP/mnt"
+cmp "$TMP/pattern" "$TMP/mnt/pattern"
+umount "$TMP/mnt"
+
+echo "all passed"
@@ -0,0 +1,932 @@
+/*
+ * USB side of the simulation: implements the frame API scsi.c uses
+ * (get_frame(), tx_uas_response(), usb_rx_*_ack(), ...) as a host that
+ * issues UAS command IUs or BOT CBWs, hands out DATA OUT on request and
+ * checks every byte read back against a shadow copy of the disk.
+ * Transfers complete instantly, so only the bus side costs time, unless
+ * stall_ns makes the host stop reading for a while now and then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "scsi.h"
+#include "usb_dev.h"
+#include "usb_desc.h"
+#include "scsi_stats.h"
+
+#define FRAME_SIZE	16384
+#define NFRAMES		64
+#define MAX_CMDS	256
+#define MAX_RETRIES	3
+#define TM_DELAY_NS	2000000
+
+struct usb_msc_cbw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t datalen;
+	uint8_t flags;
+	uint8_t lun;
+	uint8_t cbwcblen;
+	uint8_t cdb[15];
+} __attribute__((packed));
+
+struct usb_msc_csw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t data_residue;
+	uint8_t status;
+} __attribute__((packed));
+
+struct hcmd {
+	int used;
+	uint32_t tag;
+	uint32_t seq;
+	int write;
+	int lun;
+	uint32_t lba;
+	uint32_t blocks;
+	uint32_t len;
+	uint32_t din;
+	uint32_t dout;
+	int retries;
+	int ordered;
+	int aborted;		/* by task management, waits to be issued again */
+	int sense;		/* BOT REQUEST SENSE after a failed command */
+	int query;		/* enum_cmds index + 1 */
+	uint32_t issue;		/* order of issue, retries count again */
+	uint64_t issued_ns;
+	struct scsi_trace_rec *trace;
+};
+
+transfer_t *tx_free_list = LIST_END;
+transfer_t *rx_cmd_busy_list = LIST_END;
+transfer_t *rx_dout_busy_list = LIST_END;
+uint16_t rx_packet_size = 512;
+uint16_t tx_packet_size = 512;
+int usb_uas_interface_alt;
+
+struct sim_host_stats sim_host_stats;
+
+static struct sim_host_cfg cfg;
+static uint32_t blocks, blocksize;
+static uint8_t *shadow;
+
+static transfer_t frames[NFRAMES];
+static uint8_t frame_buf[NFRAMES][FRAME_SIZE] __attribute__((aligned(4096)));
+static transfer_t *pool;
+static int pool_free;
+
+static struct hcmd cmds[MAX_CMDS];
+static struct hcmd *retry;
+static struct hcmd *din_cmd, *dout_cmd;
+static int outstanding;
+static uint32_t issued, seq, next_lba, issues;
+static uint16_t next_tag = 1;
+static int warm;
+static uint64_t trace_start;
+static uint64_t wake_ns;		/* when issue() has something again */
+static uint64_t *latency;
+static uint64_t stall_until;	/* no DATA IN or status frames until then */
+static uint32_t stall_bytes;
+static int reissues;		/* aborted ones waiting */
+static uint64_t pause_until;	/* no new commands until then */
+static uint32_t paused;		/* issued at the last pause */
+static int sense_lun = -1;	/* BOT: REQUEST SENSE for it goes next */
+
+/* one task management incident at a time, about the command tm_task */
+static uint16_t tm_task;
+static int tm_lun;
+static int tm_function;
+static uint64_t tm_ns;		/* when its next IU goes */
+static uint16_t tm_tag;		/* of the IU the bridge hasn't answered yet */
+static uint32_t tm_incidents;
+
+/* what a host asks a disk it finds, again at every rescan and open */
+static const struct {
+	uint8_t cdb[10];
+	uint32_t len;
+} enum_cmds[] = {
+	{ { 0x12, 0, 0x00, 0, 36 }, 36 },	/* INQUIRY */
+	{ { 0x12, 1, 0x00, 0, 255 }, 255 },	/* supported VPD pages */
+	{ { 0x12, 1, 0x80, 0, 255 }, 255 },	/* unit serial number */
+	{ { 0x25 }, 8 },			/* READ CAPACITY(10) */
+	{ { 0x1a, 0, 0x3f, 0, 192 }, 192 },	/* MODE SENSE(6), all pages */
+	{ { 0x1a, 0, 0x08, 0, 192 }, 192 },	/* caching page */
+	{ { 0x00 }, 0 },			/* TEST UNIT READY */
+};
+#define ENUM_CMDS (sizeof(enum_cmds) / sizeof(enum_cmds[0]))
+static uint32_t enum_issued, enum_done, enum_total;
+static uint64_t enum_start;
+
+static uint32_t rnd(void)
+{
+	static uint32_t x;
+
+	if (!x)
+		x = cfg.seed ? cfg.seed : 2463534242;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static uint8_t write_pattern(const struct hcmd *c, uint32_t off)
+{
+	return c->seq * 0x9e ^ (off >> 2) ^ off;
+}
+
+static void data_moved(uint32_t len)
+{
+	if (!cfg.stall_ns)
+		return;
+	stall_bytes += len;
+	if (stall_bytes >= SIM_STALL_BYTES) {
+		stall_bytes = 0;
+		stall_until = sim_ns + cfg.stall_ns;
+	}
+}
+
+static int stalled(void)
+{
+	return sim_ns < stall_until;
+}
+
+/* get_frame() blocks, the bus side goes on meanwhile */
+static void stall_wait(void)
+{
+	if (!stalled())
+		return;
+	sim_ns = stall_until;
+	sim_target_step();
+}
+
+static transfer_t *frame_alloc(void)
+{
+	transfer_t *t = pool;
+
+	if (t == LIST_END)
+		sim_fatal("host: out of frames, %d in flight\n", NFRAMES);
+	pool = t->next;
+	pool_free--;
+	memset(t, 0, sizeof(*t));
+	t->pointer0 = (uint32_t)(uintptr_t)frame_buf[t - frames];
+	return t;
+}
+
+static void frame_free(transfer_t *t)
+{
+	t->next = pool;
+	pool = t;
+	pool_free++;
+}
+
+/* rx frames report their length like the controller does */
+static void frame_set_length(transfer_t *t, uint32_t len)
+{
+	t->status = (rx_packet_size - len) << 16;
+}
+
+static struct hcmd *find_cmd(uint32_t tag)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++)
+		if (cmds[i].used && cmds[i].tag == tag)
+			return cmds + i;
+	return NULL;
+}
+
+/* issued and neither completed nor aborted */
+static struct hcmd *live_cmd(uint32_t tag)
+{
+	struct hcmd *c = find_cmd(tag);
+
+	return c && c != retry && !c->aborted ? c : NULL;
+}
+
+static int overlaps(int lun, uint32_t lba, uint32_t n, int write)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		const struct hcmd *c = cmds + i;
+
+		if (!c->used || c->lun != lun || (!write && !c->write))
+			continue;
+		if (lba < c->lba + c->blocks && c->lba < lba + n)
+			return 1;
+	}
+	return 0;
+}
+
+static uint32_t trace_us(void)
+{
+	return (sim_ns - trace_start) / 1000;
+}
+
+/*
+ * The next trace record that can run here, once its arrival time has
+ * come. Reads and writes run as READ(10) and WRITE(10), TEST UNIT READY
+ * and SYNCHRONIZE CACHE as TEST UNIT READY, the rest is skipped.
+ */
+static int trace_next(struct hcmd *p)
+{
+	struct scsi_trace_rec *r;
+	int write;
+
+	for (; issued < cfg.commands; issued++) {
+		r = cfg.trace + issued;
+		r->status = SCSI_TRACE_NOT_RUN;
+		switch (r->opcode) {
+		case 0x08: case 0x28: case 0x88: case 0xa8:
+			write = 0;
+			break;
+		case 0x0a: case 0x2a: case 0x8a: case 0xaa:
+			write = 1;
+			break;
+		case 0x00: case 0x35:
+			write = -1;
+			break;
+		default:
+			continue;
+		}
+		if (write >= 0 && (!r->blocks || r->blocks > 0xffff ||
+				   (uint64_t)r->lba + r->blocks > blocks))
+			continue;
+		if (cfg.trace_fast)
+			r->arrival_us = trace_us();
+		else if (trace_us() < r->arrival_us) {
+			wake_ns = trace_start + r->arrival_us * 1000ULL;
+			return 0;
+		}
+		memset(p, 0, sizeof(*p));
+		p->used = 1;
+		p->seq = seq++;
+		p->trace = r;
+		if (write >= 0) {
+			p->write = write;
+			p->lba = r->lba;
+			p->blocks = r->blocks;
+			p->len = r->blocks * blocksize;
+		}
+		issued++;
+		return 1;
+	}
+	return 0;
+}
+
+static struct hcmd *new_cmd(void)
+{
+	static struct hcmd pending;
+	uint32_t n = cfg.size / blocksize;
+	int i;
+
+	/* TEST UNIT READY until each LUN is found and has no UNIT ATTENTION */
+	if (warm < cfg.luns) {
+		if (outstanding)
+			return NULL;
+		memset(&pending, 0, sizeof(pending));
+		pending.used = 1;
+		pending.lun = warm;
+		n = 0;
+	} else if (!pending.used && enum_issued < enum_total) {
+		/* one at a time, like a scan */
+		if (outstanding)
+			return NULL;
+		if (!enum_issued)
+			enum_start = sim_ns;
+		memset(&pending, 0, sizeof(pending));
+		pending.used = 1;
+		pending.query = enum_issued % ENUM_CMDS + 1;
+		pending.lun = enum_issued / ENUM_CMDS % cfg.luns;
+		pending.len = enum_cmds[pending.query - 1].len;
+		enum_issued++;
+		n = 0;
+	} else if (!pending.used && cfg.trace) {
+		if (!trace_next(&pending))
+			return NULL;
+	} else if (!pending.used) {
+		if (issued >= cfg.commands)
+			return NULL;
+		/* the last of a burst done first, the bridge has nothing then */
+		if (cfg.pause_ns && issued && !(issued % SIM_PAUSE_CMDS) && paused != issued) {
+			if (outstanding)
+				return NULL;
+			if (!pause_until)
+				pause_until = sim_ns + cfg.pause_ns;
+			if (sim_ns < pause_until) {
+				wake_ns = pause_until;
+				return NULL;
+			}
+			pause_until = 0;
+			paused = issued;
+		}
+		issued++;
+		memset(&pending, 0, sizeof(pending));
+		pending.used = 1;
+		pending.seq = seq++;
+		pending.lun = pending.seq % cfg.luns;
+		pending.write = (rnd() % 100) >= cfg.read_pct;
+		pending.ordered = cfg.ordered && !(pending.seq % cfg.ordered);
+		pending.blocks = n;
+		pending.len = cfg.size;
+		if (!n) {
+			pending.write = 0;
+		} else if (cfg.random) {
+			pending.lba = (rnd() % (blocks / n)) * n;
+		} else {
+			if (next_lba + n > blocks)
+				next_lba = 0;
+			pending.lba = next_lba;
+			next_lba += n;
+		}
+	}
+	/* keep ordering out of the picture: no overlapping I/O in flight */
+	if (pending.blocks && overlaps(pending.lun, pending.lba, pending.blocks, pending.write))
+		return NULL;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		if (!cmds[i].used) {
+			cmds[i] = pending;
+			pending.used = 0;
+			return cmds + i;
+		}
+	}
+	return NULL;
+}
+
+static void build_cdb(const struct hcmd *c, uint8_t *cdb)
+{
+	memset(cdb, 0, 16);
+	if (c->sense) {
+		cdb[0] = 0x03;
+		cdb[4] = c->len;
+		return;
+	}
+	if (c->query) {
+		memcpy(cdb, enum_cmds[c->query - 1].cdb, sizeof(enum_cmds[0].cdb));
+		return;
+	}
+	if (!c->blocks)
+		return;	/* TEST UNIT READY */
+	cdb[0] = c->write ? 0x2a : 0x28;
+	cdb[2] = c->lba >> 24;
+	cdb[3] = c->lba >> 16;
+	cdb[4] = c->lba >> 8;
+	cdb[5] = c->lba;
+	cdb[7] = c->blocks >> 8;
+	cdb[8] = c->blocks;
+}
+
+/* like a BOT host after a failed CSW, the bridge should have the sense */
+static struct hcmd *sense_cmd(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		if (!cmds[i].used) {
+			memset(cmds + i, 0, sizeof(cmds[i]));
+			cmds[i].used = 1;
+			cmds[i].sense = 1;
+			cmds[i].lun = sense_lun;
+			cmds[i].len = 18;
+			sense_lun = -1;
+			return cmds + i;
+		}
+	}
+	return NULL;
+}
+
+/* fixed format, and a sense key: nothing goes wrong without a reason */
+static void check_sense(const struct hcmd *c, const uint8_t *p, int len)
+{
+	if (len < 14 || (p[0] & 0x7e) != 0x70 || !(p[2] & 0x0f))
+		sim_fatal("host: tag %u bad sense, %d bytes, %02x %02x %02x\n", c->tag, len,
+			  len > 0 ? p[0] : 0, len > 2 ? p[2] : 0, len > 12 ? p[12] : 0);
+	if (warm >= cfg.luns)
+		sim_host_stats.sense++;
+}
+
+/* the cache in the bridge must not answer for the wrong LUN or command */
+static void check_query(const struct hcmd *c, const uint8_t *p, int len)
+{
+	const uint8_t *cdb = enum_cmds[c->query - 1].cdb;
+	uint32_t last, bs;
+
+	if (c->din)
+		sim_fatal("host: tag %u query data in pieces\n", c->tag);
+	if (cdb[0] == 0x12 && (len < 1 || (p[0] & 0xe0)))
+		sim_fatal("host: tag %u INQUIRY for no unit, %d bytes\n", c->tag, len);
+	if (cdb[0] == 0x12 && (cdb[1] & 1) && (len < 4 || p[1] != cdb[2]))
+		sim_fatal("host: tag %u VPD page %02x answered with %d bytes of %02x\n",
+			  c->tag, cdb[2], len, len > 1 ? p[1] : 0);
+	if (cdb[0] == 0x25) {
+		last = p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+		bs = p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+		if (len != 8 || last != blocks - 1 || bs != blocksize)
+			sim_fatal("host: tag %u READ CAPACITY %u blocks of %u\n", c->tag,
+				  last + 1, bs);
+	}
+}
+
+static struct hcmd *aborted_cmd(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		if (cmds[i].used && cmds[i].aborted) {
+			cmds[i].aborted = 0;
+			reissues--;
+			return cmds + i;
+		}
+	}
+	return NULL;
+}
+
+static transfer_t *task_mgmt(void)
+{
+	transfer_t *t = frame_alloc();
+	struct uas_task_mgmt_iu *iu = transfer_buffer(t);
+
+	tm_tag = next_tag++;
+	if (!next_tag)
+		next_tag = 1;
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = IU_ID_TASK_MGMT;
+	iu->tag = cpu_to_be16(tm_tag);
+	iu->function = tm_function;
+	iu->task_tag = cpu_to_be16(tm_task);
+	iu->lun[1] = tm_lun;
+	frame_set_length(t, sizeof(*iu));
+	return t;
+}
+
+/* not to be completed, it goes again with a new tag */
+static void abort_cmd(struct hcmd *c)
+{
+	outstanding--;
+	if (din_cmd == c)
+		din_cmd = NULL;
+	if (dout_cmd == c)
+		dout_cmd = NULL;
+	c->tag = 0;
+	c->aborted = 1;
+	reissues++;
+	sim_host_stats.aborted++;
+}
+
+/*
+ * QUERY TASK has to find the command unless its status came before,
+ * ABORT TASK and LUN RESET leave no status to come for what they end.
+ */
+static void tm_response(const struct uas_response_iu *iu)
+{
+	struct hcmd *c = live_cmd(tm_task);
+	int i;
+
+	if (!tm_tag || be16_to_cpu(iu->tag) != tm_tag)
+		sim_fatal("host: response for unknown tag %u\n", be16_to_cpu(iu->tag));
+	tm_tag = 0;
+	if (tm_function == UAS_TMF_QUERY_TASK && iu->response_code == UAS_RC_SUCCEEDED) {
+		if (!c)
+			sim_fatal("host: bridge still has tag %u\n", tm_task);
+		tm_function = ++tm_incidents % 4 ? UAS_TMF_ABORT_TASK : UAS_TMF_LUN_RESET;
+		tm_ns = sim_ns;
+		return;
+	}
+	if (iu->response_code != UAS_RC_COMPLETE)
+		sim_fatal("host: task management %02x for tag %u answered %02x\n",
+			  tm_function, tm_task, iu->response_code);
+	if (tm_function == UAS_TMF_QUERY_TASK && c)
+		sim_fatal("host: bridge lost tag %u\n", tm_task);
+	if (tm_function == UAS_TMF_ABORT_TASK && c)
+		abort_cmd(c);
+	if (tm_function == UAS_TMF_LUN_RESET)
+		for (i = 0; i < MAX_CMDS; i++)
+			if (cmds[i].used && cmds[i].lun == tm_lun && live_cmd(cmds[i].tag) == cmds + i)
+				abort_cmd(cmds + i);
+	tm_task = 0;
+}
+
+static transfer_t *issue(void)
+{
+	struct hcmd *c;
+	transfer_t *t;
+	int again = 1;
+
+	wake_ns = UINT64_MAX;
+	if (tm_task && !tm_tag && sim_ns >= tm_ns)
+		return task_mgmt();
+	/* quiet until it is answered, like a host in error recovery */
+	if (tm_tag || outstanding >= (cfg.uas ? cfg.queue_depth : 1))
+		return LIST_END;
+	if (sense_lun >= 0) {
+		c = sense_cmd();
+		if (!c)
+			return LIST_END;
+	} else if (retry) {
+		c = retry;
+		retry = NULL;
+	} else if (reissues) {
+		c = aborted_cmd();
+	} else {
+		c = new_cmd();
+		if (!c)
+			return LIST_END;
+		again = 0;
+	}
+
+	c->tag = next_tag++;
+	if (!next_tag)
+		next_tag = 1;
+	c->din = c->dout = 0;
+	c->issue = issues++;
+	c->issued_ns = sim_ns;
+	outstanding++;
+	wake_ns = sim_ns;
+	if (cfg.uas && cfg.abort && warm >= cfg.luns && !tm_task && !again && !c->query &&
+	    !(c->seq % cfg.abort)) {
+		tm_task = c->tag;
+		tm_lun = c->lun;
+		tm_function = UAS_TMF_QUERY_TASK;
+		tm_ns = sim_ns + rnd() % TM_DELAY_NS;
+	}
+
+	t = frame_alloc();
+	if (cfg.uas) {
+		struct uas_command_iu *iu = transfer_buffer(t);
+
+		memset(iu, 0, sizeof(*iu));
+		iu->iu_id = IU_ID_COMMAND;
+		iu->tag = cpu_to_be16(c->tag);
+		iu->prio_attr = c->ordered ? 2 : 0;	/* ORDERED or SIMPLE */
+		iu->lun[1] = c->lun;
+		build_cdb(c, iu->cdb);
+		frame_set_length(t, sizeof(*iu));
+	} else {
+		struct usb_msc_cbw *cbw = transfer_buffer(t);
+
+		memset(cbw, 0, sizeof(*cbw));
+		cbw->signature = 0x43425355;
+		cbw->tag = c->tag;
+		cbw->datalen = c->len;
+		cbw->flags = c->write ? 0 : 0x80;
+		cbw->lun = c->lun;
+		cbw->cbwcblen = c->blocks || (c->query && enum_cmds[c->query - 1].cdb[0] >= 0x20) ?
+			10 : 6;
+		build_cdb(c, cbw->cdb);
+		frame_set_length(t, sizeof(*cbw));
+		din_cmd = c->write ? NULL : c;
+		dout_cmd = c->write ? c : NULL;
+	}
+	return t;
+}
+
+/*
+ * Nothing issued before an ORDERED command completes after it, nothing
+ * issued after it completes before it.
+ */
+static void check_order(const struct hcmd *c)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		const struct hcmd *o = cmds + i;
+
+		if (!o->used || o == c || o == retry || o->aborted || o->lun != c->lun ||
+		    o->issue > c->issue)
+			continue;
+		if (o->ordered || c->ordered)
+			sim_fatal("host: tag %u completed before tag %u, %s\n", c->tag, o->tag,
+				  o->ordered ? "ORDERED" : "issued before it");
+	}
+}
+
+static void complete(struct hcmd *c, int status)
+{
+	uint64_t lat = sim_ns - c->issued_ns;
+	uint32_t i;
+
+	outstanding--;
+	if (din_cmd == c)
+		din_cmd = NULL;
+	if (dout_cmd == c)
+		dout_cmd = NULL;
+
+	if (c->sense) {
+		if (status || c->din != c->len)
+			sim_fatal("host: REQUEST SENSE tag %u status %02x, %u bytes\n",
+				  c->tag, status, c->din);
+		c->used = 0;
+		return;
+	}
+	if (status && !cfg.uas)
+		sense_lun = c->lun;
+
+	if (warm < cfg.luns) {
+		warm += !status;
+		trace_start = sim_ns;
+		c->used = 0;
+		return;
+	}
+
+	if (status) {
+		if (c->retries++ >= MAX_RETRIES) {
+			fprintf(stderr, "host: tag %u lba %u failed with status %02x\n",
+				c->tag, c->lba, status);
+			sim_host_stats.failed++;
+			if (c->trace) {
+				c->trace->done_us = trace_us();
+				c->trace->status = status;
+			}
+			c->used = 0;
+			return;
+		}
+		sim_host_stats.retries++;
+		if (retry)
+			sim_fatal("host: two retries pending\n");
+		retry = c;
+		return;
+	}
+
+	check_order(c);
+	if (c->query) {
+		if (++enum_done == enum_total)
+			sim_host_stats.enum_ns = sim_ns - enum_start;
+		sim_host_stats.queries++;
+		c->used = 0;
+		return;
+	}
+	if (c->write) {
+		if (c->dout != c->len)
+			sim_fatal("host: tag %u wrote %u of %u bytes\n", c->tag, c->dout, c->len);
+		for (i = 0; i < c->len; i++)
+			shadow[((uint64_t)c->lun * blocks + c->lba) * blocksize + i] = write_pattern(c, i);
+	} else if (c->din != c->len) {
+		sim_fatal("host: tag %u read %u of %u bytes\n", c->tag, c->din, c->len);
+	}
+
+	if (c->trace) {
+		c->trace->done_us = trace_us();
+		c->trace->status = 0;
+	}
+	latency[sim_host_stats.completed++] = lat;
+	sim_host_stats.bytes += c->len;
+	sim_host_stats.latency_ns += lat;
+	if (lat > sim_host_stats.max_latency_ns)
+		sim_host_stats.max_latency_ns = lat;
+	c->used = 0;
+}
+
+static void check_data(struct hcmd *c, const uint8_t *p, int len)
+{
+	const uint8_t *ref;
+	int i;
+
+	if (!c)
+		sim_fatal("host: %d bytes DATA IN without a command\n", len);
+	if (c->sense) {
+		check_sense(c, p, len);
+		c->din += len;
+		return;
+	}
+	if (c->din + len > c->len)
+		sim_fatal("host: tag %u overrun, %u + %d > %u\n", c->tag, c->din, len, c->len);
+	if (c->query) {
+		check_query(c, p, len);
+		c->din += len;
+		return;
+	}
+	/* a short packet ends the host's transfer */
+	if (len % tx_packet_size && c->din + len < c->len)
+		sim_fatal("host: tag %u short packet, %d bytes at %u of %u\n",
+			  c->tag, len, c->din, c->len);
+
+	ref = shadow + ((uint64_t)c->lun * blocks + c->lba) * blocksize + c->din;
+	if (memcmp(p, ref, len)) {
+		for (i = 0; p[i] == ref[i]; i++)
+			;
+		if (!sim_host_stats.miscompares)
+			fprintf(stderr, "host: tag %u lba %u miscompare at offset %u: %02x, expected %02x\n",
+				c->tag, c->lba, c->din + i, p[i], ref[i]);
+		sim_host_stats.miscompares++;
+	}
+	c->din += len;
+}
+
+static void uas_status(const uint8_t *p, int len)
+{
+	const struct uas_sense_iu *iu = (const void *)p;
+	struct hcmd *c = find_cmd(be16_to_cpu(iu->tag));
+
+	if (!c && iu->iu_id != IU_ID_RESPONSE)
+		sim_fatal("host: IU %d for unknown tag %u\n", iu->iu_id, be16_to_cpu(iu->tag));
+
+	switch (iu->iu_id) {
+	case IU_ID_READ_READY:
+		din_cmd = c;
+		break;
+	case IU_ID_WRITE_READY:
+		dout_cmd = c;
+		break;
+	case IU_ID_STATUS:
+		if (iu->status == 0x02)
+			check_sense(c, iu->sense, len - 16);
+		else if (len != 16 || iu->len)
+			sim_fatal("host: tag %u status %02x with %d bytes of sense\n", c->tag,
+				  iu->status, len - 16);
+		if (be16_to_cpu(iu->len) != len - 16)
+			sim_fatal("host: tag %u sense length %u in %d bytes\n", c->tag,
+				  be16_to_cpu(iu->len), len - 16);
+		complete(c, iu->status);
+		break;
+	case IU_ID_RESPONSE:
+		tm_response((const void *)p);
+		break;
+	default:
+		sim_fatal("host: unexpected IU %d\n", iu->iu_id);
+	}
+}
+
+static void bot_din(const uint8_t *p, int len)
+{
+	const struct usb_msc_csw *csw = (const void *)p;
+	struct hcmd *c;
+
+	if (len == sizeof(*csw) && csw->signature == 0x53425355) {
+		c = find_cmd(csw->tag);
+		if (!c)
+			sim_fatal("host: CSW for unknown tag %u\n", csw->tag);
+		if (!csw->status && csw->data_residue && !c->query)
+			sim_fatal("host: tag %u residue %u with good status\n",
+				  c->tag, csw->data_residue);
+		complete(c, csw->status);
+	} else if (len) {
+		check_data(din_cmd, p, len);
+	}
+}
+
+int tx_uas_response(transfer_t *t, int ep, int len)
+{
+	const uint8_t *p = transfer_buffer(t);
+
+	if (cfg.uas && ep == UAS_STAT_ENDPOINT)
+		uas_status(p, len);
+	else if (cfg.uas && ep == UAS_DIN_ENDPOINT) {
+		check_data(din_cmd, p, len);
+		data_moved(len);
+	}
+	else if (!cfg.uas && ep == UAS_DIN_ENDPOINT)
+		bot_din(p, len);
+	else
+		sim_fatal("host: transmit on endpoint %d\n", ep);
+	frame_free(t);
+	return 0;
+}
+
+static transfer_t *dout_frame(void)
+{
+	struct hcmd *c = dout_cmd;
+	transfer_t *t;
+	uint8_t *p;
+	uint32_t i, len;
+
+	if (!c || c->dout >= c->len)
+		sim_fatal("host: initiator waits for DATA OUT the host never sends\n");
+
+	len = c->len - c->dout;
+	if (len > rx_packet_size)
+		len = rx_packet_size;
+	t = frame_alloc();
+	p = transfer_buffer(t);
+	for (i = 0; i < len; i++)
+		p[i] = write_pattern(c, c->dout + i);
+	c->dout += len;
+	frame_set_length(t, len);
+	return t;
+}
+
+struct transfer_struct *get_frame(struct transfer_struct **list)
+{
+	if (list == &tx_free_list) {
+		stall_wait();
+		return frame_alloc();
+	}
+	if (list == &rx_dout_busy_list || list == &rx_cmd_busy_list)
+		return dout_frame();
+	sim_fatal("host: get_frame on unknown list\n");
+}
+
+struct transfer_struct *get_frame_noblock(struct transfer_struct **list)
+{
+	/* BOT DATA OUT comes in on the command pipe, right after its CBW */
+	if (list == &rx_cmd_busy_list && !cfg.uas && dout_cmd && dout_cmd->dout < dout_cmd->len)
+		return dout_frame();
+	if (list == &rx_cmd_busy_list)
+		return issue();
+	if (list == &tx_free_list)
+		return pool == LIST_END || stalled() ? LIST_END : frame_alloc();
+	if (list == &rx_dout_busy_list && dout_cmd && dout_cmd->dout < dout_cmd->len)
+		return dout_frame();
+	return LIST_END;
+}
+
+void put_frame(struct transfer_struct **list, struct transfer_struct *t)
+{
+	if (list != &tx_free_list)
+		sim_fatal("host: put_frame on unknown list\n");
+	frame_free(t);
+}
+
+void usb_rx_cmd_ack(transfer_t *t)
+{
+	frame_free(t);
+}
+
+void usb_rx_dout_ack(transfer_t *t)
+{
+	frame_free(t);
+}
+
+void usb_fill_stats(struct scsi_stats *stats)
+{
+	stats->tx_frames_free = pool_free;
+	stats->tx_frames_total = NFRAMES;
+}
+
+int sim_host_warm(void)
+{
+	return warm >= cfg.luns;
+}
+
+/* only waits for the target: UINT64_MAX, or for a trace arrival time */
+uint64_t sim_host_next(void)
+{
+	uint64_t next = wake_ns;
+
+	if (tm_task && !tm_tag && tm_ns < next)
+		next = tm_ns;
+	if (stalled() && stall_until < next)
+		return stall_until;
+	return next;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t u = *(const uint64_t *)a, v = *(const uint64_t *)b;
+
+	return u < v ? -1 : u > v;
+}
+
+/* latency percentile of the completed commands, 0 <= p <= 1 */
+uint64_t sim_host_latency(double p)
+{
+	uint32_t n = sim_host_stats.completed, i = n * p;
+
+	if (!n)
+		return 0;
+	qsort(latency, n, sizeof(*latency), cmp_u64);
+	return latency[i < n ? i : n - 1];
+}
+
+int sim_host_done(void)
+{
+	return issued >= cfg.commands && enum_done >= enum_total && !outstanding && !retry &&
+	       !reissues && !tm_task && sense_lun < 0;
+}
+
+void sim_host_init(const struct sim_host_cfg *c, uint32_t nblocks, uint32_t bs)
+{
+	uint64_t i, size;
+	int n;
+
+	cfg = *c;
+	if (cfg.luns < 1)
+		cfg.luns = 1;
+	size = (uint64_t)cfg.luns * nblocks * bs;
+	blocks = nblocks;
+	blocksize = bs;
+	usb_uas_interface_alt = cfg.uas;
+
+	if (!cfg.trace && (cfg.size % blocksize || cfg.size / blocksize > 0xffff ||
+			   cfg.size / blocksize > blocks))
+		sim_fatal("host: bad transfer size %u\n", cfg.size);
+	if (cfg.queue_depth > MAX_CMDS)
+		cfg.queue_depth = MAX_CMDS;
+	enum_total = cfg.enum_passes * cfg.luns * ENUM_CMDS;
+
+	shadow = malloc(size);
+	latency = malloc((cfg.commands + 1) * sizeof(*latency));
+	if (!shadow || !latency)
+		sim_fatal("host: no memory for shadow disk\n");
+	for (i = 0; i < size; i++)
+		shadow[i] = cfg.blank ? 0 : sim_disk_pattern(i / blocksize % blocks, i % blocksize);
+
+	if ((uintptr_t)frame_buf[NFRAMES - 1] >= 0x100000000ULL)
+		sim_fatal("host: frame buffers above 4GB, build with -no-pie\n");
+	pool = LIST_END;
+	for (n = NFRAMES - 1; n >= 0; n--)
+		frame_free(frames + n);
+	pool_free = NFRAMES;
+}
@@ -0,0 +1,437 @@
+/*
+ * Host build of the SCSI engine: runs teensy4/scsi.c against the
+ * target and host models and reports what the protocol engine costs
+ * per command and per byte. Exits non-zero when data did not verify,
+ * so the runs in the Makefile double as regression tests.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "sim.h"
+#include "scsi.h"
+#include "scsi_stats.h"
+#include "scsi_ramdisk.h"
+#include "trace.h"
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const struct sim_disk_profile *t_disk;
+
+static const char *rw_name(const struct sim_host_cfg *h)
+{
+	if (!h->size)
+		return "tur";
+	if (h->read_pct >= 100)
+		return h->random ? "randread" : "read";
+	if (h->read_pct <= 0)
+		return h->random ? "randwrite" : "write";
+	return h->random ? "randrw" : "rw";
+}
+
+/*
+ * One line of JSON per run for sim/matrix.sh. cycles are the bridge's
+ * own, from the phase counters: DATA IN and DATA OUT (phases 6 and 7)
+ * per byte, everything else per command.
+ */
+static void report_json(const struct sim_host_cfg *h, uint64_t ns, double cpu)
+{
+	const struct sim_host_stats *s = &sim_host_stats;
+	const struct sim_hal_ops *o = &sim_hal_ops;
+	uint64_t ops = o->pin_reads + o->pin_writes + o->data_reads + o->data_writes;
+	uint64_t data = scsi_stats.phase_cycles[6] + scsi_stats.phase_cycles[7], other = 0;
+	double secs = ns / 1e9, bytes = s->bytes ? s->bytes : 1;
+	uint32_t n = s->completed ? s->completed : 1;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		other += scsi_stats.phase_cycles[i];
+	other -= data;
+	printf("{\"transport\": \"%s\", \"target\": \"%s\", \"rw\": \"%s\", "
+	       "\"read_pct\": %d, \"bs\": %u, \"qd\": %d, \"commands\": %u, "
+	       "\"completed\": %u, \"failed\": %u, \"miscompares\": %u, "
+	       "\"sim_s\": %.6f, \"mb_s\": %.3f, \"iops\": %.1f, "
+	       "\"lat_p50_us\": %.1f, \"lat_p99_us\": %.1f, \"lat_max_us\": %.1f, "
+	       "\"cycles_per_byte\": %.2f, \"cycles_per_cmd\": %.0f, "
+	       "\"bus_ops_per_byte\": %.2f, \"host_ns_per_byte\": %.2f}\n",
+	       h->uas ? "uas" : "bot", t_disk ? t_disk->name : "ram", rw_name(h),
+	       h->read_pct, h->size, h->uas ? h->queue_depth : 1, h->commands,
+	       s->completed, s->failed, s->miscompares,
+	       secs, secs ? s->bytes / secs / 1e6 : 0, secs ? s->completed / secs : 0,
+	       sim_host_latency(0.5) / 1e3, sim_host_latency(0.99) / 1e3,
+	       s->max_latency_ns / 1e3,
+	       data / bytes, (double)other / n, ops / bytes, cpu * 1e9 / bytes);
+}
+
+/*
+ * Nothing moves until the target or a trace arrival time wakes the
+ * initiator up again, so usb_msc_idle() skips the time in between. Up
+ * to the next SysTick at most, it ends the WFI every millisecond and
+ * the clock policy sees the idle time go by.
+ */
+static void skip_idle(void)
+{
+	uint64_t t = sim_target_next(), h = sim_host_next();
+	uint64_t tick = (sim_ns / 1000000 + 1) * 1000000;
+
+	if (h < t)
+		t = h;
+	if (t > tick)
+		t = tick;
+	if (t > sim_ns)
+		sim_ns = t;
+}
+
+static void report(const struct sim_host_cfg *h, uint64_t ns, double cpu)
+{
+	const struct sim_host_stats *s = &sim_host_stats;
+	const struct sim_target_stats *t = &sim_target_stats;
+	const struct sim_hal_ops *o = &sim_hal_ops;
+	uint64_t ops = o->pin_reads + o->pin_writes + o->data_reads + o->data_writes;
+	double secs = ns / 1e9;
+	uint32_t n = s->completed ? s->completed : 1;
+	int i;
+
+	if (h->trace)
+		printf("%s qd %d, trace of %u commands%s\n", h->uas ? "uas" : "bot",
+		       h->uas ? h->queue_depth : 1, h->commands,
+		       h->trace_fast ? " back to back" : "");
+	else
+		printf("%s qd %d, %u x %u bytes, %d%% read, %s\n", h->uas ? "uas" : "bot",
+		       h->uas ? h->queue_depth : 1, h->commands, h->size, h->read_pct,
+		       h->random ? "random" : "sequential");
+	printf("  completed %u, retries %u, failed %u, miscompares %u\n",
+	       s->completed, s->retries, s->failed, s->miscompares);
+	printf("  simulated %.6f s: %.2f MB/s, %.0f IOPS, latency avg %.1f us max %.1f us\n",
+	       secs, secs ? s->bytes / secs / 1e6 : 0, secs ? s->completed / secs : 0,
+	       s->latency_ns / 1e3 / n, s->max_latency_ns / 1e3);
+	printf("  bus accesses: %.1f per command", (double)ops / n);
+	if (s->bytes)
+		printf(", %.2f per byte", (double)ops / s->bytes);
+	printf(" (%llu pin reads, %llu pin writes, %llu data reads, %llu data writes, %llu delays)\n",
+	       (unsigned long long)o->pin_reads, (unsigned long long)o->pin_writes,
+	       (unsigned long long)o->data_reads, (unsigned long long)o->data_writes,
+	       (unsigned long long)o->delays);
+	printf("  host cpu: %.2f us per command", cpu * 1e6 / n);
+	if (s->bytes)
+		printf(", %.2f ns per byte", cpu * 1e9 / s->bytes);
+	printf("\n");
+	printf("  target: commands %u, selections %u, reselections %u, disconnects %u, max queue %u\n"
+	       "          check conditions %u, queue full %u, rejected msgs %u, aborts %u,\n"
+	       "          device resets %u, reselection timeouts %u, arbitration lost %u,\n"
+	       "          selections ignored %u\n",
+	       t->commands, t->selections, t->reselections, t->disconnects, t->max_queue,
+	       t->check_conditions, t->queue_full, t->rejected_msgs, t->aborts,
+	       t->device_resets, t->resel_timeouts, t->arbitration_lost, t->ignored_selections);
+	if (t_disk) {
+		const struct sim_disk_stats *d = &sim_disk_stats;
+		uint32_t a = d->accesses ? d->accesses : 1;
+
+		printf("  disk %s: accesses %u, buffer hits %u, seeks %u,\n"
+		       "          avg seek %.2f ms, rotation %.2f ms, transfer %.2f ms\n",
+		       t_disk->name, d->accesses, d->buffer_hits, d->seeks,
+		       d->seek_ns / 1e6 / (d->seeks ? d->seeks : 1), d->rotate_ns / 1e6 / a,
+		       d->xfer_ns / 1e6 / a);
+	}
+	printf("  bridge: commands %u, tags max %u, unexpected disconnects %u, unknown tags %u\n",
+	       scsi_stats.commands, scsi_stats.tags_max, scsi_stats.unexpected_disconnects,
+	       scsi_stats.unknown_tags);
+	if (scsi_stats.saved_pointers || scsi_stats.restored_pointers)
+		printf("  data pointers: %u saved, %u restored, %u lost\n",
+		       scsi_stats.saved_pointers, scsi_stats.restored_pointers,
+		       scsi_stats.lost_pointers);
+	if (scsi_stats.requeued) {
+		printf("  busy or queue full: %u requeued, depth by ID:", scsi_stats.requeued);
+		for (i = 0; i < 8; i++)
+			if (scsi_stats.queue_depth_max[i])
+				printf(" %d=%u/%u", i, scsi_stats.queue_depth[i],
+				       scsi_stats.queue_depth_max[i]);
+		printf("\n");
+	}
+	if (scsi_stats.task_attrs[1] || scsi_stats.task_attrs[2])
+		printf("  task attributes: %u simple, %u head of queue, %u ordered\n",
+		       scsi_stats.task_attrs[0], scsi_stats.task_attrs[1], scsi_stats.task_attrs[2]);
+	if (scsi_stats.task_mgmt)
+		printf("  task management: %u, %u failed, %u tasks aborted, %u lun resets, "
+		       "recovery avg %.3f ms max %.3f ms, host saw %u aborted\n",
+		       scsi_stats.task_mgmt, scsi_stats.task_mgmt_failed, scsi_stats.tasks_aborted,
+		       scsi_stats.lun_resets, scsi_stats.task_mgmt_total_us / 1e3 / scsi_stats.task_mgmt,
+		       scsi_stats.task_mgmt_max_us / 1e3, sim_host_stats.aborted);
+	if (scsi_stats.auto_sense)
+		printf("  auto sense: %u, %u without sense, %u from the cache, host got %u\n",
+		       scsi_stats.auto_sense, scsi_stats.auto_sense_failed, scsi_stats.sense_cached,
+		       sim_host_stats.sense);
+	if (h->enum_passes)
+		printf("  enumeration: %u passes, %u commands, %.3f ms per pass, "
+		       "cache %u hits, %u filled, %u invalidated\n",
+		       h->enum_passes, sim_host_stats.queries,
+		       sim_host_stats.enum_ns / 1e6 / h->enum_passes, scsi_stats.resp_cache_hits,
+		       scsi_stats.resp_cache_fills, scsi_stats.resp_cache_invalidated);
+	if (scsi_stats.elevator_reorders)
+		printf("  elevator: %u reordered, %u expired, %lld blocks of seeking saved, %.0f/s\n",
+		       scsi_stats.elevator_reorders, scsi_stats.elevator_expired,
+		       (long long)scsi_stats.elevator_saved, scsi_stats.elevator_saved / secs);
+	if (scsi_stats.stalls)
+		printf("  usb stalls: %u, %u disconnected, %u refused, target saw %u\n",
+		       scsi_stats.stalls, scsi_stats.stall_disconnects, scsi_stats.stall_refused,
+		       t->initiator_disconnects);
+	if (scsi_stats.disc_withheld)
+		printf("  disconnect: %u granted, %u back early, %u withheld, %u slow, "
+		       "reselection %.2f us, %.3f ms saved\n",
+		       scsi_stats.disc_granted, scsi_stats.disc_granted_fast,
+		       scsi_stats.disc_withheld, scsi_stats.disc_withheld_slow,
+		       scsi_stats.resel_ns / 1e3, scsi_stats.disc_saved_ns / 1e6);
+	if (scsi_stats.luns > 1) {
+		printf("  luns: %u, commands by ID", scsi_stats.luns);
+		for (i = 0; i < 8; i++)
+			printf(" %u", scsi_stats.target_commands[i]);
+		printf("\n");
+	}
+	printf("  clock: boost %u MHz %.3f s, nominal %u MHz %.3f s, idle %u MHz %.3f s,\n"
+	       "         %u changes, %u throttles\n",
+	       scsi_stats.clock_hz[SCSI_CLOCK_BOOST] / 1000000,
+	       scsi_stats.clock_ms[SCSI_CLOCK_BOOST] / 1e3,
+	       scsi_stats.clock_hz[SCSI_CLOCK_NOMINAL] / 1000000,
+	       scsi_stats.clock_ms[SCSI_CLOCK_NOMINAL] / 1e3,
+	       scsi_stats.clock_hz[SCSI_CLOCK_IDLE] / 1000000,
+	       scsi_stats.clock_ms[SCSI_CLOCK_IDLE] / 1e3,
+	       scsi_stats.clock_changes, scsi_stats.clock_throttles);
+	printf("  idle: %u sleeps %.3f s, %u reselections woken up for, latency %.2f us max %.2f us\n",
+	       scsi_stats.idle_sleeps, scsi_stats.idle_us / 1e6, scsi_stats.resel_wakes,
+	       scsi_stats.resel_latency_ns / 1e3, scsi_stats.resel_latency_max_ns / 1e3);
+	printf("  tasks: %u yields, %u session waits, queued commands max %u, queued status max %u\n",
+	       scsi_stats.task_yields, scsi_stats.session_waits, scsi_stats.cmd_queued_max,
+	       scsi_stats.status_queued_max);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"host:\n"
+		"  -B           bulk-only transport instead of UAS\n"
+		"  -n count     commands (default 1000)\n"
+		"  -q depth     UAS queue depth (default 1)\n"
+		"  -s bytes     transfer size, 0 for TEST UNIT READY (default 4096)\n"
+		"  -r percent   reads (default 100)\n"
+		"  -R           random instead of sequential LBAs\n"
+		"  -S seed      random seed\n"
+		"  -t file      replay a trace from tools/scsitrace instead\n"
+		"  -V           against the bridge's RAM disk, not the target; costs\n"
+		"               no simulated time, so only the data is checked\n"
+		"  -F           replay back to back, not at the original times\n"
+		"  -w file      save the replayed trace with its new times\n"
+		"  -u ns        USB stops reading for that long every 32K\n"
+		"  -G ns        the host goes quiet for that long every 100 commands\n"
+		"  -A n         every nth UAS command ORDERED, checks completion order\n"
+		"  -X n         every nth UAS command gets QUERY TASK within 2 ms, then\n"
+		"               ABORT TASK, every 4th time LUN RESET, and is issued again\n"
+		"  -L passes    first enumerate every LUN that many times, INQUIRY, VPD,\n"
+		"               READ CAPACITY, MODE SENSE and TEST UNIT READY, one at a time\n"
+		"target:\n"
+		"  -i id        SCSI ID (default 0)\n"
+		"  -N targets   that many targets from -i up, one host LUN each (default 1)\n"
+		"  -c blocks    capacity (default 32768, with -M the drive's up to 262144)\n"
+		"  -b bytes     block size (default 512)\n"
+		"  -M profile   mechanical disk timing instead of -a/-j, list shows them\n"
+		"  -f           media accesses in arrival order, not shortest seek first\n"
+		"  -I           no IDENTIFY (implies -T)\n"
+		"  -T           no tagged queueing\n"
+		"  -D           never disconnect\n"
+		"  -k bytes     disconnect every that many data bytes, every other\n"
+		"               DATA IN chunk without SAVE DATA POINTERS\n"
+		"  -Q depth     target queue depth (default 32)\n"
+		"  -U           no power on UNIT ATTENTION\n"
+		"  -e n         every nth READ fails with MEDIUM ERROR, the host retries\n"
+		"  -Z n         every nth selection goes unanswered, like an absent ID\n"
+		"  -a ns        media access time (default 0)\n"
+		"  -j ns        random extra access time (default 0)\n"
+		"  -o ns        command overhead (default 20000)\n"
+		"  -p ns        minimum REQ period (default 100)\n"
+		"bridge:\n"
+		"  -E us        elevator age limit, 0 turns it off (default 1000000)\n"
+		"  -C           no response cache for INQUIRY, READ CAPACITY, MODE SENSE\n"
+		"simulation:\n"
+		"  -O ns        cost of one bus access (default 10)\n"
+		"  -P           poll through idle time instead of skipping it\n"
+		"  -H celsius   die temperature the clock policy sees once the scan is\n"
+		"               done (default 50)\n"
+		"  -x seconds   simulated time limit (default 600)\n"
+		"  -v           show firmware console output\n"
+		"  -J           results as one line of JSON\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_host_cfg h = {
+		.uas = 1,
+		.commands = 1000,
+		.queue_depth = 1,
+		.size = 4096,
+		.read_pct = 100,
+	};
+	struct sim_target_cfg t = {
+		.id = 0,
+		.blocks = 32768,
+		.blocksize = 512,
+		.identify = 1,
+		.tags = 1,
+		.disconnect = 1,
+		.queue_depth = 32,
+		.unit_attention = 1,
+		.sel_ns = 1000,
+		.cmd_ns = 20000,
+		.req_ns = 100,
+	};
+	uint64_t limit = 600, start;
+	double cpu;
+	int c, capacity = 0, json = 0, poll = 0, ramdisk = 0, ntargets = 1, temp = sim_die_temp;
+	const char *trace_in = NULL, *trace_out = NULL;
+	struct trace tr;
+
+	while ((c = getopt(argc, argv, "BA:X:L:n:q:s:r:RS:t:Fw:u:G:Vi:N:c:b:M:fITDk:Q:Ue:Z:a:j:o:p:O:PH:x:vJE:Ch")) != -1) {
+		switch (c) {
+		case 'B': h.uas = 0; break;
+		case 'n': h.commands = strtoul(optarg, NULL, 0); break;
+		case 'q': h.queue_depth = atoi(optarg); break;
+		case 's': h.size = strtoul(optarg, NULL, 0); break;
+		case 'r': h.read_pct = atoi(optarg); break;
+		case 'R': h.random = 1; break;
+		case 'S': h.seed = strtoul(optarg, NULL, 0); break;
+		case 't': trace_in = optarg; break;
+		case 'F': h.trace_fast = 1; break;
+		case 'w': trace_out = optarg; break;
+		case 'u': h.stall_ns = strtoul(optarg, NULL, 0); break;
+		case 'G': h.pause_ns = strtoull(optarg, NULL, 0); break;
+		case 'A': h.ordered = strtoul(optarg, NULL, 0); break;
+		case 'X': h.abort = strtoul(optarg, NULL, 0); break;
+		case 'L': h.enum_passes = strtoul(optarg, NULL, 0); break;
+		case 'V': ramdisk = 1; break;
+		case 'i': t.id = atoi(optarg); break;
+		case 'N': ntargets = atoi(optarg); break;
+		case 'c': t.blocks = strtoul(optarg, NULL, 0); capacity = 1; break;
+		case 'b': t.blocksize = strtoul(optarg, NULL, 0); break;
+		case 'M':
+			if (!strcmp(optarg, "list")) {
+				sim_disk_list();
+				return 0;
+			}
+			t.disk = sim_disk_find(optarg);
+			if (!t.disk) {
+				fprintf(stderr, "unknown disk profile %s, -M list shows them\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f': t.fifo = 1; break;
+		case 'I': t.identify = 0; break;
+		case 'T': t.tags = 0; break;
+		case 'D': t.disconnect = 0; break;
+		case 'k': t.chunk = strtoul(optarg, NULL, 0); break;
+		case 'Q': t.queue_depth = atoi(optarg); break;
+		case 'U': t.unit_attention = 0; break;
+		case 'e': t.read_errors = atoi(optarg); break;
+		case 'Z': t.absent = atoi(optarg); break;
+		case 'a': t.access_ns = strtoul(optarg, NULL, 0); break;
+		case 'j': t.jitter_ns = strtoul(optarg, NULL, 0); break;
+		case 'o': t.cmd_ns = strtoul(optarg, NULL, 0); break;
+		case 'p': t.req_ns = strtoul(optarg, NULL, 0); break;
+		case 'O': sim_op_ns = strtoul(optarg, NULL, 0); break;
+		case 'P': poll = 1; break;
+		case 'H': temp = atoi(optarg); break;
+		case 'x': limit = strtoull(optarg, NULL, 0); break;
+		case 'v': sim_verbose = 1; break;
+		case 'J': json = 1; break;
+		case 'E': scsi_tunables.elevator_us = strtoul(optarg, NULL, 0); break;
+		case 'C': scsi_tunables.resp_cache = 0; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (t.disk) {
+		t.blocksize = t.disk->blocksize;
+		if (!capacity) {
+			t.blocks = sim_disk_blocks(t.disk);
+			if (t.blocks > 262144)
+				t.blocks = 262144;
+		}
+	}
+	t_disk = t.disk;
+	if (t.id < 0 || ntargets < 1 || t.id + ntargets > 7 || !t.blocks || !t.blocksize ||
+	    h.queue_depth < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (ntargets > 1 && ramdisk) {
+		fprintf(stderr, "-N doesn't go with -V\n");
+		return 1;
+	}
+	h.luns = ntargets;
+
+	if (trace_in) {
+		if (trace_load(&tr, trace_in))
+			return 1;
+		tr.blocksize = t.blocksize;
+		h.trace = tr.rec;
+		h.commands = tr.count;
+	}
+
+	for (c = 0; c < ntargets; c++, t.id++)
+		sim_target_init(&t);
+	if (ramdisk) {
+		scsi_tunables.ramdisk = 1;
+		scsi_ramdisk_active();
+		h.blank = 1;
+		sim_host_init(&h, scsi_ramdisk_blocks(), SCSI_RAMDISK_BLOCKSIZE);
+	} else {
+		sim_host_init(&h, t.blocks, t.blocksize);
+	}
+	if (!poll)
+		sim_idle = skip_idle;
+	scsi_initialize();
+	scsi_reset();
+
+	limit *= 1000000000ULL;
+	while (!sim_host_warm()) {
+		usb_msc_poll();
+		usb_msc_idle();
+		if (sim_ns > limit)
+			sim_fatal("no target found\n");
+	}
+	/* the scan and the UNIT ATTENTION are not part of the measurement */
+	start = sim_ns;
+	memset(&sim_hal_ops, 0, sizeof(sim_hal_ops));
+	memset(&sim_target_stats, 0, sizeof(sim_target_stats));
+	scsi_stats_reset();
+	/* heats up now, a throttle shows in the report */
+	sim_die_temp = temp;
+
+	cpu = cpu_seconds();
+	while (!sim_host_done()) {
+		usb_msc_poll();
+		usb_msc_idle();
+		if (sim_ns > limit)
+			sim_fatal("simulated time limit reached, %u commands done\n",
+				  sim_host_stats.completed);
+	}
+	cpu = cpu_seconds() - cpu;
+
+	if (json) {
+		report_json(&h, sim_ns - start, cpu);
+		return sim_host_stats.failed || sim_host_stats.miscompares;
+	}
+	report(&h, sim_ns - start, cpu);
+	if (trace_in) {
+		printf("  trace: ");
+		trace_report(&tr, stdout);
+		if (trace_out && trace_save(&tr, trace_out))
+			return 1;
+	}
+	return sim_host_stats.failed || sim_host_stats.miscompares;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs the fixed benchmark matrix through scsisim and writes the results
+# as a JSON array, one run per line in a stable order so two result
+# files diff line by line:
+#
+#	./matrix.sh [output]	(default matrix.json)
+#
+# sequential and random reads and writes, UAS at queue depth 1, 4, 16
+# and 32 and BOT, 512 bytes to 1 MB, against the RAM target and the
+# ST32550N mechanical model. Each run moves about 4 MB, at least 16 and
+# at most 256 commands, a few minutes altogether.
+
+set -e
+
+OUT=${1:-matrix.json}
+SIM=$(dirname "$0")/scsisim
+TARGETS="ram st32550n"
+RWS="read write randread randwrite"
+LINKS="uas:1 uas:4 uas:16 uas:32 bot:1"
+SIZES="512 4096 65536 1048576"
+BYTES=4194304
+
+sep="["
+: > "$OUT.tmp"
+for target in $TARGETS; do
+	case $target in
+	ram)	T="-c 262144" ;;
+	*)	T="-M $target" ;;
+	esac
+	for rw in $RWS; do
+		case $rw in
+		read)		W="-r 100" ;;
+		write)		W="-r 0" ;;
+		randread)	W="-r 100 -R" ;;
+		randwrite)	W="-r 0 -R" ;;
+		esac
+		for link in $LINKS; do
+			case $link in
+			uas:*)	L="-q ${link#uas:}" ;;
+			bot:*)	L="-B" ;;
+			esac
+			for bs in $SIZES; do
+				n=$((BYTES / bs))
+				[ $n -lt 16 ] && n=16
+				[ $n -gt 256 ] && n=256
+				echo "$target $rw $link $bs" >&2
+				printf '%s' "$sep" >> "$OUT.tmp"
+				"$SIM" -J $T $W $L -s $bs -n $n >> "$OUT.tmp"
+				sep=","
+			done
+		done
+	done
+done
+echo "]" >> "$OUT.tmp"
+mv "$OUT.tmp" "$OUT"
@@ -0,0 +1,230 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+/*
+ * Bus lines as seen from both ends, 1 = asserted. What scsi.c reads is
+ * the wired-OR of both sides, inverted like the real receivers.
+ */
+struct sim_bus {
+	uint8_t i_data;
+	unsigned int i_sel:1;
+	unsigned int i_bsy:1;
+	unsigned int i_atn:1;
+	unsigned int i_ack:1;
+	unsigned int i_rst:1;
+
+	uint8_t t_data;
+	unsigned int t_sel:1;
+	unsigned int t_bsy:1;
+	unsigned int t_req:1;
+	unsigned int t_cd:1;
+	unsigned int t_io:1;
+	unsigned int t_msg:1;
+};
+
+struct sim_hal_ops {
+	uint64_t pin_reads;
+	uint64_t pin_writes;
+	uint64_t data_reads;
+	uint64_t data_writes;
+	uint64_t delays;
+	uint64_t delay_ns;
+};
+
+extern struct sim_bus sim_bus;
+extern struct sim_hal_ops sim_hal_ops;
+extern uint64_t sim_ns;
+extern uint32_t sim_op_ns;
+extern int sim_verbose;
+extern int sim_die_temp;		/* what scsi_hal_temp() reports */
+extern void (*sim_idle)(void);		/* what scsi_hal_wait_event() sleeps through */
+
+void sim_fatal(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+/* disk.c, mechanical timing of a drive */
+#define SIM_DISK_ZONES	8
+
+struct sim_disk_zone {
+	uint32_t cylinders;
+	uint32_t sectors;	/* per track */
+};
+
+struct sim_disk_profile {
+	const char *name;
+	const char *desc;
+	uint8_t type;		/* INQUIRY peripheral device type */
+	uint32_t blocksize;
+	uint32_t heads;
+	uint32_t rpm;		/* 0: constant linear velocity */
+	uint32_t sector_ns;	/* ... at this time per sector */
+	uint32_t track_ns;	/* track to track seek */
+	uint32_t avg_seek_ns;	/* over a third of the stroke */
+	uint32_t max_seek_ns;	/* full stroke */
+	uint32_t head_ns;	/* head switch */
+	uint32_t buffer;	/* read ahead buffer in bytes */
+	struct sim_disk_zone zones[SIM_DISK_ZONES];	/* outside in */
+};
+
+struct sim_disk_stats {
+	uint32_t accesses;	/* that moved the heads or waited for the media */
+	uint32_t buffer_hits;
+	uint32_t seeks;
+	uint64_t seek_ns;
+	uint64_t rotate_ns;
+	uint64_t xfer_ns;
+};
+
+extern struct sim_disk_stats sim_disk_stats;
+
+const struct sim_disk_profile *sim_disk_find(const char *name);
+void sim_disk_list(void);
+uint32_t sim_disk_blocks(const struct sim_disk_profile *d);
+struct sim_drive;	/* a drive's heads and buffer, one per target */
+
+struct sim_drive *sim_disk_init(const struct sim_disk_profile *d);
+int sim_disk_cached(struct sim_drive *d, uint32_t lba, uint32_t n);
+uint64_t sim_disk_estimate(struct sim_drive *d, uint32_t lba, uint32_t n, int write, uint64_t at);
+uint64_t sim_disk_access(struct sim_drive *d, uint32_t lba, uint32_t n, int write, uint64_t at);
+
+/* target.c */
+#define SIM_TARGETS	7	/* every SCSI ID but the initiator's */
+
+struct sim_target_cfg {
+	int id;
+	uint32_t blocks;
+	uint32_t blocksize;
+	int identify;		/* accepts IDENTIFY, otherwise rejects it */
+	int tags;		/* accepts SIMPLE TAG, otherwise rejects it */
+	int disconnect;		/* disconnects for media access when allowed */
+	int queue_depth;	/* QUEUE FULL beyond this */
+	int unit_attention;	/* power on UNIT ATTENTION */
+	uint32_t sel_ns;	/* selection response */
+	uint32_t cmd_ns;	/* command decode */
+	uint32_t access_ns;	/* media access, fixed part */
+	uint32_t jitter_ns;	/* media access, random part */
+	uint32_t req_ns;	/* minimum REQ to REQ time */
+	const struct sim_disk_profile *disk;	/* media timing, replaces access_ns */
+	int fifo;		/* media accesses in arrival order, not shortest first */
+	uint32_t chunk;		/* disconnects after that many data bytes, 0: never */
+	uint32_t read_errors;	/* every that many READs fail, 0: none */
+	uint32_t absent;	/* every that many selections go unanswered, 0: none */
+};
+
+struct sim_target_stats {
+	uint32_t selections;
+	uint32_t reselections;
+	uint32_t resel_timeouts;
+	uint32_t arbitration_lost;
+	uint32_t ignored_selections;	/* -Z, like an ID nobody has */
+	uint32_t disconnects;
+	uint32_t commands;
+	uint32_t check_conditions;
+	uint32_t queue_full;
+	uint32_t rejected_msgs;
+	uint32_t aborts;
+	uint32_t device_resets;		/* ... of them BUS DEVICE RESET */
+	uint32_t resets;
+	uint32_t max_queue;
+	uint32_t initiator_disconnects;	/* DISCONNECT from the initiator */
+};
+
+extern struct sim_target_stats sim_target_stats;
+
+void sim_target_init(const struct sim_target_cfg *cfg);
+void sim_target_step(void);
+int sim_target_idle(void);
+uint64_t sim_target_next(void);
+uint8_t sim_disk_pattern(uint32_t lba, uint32_t off);
+
+/* host.c */
+struct scsi_trace_rec;
+
+struct sim_host_cfg {
+	int uas;
+	uint32_t commands;
+	int queue_depth;
+	uint32_t size;		/* bytes per command, 0: TEST UNIT READY */
+	int read_pct;
+	int random;
+	uint32_t seed;
+	struct scsi_trace_rec *trace;	/* replay these instead, 'commands' of them */
+	int trace_fast;		/* back to back, not at their arrival times */
+	int blank;		/* the disk starts out zeroed, like the RAM disk */
+	int luns;		/* host LUNs, commands go round robin */
+	uint32_t stall_ns;	/* no DATA IN taken after every SIM_STALL_BYTES of it */
+	uint32_t ordered;	/* every that many UAS commands ORDERED, 0: none */
+	uint32_t abort;		/* every that many UAS commands aborted, 0: none */
+	uint32_t enum_passes;	/* enumeration commands for every LUN first */
+	uint64_t pause_ns;	/* quiet after every SIM_PAUSE_CMDS commands */
+};
+
+#define SIM_STALL_BYTES	32768
+#define SIM_PAUSE_CMDS	100
+
+struct sim_host_stats {
+	uint32_t completed;
+	uint32_t retries;
+	uint32_t failed;
+	uint32_t aborted;	/* by task management, issued again */
+	uint32_t sense;		/* CHECK CONDITIONs it got the sense for */
+	uint32_t queries;	/* enumeration commands */
+	uint64_t enum_ns;	/* all of them, one at a time */
+	uint32_t miscompares;
+	uint64_t bytes;
+	uint64_t latency_ns;
+	uint64_t max_latency_ns;
+};
+
+extern struct sim_host_stats sim_host_stats;
+
+void sim_host_init(const struct sim_host_cfg *cfg, uint32_t blocks, uint32_t blocksize);
+int sim_host_warm(void);
+int sim_host_done(void);
+uint64_t sim_host_next(void);
+uint64_t sim_host_latency(double p);
+
+/* usbdc.c, endpoint bits are numbered like ENDPTPRIME: rx 0-7, tx 16-23 */
+struct sim_usb_cfg {
+	uint32_t seed;
+	uint32_t reg_ns;	/* one USB1 register access */
+	uint32_t prime_ns;	/* prime latency, random up to this */
+	uint32_t hazard_ns;	/* next dTD fetch to ENDPTSTATUS update, random */
+	uint32_t xfer_ns;	/* host side delay per dTD, random up to this */
+	uint32_t byte_ns;	/* per byte on the wire, in 1/16 ns */
+	uint32_t irq_ns;	/* interrupt latency, random up to this */
+};
+
+struct sim_usb_host {
+	/* data of a completed IN dTD, -1: host not taking it yet */
+	int (*in)(int ep, const uint8_t *data, uint32_t len);
+	/* fill an OUT dTD with up to len bytes, -1: host has nothing yet */
+	int (*out)(int ep, uint8_t *data, uint32_t len);
+};
+
+struct sim_usb_stats {
+	uint64_t accesses;	/* register accesses */
+	uint64_t isr_accesses;	/* ... of those from the interrupt handler */
+	uint64_t isr_host_ns;	/* host time spent in the interrupt handler */
+	uint32_t interrupts;
+	uint32_t dtds;		/* dTDs retired */
+	uint32_t primes;
+	uint32_t prime_busy;	/* primed while the endpoint was active */
+	uint32_t stale_primes;	/* primed with a dTD that already completed */
+	uint32_t atdtw_sets;
+	uint32_t atdtw_trips;	/* ATDTW cleared by the controller */
+	uint32_t flushes;
+};
+
+extern struct sim_usb_stats sim_usb_stats;
+
+void sim_usb_init(const struct sim_usb_cfg *cfg, const struct sim_usb_host *host);
+void sim_usb_attach(int high_speed);
+void sim_usb_setup(uint64_t setup);
+int sim_usb_ep0_stalled(void);
+void sim_usb_run(uint32_t ns);
+uint32_t sim_usb_pending(void);
+void sim_usb_dump(void);
+
+#endif
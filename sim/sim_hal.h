@@ -0,0 +1,61 @@
+#ifndef SIM_HAL_H
+#define SIM_HAL_H
+
+/*
+ * Stand-ins for the Teensy core calls scsi.c uses, see
+ * teensy4/scsi_hal.h. Every access advances simulated time and lets
+ * the target model react before the value is returned.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DMAMEM
+#define EXTMEM
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int digitalReadFast(int pin);
+void digitalWriteFast(int pin, int val);
+void pinMode(int pin, int mode);
+void delayNanoseconds(uint32_t ns);
+void delay(uint32_t ms);
+unsigned long millis(void);	/* uint32_t is unsigned long on the Teensy */
+unsigned long micros(void);
+
+uint8_t scsi_hal_data_read(void);
+void scsi_hal_data_write(uint8_t data);
+void scsi_hal_data_release(void);
+int scsi_hal_phase_read(void);
+uint32_t scsi_hal_cycles(void);
+uint32_t scsi_hal_cpu_hz(void);
+uint32_t scsi_hal_set_cpu_hz(uint32_t hz);
+int scsi_hal_temp(void);
+
+/* one thread, nothing to lock against */
+#define scsi_hal_irq_disable()	do { } while (0)
+#define scsi_hal_irq_enable()	do { } while (0)
+
+#define SCSI_HAL_EVENT_SEL	0x01
+#define SCSI_HAL_EVENT_RST	0x02
+
+void scsi_hal_bus_events_init(void);
+int scsi_hal_bus_events(void);
+void scsi_hal_wait_event(void);
+
+int sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#ifdef __cplusplus
+}
+#endif
+
+/* the firmware's console output only shows up with -v */
+#define printf(...) sim_log(__VA_ARGS__)
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SIM_USB_H
+#define SIM_USB_H
+
+/*
+ * Included by teensy4/usb.c and usb_desc.c in place of the core headers
+ * when they are built for the host. The USB1 registers usb.c touches are routed to
+ * the controller model in usbdc.c: each access lets the model run
+ * first, like the controller running concurrently with the CPU, and
+ * the value written is picked up on the next access. The PHY, clock,
+ * power and fuse registers usb_init() pokes are plain scratch memory.
+ */
+#include "sim_hal.h"
+#include "imxrt.h"
+
+#define DMAMEM
+#define FLASHMEM
+#define PROGMEM
+
+#define systick_millis_count ((uint32_t)millis())
+
+extern IMXRT_REGISTER32_t sim_usb1, sim_usbphy1, sim_ccm, sim_pmu, sim_ocotp;
+
+volatile uint32_t *sim_usb_reg(unsigned int offset);
+void sim_usb_irq_disable(void);
+void sim_usb_irq_enable(void);
+void sim_usb_nvic_enable(int irq);
+void sim_usb_dcache(void *addr, uint32_t size);
+
+#undef IMXRT_USB1
+#undef IMXRT_USBPHY1
+#undef IMXRT_CCM
+#undef IMXRT_PMU
+#undef IMXRT_OCOTP_VALUE
+#define IMXRT_USB1		sim_usb1
+#define IMXRT_USBPHY1		sim_usbphy1
+#define IMXRT_CCM		sim_ccm
+#define IMXRT_PMU		sim_pmu
+#define IMXRT_OCOTP_VALUE	sim_ocotp
+
+#undef USB1_USBCMD
+#undef USB1_USBSTS
+#undef USB1_USBINTR
+#undef USB1_DEVICEADDR
+#undef USB1_ENDPOINTLISTADDR
+#undef USB1_PORTSC1
+#undef USB1_USBMODE
+#undef USB1_ENDPTSETUPSTAT
+#undef USB1_ENDPTPRIME
+#undef USB1_ENDPTFLUSH
+#undef USB1_ENDPTSTATUS
+#undef USB1_ENDPTCOMPLETE
+#undef USB1_ENDPTCTRL0
+#define USB1_USBCMD		(*sim_usb_reg(0x140))
+#define USB1_USBSTS		(*sim_usb_reg(0x144))
+#define USB1_USBINTR		(*sim_usb_reg(0x148))
+#define USB1_DEVICEADDR		(*sim_usb_reg(0x154))
+#define USB1_ENDPOINTLISTADDR	(*sim_usb_reg(0x158))
+#define USB1_PORTSC1		(*sim_usb_reg(0x184))
+#define USB1_USBMODE		(*sim_usb_reg(0x1A8))
+#define USB1_ENDPTSETUPSTAT	(*sim_usb_reg(0x1AC))
+#define USB1_ENDPTPRIME		(*sim_usb_reg(0x1B0))
+#define USB1_ENDPTFLUSH		(*sim_usb_reg(0x1B4))
+#define USB1_ENDPTSTATUS	(*sim_usb_reg(0x1B8))
+#define USB1_ENDPTCOMPLETE	(*sim_usb_reg(0x1BC))
+/* usb.c indexes ENDPTCTRL1-7 from this one */
+#define USB1_ENDPTCTRL0		(*sim_usb_reg(0x1C0))
+
+#undef __disable_irq
+#undef __enable_irq
+#define __disable_irq()		sim_usb_irq_disable()
+#define __enable_irq()		sim_usb_irq_enable()
+
+#undef NVIC_ENABLE_IRQ
+#undef NVIC_CLEAR_PENDING
+#define NVIC_ENABLE_IRQ(n)	sim_usb_nvic_enable(n)
+#define NVIC_CLEAR_PENDING(n)	((void)(n))
+
+#define arm_dcache_delete(addr, size)		sim_usb_dcache(addr, size)
+#define arm_dcache_flush(addr, size)		sim_usb_dcache(addr, size)
+#define arm_dcache_flush_delete(addr, size)	sim_usb_dcache(addr, size)
+
+#endif
@@ -0,0 +1,1026 @@
+/*
+ * SCSI disk target model. It runs as a state machine that is stepped
+ * on every bus access of the initiator, so the REQ/ACK handshake of
+ * the unmodified phase handlers works without threads. Supports
+ * IDENTIFY, the queue tags and DISCONNECT, or rejects them when they
+ * are configured off, keeps to ORDERED and HEAD OF QUEUE, honours ATN in the data phases and a DISCONNECT the
+ * initiator sends there, and keeps disconnected commands in a queue until
+ * their media access time has passed. With a disk profile the media
+ * accesses go through disk.c one at a time, shortest positioning time
+ * first or in arrival order. There is one of them per SCSI ID, their
+ * lines are wired-OR on the bus.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+#define BUS_FREE_DELAY		800
+#define ARBITRATION_DELAY	2400
+#define BUS_CLEAR_DELAY		800
+#define RESELECT_TIMEOUT	250000000ULL
+
+#define PHASE_DOUT	7
+#define PHASE_DIN	6
+#define PHASE_CMD	5
+#define PHASE_STATUS	4
+#define PHASE_MOUT	1
+#define PHASE_MIN	0
+
+#define MAX_CMDS	256
+
+enum {
+	T_FREE,
+	T_SELECTING,	/* selected, about to assert BSY */
+	T_SELECTED,	/* BSY asserted, waiting for SEL to go away */
+	T_ARBITRATE,
+	T_RESELECT,	/* waiting for the initiator to assert BSY */
+	T_RESELECTED,	/* waiting for the initiator to release BSY */
+	T_CONNECTED,
+};
+
+enum {
+	HS_IDLE,
+	HS_REQ,
+	HS_ACK,
+};
+
+struct tcmd {
+	int used;
+	int tag;		/* -1: untagged */
+	uint8_t attr;		/* its tag message */
+	uint32_t order;		/* of arrival */
+	int lun;
+	int initiator;
+	int disc;		/* disconnect privilege */
+	uint8_t cdb[16];
+	uint8_t status;
+	uint8_t *data;
+	uint32_t len;
+	uint32_t pos;		/* data pointer */
+	uint32_t saved;		/* SAVE DATA POINTERS */
+	uint32_t chunks;
+	int din;
+	uint64_t ready_at;
+	int queued;
+	uint32_t lba;
+	uint32_t blocks;
+	int waiting;		/* for the mechanism */
+	uint32_t seq;
+	uint64_t media_at;	/* command decoded, may go to the media */
+	uint8_t buf[64];
+};
+
+struct sim_target_stats sim_target_stats;
+
+/* one per SCSI ID, all stepped on every bus access */
+struct target {
+	struct sim_target_cfg cfg;
+	uint8_t *disk;
+	struct sim_drive *drive;	/* with a disk profile */
+	struct tcmd cmds[MAX_CMDS];
+	struct tcmd *cur;
+	struct tcmd *nexus;	/* the tag message named one it has, for ABORT TAG */
+	int state;
+	int nqueued;
+	int nwaiting;
+	uint32_t media_seq;
+	uint32_t reads;
+	uint32_t sel_seen;
+	int sel_ignore;		/* this selection goes unanswered */
+	uint32_t arrivals;
+	uint64_t disk_busy;	/* mechanism busy until */
+	uint64_t timer;
+	uint64_t free_since;
+	int was_free;
+	int initiator;
+	int sel_atn;
+	uint8_t sense[18];
+	int unit_attention;
+
+	/* data transfer engine */
+	struct {
+		int phase;
+		uint8_t *buf;
+		uint32_t len;
+		uint32_t pos;
+		int hs;
+		uint64_t ready_at;
+		void (*done)(void);
+	} xf;
+
+	uint8_t msgout[16];
+	uint8_t msgin[4];
+	void (*after_msgout)(void);
+	struct sim_bus lines;	/* the t_* ones it drives */
+};
+
+static struct target targets[SIM_TARGETS];
+static int ntargets;
+static struct target *tgt;	/* the one being stepped */
+
+static uint32_t rnd(void)
+{
+	static uint32_t x = 88172645;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+uint8_t sim_disk_pattern(uint32_t lba, uint32_t off)
+{
+	return lba ^ (lba >> 8) ^ (off * 3);
+}
+
+static void set_phase(int phase)
+{
+	tgt->lines.t_io = !(phase & 1);
+	tgt->lines.t_cd = !(phase & 2);
+	tgt->lines.t_msg = !(phase & 4);
+}
+
+static void release_bus(void)
+{
+	tgt->lines.t_bsy = 0;
+	tgt->lines.t_sel = 0;
+	tgt->lines.t_req = 0;
+	tgt->lines.t_data = 0;
+	tgt->lines.t_io = 0;
+	tgt->lines.t_cd = 0;
+	tgt->lines.t_msg = 0;
+	tgt->state = T_FREE;
+	tgt->cur = NULL;
+}
+
+static void start_xfer(int phase, uint8_t *buf, uint32_t len, void (*done)(void))
+{
+	set_phase(phase);
+	tgt->xf.phase = phase;
+	tgt->xf.buf = buf;
+	tgt->xf.len = len;
+	tgt->xf.pos = 0;
+	tgt->xf.hs = HS_IDLE;
+	tgt->xf.done = done;
+}
+
+static void free_cmd(struct tcmd *c)
+{
+	if (c->queued)
+		tgt->nqueued--;
+	if (c->waiting)
+		tgt->nwaiting--;
+	memset(c, 0, sizeof(*c));
+}
+
+static void set_sense(int key, int asc, int ascq)
+{
+	memset(tgt->sense, 0, sizeof(tgt->sense));
+	tgt->sense[0] = 0x70;
+	tgt->sense[2] = key;
+	tgt->sense[7] = 10;
+	tgt->sense[12] = asc;
+	tgt->sense[13] = ascq;
+}
+
+static void complete_done(void)
+{
+	free_cmd(tgt->cur);
+	release_bus();
+}
+
+static void status_done(void)
+{
+	tgt->msgin[0] = 0x00;	/* COMMAND COMPLETE */
+	start_xfer(PHASE_MIN, tgt->msgin, 1, complete_done);
+}
+
+static void data_done(void)
+{
+	tgt->cur->buf[0] = tgt->cur->status;
+	start_xfer(PHASE_STATUS, tgt->cur->buf, 1, status_done);
+}
+
+static void disconnect_done(void);
+
+/*
+ * The data stops after every cfg.chunk bytes, like a drive at a track
+ * boundary. Every other DATA IN chunk goes without SAVE DATA POINTERS,
+ * so it is sent again after the reselection.
+ */
+static void chunk_done(void)
+{
+	struct tcmd *c = tgt->cur;
+	int n = 0;
+
+	c->pos += tgt->xf.len;
+	if (c->pos == c->len) {
+		data_done();
+		return;
+	}
+	if (!c->din || ++c->chunks & 1) {
+		c->saved = c->pos;
+		tgt->msgin[n++] = 0x02;	/* SAVE DATA POINTERS */
+	}
+	tgt->msgin[n++] = 0x04;		/* DISCONNECT */
+	c->ready_at = sim_ns + tgt->cfg.cmd_ns;
+	start_xfer(PHASE_MIN, tgt->msgin, n, disconnect_done);
+}
+
+/* connected and the media access is done: data, status, message */
+static void run_cmd(void)
+{
+	struct tcmd *c = tgt->cur;
+	uint32_t n = c->len - c->pos;
+
+	tgt->xf.ready_at = c->ready_at;
+	if (!n) {
+		data_done();
+		return;
+	}
+	if (tgt->cfg.chunk && c->disc && tgt->cfg.disconnect && n > tgt->cfg.chunk)
+		n = tgt->cfg.chunk;
+	start_xfer(c->din ? PHASE_DIN : PHASE_DOUT, c->data + c->pos, n, chunk_done);
+}
+
+/* MSG OUT in the middle of the data, it goes on from c->pos after it */
+static void data_attention(void)
+{
+	tgt->cur->pos += tgt->xf.pos;
+	tgt->after_msgout = run_cmd;
+	start_xfer(PHASE_MOUT, tgt->msgout, sizeof(tgt->msgout), run_cmd);
+}
+
+/* DISCONNECT from the initiator: save the pointer, reselect right away */
+static void initiator_disconnect(void)
+{
+	struct tcmd *c = tgt->cur;
+
+	sim_target_stats.initiator_disconnects++;
+	c->saved = c->pos;
+	c->ready_at = sim_ns + tgt->cfg.cmd_ns;
+	tgt->msgin[0] = 0x02;	/* SAVE DATA POINTERS */
+	tgt->msgin[1] = 0x04;	/* DISCONNECT */
+	start_xfer(PHASE_MIN, tgt->msgin, 2, disconnect_done);
+}
+
+static void disconnect_done(void)
+{
+	tgt->cur->queued = 1;
+	if (++tgt->nqueued > sim_target_stats.max_queue)
+		sim_target_stats.max_queue = tgt->nqueued;
+	sim_target_stats.disconnects++;
+	tgt->cur = NULL;
+	release_bus();
+}
+
+static void check_condition(struct tcmd *c, int key, int asc, int ascq)
+{
+	sim_target_stats.check_conditions++;
+	set_sense(key, asc, ascq);
+	c->status = 0x02;
+	c->len = 0;
+}
+
+static int media_cmd(struct tcmd *c, uint32_t lba, uint32_t blocks, int din)
+{
+	if ((uint64_t)lba + blocks > tgt->cfg.blocks) {
+		check_condition(c, 0x05, 0x21, 0x00);
+		return 0;
+	}
+	if (!din && tgt->cfg.disk && tgt->cfg.disk->type == 5) {
+		check_condition(c, 0x07, 0x27, 0x00);
+		return 0;
+	}
+	c->data = tgt->disk + (uint64_t)lba * tgt->cfg.blocksize;
+	c->len = blocks * tgt->cfg.blocksize;
+	c->din = din;
+	c->lba = lba;
+	c->blocks = blocks;
+	return 1;
+}
+
+/*
+ * Task attributes: an ORDERED command waits for all before it, and all
+ * after it wait for it. HEAD OF QUEUE waits for nothing and gets the
+ * mechanism first.
+ */
+static int blocked(const struct tcmd *c)
+{
+	int i;
+
+	if (c->attr == 0x21)
+		return 0;
+	for (i = 0; i < MAX_CMDS; i++) {
+		const struct tcmd *o = tgt->cmds + i;
+
+		if (!o->used || o->order >= c->order || o->lun != c->lun ||
+		    o->initiator != c->initiator)
+			continue;
+		if (o->attr == 0x22 || c->attr == 0x22)
+			return 1;
+	}
+	return 0;
+}
+
+/* start the next media access once the mechanism is free */
+static void disk_schedule(void)
+{
+	struct tcmd *best = NULL;
+	uint64_t best_at = 0;
+	int i;
+
+	if (!tgt->nwaiting || tgt->disk_busy > sim_ns)
+		return;
+	for (i = 0; i < MAX_CMDS; i++) {
+		struct tcmd *c = tgt->cmds + i;
+		uint64_t at;
+
+		if (!c->used || !c->waiting || c->media_at > sim_ns || blocked(c))
+			continue;
+		if (best && (best->attr == 0x21) != (c->attr == 0x21)) {
+			if (c->attr == 0x21)
+				best = c;
+			continue;
+		}
+		if (tgt->cfg.fifo) {
+			if (!best || c->seq < best->seq)
+				best = c;
+			continue;
+		}
+		at = sim_disk_estimate(tgt->drive, c->lba, c->blocks, !c->din, sim_ns);
+		if (!best || at < best_at) {
+			best = c;
+			best_at = at;
+		}
+	}
+	if (!best)
+		return;
+	best->waiting = 0;
+	tgt->nwaiting--;
+	best->ready_at = sim_disk_access(tgt->drive, best->lba, best->blocks, !best->din, sim_ns);
+	tgt->disk_busy = best->ready_at;
+	/* still connected and waiting to transfer the data */
+	if (best == tgt->cur && tgt->xf.buf == best->data)
+		tgt->xf.ready_at = best->ready_at;
+}
+
+static uint32_t alloc_len(struct tcmd *c, uint32_t avail, uint32_t alloc)
+{
+	memset(c->buf, 0, sizeof(c->buf));
+	c->data = c->buf;
+	c->din = 1;
+	c->len = avail < alloc ? avail : alloc;
+	return c->len;
+}
+
+/* the supported pages and a unit serial number, SPC-2 style */
+static void inquiry_vpd(struct tcmd *c, int page, int alloc)
+{
+	switch (page) {
+	case 0x00:
+		alloc_len(c, 6, alloc);
+		c->buf[3] = 2;
+		c->buf[5] = 0x80;
+		break;
+	case 0x80:
+		alloc_len(c, 12, alloc);
+		c->buf[1] = 0x80;
+		c->buf[3] = 8;
+		memcpy(c->buf + 4, "SIM0000", 7);
+		c->buf[11] = '0' + tgt->cfg.id;
+		break;
+	default:
+		check_condition(c, 0x05, 0x24, 0x00);	/* INVALID FIELD IN CDB */
+		break;
+	}
+}
+
+/* read cache on, write cache off */
+static void caching_page(uint8_t *p)
+{
+	p[0] = 0x08;
+	p[1] = 18;
+}
+
+static int exec_cmd(struct tcmd *c)
+{
+	uint8_t *cdb = c->cdb;
+	uint32_t lba, blocks;
+	int media = 0;
+
+	sim_target_stats.commands++;
+	c->status = 0;
+	c->len = 0;
+
+	if (tgt->unit_attention && cdb[0] != 0x12 && cdb[0] != 0x03) {
+		tgt->unit_attention = 0;
+		check_condition(c, 0x06, 0x29, 0x00);
+		return 0;
+	}
+	if (c->lun) {
+		check_condition(c, 0x05, 0x25, 0x00);
+		return 0;
+	}
+
+	switch (cdb[0]) {
+	case 0x00: // TEST UNIT READY
+	case 0x1b: // START STOP UNIT
+	case 0x35: // SYNCHRONIZE CACHE
+		break;
+	case 0x03: // REQUEST SENSE
+		alloc_len(c, sizeof(tgt->sense), cdb[4]);
+		memcpy(c->buf, tgt->sense, sizeof(tgt->sense));
+		set_sense(0, 0, 0);
+		break;
+	case 0x12: // INQUIRY
+		if (cdb[1] & 1) {
+			inquiry_vpd(c, cdb[2], cdb[4]);
+			break;
+		}
+		alloc_len(c, 36, cdb[4]);
+		if (tgt->cfg.disk && tgt->cfg.disk->type) {
+			c->buf[0] = tgt->cfg.disk->type;
+			c->buf[1] = 0x80;	/* removable */
+		}
+		c->buf[2] = 2;
+		c->buf[3] = 2;
+		c->buf[4] = 31;
+		c->buf[7] = (tgt->cfg.tags ? 0x02 : 0);
+		memcpy(c->buf + 8, "SIM     SCSI DISK MODEL 0001", 28);
+		break;
+	case 0x1a: // MODE SENSE(6)
+		if ((cdb[2] & 0x3f) == 0x08 || (cdb[2] & 0x3f) == 0x3f) {
+			alloc_len(c, 24, cdb[4]);
+			c->buf[0] = 23;
+			caching_page(c->buf + 4);
+			break;
+		}
+		alloc_len(c, 4, cdb[4]);
+		c->buf[0] = 3;
+		break;
+	case 0x5a: // MODE SENSE(10)
+		alloc_len(c, 8, (cdb[7] << 8) | cdb[8]);
+		c->buf[1] = 6;
+		break;
+	case 0x25: // READ CAPACITY(10)
+		alloc_len(c, 8, 8);
+		lba = tgt->cfg.blocks - 1;
+		c->buf[0] = lba >> 24;
+		c->buf[1] = lba >> 16;
+		c->buf[2] = lba >> 8;
+		c->buf[3] = lba;
+		c->buf[6] = tgt->cfg.blocksize >> 8;
+		c->buf[7] = tgt->cfg.blocksize;
+		break;
+	case 0x08: // READ(6)
+	case 0x0a: // WRITE(6)
+		lba = ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3];
+		blocks = cdb[4] ? cdb[4] : 256;
+		media = media_cmd(c, lba, blocks, cdb[0] == 0x08);
+		break;
+	case 0x28: // READ(10)
+		if (tgt->cfg.read_errors && !(++tgt->reads % tgt->cfg.read_errors)) {
+			check_condition(c, 0x03, 0x11, 0x00);	/* UNRECOVERED READ ERROR */
+			break;
+		}
+		/* fall through */
+	case 0x2a: // WRITE(10)
+		lba = (cdb[2] << 24) | (cdb[3] << 16) | (cdb[4] << 8) | cdb[5];
+		blocks = (cdb[7] << 8) | cdb[8];
+		media = media_cmd(c, lba, blocks, cdb[0] == 0x28);
+		break;
+	default:
+		check_condition(c, 0x05, 0x20, 0x00);
+		break;
+	}
+
+	c->ready_at = sim_ns + tgt->cfg.cmd_ns;
+	if (media && tgt->cfg.disk) {
+		/* from the buffer without giving up the bus */
+		if (c->din && sim_disk_cached(tgt->drive, c->lba, c->blocks)) {
+			c->ready_at = sim_disk_access(tgt->drive, c->lba, c->blocks, 0, c->ready_at);
+			return 0;
+		}
+		c->media_at = c->ready_at;
+		c->ready_at = UINT64_MAX;
+		c->seq = ++tgt->media_seq;
+		c->waiting = 1;
+		tgt->nwaiting++;
+		disk_schedule();
+	} else if (media) {
+		c->ready_at += tgt->cfg.access_ns;
+		if (tgt->cfg.jitter_ns)
+			c->ready_at += rnd() % tgt->cfg.jitter_ns;
+	}
+	return media;
+}
+
+static int cdb_len(uint8_t opcode)
+{
+	switch (opcode >> 5) {
+	case 0:
+		return 6;
+	case 4:
+		return 16;
+	case 5:
+		return 12;
+	default:
+		return 10;
+	}
+}
+
+static void cmd_done(void)
+{
+	int media = exec_cmd(tgt->cur);
+
+	if (media && tgt->nqueued >= tgt->cfg.queue_depth) {
+		sim_target_stats.queue_full++;
+		tgt->cur->status = 0x28;
+		tgt->cur->len = 0;
+		if (tgt->cur->waiting) {
+			tgt->cur->waiting = 0;
+			tgt->nwaiting--;
+			tgt->cur->ready_at = sim_ns + tgt->cfg.cmd_ns;
+		}
+		media = 0;
+	}
+	if (!tgt->cur->status && blocked(tgt->cur)) {
+		if (!tgt->cur->disc || !tgt->cfg.disconnect) {
+			tgt->cur->status = 0x08;	/* BUSY */
+			tgt->cur->len = 0;
+			if (tgt->cur->waiting) {
+				tgt->cur->waiting = 0;
+				tgt->nwaiting--;
+				tgt->cur->ready_at = sim_ns + tgt->cfg.cmd_ns;
+			}
+		}
+		media = 1;
+	}
+	if (media && tgt->cur->disc && tgt->cfg.disconnect) {
+		tgt->msgin[0] = 0x04;	/* DISCONNECT */
+		start_xfer(PHASE_MIN, tgt->msgin, 1, disconnect_done);
+		return;
+	}
+	run_cmd();
+}
+
+static void start_cmd(void)
+{
+	tgt->xf.ready_at = sim_ns;
+	start_xfer(PHASE_CMD, tgt->cur->cdb, 6, cmd_done);
+}
+
+static void reject_done(void)
+{
+	if (sim_bus.i_atn)
+		start_xfer(PHASE_MOUT, tgt->msgout, sizeof(tgt->msgout), tgt->after_msgout);
+	else if (tgt->after_msgout == run_cmd)
+		run_cmd();
+	else
+		start_cmd();
+}
+
+static struct tcmd *find_tag(int tag)
+{
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++)
+		if (tgt->cmds[i].used && tgt->cmds[i].tag == tag && tgt->cmds[i].initiator == tgt->initiator)
+			return tgt->cmds + i;
+	return NULL;
+}
+
+static void reject(void)
+{
+	sim_target_stats.rejected_msgs++;
+	tgt->msgin[0] = 0x07;	/* MESSAGE REJECT */
+	start_xfer(PHASE_MIN, tgt->msgin, 1, reject_done);
+}
+
+/*
+ * ABORT ends all of the initiator's commands on the LUN, ABORT TAG the
+ * one the tag message named, or the one connected, BUS DEVICE RESET
+ * all of them. The connected one goes along in any case.
+ */
+static void abort_msg(uint8_t msg)
+{
+	int i;
+
+	sim_target_stats.aborts++;
+	for (i = 0; i < MAX_CMDS; i++) {
+		struct tcmd *c = tgt->cmds + i;
+
+		if (!c->used || c == tgt->cur)
+			continue;
+		if (msg == 0x0c || (msg == 0x0d && c == tgt->nexus) ||
+		    (msg == 0x06 && c->initiator == tgt->initiator && c->lun == tgt->cur->lun))
+			free_cmd(c);
+	}
+	if (msg == 0x0c) {
+		sim_target_stats.device_resets++;
+		tgt->unit_attention = 1;
+	}
+	tgt->nexus = NULL;
+}
+
+/*
+ * Called after every MSG OUT byte, returns 1 when the phase is over
+ * because a message had to be rejected or the nexus was dropped.
+ */
+static int parse_msgout(void)
+{
+	uint8_t msg = tgt->msgout[0];
+
+	if (msg & 0x80) {
+		if (!tgt->cfg.identify) {
+			reject();
+			return 1;
+		}
+		tgt->cur->lun = msg & 7;
+		tgt->cur->disc = !!(msg & 0x40);
+	} else if (msg >= 0x20 && msg <= 0x22) {
+		if (tgt->xf.pos < 2)
+			return 0;
+		if (!tgt->cfg.tags) {
+			reject();
+			return 1;
+		}
+		tgt->nexus = find_tag(tgt->msgout[1]);
+		tgt->cur->tag = tgt->msgout[1];
+		tgt->cur->attr = msg;
+	} else if (msg == 0x04) {
+		if (tgt->after_msgout != run_cmd || !tgt->cur->disc || !tgt->cfg.disconnect) {
+			reject();
+			return 1;
+		}
+		initiator_disconnect();
+		return 1;
+	} else if (msg == 0x06 || msg == 0x0d || msg == 0x0c) {
+		abort_msg(msg);
+		complete_done();
+		return 1;
+	} else if (msg != 0x08) {
+		reject();
+		return 1;
+	}
+	tgt->xf.pos = 0;
+	return 0;
+}
+
+static void msgout_done(void)
+{
+	int i;
+
+	if (tgt->state != T_CONNECTED)
+		return;
+	if (tgt->nexus)
+		sim_fatal("target: tag %02x already in use\n", tgt->cur->tag);
+	/* one untagged command per I_T_L, and none next to tagged ones */
+	for (i = 0; i < MAX_CMDS; i++) {
+		struct tcmd *c = tgt->cmds + i;
+
+		if (c->used && c != tgt->cur && c->initiator == tgt->initiator &&
+		    c->lun == tgt->cur->lun && (c->tag < 0 || tgt->cur->tag < 0))
+			sim_fatal("target: overlapped command on LUN %d\n", c->lun);
+	}
+	start_cmd();
+}
+
+static void selected(void)
+{
+	struct tcmd *c = NULL;
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		if (!tgt->cmds[i].used) {
+			c = tgt->cmds + i;
+			break;
+		}
+	}
+	if (!c)
+		sim_fatal("target: out of command slots\n");
+	memset(c, 0, sizeof(*c));
+	c->used = 1;
+	c->tag = -1;
+	c->order = ++tgt->arrivals;
+	c->initiator = tgt->initiator;
+	tgt->cur = c;
+	tgt->nexus = NULL;
+	tgt->state = T_CONNECTED;
+	tgt->xf.ready_at = sim_ns;
+	if (tgt->sel_atn) {
+		tgt->after_msgout = msgout_done;
+		start_xfer(PHASE_MOUT, tgt->msgout, sizeof(tgt->msgout), msgout_done);
+	} else {
+		start_cmd();
+	}
+}
+
+static void reselect_identify_done(void)
+{
+	run_cmd();
+}
+
+static void reselected(void)
+{
+	int n = 0;
+
+	tgt->state = T_CONNECTED;
+	tgt->lines.t_data = 0;
+	tgt->cur->queued = 0;
+	tgt->nqueued--;
+	sim_target_stats.reselections++;
+	tgt->msgin[n++] = 0x80 | tgt->cur->lun;
+	if (tgt->cur->tag >= 0) {
+		tgt->msgin[n++] = 0x20;
+		tgt->msgin[n++] = tgt->cur->tag;
+	}
+	/* implied by the reselection, but some drives say it anyway */
+	if (tgt->cur->pos != tgt->cur->saved)
+		tgt->msgin[n++] = 0x03;	/* RESTORE POINTERS */
+	tgt->cur->pos = tgt->cur->saved;
+	tgt->xf.ready_at = sim_ns;
+	start_xfer(PHASE_MIN, tgt->msgin, n, reselect_identify_done);
+}
+
+static void step_xfer(void)
+{
+	struct sim_bus *b = &sim_bus;
+	int in = tgt->xf.phase == PHASE_DIN || tgt->xf.phase == PHASE_STATUS || tgt->xf.phase == PHASE_MIN;
+
+	switch (tgt->xf.hs) {
+	case HS_IDLE:
+		if (sim_ns < tgt->xf.ready_at)
+			return;
+		if (in)
+			tgt->lines.t_data = tgt->xf.buf[tgt->xf.pos];
+		tgt->lines.t_req = 1;
+		tgt->xf.hs = HS_REQ;
+		break;
+	case HS_REQ:
+		if (!b->i_ack)
+			return;
+		if (!in)
+			tgt->xf.buf[tgt->xf.pos] = b->i_data;
+		tgt->xf.pos++;
+		tgt->lines.t_req = 0;
+		tgt->xf.hs = HS_ACK;
+		break;
+	case HS_ACK:
+		if (b->i_ack)
+			return;
+		tgt->lines.t_data = 0;
+		tgt->xf.hs = HS_IDLE;
+		tgt->xf.ready_at = sim_ns + tgt->cfg.req_ns;
+		if (tgt->xf.phase == PHASE_MOUT) {
+			if (parse_msgout())
+				break;
+			if (!b->i_atn || tgt->xf.pos == tgt->xf.len)
+				tgt->xf.done();
+		} else if (tgt->xf.phase == PHASE_CMD && tgt->xf.pos == 1) {
+			tgt->xf.len = cdb_len(tgt->xf.buf[0]);
+		} else if ((tgt->xf.phase == PHASE_DIN || tgt->xf.phase == PHASE_DOUT) &&
+			   b->i_atn && tgt->xf.pos < tgt->xf.len) {
+			data_attention();
+		} else if (tgt->xf.pos == tgt->xf.len) {
+			tgt->xf.done();
+		}
+		break;
+	}
+}
+
+static struct tcmd *ready_cmd(void)
+{
+	struct tcmd *best = NULL;
+	int i;
+
+	for (i = 0; i < MAX_CMDS; i++) {
+		struct tcmd *c = tgt->cmds + i;
+
+		if (!c->used || !c->queued || c->ready_at > sim_ns || blocked(c))
+			continue;
+		if (!best || c->ready_at < best->ready_at)
+			best = c;
+	}
+	return best;
+}
+
+static void target_step(void)
+{
+	struct sim_bus *b = &sim_bus;
+	int free = !(b->i_bsy | b->t_bsy | b->i_sel | b->t_sel);
+
+	if (b->i_rst) {
+		int i;
+
+		if (tgt->state != T_FREE || tgt->nqueued)
+			sim_target_stats.resets++;
+		release_bus();
+		for (i = 0; i < MAX_CMDS; i++)
+			memset(tgt->cmds + i, 0, sizeof(tgt->cmds[i]));
+		tgt->nqueued = 0;
+		tgt->nwaiting = 0;
+		tgt->disk_busy = 0;
+		tgt->unit_attention = 1;
+		return;
+	}
+
+	if (tgt->nwaiting)
+		disk_schedule();
+
+	if (free && !tgt->was_free)
+		tgt->free_since = sim_ns;
+	tgt->was_free = free;
+
+	switch (tgt->state) {
+	case T_FREE:
+		if (b->i_sel && !b->i_bsy && (b->i_data & (1 << tgt->cfg.id))) {
+			tgt->initiator = b->i_data & ~(1 << tgt->cfg.id);
+			tgt->initiator = tgt->initiator ? __builtin_ctz(tgt->initiator) : -1;
+			tgt->sel_atn = b->i_atn;
+			tgt->sel_ignore = tgt->cfg.absent && !(++tgt->sel_seen % tgt->cfg.absent);
+			sim_target_stats.ignored_selections += tgt->sel_ignore;
+			tgt->timer = sim_ns + tgt->cfg.sel_ns;
+			tgt->state = T_SELECTING;
+			break;
+		}
+		if (free && sim_ns - tgt->free_since >= BUS_FREE_DELAY && tgt->timer <= sim_ns &&
+		    (tgt->cur = ready_cmd())) {
+			tgt->lines.t_bsy = 1;
+			tgt->lines.t_data = 1 << tgt->cfg.id;
+			tgt->timer = sim_ns + ARBITRATION_DELAY;
+			tgt->state = T_ARBITRATE;
+		}
+		break;
+	case T_SELECTING:
+		if (!b->i_sel) {
+			tgt->state = T_FREE;
+			break;
+		}
+		if (sim_ns < tgt->timer || tgt->sel_ignore)
+			break;
+		sim_target_stats.selections++;
+		tgt->lines.t_bsy = 1;
+		tgt->state = T_SELECTED;
+		break;
+	case T_SELECTED:
+		if (b->i_sel)
+			break;
+		selected();
+		break;
+	case T_ARBITRATE:
+		if (sim_ns < tgt->timer)
+			break;
+		if ((b->i_data | b->t_data) & ~((2 << tgt->cfg.id) - 1)) {
+			/* a higher ID is arbitrating too, back off */
+			sim_target_stats.arbitration_lost++;
+			release_bus();
+			tgt->timer = sim_ns + BUS_CLEAR_DELAY + rnd() % 1000;
+			break;
+		}
+		tgt->lines.t_sel = 1;
+		tgt->lines.t_io = 1;
+		tgt->lines.t_data = (1 << tgt->cfg.id) | (1 << tgt->cur->initiator);
+		tgt->lines.t_bsy = 0;
+		tgt->timer = sim_ns + RESELECT_TIMEOUT;
+		tgt->state = T_RESELECT;
+		break;
+	case T_RESELECT:
+		if (b->i_bsy) {
+			tgt->lines.t_bsy = 1;
+			tgt->lines.t_sel = 0;
+			tgt->timer = 0;
+			tgt->state = T_RESELECTED;
+		} else if (sim_ns > tgt->timer) {
+			sim_target_stats.resel_timeouts++;
+			release_bus();
+		}
+		break;
+	case T_RESELECTED:
+		if (!b->i_bsy)
+			reselected();
+		break;
+	case T_CONNECTED:
+		step_xfer();
+		break;
+	}
+}
+
+/* the targets' lines are wired-OR on the bus */
+static void drive_bus(void)
+{
+	struct sim_bus *b = &sim_bus;
+	const struct sim_bus *l;
+	int i;
+
+	b->t_data = 0;
+	b->t_sel = b->t_bsy = b->t_req = b->t_cd = b->t_io = b->t_msg = 0;
+	for (i = 0; i < ntargets; i++) {
+		l = &targets[i].lines;
+		b->t_data |= l->t_data;
+		b->t_sel |= l->t_sel;
+		b->t_bsy |= l->t_bsy;
+		b->t_req |= l->t_req;
+		b->t_cd |= l->t_cd;
+		b->t_io |= l->t_io;
+		b->t_msg |= l->t_msg;
+	}
+}
+
+void sim_target_step(void)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		tgt = targets + i;
+		target_step();
+		drive_bus();
+	}
+}
+
+int sim_target_idle(void)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++)
+		if (targets[i].state != T_FREE || targets[i].nqueued)
+			return 0;
+	return 1;
+}
+
+/*
+ * When the target next does something on its own: reselects, or starts
+ * a media access. sim_ns while anything is happening on the bus,
+ * UINT64_MAX when it only waits for the initiator.
+ */
+static uint64_t target_next(void)
+{
+	const struct sim_bus *b = &sim_bus;
+	uint64_t next = UINT64_MAX, earliest;
+	int i;
+
+	if (tgt->state != T_FREE || b->i_bsy || b->t_bsy || b->i_sel || b->t_sel || b->i_rst)
+		return sim_ns;
+	earliest = tgt->free_since + BUS_FREE_DELAY;
+	if (tgt->timer > earliest)
+		earliest = tgt->timer;
+	for (i = 0; i < MAX_CMDS; i++) {
+		const struct tcmd *c = tgt->cmds + i;
+
+		if (!c->used || blocked(c))
+			continue;
+		if (c->queued && c->ready_at < next)
+			next = c->ready_at > earliest ? c->ready_at : earliest;
+		if (c->waiting) {
+			uint64_t at = c->media_at > tgt->disk_busy ? c->media_at : tgt->disk_busy;
+
+			if (at < next)
+				next = at;
+		}
+	}
+	return next > sim_ns ? next : sim_ns;
+}
+
+uint64_t sim_target_next(void)
+{
+	uint64_t next = UINT64_MAX, t;
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		tgt = targets + i;
+		t = target_next();
+		if (t < next)
+			next = t;
+	}
+	return next;
+}
+
+/* adds a target at c->id */
+void sim_target_init(const struct sim_target_cfg *c)
+{
+	uint64_t size, i;
+
+	if (ntargets == SIM_TARGETS)
+		sim_fatal("target: more than %d targets\n", SIM_TARGETS);
+	tgt = targets + ntargets++;
+	tgt->cfg = *c;
+	if (!tgt->cfg.identify)
+		tgt->cfg.tags = 0;
+	if (tgt->cfg.disk) {
+		if (tgt->cfg.blocks > sim_disk_blocks(tgt->cfg.disk) || tgt->cfg.blocksize != tgt->cfg.disk->blocksize)
+			sim_fatal("target: %s holds %u blocks of %u bytes\n", tgt->cfg.disk->name,
+				  sim_disk_blocks(tgt->cfg.disk), tgt->cfg.disk->blocksize);
+		tgt->drive = sim_disk_init(tgt->cfg.disk);
+	}
+	size = (uint64_t)tgt->cfg.blocks * tgt->cfg.blocksize;
+	tgt->disk = malloc(size);
+	if (!tgt->disk)
+		sim_fatal("target: no memory for %llu byte disk\n", (unsigned long long)size);
+	for (i = 0; i < size; i++)
+		tgt->disk[i] = sim_disk_pattern(i / tgt->cfg.blocksize, i % tgt->cfg.blocksize);
+	tgt->unit_attention = tgt->cfg.unit_attention;
+	set_sense(0, 0, 0);
+	release_bus();
+	tgt->was_free = 1;
+}
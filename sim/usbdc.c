@@ -0,0 +1,510 @@
+/*
+ * Model of the i.MX RT USB1 device controller, as far as usb.c relies
+ * on it: endpoint queue heads and dTD lists, ENDPTPRIME, ENDPTSTATUS,
+ * ENDPTCOMPLETE, the ATDTW tripwire, flushing and the interrupt.
+ *
+ * usb.c gets at the registers through sim_usb_reg(), see sim_usb.h. The
+ * returned word is loaded with the register's current value, whatever
+ * the CPU leaves in it is interpreted on the next access. The write-1-
+ * to-clear registers are acknowledged on read: usb.c always writes back
+ * what it read, so that cannot be told apart from the real thing.
+ *
+ * Retiring a dTD and fetching the next one are two steps: the next
+ * pointer is read right away, ENDPTSTATUS only changes hazard_ns later.
+ * ATDTW is cleared while that window is open, like the hardware does,
+ * so a link that misses the fetch has to be caught by usb.c.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include "sim.h"
+#include "sim_usb.h"
+#include "usb_dev.h"
+
+#undef printf
+
+#define EP_BITS		0x00ff00ff
+#define NONE		0xffffffff
+
+/*
+ * Queue head as declared in usb.c. It has pointers in it, so on a 64 bit
+ * host it is laid out differently from the 64 byte hardware format.
+ */
+struct dqh {
+	uint32_t config;
+	uint32_t current;
+	transfer_t *next;
+	uint32_t status;
+	uint32_t pointer[5];
+	uint32_t reserved;
+	uint32_t setup[2];
+	transfer_t *first_transfer;
+	transfer_t *last_transfer;
+	void (*callback_function)(transfer_t *completed_transfer);
+	uint32_t unused1;
+};
+
+struct ep {
+	transfer_t *cur;	/* dTD being executed */
+	transfer_t *next;	/* next pointer of the last retired dTD */
+	uint64_t prime_at;
+	uint64_t done_at;
+	uint64_t hazard_end;
+	uint64_t started;	/* dTD start order, for ep0 */
+	int hazard;
+};
+
+IMXRT_REGISTER32_t sim_usb1, sim_usbphy1, sim_ccm, sim_pmu, sim_ocotp;
+void (*_VectorsRam[NVIC_NUM_INTERRUPTS + 16])(void);
+struct sim_usb_stats sim_usb_stats;
+
+static struct sim_usb_cfg cfg;
+static struct sim_usb_host host;
+static struct ep eps[32];
+static uint32_t usbcmd, usbsts, portsc, setupstat, prime, flush, status, complete;
+static uint32_t last_off = NONE, last_val;
+static int primask, nvic_on, in_isr;
+static uint64_t irq_at, dtd_seq;
+static uint32_t rnd_state;
+static uint8_t scratch[5 * 4096];
+
+static uint32_t rnd(uint32_t max)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return max ? rnd_state % (max + 1) : 0;
+}
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static volatile uint32_t *reg(unsigned int off)
+{
+	return (volatile uint32_t *)((uint8_t *)&sim_usb1 + off);
+}
+
+static struct dqh *qh(int bit)
+{
+	struct dqh *list = (struct dqh *)(uintptr_t)*reg(0x158);
+
+	if (!list)
+		sim_fatal("ENDPOINTLISTADDR not set\n");
+	return list + (bit & 15) * 2 + (bit >> 4);
+}
+
+static int ep_num(int bit)
+{
+	return bit & 15;
+}
+
+static int ep_tx(int bit)
+{
+	return bit >= 16;
+}
+
+/* move len bytes between buf and the dTD's buffer pages */
+static void dtd_copy(const transfer_t *t, uint8_t *buf, uint32_t len, int to_dtd)
+{
+	const uint32_t page[5] = { t->pointer0, t->pointer1, t->pointer2,
+				   t->pointer3, t->pointer4 };
+	uint32_t off = t->pointer0 & 0xfff, done = 0;
+	int i;
+
+	for (i = 0; done < len; i++) {
+		uint32_t n = 4096 - off;
+		uint8_t *p;
+
+		if (i == 5)
+			sim_fatal("dTD %p: %u bytes do not fit its pages\n", (void *)t, len);
+		p = (uint8_t *)(uintptr_t)((page[i] & ~0xfff) + off);
+		if (!p)
+			sim_fatal("dTD %p: page %d not set\n", (void *)t, i);
+		if (n > len - done)
+			n = len - done;
+		if (to_dtd)
+			memcpy(p, buf + done, n);
+		else
+			memcpy(buf + done, p, n);
+		done += n;
+		off = 0;
+	}
+}
+
+static void dtd_start(int bit, transfer_t *t)
+{
+	struct ep *e = eps + bit;
+	struct dqh *q = qh(bit);
+	uint32_t len;
+
+	/* dTD arrays only keep the 32 byte alignment where they are 32 bytes */
+	if ((uintptr_t)t & (sizeof(transfer_t) == 32 ? 0x1f : sizeof(void *) - 1))
+		sim_fatal("ep%d%s: misaligned dTD %p\n", ep_num(bit),
+			  ep_tx(bit) ? "in" : "out", (void *)t);
+	if (!(t->status & 0x80))
+		sim_fatal("ep%d%s: dTD %p on the list is not active\n", ep_num(bit),
+			  ep_tx(bit) ? "in" : "out", (void *)t);
+	e->cur = t;
+	e->started = ++dtd_seq;
+	q->current = (uint32_t)(uintptr_t)t;
+	q->next = t->next;
+	q->status = t->status;
+	len = (t->status >> 16) & 0x7fff;
+	e->done_at = sim_ns + rnd(cfg.xfer_ns) + (uint64_t)len * cfg.byte_ns / 16;
+}
+
+static void dtd_retire(int bit)
+{
+	struct ep *e = eps + bit;
+	transfer_t *t = e->cur;
+	uint32_t len = (t->status >> 16) & 0x7fff, remaining = 0;
+
+	/* the stages of a control transfer go over the wire in turn */
+	if (ep_num(bit) == 0) {
+		const struct ep *o = eps + (bit ^ 16);
+
+		if (o->cur && o->started < e->started) {
+			e->done_at = o->done_at + 1;
+			return;
+		}
+	}
+	if (ep_tx(bit)) {
+		dtd_copy(t, scratch, len, 0);
+		if (host.in && host.in(ep_num(bit), scratch, len) < 0) {
+			/* host not taking data yet, try again */
+			e->done_at = sim_ns + rnd(cfg.xfer_ns) + 1;
+			return;
+		}
+	} else {
+		int n = host.out ? host.out(ep_num(bit), scratch, len) : 0;
+
+		if (n < 0) {
+			/* nothing from the host yet, poll again */
+			e->done_at = sim_ns + rnd(cfg.xfer_ns) + 1;
+			return;
+		}
+		if (n > len)
+			sim_fatal("ep%dout: host sent %d bytes into a %u byte dTD\n",
+				  ep_num(bit), n, len);
+		dtd_copy(t, scratch, n, 1);
+		remaining = len - n;
+	}
+	t->status = (t->status & ~0x7fff00ff) | (remaining << 16);
+	qh(bit)->status = t->status;
+	sim_usb_stats.dtds++;
+	if (t->status & (1 << 15)) {
+		complete |= 1 << bit;
+		usbsts |= USB_USBSTS_UI;
+	}
+	/* the next pointer is sampled now, ENDPTSTATUS follows later */
+	e->next = t->next;
+	e->cur = NULL;
+	e->hazard = 1;
+	e->hazard_end = sim_ns + rnd(cfg.hazard_ns) + 1;
+}
+
+static void dtd_fetch(int bit)
+{
+	struct ep *e = eps + bit;
+
+	e->hazard = 0;
+	if ((uintptr_t)e->next & 1) {
+		qh(bit)->next = LIST_END;
+		status &= ~(1 << bit);
+		return;
+	}
+	dtd_start(bit, e->next);
+}
+
+static void prime_done(int bit)
+{
+	struct ep *e = eps + bit;
+	struct dqh *q = qh(bit);
+
+	prime &= ~(1 << bit);
+	if (e->cur || e->hazard) {
+		sim_usb_stats.prime_busy++;
+		return;
+	}
+	if ((uintptr_t)q->next & 1)
+		return;
+	/*
+	 * usb.c primes when ENDPTSTATUS was clear after linking, the dTD
+	 * may have run to completion while it waited for ATDTW. The
+	 * controller takes an inactive dTD as the end of the list.
+	 */
+	if (!(q->next->status & 0x80)) {
+		sim_usb_stats.stale_primes++;
+		return;
+	}
+	status |= 1 << bit;
+	dtd_start(bit, q->next);
+}
+
+static void ep_flush(uint32_t mask)
+{
+	int bit;
+
+	for (bit = 0; bit < 32; bit++) {
+		if (!(mask & (1 << bit)))
+			continue;
+		memset(eps + bit, 0, sizeof(eps[bit]));
+		sim_usb_stats.flushes++;
+	}
+	prime &= ~mask;
+	status &= ~mask;
+}
+
+/* run everything that is due by now */
+static void advance(void)
+{
+	uint32_t pending;
+	int busy, more;
+
+	if (flush) {
+		ep_flush(flush);
+		flush = 0;
+	}
+	if (!(usbcmd & USB_USBCMD_RS))
+		return;
+	do {
+		more = 0;
+		busy = 0;
+		/* an endpoint with a dTD in flight has its ENDPTSTATUS bit set */
+		for (pending = prime | status; pending; pending &= pending - 1) {
+			int bit = __builtin_ctz(pending);
+			struct ep *e = eps + bit;
+
+			if (e->hazard && sim_ns >= e->hazard_end) {
+				dtd_fetch(bit);
+				more = 1;
+			} else if (!e->hazard && (prime & (1 << bit)) && sim_ns >= e->prime_at) {
+				prime_done(bit);
+				more = 1;
+			} else if (e->cur && sim_ns >= e->done_at) {
+				dtd_retire(bit);
+				more = 1;
+			}
+			busy |= e->hazard;
+		}
+	} while (more);
+
+	if (busy && (usbcmd & USB_USBCMD_ATDTW)) {
+		usbcmd &= ~USB_USBCMD_ATDTW;
+		sim_usb_stats.atdtw_trips++;
+	}
+}
+
+/* take in whatever the CPU did to the register presented last */
+static void commit(void)
+{
+	uint32_t v, changed;
+
+	if (last_off == NONE)
+		return;
+	v = *reg(last_off);
+	changed = v != last_val;
+
+	switch (last_off) {
+	case 0x140: /* USBCMD */
+		if ((v & USB_USBCMD_ATDTW) && !(usbcmd & USB_USBCMD_ATDTW))
+			sim_usb_stats.atdtw_sets++;
+		usbcmd = v & ~USB_USBCMD_RST;
+		if (v & USB_USBCMD_RST) {
+			ep_flush(EP_BITS);
+			usbsts = setupstat = complete = 0;
+		}
+		break;
+	case 0x144: /* USBSTS */
+		usbsts &= ~v;
+		break;
+	case 0x1AC: /* ENDPTSETUPSTAT */
+		setupstat &= ~v;
+		break;
+	case 0x1BC: /* ENDPTCOMPLETE */
+		complete &= ~v;
+		break;
+	case 0x1B0: /* ENDPTPRIME */
+		if (changed) {
+			uint32_t set = v & EP_BITS & ~prime;
+			int bit;
+
+			for (bit = 0; bit < 32; bit++) {
+				if (!(set & (1 << bit)))
+					continue;
+				eps[bit].prime_at = sim_ns + rnd(cfg.prime_ns);
+				sim_usb_stats.primes++;
+			}
+			prime |= set;
+		}
+		break;
+	case 0x1B4: /* ENDPTFLUSH */
+		if (changed)
+			flush |= v & EP_BITS;
+		break;
+	}
+	last_off = NONE;
+}
+
+static void irq_check(void)
+{
+	void (*isr)(void) = _VectorsRam[IRQ_USB1 + 16];
+	uint64_t start, accesses;
+
+	if (!(usbsts & *reg(0x148))) {
+		irq_at = 0;
+		return;
+	}
+	/* interrupt latency, random per event */
+	if (!irq_at)
+		irq_at = sim_ns + rnd(cfg.irq_ns) + 1;
+	if (!isr || !nvic_on || primask || in_isr || sim_ns < irq_at)
+		return;
+	irq_at = 0;
+	in_isr = 1;
+	sim_usb_stats.interrupts++;
+	accesses = sim_usb_stats.accesses;
+	start = host_ns();
+	isr();
+	commit();
+	sim_usb_stats.isr_host_ns += host_ns() - start;
+	sim_usb_stats.isr_accesses += sim_usb_stats.accesses - accesses;
+	in_isr = 0;
+}
+
+static void step(uint32_t ns)
+{
+	commit();
+	sim_ns += ns;
+	advance();
+	irq_check();
+	commit();
+}
+
+volatile uint32_t *sim_usb_reg(unsigned int off)
+{
+	volatile uint32_t *r = reg(off);
+
+	sim_usb_stats.accesses++;
+	step(cfg.reg_ns);
+
+	switch (off) {
+	case 0x140: *r = usbcmd; break;
+	case 0x144: *r = usbsts; break;
+	case 0x184: *r = portsc; break;
+	case 0x1AC: *r = setupstat; break;
+	case 0x1B0: *r = prime; break;
+	case 0x1B4: *r = flush; break;
+	case 0x1B8: *r = status; break;
+	case 0x1BC: *r = complete; break;
+	}
+	last_off = off;
+	last_val = *r;
+	return r;
+}
+
+/*
+ * The other places usb.c lets the controller and the interrupt in
+ * between its memory accesses.
+ */
+void sim_usb_irq_disable(void)
+{
+	step(1);
+	primask = 1;
+}
+
+void sim_usb_irq_enable(void)
+{
+	primask = 0;
+	step(1);
+}
+
+void sim_usb_dcache(void *addr, uint32_t size)
+{
+	step(1);
+}
+
+void sim_usb_nvic_enable(int irq)
+{
+	if (irq == IRQ_USB1)
+		nvic_on = 1;
+}
+
+void sim_usb_run(uint32_t ns)
+{
+	while (ns) {
+		uint32_t n = ns < 100 ? ns : 100;
+
+		step(n);
+		ns -= n;
+	}
+}
+
+uint32_t sim_usb_pending(void)
+{
+	commit();
+	return prime | status;
+}
+
+/* bus reset from the host, the port comes up at the given speed */
+void sim_usb_attach(int high_speed)
+{
+	commit();
+	portsc = high_speed ? USB_PORTSC1_HSP : 0;
+	usbsts |= USB_USBSTS_URI | USB_USBSTS_PCI;
+}
+
+void sim_usb_setup(uint64_t setup)
+{
+	struct dqh *q;
+
+	commit();
+	q = qh(0);
+	q->setup[0] = setup;
+	q->setup[1] = setup >> 32;
+	setupstat |= 1;
+	usbcmd &= ~USB_USBCMD_SUTW;
+	usbsts |= USB_USBSTS_UI;
+	/* a setup packet clears the ep0 stall */
+	*reg(0x1C0) &= ~(USB_ENDPTCTRL_TXS | USB_ENDPTCTRL_RXS);
+}
+
+int sim_usb_ep0_stalled(void)
+{
+	commit();
+	return !!(*reg(0x1C0) & (USB_ENDPTCTRL_TXS | USB_ENDPTCTRL_RXS));
+}
+
+void sim_usb_dump(void)
+{
+	int bit;
+
+	commit();
+	fprintf(stderr, "USBCMD %08x USBSTS %08x PRIME %08x STATUS %08x COMPLETE %08x\n",
+		usbcmd, usbsts, prime, status, complete);
+	for (bit = 0; bit < 32; bit++) {
+		const struct ep *e = eps + bit;
+		const struct dqh *q;
+
+		if (!((EP_BITS >> bit) & 1) || !*reg(0x158))
+			continue;
+		q = qh(bit);
+		if (!q->config && !e->cur)
+			continue;
+		fprintf(stderr, "ep%d%-3s cur %p%s next %p first %p last %p\n",
+			ep_num(bit), ep_tx(bit) ? "in" : "out", (void *)e->cur,
+			e->hazard ? " (fetching)" : "", (void *)q->next,
+			(void *)q->first_transfer, (void *)q->last_transfer);
+	}
+}
+
+void sim_usb_init(const struct sim_usb_cfg *c, const struct sim_usb_host *h)
+{
+	cfg = *c;
+	host = *h;
+	rnd_state = cfg.seed ? cfg.seed : 1;
+}
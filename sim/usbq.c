@@ -0,0 +1,336 @@
+/*
+ * Runs teensy4/usb.c's transfer queueing against the controller model:
+ * enumerates through the real interrupt handler, then keeps the UAS
+ * endpoints busy the way scsi.c does. Received frames are handed back
+ * in random order and the host side runs with random delays, so the
+ * dTD lists are relinked and completed in ever changing orders. Every
+ * packet carries a sequence number and is checked on the other end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "sim.h"
+#include "sim_hal.h"
+#include "usb_dev.h"
+#define USB_DESC_LIST_DEFINE
+#include "usb_desc.h"
+#include "scsi.h"
+#include "scsi_stats.h"
+
+#undef printf
+
+#define RX_HELD_MAX	16
+#define STALL_NS	100000000ULL
+
+/* what usb.c expects from usb_desc.c and scsi.c */
+const usb_descriptor_list_t usb_descriptor_list[] = { { 0, 0, NULL, 0 } };
+const uint8_t usb_config_descriptor_480[1];
+const uint8_t usb_config_descriptor_12[1];
+uint8_t usb_descriptor_buffer[64];
+extern volatile uint8_t usb_configuration;
+
+void usb_init_serialnumber(void)
+{
+}
+
+void scsi_reset(void)
+{
+}
+
+int scsi_selftest_start(const struct scsi_selftest_params *params)
+{
+	return -1;
+}
+
+struct flow {
+	const char *name;
+	uint32_t sent;		/* packets put on the wire */
+	uint32_t received;	/* packets checked on the other end */
+	uint64_t bytes;
+};
+
+static struct flow cmd_flow = { "cmd" }, dout_flow = { "dout" };
+static struct flow din_flow = { "din" }, stat_flow = { "stat" };
+
+static uint32_t transfers = 10000, max_len = 16384, gap_pct = 30;
+static uint32_t quarter;	/* packets per pipe */
+static uint32_t rnd_state = 1;
+static uint8_t stats_buf[sizeof(struct scsi_stats)];
+static uint32_t stats_len;
+static uint64_t submit_ns;
+static uint32_t submits;
+
+static uint32_t rnd(uint32_t max)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return max ? rnd_state % (max + 1) : 0;
+}
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t pattern(uint32_t seq, uint32_t off)
+{
+	return seq * 7 + off;
+}
+
+static void fill(uint8_t *p, uint32_t seq, uint32_t len)
+{
+	uint32_t i;
+
+	memcpy(p, &seq, 4);
+	memcpy(p + 4, &len, 4);
+	for (i = 8; i < len; i++)
+		p[i] = pattern(seq, i);
+}
+
+static void check(struct flow *f, const uint8_t *p, uint32_t len)
+{
+	uint32_t seq, hlen, i;
+
+	if (len < 8)
+		sim_fatal("%s: short packet of %u bytes\n", f->name, len);
+	memcpy(&seq, p, 4);
+	memcpy(&hlen, p + 4, 4);
+	if (seq != f->received)
+		sim_fatal("%s: got packet %u, expected %u\n", f->name, seq, f->received);
+	if (hlen != len)
+		sim_fatal("%s: packet %u has %u bytes, sent %u\n", f->name, seq, len, hlen);
+	for (i = 8; i < len; i++)
+		if (p[i] != pattern(seq, i))
+			sim_fatal("%s: packet %u corrupt at %u\n", f->name, seq, i);
+	f->received++;
+	f->bytes += len;
+}
+
+static uint32_t done(void)
+{
+	return cmd_flow.received + dout_flow.received + din_flow.received + stat_flow.received;
+}
+
+/* host side, called by the controller model */
+static int host_in(int ep, const uint8_t *data, uint32_t len)
+{
+	if (ep == 0) {
+		if (len) {
+			memcpy(stats_buf, data, len < sizeof(stats_buf) ? len : sizeof(stats_buf));
+			stats_len = len;
+		}
+		return 0;
+	}
+	check(ep == UAS_DIN_ENDPOINT ? &din_flow : &stat_flow, data, len);
+	return 0;
+}
+
+static int host_out(int ep, uint8_t *data, uint32_t len)
+{
+	struct flow *f = ep == UAS_CMD_ENDPOINT ? &cmd_flow : &dout_flow;
+	uint32_t n;
+
+	if (ep == 0)
+		return 0;
+	if (f->sent >= quarter || rnd(99) < gap_pct)
+		return -1;
+	n = 8 + rnd(len - 8);
+	fill(data, f->sent++, n);
+	return n;
+}
+
+/* device side, the way scsi.c consumes and returns frames */
+static struct held {
+	transfer_t *t;
+	int cmd;
+} held[RX_HELD_MAX];
+static int nheld;
+
+static void rx_poll(transfer_t **list, struct flow *f)
+{
+	transfer_t *t = get_frame_noblock(list);
+
+	if (t == LIST_END)
+		return;
+	if (t->status & 0x80)
+		sim_fatal("%s: frame %p handed out while active\n", f->name, (void *)t);
+	check(f, transfer_buffer(t), transfer_length(t));
+	if (nheld == RX_HELD_MAX)
+		sim_fatal("more frames received than queued\n");
+	held[nheld].t = t;
+	held[nheld++].cmd = f == &cmd_flow;
+}
+
+/* hand a random one of the held frames back to the controller */
+static void rx_release(void)
+{
+	int i = rnd(nheld - 1);
+	struct held h = held[i];
+
+	uint64_t start;
+
+	held[i] = held[--nheld];
+	start = host_ns();
+	if (h.cmd)
+		usb_rx_cmd_ack(h.t);
+	else
+		usb_rx_dout_ack(h.t);
+	submit_ns += host_ns() - start;
+	submits++;
+}
+
+static void tx_send(void)
+{
+	int ep = rnd(1) ? UAS_DIN_ENDPOINT : UAS_STAT_ENDPOINT;
+	struct flow *f = ep == UAS_DIN_ENDPOINT ? &din_flow : &stat_flow;
+	uint32_t len = 8 + rnd((ep == UAS_DIN_ENDPOINT ? max_len : 32) - 8);
+	uint64_t start;
+	transfer_t *t;
+
+	/* get_frame() would spin here until the host reads something */
+	if (tx_free_list == LIST_END)
+		return;
+	t = get_frame(&tx_free_list);
+	fill(transfer_buffer(t), f->sent++, len);
+	start = host_ns();
+	tx_uas_response(t, ep, len);
+	submit_ns += host_ns() - start;
+	submits++;
+}
+
+static void control(uint64_t setup)
+{
+	uint64_t start = sim_ns;
+
+	sim_usb_setup(setup);
+	while (sim_ns - start < 1000000)
+		sim_usb_run(1000);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"  -n count     transfers, split over the four UAS pipes (default 10000)\n"
+		"  -l bytes     largest data-in transfer (default 16384)\n"
+		"  -g percent   chance the host has nothing to send when asked (default 30)\n"
+		"  -S seed      random seed\n"
+		"  -p ns        prime latency, random up to (default 200)\n"
+		"  -z ns        dTD fetch to ENDPTSTATUS update, random up to (default 100)\n"
+		"  -t ns        host side delay per dTD, random up to (default 2000)\n"
+		"  -b ns        wire time per byte, in 1/16 ns (default 32)\n"
+		"  -i ns        interrupt latency, random up to (default 500)\n"
+		"  -O ns        cost of one register access (default 20)\n"
+		"  -v           show firmware console output\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_usb_cfg cfg = {
+		.seed = 1,
+		.reg_ns = 20,
+		.prime_ns = 200,
+		.hazard_ns = 100,
+		.xfer_ns = 2000,
+		.byte_ns = 32,
+		.irq_ns = 500,
+	};
+	struct sim_usb_host host = { host_in, host_out };
+	const struct sim_usb_stats *u = &sim_usb_stats;
+	const struct scsi_stats *s = (const struct scsi_stats *)stats_buf;
+	uint64_t progress_ns, start_ns;
+	uint32_t last, n;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:l:g:S:p:z:t:b:i:O:vh")) != -1) {
+		switch (c) {
+		case 'n': transfers = strtoul(optarg, NULL, 0); break;
+		case 'l': max_len = strtoul(optarg, NULL, 0); break;
+		case 'g': gap_pct = strtoul(optarg, NULL, 0); break;
+		case 'S': cfg.seed = strtoul(optarg, NULL, 0); break;
+		case 'p': cfg.prime_ns = strtoul(optarg, NULL, 0); break;
+		case 'z': cfg.hazard_ns = strtoul(optarg, NULL, 0); break;
+		case 't': cfg.xfer_ns = strtoul(optarg, NULL, 0); break;
+		case 'b': cfg.byte_ns = strtoul(optarg, NULL, 0); break;
+		case 'i': cfg.irq_ns = strtoul(optarg, NULL, 0); break;
+		case 'O': cfg.reg_ns = strtoul(optarg, NULL, 0); break;
+		case 'v': sim_verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (transfers < 4 || max_len < 32 || max_len > 16384 || gap_pct > 99) {
+		usage(argv[0]);
+		return 1;
+	}
+	rnd_state = cfg.seed ? cfg.seed * 2654435761u : 1;
+	quarter = transfers / 4;
+
+	sim_usb_init(&cfg, &host);
+	usb_init();
+	sim_usb_attach(1);
+	sim_usb_run(10000);
+	control(0x0000000000010900ULL);	/* SET_CONFIGURATION 1 */
+	if (!usb_configuration || rx_packet_size != 512)
+		sim_fatal("not configured %d %d\n", usb_configuration, rx_packet_size);
+
+	memset((void *)u, 0, sizeof(*u));
+	start_ns = progress_ns = sim_ns;
+	last = 0;
+	while (done() < quarter * 4) {
+		rx_poll(&rx_cmd_busy_list, &cmd_flow);
+		rx_poll(&rx_dout_busy_list, &dout_flow);
+		while (nheld && rnd(1))
+			rx_release();
+		if (din_flow.sent + stat_flow.sent < quarter * 2 && rnd(1))
+			tx_send();
+		if (rnd(3) == 0)
+			sim_usb_run(rnd(2000));
+		if (done() != last) {
+			last = done();
+			progress_ns = sim_ns;
+		} else if (sim_ns - progress_ns > STALL_NS) {
+			sim_usb_dump();
+			sim_fatal("no progress, cmd %u/%u dout %u/%u din %u/%u stat %u/%u\n",
+				  cmd_flow.received, cmd_flow.sent, dout_flow.received,
+				  dout_flow.sent, din_flow.received, din_flow.sent,
+				  stat_flow.received, stat_flow.sent);
+		}
+	}
+	for (n = 0; nheld && n < 1000; n++)
+		rx_release();
+	/* the host sees the last packets before the interrupt reaps them */
+	sim_usb_run(100000);
+
+	/* everything handed back: the stats must see all tx frames free */
+	control((uint64_t)sizeof(struct scsi_stats) << 48 | 0x01C0);	/* GET_STATS */
+	if (stats_len != sizeof(struct scsi_stats))
+		sim_fatal("GET_STATS returned %u bytes\n", stats_len);
+	if (s->tx_frames_free != s->tx_frames_total)
+		sim_fatal("%u of %u tx frames free after draining\n",
+			  s->tx_frames_free, s->tx_frames_total);
+
+	n = done();
+	printf("%u transfers (cmd %u, dout %u, din %u, stat %u), %.1f MB in %.3f ms simulated\n",
+	       n, cmd_flow.received, dout_flow.received, din_flow.received,
+	       stat_flow.received, (cmd_flow.bytes + dout_flow.bytes + din_flow.bytes +
+				    stat_flow.bytes) / 1e6, (sim_ns - start_ns) / 1e6);
+	printf("  dTDs %u, primes %u (%u while busy, %u stale), interrupts %u, %.2f dTDs per interrupt\n",
+	       u->dtds, u->primes, u->prime_busy, u->stale_primes, u->interrupts,
+	       u->interrupts ? (double)u->dtds / u->interrupts : 0);
+	printf("  ATDTW set %u, tripped %u, frame waits %u\n",
+	       u->atdtw_sets, u->atdtw_trips, s->frame_waits);
+	printf("  register accesses: %.2f per transfer, %.2f per dTD in the interrupt handler\n",
+	       (double)u->accesses / n, u->dtds ? (double)u->isr_accesses / u->dtds : 0);
+	/* both include the model's own work behind each register access */
+	printf("  host time: %.0f ns per queued dTD, %.0f ns per dTD in the interrupt handler\n",
+	       submits ? (double)submit_ns / submits : 0,
+	       u->dtds ? (double)u->isr_host_ns / u->dtds : 0);
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include "scsi.h"
 #include "usb_desc.h"
 #include "usb_dev.h"
+#include "sniffer.h"
 #include <stdio.h>
 
 extern void usb_msc_loop(void);
@@ -40,7 +41,11 @@ int main(void)
 {
 
 	scsi_initialize();
+#ifdef SCSI_SNIFFER
+	scsi_sniffer_loop();
+#else
 	usb_msc_loop();
+#endif
 	return 0;
 }
 
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Post-link check of the memory map, run by the Makefile on main.elf:
+#
+#	./memmap.sh main.elf [toolchain prefix]
+#
+# Prints what each memory holds and where the symbols listed below
+# ended up. ITCM and DTCM run at the core clock without wait states,
+# OCRAM is behind the AXI bus, flash and PSRAM behind FlexSPI and the
+# cache. A hot symbol outside ITCM/DTCM, or a buffer outside the memory
+# it was meant for, fails the build. Static functions that got inlined
+# don't show up and are only listed.
+
+ELF=${1:-main.elf}
+CROSS=${2:-arm-none-eabi-}
+
+# handshake loops and frame list helpers, all code but FLASHMEM is here
+ITCM="scsi_ack_async scsi_handle_cmd scsi_handle_msgout scsi_handle_msgin
+scsi_get_dout_frame scsi_put_dout_frame scsi_get_din_frame scsi_put_din_frame
+scsi_next_frame scsi_handle_data_out scsi_handle_data_in scsi_handle_status scsi_handle_phase
+get_frame get_frame_noblock put_frame usb_rx_cmd_ack usb_rx_dout_ack
+tx_uas_response usb_prepare_transfer schedule_transfer usb_transmit
+usb_receive run_callbacks isr scsi_clock_nominal memcpy"
+# their state and small lookups, .bss; the command queue and sessions
+# are touched in every phase
+DTCM="sctx scsi_tags parity_table endpoint_queue_head rx_cmd_transfer
+rx_dout_transfer tx_transfer tx_free_list rx_cmd_busy_list rx_dout_busy_list
+cmd_queue sessions status_queue status_sense sense_cache ramdisk_dtcm"
+# DMAMEM, the USB frames and the bulk buffers, too big for DTCM and not hot
+OCRAM="rx_cmd_buf rx_dout_buf txbuf scsi_trace_ring resp_cache selftest_buf"
+# EXTMEM
+PSRAM="ramdisk_psram"
+
+{
+	${CROSS}size -A "$ELF" | sed 's/^/S /'
+	${CROSS}nm "$ELF" | sed 's/^/N /'
+} | awk -v itcm="$ITCM" -v dtcm="$DTCM" -v ocram="$OCRAM" -v psram="$PSRAM" '
+function hex(s,	i, v) {
+	v = 0
+	s = tolower(s)
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+function region(a) {
+	if (a < 524288)
+		return "ITCM"
+	if (a >= 536870912 && a < 537395200)
+		return "DTCM"
+	if (a >= 538968064 && a < 539492352)
+		return "OCRAM"
+	if (a >= 1610612736 && a < 1879048192)
+		return "FLASH"
+	if (a >= 1879048192 && a < 1895825408)
+		return "PSRAM"
+	return "?"
+}
+function want(list, r,	n, i, w) {
+	n = split(list, w)
+	for (i = 1; i <= n; i++)
+		expect[w[i]] = r
+}
+BEGIN {
+	want(itcm, "ITCM")
+	want(dtcm, "DTCM")
+	want(ocram, "OCRAM")
+	want(psram, "PSRAM")
+}
+$1 == "S" && $4 ~ /^[0-9]+$/ && $2 !~ /^\.(debug|comment|ARM\.attributes)/ {
+	used[region($4)] += $3
+	# code and initialized data are copied out of flash
+	if ($2 == ".text.itcm" || $2 == ".ARM.exidx" || $2 == ".data")
+		used["FLASH"] += $3
+}
+$1 == "N" && NF == 4 && ($4 in expect) {
+	r = region(hex($2))
+	printf "%-24s %s %s%s\n", $4, $2, r, r == expect[$4] ? "" : "  should be in " expect[$4]
+	if (r != expect[$4])
+		bad++
+	seen[$4] = 1
+}
+END {
+	banks = int((used["ITCM"] + 32767) / 32768)
+	printf "ITCM  %8d bytes, %d of 16 32K FlexRAM banks\n", used["ITCM"], banks
+	printf "DTCM  %8d bytes of %d\n", used["DTCM"], (16 - banks) * 32768
+	printf "OCRAM %8d bytes of 524288\n", used["OCRAM"]
+	printf "FLASH %8d bytes\n", used["FLASH"]
+	printf "PSRAM %8d bytes\n", used["PSRAM"]
+	for (s in expect)
+		if (!(s in seen))
+			printf "%-24s inlined or not linked\n", s
+	if (bad) {
+		printf "%d symbols in the wrong memory\n", bad
+		exit 1
+	}
+}'
@@ -1,71 +1,90 @@
 #include <scsi.h>
-#include <core_pins.h>
+#include "scsi_pins.h"
+#include "scsi_stats.h"
+#include "scsi_ramdisk.h"
+#include "scsi_clock.h"
+#include "scsi_task.h"
+#include "scsi_hal.h"
 #include <stdio.h>
 #include "usb_dev.h"
 #include "usb_desc.h"
-#include "wiring.h"
-#include <Arduino.h>
-
-#define BSYI_PIN 2
-#define BSYO_PIN 3
-#define SELI_PIN 6
-#define CDO_PIN 7
-#define IOO_PIN 8
-#define REQI_PIN 9
-#define IOI_PIN 10
-#define MSGI_PIN 11
-#define CDI_PIN 12
-#define ACKO_PIN 24
-#define REQO_PIN 25
-#define DB6O_PIN 26
-#define DB7O_PIN 27
-#define RSTI_PIN 28
-#define DBPI_PIN 30
-#define DBPO_PIN 31
-#define ACKI_PIN 32
-#define SELO_PIN 33
-#define ATNI_PIN 34
-#define MSGO_PIN 35
-#define RSTO_PIN 36
-#define ATNO_PIN 37
-#define DB4O_PIN 38
-#define DB5O_PIN 39
-#define DB4I_PIN 40
-#define DB5I_PIN 41
-#define DB2I_PIN 14
-#define DB3I_PIN 15
-#define DB7I_PIN 16
-#define DB6I_PIN 17
-#define DB1I_PIN 18
-#define DB0I_PIN 19
-#define DB2O_PIN 20
-#define DB3O_PIN 21
-#define DB0O_PIN 22
-#define DB1O_PIN 23
-
-#define LED_PIN 13
-#define SCSI_BUS_CLEAR_DELAY 800
-#define SCSI_ARBITRATION_DELAY 2400
-#define SCSI_BUS_SETTLE_DELAY 400
+
+#define SCSI_BUS_CLEAR_DELAY (scsi_tunables.bus_clear_delay)
+#define SCSI_ARBITRATION_DELAY (scsi_tunables.arbitration_delay)
+#define SCSI_BUS_SETTLE_DELAY (scsi_tunables.bus_settle_delay)
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
 
-struct scsi_ctx {
+/* what the scan found out about a SCSI ID, and what it rejected since */
+struct scsi_target {
+	unsigned int present:1;
 	unsigned int support_identify:1;
 	unsigned int support_tags:1;
 	unsigned int support_sdtr:1;
 	unsigned int support_disconnect:1;
+	uint8_t untagged;		/* LUNs with an untagged command disconnected */
+	uint8_t lun_tag[8];		/* and its scsi_tags slot */
+	uint8_t disconnected;		/* commands it has disconnected */
+	uint8_t ordered;		/* ... of them ORDERED */
+	uint32_t access_us[2];		/* READ and WRITE, command to data or status */
+	uint16_t block_size[8];		/* by LUN, from the last READ or WRITE */
+	uint32_t head_lba[8];		/* by LUN, where the last READ or WRITE ended */
+	uint8_t depth;			/* commands it takes at once, see scsi_queue_status() */
+	uint8_t depth_good;		/* good status since depth last changed */
+	uint16_t busy_us;		/* back-off after BUSY, 0 after good status */
+	uint32_t busy_until;
+};
+
+struct scsi_ctx {
 	int hostid;
 	int hostidmsk;
-	int targetid;
+	int scanned;
+	int luns;
+	uint32_t resel_ns;		/* reselection up to the first phase after it */
+	uint8_t lun_map[SCSI_LUNS];	/* host LUN: SCSI ID << 3 | LUN */
+	struct scsi_target target[8];
 } sctx;
 
+/* task attributes, in the order of their tag messages */
+#define SCSI_ATTR_SIMPLE	0
+#define SCSI_ATTR_HEAD		1
+#define SCSI_ATTR_ORDERED	2
+
+/*
+ * One per command, the Q of its I_T_L_Q nexus. While the target has it
+ * disconnected, this is all that is left of the xfer: reselection finds
+ * it by ID and tag, or by ID and LUN for an untagged one, and goes on
+ * from here.
+ */
 struct scsi_tag {
 	uint32_t host_tag;
 	uint8_t tag;
-	int valid:1;
-	int sent_read_ready:1;
-	int sent_write_ready:1;
+	uint8_t id;
+	uint8_t lun;
+	unsigned int valid:1;
+	unsigned int sent_read_ready:1;
+	unsigned int sent_write_ready:1;
+	unsigned int queued:1;		/* still in cmd_queue, not at the target */
+	unsigned int disconnected:1;
+	unsigned int untagged:1;	/* I_T_L nexus, the target got no tag message */
+	unsigned int frame_din:1;
+	unsigned int privileged:1;	/* IDENTIFY allowed it to disconnect */
+	unsigned int reselected:1;
+	unsigned int timing:1;		/* access time not measured yet */
+	uint8_t resp;		/* resp_cache entry + 1 its data goes to */
+	uint8_t requeues;	/* BUSY or QUEUE FULL so far */
+	uint8_t task_attr;	/* SCSI_ATTR_* */
+	uint8_t cmd_class;	/* SCSI_CLASS_* */
+	uint32_t cmd_us;	/* end of the command phase */
+	uint32_t blocks;	/* of a READ or WRITE */
+	uint32_t data_due;	/* bytes it moves, 0 if the block size isn't known yet */
+	int data_act;		/* when it disconnected */
+	int data_saved;		/* SAVE DATA POINTERS */
+	int data_done;
+	transfer_t *frame;	/* parked here while disconnected */
+	uint16_t frame_pos;
+	uint16_t frame_len;
+	struct scsi_trace_rec trace;
 } scsi_tags[256];
 
 typedef enum {
@@ -201,7 +220,7 @@ static void scsi_setup_ports(void)
 
 static uint8_t scsi_get_data(void)
 {
-	return ~(GPIO6_PSR >> 16);
+	return scsi_hal_data_read();
 }
 
 static const int parity_table[256] = {
@@ -258,6 +277,8 @@ static int scsi_insert_tag(uint32_t host_tag)
 		ret->host_tag = host_tag;
 		ret->tag = i;
 		ret->valid = 1;
+		if (++scsi_stats.tags_in_use > scsi_stats.tags_max)
+			scsi_stats.tags_max = scsi_stats.tags_in_use;
 		return i;
 	}
 
@@ -277,23 +298,127 @@ static struct scsi_tag *scsi_lookup_tag(int tag)
 	return ret;
 }
 
+/*
+ * INQUIRY, READ CAPACITY and MODE SENSE come again for every rescan
+ * and every program that opens the disk, and each one costs a
+ * selection and the firmware of an old controller. What a target
+ * answered with GOOD status stays in resp_cache, under the host LUN
+ * and the CDB bytes that select the data, and the next one is answered
+ * from RAM, see scsi_resp_cached(). scsi_put_din_frame() copies the
+ * data as it goes to the host, the status commits it. A response
+ * shorter than its allocation length is all there is and serves any
+ * length, a cut one only as much as it has. UNIT ATTENTION, MODE SELECT
+ * and FORMAT UNIT drop the entries of their LUN, a bus reset and a
+ * rescan all of them.
+ */
+#define SCSI_RESP_ENTRIES	16
+#define SCSI_RESP_MAX		256
+
+enum { SCSI_RESP_FREE, SCSI_RESP_FILLING, SCSI_RESP_VALID };
+
+struct scsi_resp {
+	uint8_t state;
+	uint8_t lun;		/* host LUN */
+	uint8_t tag;		/* filling it */
+	uint8_t key[4];		/* opcode and what selects the data */
+	uint16_t len;
+	uint16_t alloc;		/* of the command that filled it */
+	uint32_t used;		/* resp_clock, the oldest goes first */
+	uint8_t data[SCSI_RESP_MAX];
+};
+
+DMAMEM static struct scsi_resp resp_cache[SCSI_RESP_ENTRIES];
+static uint32_t resp_clock;
+
+/* the host LUN's entries, or all of them for -1 */
+static void scsi_resp_invalidate(int lun)
+{
+	struct scsi_resp *r;
+
+	for (r = resp_cache; r < resp_cache + SCSI_RESP_ENTRIES; r++) {
+		if (r->state == SCSI_RESP_FREE || (lun != -1 && r->lun != lun))
+			continue;
+		if (r->state == SCSI_RESP_VALID)
+			scsi_stats.resp_cache_invalidated++;
+		r->state = SCSI_RESP_FREE;
+		r->used = 0;
+	}
+}
+
+/* the entry the tag fills, NULL if it was dropped meanwhile */
+static struct scsi_resp *scsi_resp_filling(struct scsi_tag *t)
+{
+	struct scsi_resp *r = resp_cache + t->resp - 1;
+
+	if (r->state == SCSI_RESP_FILLING && r->tag == t->tag)
+		return r;
+	t->resp = 0;
+	return NULL;
+}
+
+/* len bytes of the response at off went to the host */
+static void scsi_resp_snoop(struct scsi_tag *t, const uint8_t *data, int off, int len)
+{
+	struct scsi_resp *r = scsi_resp_filling(t);
+
+	if (!r)
+		return;
+	if (off != r->len || off + len > SCSI_RESP_MAX) {
+		r->state = SCSI_RESP_FREE;
+		t->resp = 0;
+		return;
+	}
+	memcpy(r->data + off, data, len);
+	r->len += len;
+}
+
+static void scsi_resp_done(struct scsi_tag *t, uint8_t status)
+{
+	struct scsi_resp *r = scsi_resp_filling(t);
+
+	t->resp = 0;
+	if (!r)
+		return;
+	if (status) {
+		r->state = SCSI_RESP_FREE;
+		return;
+	}
+	r->state = SCSI_RESP_VALID;
+	r->used = ++resp_clock;
+	scsi_stats.resp_cache_fills++;
+}
+
 static void scsi_free_tag(int tag)
 {
+	struct scsi_tag *t = scsi_tags + tag;
+	struct scsi_target *target;
+
 	if (tag > ARRAY_SIZE(scsi_tags))
 		return;
-	memset(scsi_tags + tag, 0, sizeof(struct scsi_tag));
+	target = sctx.target + t->id;
+	if (t->valid && t->untagged && target->lun_tag[t->lun] == tag)
+		target->untagged &= ~(1 << t->lun);
+	if (t->valid && t->disconnected) {
+		target->disconnected--;
+		if (t->task_attr == SCSI_ATTR_ORDERED)
+			target->ordered--;
+	}
+	if (t->valid && t->resp)
+		scsi_resp_done(t, 0xff);
+	if (t->valid && scsi_stats.tags_in_use)
+		scsi_stats.tags_in_use--;
+	memset(t, 0, sizeof(struct scsi_tag));
 }
 
 static void scsi_set_hiz(void)
 {
-	GPIO6_DR_CLEAR |= (0xff << 24);
+	scsi_hal_data_release();
 	digitalWriteFast(DBPO_PIN, LOW);
 }
 
 static void scsi_set_data(uint8_t data)
 {
-	GPIO6_DR_CLEAR |= ~data << 24;
-	GPIO6_DR_SET |= data << 24;
+	scsi_hal_data_write(data);
 	digitalWriteFast(DBPO_PIN, parity_table[data]);
 }
 
@@ -314,8 +439,17 @@ static __attribute__((unused)) void dump_scsi(const char *prefix)
 	       digitalReadFast(DBPI_PIN) ? "" : "DBP ");
 }
 
+static void scsi_flush_queues(void);
+static void scsi_tasks_init(void);
+
 void scsi_reset(void)
 {
+	int i;
+
+#ifdef SCSI_SNIFFER
+	/* the sniffer never drives the bus */
+	return;
+#endif
 	digitalWriteFast(RSTO_PIN, HIGH);
 	scsi_set_hiz();
         digitalWriteFast(SELO_PIN, LOW);
@@ -330,18 +464,48 @@ void scsi_reset(void)
 	digitalWriteFast(RSTO_PIN, LOW);
 	delay(250);
 	memset(&scsi_tags, 0, sizeof(scsi_tags));
+	scsi_stats.tags_in_use = 0;
+	scsi_resp_invalidate(-1);
+	for (i = 0; i < ARRAY_SIZE(sctx.target); i++) {
+		sctx.target[i].untagged = 0;
+		sctx.target[i].disconnected = 0;
+		sctx.target[i].ordered = 0;
+	}
+	scsi_flush_queues();
+	/* whatever was powered on meanwhile shows up at the next command */
+	sctx.scanned = 0;
+	/* our own RST edges are latched too */
+	scsi_hal_bus_events();
+}
+
+static int scsi_check_reselection(void);
+static void scsi_session_sync(void);
+
+/*
+ * BSY before SEL: a target that won arbitration asserts SEL before it
+ * lets go of BSY, read the other way round the two could both look
+ * released in between.
+ */
+static int scsi_bus_idle(void)
+{
+	if (!digitalReadFast(BSYI_PIN))
+		return 0;
+	return digitalReadFast(SELI_PIN);
 }
 
 static int scsi_wait_bus_free(void)
 {
 	for(;;) {
 		digitalWriteFast(BSYO_PIN, LOW);
-		delayNanoseconds(800); /* Bus clear delay */
-		while(!(digitalReadFast(SELI_PIN) & digitalReadFast(BSYI_PIN)));
+		delayNanoseconds(SCSI_BUS_CLEAR_DELAY);
+		/* a target may be reselecting us while we wait */
+		while(!scsi_bus_idle())
+			if (scsi_check_reselection())
+				scsi_session_sync();
 		/* start arbitration */
 		digitalWriteFast(BSYO_PIN, HIGH);
 		scsi_set_data(sctx.hostidmsk);
-		delayNanoseconds(2400); /* Arbitration delay */
+		delayNanoseconds(SCSI_ARBITRATION_DELAY);
 		if (!(scsi_get_data() & (sctx.hostidmsk-1)))
 			break;
 	}
@@ -351,7 +515,7 @@ static int scsi_wait_bus_free(void)
 
 static int scsi_select(struct scsi_xfer *xfer, int id)
 {
-	int i = 250000000 / SCSI_BUS_SETTLE_DELAY;
+	int i = scsi_tunables.select_timeout * (1000000 / SCSI_BUS_SETTLE_DELAY);
 
 	digitalWriteFast(SELO_PIN, HIGH);
 	if (xfer->outmsgcnt)
@@ -367,7 +531,9 @@ static int scsi_select(struct scsi_xfer *xfer, int id)
 
 	if (i < 0) {
 		SCSI_DEBUG(SCSI_DEBUG_PHASE, "select failed\n");
+		scsi_stats.select_timeouts++;
 		digitalWriteFast(SELO_PIN, LOW);
+		digitalWriteFast(ATNO_PIN, LOW);
 		return 1;
 	}
 	xfer->id = id;
@@ -379,7 +545,7 @@ static int scsi_select(struct scsi_xfer *xfer, int id)
 
 static scsi_phase_t scsi_get_phase(void)
 {
-	return GPIO7_PSR & 7;
+	return scsi_hal_phase_read();
 }
 
 static unsigned int get_cdb_len(struct scsi_xfer *xfer)
@@ -394,33 +560,57 @@ static void scsi_ack_async(void)
 	digitalWriteFast(ACKO_PIN, LOW);
 }
 
+/* REQ polls in a row without a byte until a phase counts as stalled */
+#define SCSI_STALL_SPINS 4096
+
+static int scsi_xfer_wait(struct scsi_xfer *xfer);
+
 static void scsi_handle_cmd(struct scsi_xfer *xfer)
 {
-	unsigned int i;
+	unsigned int i, spins = 0;
 	uint8_t *cdb = xfer->cdb;
+	uint32_t sent = 0;
 	SCSI_DEBUG(SCSI_DEBUG_CMD, "%lx: CDB: ", get_xfer_tag(xfer));
-	for(i = 0; i < get_cdb_len(xfer);) {
+	/* the target may go to its media access with REQ off before the phase changes */
+	for(i = xfer->cdbpos; i < get_cdb_len(xfer);) {
 		if (digitalReadFast(BSYI_PIN))
 			break;
 
-		if (digitalReadFast(REQI_PIN))
+		if (digitalReadFast(REQI_PIN)) {
+			if (!(++spins % SCSI_STALL_SPINS) && scsi_xfer_wait(xfer))
+				break;
 			continue;
+		}
+		spins = 0;
 		if (scsi_get_phase() != SCSI_PHASE_CMD)
 			break;
 
 		SCSI_DEBUG_NOH(SCSI_DEBUG_CMD, " %02X", cdb[i]);
 		scsi_set_data(cdb[i++]);
 		scsi_ack_async();
+		sent = micros();
 	}
 	scsi_set_hiz();
+	/* the access time starts at the last byte, see scsi_access_done() */
+	if (i > xfer->cdbpos && xfer->tag)
+		xfer->tag->cmd_us = sent;
+	xfer->cdbpos = i;
 	SCSI_DEBUG_NOH(SCSI_DEBUG_CMD, "\n");
 }
 
+static void scsi_stall_msg(struct scsi_xfer *xfer);
+static int scsi_bus_wanted(int id);
+
 static void scsi_handle_msgout(struct scsi_xfer *xfer)
 {
 	SCSI_DEBUG(SCSI_DEBUG_DUMP, "%lx: MOUT: (%d/%d)", get_xfer_tag(xfer),
 		   xfer->outmsgpos, xfer->outmsgcnt);
 
+	if (xfer->stalled)
+		scsi_stall_msg(xfer);
+	if (xfer->suspended)
+		return;
+
 	while(xfer->outmsgpos < xfer->outmsgcnt) {
 		if (digitalReadFast(BSYI_PIN))
 			break;
@@ -472,19 +662,124 @@ static void scsi_handle_rejected_msg(struct scsi_xfer *xfer)
 		pos += len;
 	}
 	msg = xfer->outmsgs[pos];
-	if ((msg & ~0x47) == SCSI_MSG_IDENTIFY)
-		sctx.support_identify = 0;
-	else if (msg == SCSI_MSG_SIMPLE_TAG)
-		sctx.support_tags = 0;
+	scsi_stats.rejected_msgs++;
+	if (msg == SCSI_MSG_DISCONNECT)
+		scsi_stats.stall_refused++;
+	else if ((msg & ~0x47) == SCSI_MSG_IDENTIFY)
+		sctx.target[xfer->id].support_identify = 0;
+	else if (msg >= SCSI_MSG_SIMPLE_TAG && msg <= SCSI_MSG_ORDERED_TAG) {
+		sctx.target[xfer->id].support_tags = 0;
+		xfer->tag->untagged = 1;
+	}
 	if (len)
 		memset(xfer->outmsgs + pos, SCSI_MSG_NOP, len);
 }
 
-static void scsi_handle_msgin(struct scsi_xfer *xfer)
+extern uint16_t rx_packet_size, tx_packet_size;
+
+static void scsi_flush_frame(struct scsi_xfer *xfer);
+static void usb_status_hook(struct scsi_xfer *xfer, uint8_t status);
+static void scsi_auto_sense(struct scsi_xfer *xfer);
+static void scsi_learn_block_size(struct scsi_xfer *xfer);
+
+/*
+ * The target let go of the bus, it comes back for the command later.
+ * An unfinished DATA IN frame of whole packets can go to the host, it
+ * doesn't end the host's transfer. Anything else waits here for the
+ * rest of the data.
+ */
+static void scsi_nexus_save(struct scsi_xfer *xfer)
+{
+	struct scsi_tag *tag = xfer->tag;
+	struct scsi_target *t = sctx.target + xfer->id;
+
+	if (xfer->frame && xfer->frame_din && !(xfer->frame_pos % tx_packet_size))
+		scsi_flush_frame(xfer);
+	tag->data_act = xfer->data_act;
+	tag->data_done = xfer->data_done;
+	tag->frame = xfer->frame;
+	tag->frame_din = xfer->frame_din;
+	tag->frame_pos = xfer->frame_pos;
+	tag->frame_len = xfer->frame_len;
+	xfer->frame = NULL;
+	/* other commands may use the data pipes meanwhile, announce it again */
+	tag->sent_read_ready = 0;
+	tag->sent_write_ready = 0;
+	tag->disconnected = 1;
+	tag->reselected = 1;
+	t->disconnected++;
+	if (tag->task_attr == SCSI_ATTR_ORDERED)
+		t->ordered++;
+	if (t->disconnected > scsi_stats.queue_depth_max[xfer->id])
+		scsi_stats.queue_depth_max[xfer->id] = t->disconnected;
+	if (tag->untagged) {
+		t->untagged |= 1 << tag->lun;
+		t->lun_tag[tag->lun] = tag->tag;
+	}
+}
+
+/* reselection named a disconnected command, nonzero if there is none */
+static int scsi_nexus_restore(struct scsi_xfer *xfer, struct scsi_tag *tag)
+{
+	if (!tag || !tag->disconnected || tag->id != xfer->id)
+		return -1;
+	tag->disconnected = 0;
+	sctx.target[tag->id].disconnected--;
+	if (tag->task_attr == SCSI_ATTR_ORDERED)
+		sctx.target[tag->id].ordered--;
+	xfer->tag = tag;
+	xfer->lun = tag->lun;
+	xfer->data_act = tag->data_act;
+	xfer->data_done = tag->data_done;
+	xfer->frame = tag->frame;
+	xfer->frame_din = tag->frame_din;
+	xfer->frame_pos = tag->frame_pos;
+	xfer->frame_len = tag->frame_len;
+	tag->frame = NULL;
+	return 0;
+}
+
+/*
+ * RESTORE POINTERS, and implied by every reselection: the target goes
+ * back to the saved data pointer. DATA IN it sends again is dropped,
+ * data_done says how far it got before. DATA OUT is sent again out of
+ * the frame at hand, nonzero if that part went back to USB already.
+ */
+static int scsi_restore_pointers(struct scsi_xfer *xfer)
+{
+	int back = xfer->data_act - xfer->tag->data_saved;
+
+	if (!back)
+		return 0;
+	scsi_stats.restored_pointers++;
+	/* only DATA IN counts data_done */
+	if (xfer->data_done < xfer->data_act) {
+		if (!xfer->frame || xfer->frame_pos < back)
+			return -1;
+		xfer->frame_pos -= back;
+	}
+	xfer->data_act -= back;
+	return 0;
+}
+
+/*
+ * ABORT TAG at the next MSG OUT, ABORT for an untagged nexus, which
+ * would take the target's other commands of ours on the LUN along.
+ * The target goes bus free.
+ */
+static void scsi_send_abort(struct scsi_xfer *xfer, int tagged)
 {
+	xfer->outmsgs[0] = tagged ? SCSI_MSG_ABORT_TAG : SCSI_MSG_ABORT;
+	xfer->outmsgpos = 0;
+	xfer->outmsgcnt = 1;
+	digitalWriteFast(ATNO_PIN, HIGH);
+}
 
+static void scsi_handle_msgin(struct scsi_xfer *xfer)
+{
+	struct scsi_target *t = sctx.target + xfer->id;
 	uint8_t tmp, *p, *msg = xfer->inmsgs;
-	int len;
+	int len, resel = 0, tagged = 0;
 
 	xfer->inmsgcnt = 0;
 	SCSI_DEBUG(SCSI_DEBUG_DUMP, "MSGIN: ");
@@ -525,21 +820,41 @@ static void scsi_handle_msgin(struct scsi_xfer *xfer)
 		case SCSI_MSG_REJECT:
 			scsi_handle_rejected_msg(xfer);
 			break;
-		case SCSI_MSG_SIMPLE_TAG:
-			xfer->tag = scsi_lookup_tag(p[1]);
-			if (!xfer->tag) {
-				xfer->outmsgs[0] = SCSI_MSG_ABORT;
-				xfer->outmsgpos = 0;
-				xfer->outmsgcnt = 1;
-				digitalWriteFast(ATNO_PIN, HIGH);
-				return;
-			}
+		case SCSI_MSG_IDENTIFY ... 0xff:
+			/* reselection, an untagged command is known by its LUN */
+			if (xfer->tag)
+				break;
+			resel = 1;
+			if (t->untagged & (1 << (p[0] & 7)))
+				scsi_nexus_restore(xfer, scsi_tags + t->lun_tag[p[0] & 7]);
+			break;
+		case SCSI_MSG_SIMPLE_TAG ... SCSI_MSG_ORDERED_TAG:
+			/* SCSI-2 says SIMPLE, some repeat the one they got */
+			tagged = 1;
+			if (scsi_nexus_restore(xfer, scsi_lookup_tag(p[1])))
+				goto unknown;
+			break;
+		case SCSI_MSG_SAVE_POINTERS:
+			xfer->tag->data_saved = xfer->data_act;
+			scsi_stats.saved_pointers++;
+			break;
+		case SCSI_MSG_RESTORE_POINTERS:
+			if (scsi_restore_pointers(xfer))
+				goto lost;
 			break;
 		case SCSI_MSG_COMPLETE:
+			xfer->disconnect_ok = 1;
+			/* it keeps its tag in cmd_queue, or for scsi_auto_sense() */
+			if (xfer->requeue)
+				break;
+			scsi_learn_block_size(xfer);
+			if (xfer->sense)
+				break;
 			scsi_free_tag(xfer->tag->tag);
 			xfer->tag = 0;
-			/* fallthrough */
+			break;
 		case SCSI_MSG_DISCONNECT:
+			scsi_nexus_save(xfer);
 			xfer->disconnect_ok = 1;
 			break;
 		default:
@@ -547,14 +862,39 @@ static void scsi_handle_msgin(struct scsi_xfer *xfer)
 		}
 		p += len;
 	}
+	if (!resel)
+		return;
+	if (!xfer->tag)
+		goto unknown;
+	if (!scsi_restore_pointers(xfer))
+		return;
+lost:
+	/* hosts retry TASK ABORTED */
+	scsi_stats.lost_pointers++;
+	if (!xfer->selftest)
+		usb_status_hook(xfer, 0x40);
+	scsi_send_abort(xfer, !xfer->tag->untagged);
+	return;
+unknown:
+	scsi_stats.unknown_tags++;
+	scsi_send_abort(xfer, tagged);
 }
 
-extern uint16_t rx_packet_size, tx_packet_size;
+/* the frame READ READY or WRITE READY goes in, NULL if a session won't wait for it */
+static transfer_t *uas_ready_frame(int nowait)
+{
+	transfer_t *t;
+
+	if (!nowait)
+		return get_frame(&tx_free_list);
+	t = get_frame_noblock(&tx_free_list);
+	return t == LIST_END ? NULL : t;
+}
 
-static void uas_send_read_ready(int tag)
+static void uas_send_read_ready(transfer_t *t, int tag)
 {
 	struct uas_response_iu *response_iu;
-	transfer_t *t = get_frame(&tx_free_list);
+
 	SCSI_DEBUG(SCSI_DEBUG_UAS, "%x: read ready\n", tag);
 	response_iu = transfer_buffer(t);
 	memset(response_iu, 0, sizeof(*response_iu));
@@ -563,55 +903,279 @@ static void uas_send_read_ready(int tag)
 	tx_uas_response(t, UAS_STAT_ENDPOINT, sizeof(*response_iu));
 
 }
-static void uas_read_ready(struct scsi_xfer *xfer)
+/* 1 if it is still to be sent, only with nowait */
+static int uas_read_ready(struct scsi_xfer *xfer, int nowait)
 {
+	transfer_t *t;
 
 	if (!usb_uas_interface_alt)
-		return;
+		return 0;
 
 	if (!xfer->tag || xfer->tag->sent_read_ready)
-		return;
+		return 0;
 
+	t = uas_ready_frame(nowait);
+	if (!t)
+		return 1;
 	xfer->tag->sent_read_ready = 1;
-	uas_send_read_ready(xfer->tag->host_tag);
+	uas_send_read_ready(t, xfer->tag->host_tag);
+	return 0;
 }
 
-static void uas_write_ready(struct scsi_xfer *xfer)
+static int uas_write_ready(struct scsi_xfer *xfer, int nowait)
 {
 	struct uas_response_iu *response_iu;
 	transfer_t *t;
 
 	if (!usb_uas_interface_alt)
-		return;
+		return 0;
 
 	if (!xfer->tag || xfer->tag->sent_write_ready)
-		return;
+		return 0;
 
+	t = uas_ready_frame(nowait);
+	if (!t)
+		return 1;
 	xfer->tag->sent_write_ready = 1;
 
-	t = get_frame(&tx_free_list);
 	SCSI_DEBUG(SCSI_DEBUG_UAS, "%lx: write ready\n", xfer->tag->host_tag);
 	response_iu = transfer_buffer(t);
 	memset(response_iu, 0, sizeof(*response_iu));
 	response_iu->iu_id = IU_ID_WRITE_READY;
 	response_iu->tag = be16_to_cpu(xfer->tag->host_tag);
 	tx_uas_response(t, UAS_STAT_ENDPOINT, sizeof(*response_iu));
+	return 0;
 }
 
-static void scsi_handle_data_out(struct scsi_xfer *xfer)
+/*
+ * Self-test commands run against selftest_frame instead of USB frames,
+ * the data just wraps around in its buffer.
+ */
+#define SELFTEST_BUF_SIZE 16384
+
+DMAMEM static uint8_t selftest_buf[SELFTEST_BUF_SIZE] __attribute__((aligned(4096)));
+static transfer_t selftest_frame;
+
+static transfer_t *scsi_get_dout_frame(struct scsi_xfer *xfer, int *len)
 {
-	uint8_t *p = NULL;
-	int cnt = 0;
-	transfer_t *t = NULL;
+	transfer_t *t;
+
+	if (xfer->selftest) {
+		*len = SELFTEST_BUF_SIZE;
+		return &selftest_frame;
+	}
+
+	uas_write_ready(xfer, 0);
+	if (usb_uas_interface_alt)
+		t = get_frame(&rx_dout_busy_list);
+	else
+		t = get_frame(&rx_cmd_busy_list);
+	*len = transfer_length(t);
+	return t;
+}
+
+static void scsi_put_dout_frame(struct scsi_xfer *xfer, transfer_t *t)
+{
+	if (xfer->selftest)
+		return;
+	if (usb_uas_interface_alt)
+		usb_rx_dout_ack(t);
+	else
+		usb_rx_cmd_ack(t);
+}
+
+static transfer_t *scsi_get_din_frame(struct scsi_xfer *xfer)
+{
+	if (xfer->selftest)
+		return &selftest_frame;
+	uas_read_ready(xfer, 0);
+	return get_frame(&tx_free_list);
+}
+
+static void scsi_put_din_frame(struct scsi_xfer *xfer, transfer_t *t, int len)
+{
+	if (xfer->selftest)
+		return;
+	if (xfer->tag && xfer->tag->resp)
+		scsi_resp_snoop(xfer->tag, transfer_buffer(t), xfer->data_act - len, len);
+	/* a frame parked over a disconnect goes out without a new one */
+	uas_read_ready(xfer, 0);
+	SCSI_DEBUG(SCSI_DEBUG_PHASE, "%lx: sending %d bytes\n", get_xfer_tag(xfer), len);
+	tx_uas_response(t, UAS_DIN_ENDPOINT, len);
+}
+
+/* the data phases are over, or stopped halfway: the frame goes */
+static void scsi_flush_frame(struct scsi_xfer *xfer)
+{
+	transfer_t *t = xfer->frame;
+
+	if (!t)
+		return;
+	xfer->frame = NULL;
+	if (xfer->frame_din)
+		scsi_put_din_frame(xfer, t, xfer->frame_pos);
+	else
+		scsi_put_dout_frame(xfer, t);
+}
 
+static transfer_t **scsi_frame_list(int din)
+{
+	if (din)
+		return &tx_free_list;
+	return usb_uas_interface_alt ? &rx_dout_busy_list : &rx_cmd_busy_list;
+}
+
+/*
+ * The target holds REQ, or USB has no frame: a session leaves the phase
+ * and goes on from the main loop, see scsi_session_run(). The other
+ * connections let the other tasks run and wait on. 1 to leave.
+ */
+static int scsi_xfer_wait(struct scsi_xfer *xfer)
+{
+	if (xfer->session) {
+		xfer->suspended = 1;
+		return 1;
+	}
+	scsi_task_yield();
+	return 0;
+}
+
+/* a frame for the data phase, parked in xfer->frame, 0 if a session has to wait */
+static int scsi_frame_ready(struct scsi_xfer *xfer, int din)
+{
+	transfer_t *t;
+	int len = 0;
+
+	if (xfer->frame && xfer->frame_din == din)
+		return 1;
+	scsi_flush_frame(xfer);
+	if (!xfer->session || xfer->selftest) {
+		t = din ? scsi_get_din_frame(xfer) : scsi_get_dout_frame(xfer, &len);
+	} else {
+		/* READ READY and WRITE READY take a frame of their own */
+		if (din ? uas_read_ready(xfer, 1) : uas_write_ready(xfer, 1))
+			goto wait;
+		t = get_frame_noblock(scsi_frame_list(din));
+		if (t == LIST_END)
+			goto wait;
+		if (!din)
+			len = transfer_length(t);
+	}
+	xfer->frame_wait = 0;
+	xfer->frame = t;
+	xfer->frame_din = din;
+	xfer->frame_pos = 0;
+	xfer->frame_len = len;
+	return 1;
+wait:
+	if (!xfer->frame_wait)
+		scsi_stats.frame_waits++;
+	xfer->frame_wait = 1;
+	xfer->suspended = 1;
+	return 0;
+}
+
+/*
+ * A frame is used up and the command has more data due: the next one
+ * if USB has it ready. If not, ATN goes up before the last byte is
+ * acknowledged, so the target comes to MSG OUT instead of waiting with
+ * REQ asserted for a byte that has nowhere to go.
+ */
+static transfer_t *scsi_next_frame(struct scsi_xfer *xfer, int din)
+{
+	transfer_t *t;
+
+	if (xfer->selftest || !xfer->tag || !xfer->tag->privileged ||
+	    xfer->data_act >= xfer->tag->data_due)
+		return NULL;
+	/* a frame parked over a disconnect didn't announce it again */
+	if (din ? uas_read_ready(xfer, xfer->session) : uas_write_ready(xfer, xfer->session))
+		t = LIST_END;
+	else
+		t = get_frame_noblock(scsi_frame_list(din));
+	if (t != LIST_END)
+		return t;
+	xfer->stalled = 1;
+	xfer->stall_din = din;
+	xfer->stall_us = micros();
+	scsi_stats.stalls++;
+	xfer->outmsgs[0] = SCSI_MSG_NOP;
+	xfer->outmsgpos = 0;
+	xfer->outmsgcnt = 1;
+	digitalWriteFast(ATNO_PIN, HIGH);
+	return NULL;
+}
+
+/*
+ * MSG OUT after scsi_next_frame() raised ATN. USB has stall_us more to
+ * come up with the frame, then the target is asked to DISCONNECT and
+ * the bus is free for the others. It saves the data pointer and
+ * reselects once it wants to go on. One that rejects the message just
+ * goes on, the data loop waits for the frame as before.
+ */
+static void scsi_stall_msg(struct scsi_xfer *xfer)
+{
+	transfer_t *t;
+
+	for (;;) {
+		/* DATA OUT only comes once WRITE READY is out */
+		if (xfer->stall_din ? uas_read_ready(xfer, 1) : uas_write_ready(xfer, 1))
+			t = LIST_END;
+		else
+			t = get_frame_noblock(scsi_frame_list(xfer->stall_din));
+		if (t != LIST_END)
+			break;
+		if (digitalReadFast(BSYI_PIN))
+			goto out;
+		if (micros() - xfer->stall_us >= scsi_tunables.stall_us &&
+		    scsi_bus_wanted(xfer->id)) {
+			xfer->outmsgs[0] = SCSI_MSG_DISCONNECT;
+			scsi_stats.stall_disconnects++;
+			goto out;
+		}
+		/* ATN stays up, MSG OUT goes on from here */
+		if (scsi_xfer_wait(xfer))
+			return;
+	}
+	xfer->stalled = 0;
+	/* the data loop takes it from here */
+	xfer->frame = t;
+	xfer->frame_din = xfer->stall_din;
+	xfer->frame_pos = 0;
+	xfer->frame_len = xfer->stall_din ? 0 : transfer_length(t);
+	return;
+out:
+	xfer->stalled = 0;
+}
 
+static void scsi_handle_data_out(struct scsi_xfer *xfer)
+{
+	uint8_t *p = NULL;
+	int cnt = 0, len = 0, start = xfer->data_act;
+	unsigned int spins = 0;
+	transfer_t *t = NULL, *next = NULL;
+
+	/* what an earlier DATA OUT phase left of its frame comes first */
+	if (xfer->frame && xfer->frame_din)
+		scsi_flush_frame(xfer);
+	if (xfer->frame) {
+		t = xfer->frame;
+		len = xfer->frame_len;
+		cnt = len - xfer->frame_pos;
+		p = (uint8_t *)transfer_buffer(t) + xfer->frame_pos;
+		xfer->frame = NULL;
+	}
 
 	for(;;) {
 		if (digitalReadFast(BSYI_PIN))
 			break;
 
-		if (digitalReadFast(REQI_PIN))
+		if (digitalReadFast(REQI_PIN)) {
+			if (!(++spins % SCSI_STALL_SPINS) && scsi_xfer_wait(xfer))
+				break;
 			continue;
+		}
+		spins = 0;
 
 		delayNanoseconds(5);
 
@@ -619,123 +1183,320 @@ static void scsi_handle_data_out(struct scsi_xfer *xfer)
 			break;
 
 		if (!t) {
-			uas_write_ready(xfer);
-			if (usb_uas_interface_alt)
-				t = get_frame(&rx_dout_busy_list);
-			else
-				t = get_frame(&rx_cmd_busy_list);
+			if (!scsi_frame_ready(xfer, 0))
+				break;
+			t = xfer->frame;
+			xfer->frame = NULL;
 			p = transfer_buffer(t);
-			cnt = transfer_length(t);
+			cnt = len = xfer->frame_len;
 		}
 
 		scsi_set_data(*p++);
 		xfer->data_act++;
+		if (cnt == 1)
+			next = scsi_next_frame(xfer, 0);
 		scsi_ack_async();
 
 		cnt--;
 		if (!cnt) {
-			if (usb_uas_interface_alt)
-				usb_rx_dout_ack(t);
-			else
-				usb_rx_cmd_ack(t);
-			t = NULL;
+			scsi_put_dout_frame(xfer, t);
+			t = next;
+			next = NULL;
+			if (t) {
+				p = transfer_buffer(t);
+				cnt = len = transfer_length(t);
+			}
 		}
 
 	}
 	if (t) {
-		if (usb_uas_interface_alt)
-			usb_rx_dout_ack(t);
-		else
-			usb_rx_cmd_ack(t);
+		xfer->frame = t;
+		xfer->frame_din = 0;
+		xfer->frame_len = len;
+		xfer->frame_pos = len - cnt;
 	}
 	scsi_set_hiz();
+	scsi_stats.bytes_out += xfer->data_act - start;
 }
 
 static void scsi_handle_data_in(struct scsi_xfer *xfer)
 {
 	uint8_t *p = NULL;
-	int cnt = 0;
+	int cnt = 0, skip, start = xfer->data_act;
+	unsigned int spins = 0;
 	transfer_t *t = NULL;
 
+	if (xfer->frame && !xfer->frame_din)
+		scsi_flush_frame(xfer);
+	if (xfer->frame) {
+		t = xfer->frame;
+		cnt = xfer->frame_pos;
+		p = (uint8_t *)transfer_buffer(t) + cnt;
+		xfer->frame = NULL;
+	}
+	/* after RESTORE POINTERS, what the host has got already */
+	skip = xfer->data_done - xfer->data_act;
+
 	for(;;) {
 
 		if (digitalReadFast(BSYI_PIN))
 			break;
 
-		if (digitalReadFast(REQI_PIN))
+		if (digitalReadFast(REQI_PIN)) {
+			if (!(++spins % SCSI_STALL_SPINS) && scsi_xfer_wait(xfer))
+				break;
 			continue;
+		}
+		spins = 0;
 
 		if (scsi_get_phase() != SCSI_PHASE_DIN)
 			break;
 
+		if (skip) {
+			skip--;
+			xfer->data_act++;
+			scsi_ack_async();
+			continue;
+		}
 		if (!t) {
-			uas_read_ready(xfer);
-			t = get_frame(&tx_free_list);
+			if (!scsi_frame_ready(xfer, 1))
+				break;
+			t = xfer->frame;
+			xfer->frame = NULL;
 			p = transfer_buffer(t);
 		}
 		*p++ = scsi_get_data();
 		cnt++;
 		xfer->data_act++;
 		if (cnt == 16384/*tx_packet_size*/) {
-			SCSI_DEBUG(SCSI_DEBUG_PHASE, "%lx: sending %d bytes\n", get_xfer_tag(xfer), cnt);
-			tx_uas_response(t, UAS_DIN_ENDPOINT, cnt);
+			scsi_put_din_frame(xfer, t, cnt);
 			cnt = 0;
-			t = NULL;
-			p = NULL;
+			t = scsi_next_frame(xfer, 1);
+			p = t ? transfer_buffer(t) : NULL;
 		}
 
 		scsi_ack_async();
 	}
-	if (cnt) {
-		SCSI_DEBUG(SCSI_DEBUG_PHASE, "%lx: sending %d final bytes\n", get_xfer_tag(xfer), cnt);
-		tx_uas_response(t, UAS_DIN_ENDPOINT, cnt);
+	if (!skip)
+		xfer->data_done = xfer->data_act;
+	if (t) {
+		xfer->frame = t;
+		xfer->frame_din = 1;
+		xfer->frame_pos = cnt;
 	}
+	scsi_stats.bytes_in += xfer->data_act - start;
 }
 
-static void uas_send_status(int status, int tag)
+static void uas_send_status(transfer_t *t, int status, int tag, const uint8_t *sense, int len)
 {
 	struct uas_sense_iu *sense_iu;
-	transfer_t *t = get_frame(&tx_free_list);
+
 	sense_iu = transfer_buffer(t);
-	memset(sense_iu, 0, sizeof(*sense_iu));
+	memset(sense_iu, 0, 16);
 	sense_iu->iu_id = IU_ID_STATUS;
 	sense_iu->tag = cpu_to_be16(tag);
 	sense_iu->status = status;
-	tx_uas_response(t, UAS_STAT_ENDPOINT, 16);
+	sense_iu->len = cpu_to_be16(len);
+	memcpy(sense_iu->sense, sense, len);
+	tx_uas_response(t, UAS_STAT_ENDPOINT, 16 + len);
+}
+
+static void uas_send_response(transfer_t *t, int code, int tag)
+{
+	struct uas_response_iu *response_iu;
 
+	SCSI_DEBUG(SCSI_DEBUG_UAS, "%x: response %02x\n", tag, code);
+	response_iu = transfer_buffer(t);
+	memset(response_iu, 0, sizeof(*response_iu));
+	response_iu->iu_id = IU_ID_RESPONSE;
+	response_iu->tag = cpu_to_be16(tag);
+	response_iu->response_code = code;
+	tx_uas_response(t, UAS_STAT_ENDPOINT, sizeof(*response_iu));
+}
+
+/*
+ * Status waits here until the status task finds a free frame for it,
+ * so the bus session goes on with the next command meanwhile. Only a
+ * full queue makes usb_status_hook() wait itself.
+ */
+#define SCSI_STATUS_QUEUE 32
+
+struct scsi_status {
+	uint32_t host_tag;
+	uint32_t residue;
+	uint8_t status;
+	uint8_t short_din;	/* BOT DATA IN ended early, ZLP before the CSW */
+	uint8_t response;	/* a RESPONSE IU, status is its code */
+	uint8_t sense_len;	/* UAS, sense data in status_sense */
+	uint8_t *sense;
+};
+
+static struct scsi_status status_queue[SCSI_STATUS_QUEUE];
+static uint8_t status_sense[SCSI_STATUS_QUEUE][SCSI_SENSE_BUFFERSIZE];
+static unsigned int status_head, status_tail;
+
+static void usb_send_status(transfer_t *t, const struct scsi_status *s)
+{
+	struct usb_msc_csw *csw;
+
+	if (s->response) {
+		uas_send_response(t, s->status, s->host_tag);
+		return;
+	}
+	if (usb_uas_interface_alt) {
+		uas_send_status(t, s->status, s->host_tag, s->sense, s->sense_len);
+		return;
+	}
+	if (s->short_din) {
+		tx_uas_response(t, UAS_DIN_ENDPOINT, 0);
+		t = get_frame(&tx_free_list);
+	}
+	csw = transfer_buffer(t);
+	csw->signature = 0x53425355;
+	csw->tag = s->host_tag;
+	csw->data_residue = s->residue;
+	csw->status = s->status ? 1 : 0;
+	SCSI_DEBUG(SCSI_DEBUG_MSC, "data residue %ld\n", csw->data_residue);
+	tx_uas_response(t, UAS_DIN_ENDPOINT, sizeof(*csw));
+}
+
+/* the next free entry, it counts once filled in */
+static struct scsi_status *usb_status_slot(void)
+{
+	if (status_head - status_tail == SCSI_STATUS_QUEUE) {
+		struct scsi_status old = status_queue[status_tail++ % SCSI_STATUS_QUEUE];
+
+		usb_send_status(get_frame(&tx_free_list), &old);
+	}
+	status_queue[status_head % SCSI_STATUS_QUEUE].sense =
+		status_sense[status_head % SCSI_STATUS_QUEUE];
+	return status_queue + status_head % SCSI_STATUS_QUEUE;
+}
+
+static void usb_status_queued(void)
+{
+	status_head++;
+	if (status_head - status_tail > scsi_stats.status_queued_max)
+		scsi_stats.status_queued_max = status_head - status_tail;
+}
+
+static struct scsi_status *usb_status_fill(struct scsi_xfer *xfer, uint8_t status)
+{
+	struct scsi_status *s;
+
+	scsi_trace_done(&xfer->tag->trace, status);
+	if (xfer->tag->resp)
+		scsi_resp_done(xfer->tag, status);
+	s = usb_status_slot();
+	s->host_tag = xfer->tag->host_tag;
+	s->residue = xfer->data_exp - xfer->data_act;
+	s->status = status;
+	s->short_din = !usb_uas_interface_alt && xfer->data_exp != xfer->data_act && status;
+	s->response = 0;
+	s->sense_len = 0;
+	return s;
 }
 
 static void usb_status_hook(struct scsi_xfer *xfer, uint8_t status)
 {
+	usb_status_fill(xfer, status);
+	usb_status_queued();
+}
 
-	struct usb_msc_csw *csw;
+/* behind the status of the commands that completed before it */
+static void uas_queue_response(uint16_t tag, uint8_t code)
+{
+	struct scsi_status *s = usb_status_slot();
+
+	s->host_tag = tag;
+	s->residue = 0;
+	s->short_din = 0;
+	s->sense_len = 0;
+	s->status = code;
+	s->response = 1;
+	usb_status_queued();
+}
 
+static int scsi_status_task(struct scsi_task *task)
+{
+	struct scsi_status s;
 	transfer_t *t;
+	int busy = 0;
 
-	if (!usb_uas_interface_alt && xfer->data_exp != xfer->data_act && status) {
-		t = get_frame(&tx_free_list);
-		tx_uas_response(t, UAS_DIN_ENDPOINT, 0);
+	while (status_tail != status_head && !scsi_task_slice_over()) {
+		t = get_frame_noblock(&tx_free_list);
+		if (t == LIST_END)
+			break;
+		s = status_queue[status_tail++ % SCSI_STATUS_QUEUE];
+		usb_send_status(t, &s);
+		busy = 1;
 	}
+	return busy;
+}
 
-	if (usb_uas_interface_alt) {
-		uas_send_status(status, xfer->tag->host_tag);
-	} else {
-		t = get_frame(&tx_free_list);
-		csw = transfer_buffer(t);
-		csw->signature = 0x55534253;
-		csw->tag = xfer->tag->host_tag;
-		csw->data_residue = xfer->data_exp - xfer->data_act;
-		csw->status = status ? 1 : 0;
-		SCSI_DEBUG(SCSI_DEBUG_MSC, "data residue %ld, expected %d, actual %d\n",
-					  csw->data_residue, xfer->data_exp, xfer->data_act);
-		tx_uas_response(t, UAS_DIN_ENDPOINT, sizeof(*csw));
+/*
+ * BUSY and QUEUE FULL aren't passed on, the host would take them for
+ * errors and go into error recovery. The command goes back to the head
+ * of cmd_queue instead, up to SCSI_REQUEUES times, and scsi_cmd_waits()
+ * holds it there. A target's depth is what it may hold of ours at a
+ * time. QUEUE FULL halves it, but not below what the target does hold,
+ * good status raises it by one every SCSI_DEPTH_RAMP commands. With
+ * none of ours left at the target nothing would end the wait, so BUSY,
+ * and QUEUE FULL then, hold the target off for busy_us, doubled each
+ * time.
+ */
+#define SCSI_DEPTH_MAX		255
+#define SCSI_DEPTH_RAMP		16
+#define SCSI_REQUEUES		16
+#define SCSI_BUSY_MIN_US	100
+#define SCSI_BUSY_MAX_US	50000
+
+static int scsi_queue_status(struct scsi_xfer *xfer, uint8_t status)
+{
+	struct scsi_target *t = sctx.target + xfer->id;
+
+	if (status != 0x08 && status != 0x28) {
+		if (status)
+			return 0;
+		t->busy_us = 0;
+		if (t->depth < SCSI_DEPTH_MAX && ++t->depth_good >= SCSI_DEPTH_RAMP) {
+			t->depth++;
+			t->depth_good = 0;
+			scsi_stats.queue_depth[xfer->id] = t->depth;
+		}
+		return 0;
+	}
+	if (status == 0x28) {
+		t->depth /= 2;
+		if (t->depth < t->disconnected)
+			t->depth = t->disconnected;
+		if (!t->depth)
+			t->depth = 1;
+		t->depth_good = 0;
+		scsi_stats.queue_depth[xfer->id] = t->depth;
 	}
+	if (status == 0x08 || !t->disconnected) {
+		t->busy_us = t->busy_us ? t->busy_us * 2 : SCSI_BUSY_MIN_US;
+		if (t->busy_us > SCSI_BUSY_MAX_US)
+			t->busy_us = SCSI_BUSY_MAX_US;
+		t->busy_until = micros() + t->busy_us;
+	}
+	/* before any data, and not after a reselection */
+	if (!xfer->cdb || xfer->data_act || xfer->tag->reselected ||
+	    xfer->tag->requeues >= SCSI_REQUEUES)
+		return 0;
+	xfer->tag->requeues++;
+	xfer->requeue = 1;
+	scsi_stats.requeued++;
+	return 1;
 }
 
 static void scsi_handle_status(struct scsi_xfer *xfer)
 {
 	uint8_t status;
 
+	/* the data goes ahead of the status */
+	scsi_flush_frame(xfer);
 	for(;;) {
 		if (digitalReadFast(BSYI_PIN))
 			break;
@@ -745,26 +1506,156 @@ static void scsi_handle_status(struct scsi_xfer *xfer)
 				break;
 
 			status = scsi_get_data();
-			usb_status_hook(xfer, status);
+			if (status == 0x02)
+				scsi_stats.check_conditions++;
+			else if (status == 0x08 || status == 0x28)
+				scsi_stats.busy_status++;
+			xfer->status = status;
+			if (!xfer->selftest && !scsi_queue_status(xfer, status)) {
+				/* with its sense once the bus is free */
+				if (status == 0x02)
+					xfer->sense = 1;
+				else
+					usb_status_hook(xfer, status);
+			}
 			SCSI_DEBUG(SCSI_DEBUG_DUMP, "%lx: STATUS: %02x\n", get_xfer_tag(xfer), status);
 			scsi_ack_async();
 		}
 	}
 }
 
-static void scsi_handle_phase(struct scsi_xfer *xfer)
+/*
+ * What a command is likely to do at the target. READ and WRITE go to
+ * the media, how long that takes is measured per target. The quick ones
+ * are answered from the target's memory.
+ */
+#define SCSI_CLASS_READ		0
+#define SCSI_CLASS_WRITE	1
+#define SCSI_CLASS_QUICK	2
+#define SCSI_CLASS_OTHER	3
+
+static int scsi_cmd_class(uint8_t opcode)
 {
-	int phase = scsi_get_phase();
-
-	SCSI_DEBUG(SCSI_DEBUG_PHASE, "%lx: handle %s\n", get_xfer_tag(xfer), phase_names[phase & 7]);
+	switch (opcode) {
+	case 0x08:
+	case 0x28:
+	case 0xa8:
+	case 0x88:
+		return SCSI_CLASS_READ;
+	case 0x0a:
+	case 0x2a:
+	case 0xaa:
+	case 0x8a:
+		return SCSI_CLASS_WRITE;
+	case 0x00:	/* TEST UNIT READY */
+	case 0x03:	/* REQUEST SENSE */
+	case 0x12:	/* INQUIRY */
+	case 0x1a:	/* MODE SENSE */
+	case 0x1e:	/* PREVENT ALLOW MEDIUM REMOVAL */
+	case 0x25:	/* READ CAPACITY */
+	case 0x5a:
+		return SCSI_CLASS_QUICK;
+	default:
+		return SCSI_CLASS_OTHER;
+	}
+}
 
-	while(digitalReadFast(REQI_PIN)) {
-		if (digitalReadFast(BSYI_PIN)) {
+/* transfer length of a READ or WRITE, in blocks */
+static uint32_t scsi_cmd_blocks(const uint8_t *cdb)
+{
+	switch (cdb[0] >> 5) {
+	case 0:
+		return cdb[4] ? cdb[4] : 256;
+	case 1:
+		return cdb[7] << 8 | cdb[8];
+	case 4:
+		return cdb[10] << 24 | cdb[11] << 16 | cdb[12] << 8 | cdb[13];
+	default:
+		return cdb[6] << 24 | cdb[7] << 16 | cdb[8] << 8 | cdb[9];
+	}
+}
+
+static uint32_t scsi_cmd_lba(const uint8_t *cdb)
+{
+	switch (cdb[0] >> 5) {
+	case 0:
+		return (cdb[1] & 0x1f) << 16 | cdb[2] << 8 | cdb[3];
+	case 4:
+		return cdb[6] << 24 | cdb[7] << 16 | cdb[8] << 8 | cdb[9];
+	default:
+		return cdb[2] << 24 | cdb[3] << 16 | cdb[4] << 8 | cdb[5];
+	}
+}
+
+/*
+ * What a reselection costs, the measured average once there was one.
+ * Before that an estimate from the timing tunables: the target's
+ * arbitration, the selection and a bus settle delay for each of the
+ * DISCONNECT, IDENTIFY and tag messages.
+ */
+static uint32_t scsi_resel_ns(void)
+{
+	if (sctx.resel_ns)
+		return sctx.resel_ns;
+	return SCSI_BUS_CLEAR_DELAY + SCSI_ARBITRATION_DELAY + 5 * SCSI_BUS_SETTLE_DELAY;
+}
+
+/* from the command phase to the first data or status, over a disconnect too */
+static void scsi_access_done(struct scsi_xfer *xfer)
+{
+	struct scsi_tag *tag = xfer->tag;
+	struct scsi_target *t = sctx.target + tag->id;
+	uint32_t us = micros() - tag->cmd_us;
+
+	tag->timing = 0;
+	if (tag->cmd_class <= SCSI_CLASS_WRITE)
+		t->access_us[tag->cmd_class] = (t->access_us[tag->cmd_class] * 7 + us) / 8;
+	if (!tag->privileged) {
+		if (us > scsi_tunables.disconnect_us)
+			scsi_stats.disc_withheld_slow++;
+		else
+			scsi_stats.disc_saved_ns += scsi_resel_ns();
+	} else if (tag->reselected && us * 1000 < scsi_resel_ns()) {
+		scsi_stats.disc_granted_fast++;
+	}
+}
+
+/* a READ or WRITE that went through tells the LUN's block size */
+static void scsi_learn_block_size(struct scsi_xfer *xfer)
+{
+	struct scsi_tag *tag = xfer->tag;
+
+	if (!tag || xfer->status || !tag->blocks || xfer->data_act % tag->blocks ||
+	    xfer->data_act / tag->blocks > 0xffff)
+		return;
+	sctx.target[tag->id].block_size[tag->lun] = xfer->data_act / tag->blocks;
+}
+
+static void scsi_handle_phase(struct scsi_xfer *xfer)
+{
+	int phase = scsi_get_phase();
+	uint32_t start = scsi_hal_cycles();
+	unsigned int spins = 0;
+
+	SCSI_DEBUG(SCSI_DEBUG_PHASE, "%lx: handle %s\n", get_xfer_tag(xfer), phase_names[phase & 7]);
+
+	while(digitalReadFast(REQI_PIN)) {
+		if (digitalReadFast(BSYI_PIN)) {
 			SCSI_DEBUG(SCSI_DEBUG_PHASE, "disconnected\n");
 			return;
 		}
+		if (!(++spins % SCSI_STALL_SPINS) && scsi_xfer_wait(xfer))
+			return;
 		delayNanoseconds(5);
 	}
+	if (xfer->tag && xfer->tag->timing && phase != SCSI_PHASE_CMD &&
+	    phase != SCSI_PHASE_MIN && phase != SCSI_PHASE_MOUT)
+		scsi_access_done(xfer);
+	/* a session takes the frame before the first byte, it may have to wait for it */
+	if (xfer->session && (phase == SCSI_PHASE_DOUT ||
+	    (phase == SCSI_PHASE_DIN && xfer->data_done <= xfer->data_act)) &&
+	    !scsi_frame_ready(xfer, phase == SCSI_PHASE_DIN))
+		return;
 	switch (phase) {
 	case SCSI_PHASE_DOUT:
 		scsi_handle_data_out(xfer);
@@ -794,6 +1685,20 @@ static void scsi_handle_phase(struct scsi_xfer *xfer)
 		SCSI_DEBUG(SCSI_DEBUG_ERROR, "%s: unknown phase %d\n", __func__, phase);
 		break;
 	}
+	/* one left halfway is counted when it is done */
+	if (!xfer->suspended)
+		scsi_stats.phase_count[phase & 7]++;
+	scsi_stats.phase_cycles[phase & 7] += scsi_clock_nominal(scsi_hal_cycles() - start);
+}
+
+static void scsi_update_hostid(void)
+{
+	if (sctx.hostid == scsi_tunables.hostid)
+		return;
+
+	sctx.hostid = scsi_tunables.hostid;
+	sctx.hostidmsk = (1 << sctx.hostid);
+	sctx.scanned = 0;
 }
 
 static int scsi_transfer(int id, struct scsi_xfer *xfer)
@@ -808,7 +1713,10 @@ static int scsi_transfer(int id, struct scsi_xfer *xfer)
 	while(!digitalReadFast(BSYI_PIN))
 		scsi_handle_phase(xfer);
 
-	if (!xfer->disconnect_ok && xfer->tag)
+	scsi_flush_frame(xfer);
+	if (xfer->sense)
+		scsi_auto_sense(xfer);
+	if (!xfer->disconnect_ok && xfer->tag && !xfer->requeue)
 		scsi_free_tag(xfer->tag->tag);
 	digitalWriteFast(LED_PIN, LOW);
 	return 0;
@@ -821,194 +1729,1865 @@ void scsi_initialize(void)
 {
 	scsi_setup_ports();
 	memset(&sctx, 0, sizeof(sctx));
-	sctx.hostid = 7;
+	/* DMAMEM, startup.c doesn't clear it */
+	memset(resp_cache, 0, sizeof(resp_cache));
+	sctx.hostid = scsi_tunables.hostid;
 	sctx.hostidmsk = (1 << sctx.hostid);
-	sctx.support_disconnect = 1;
-	sctx.support_tags = 1;
-	sctx.support_sdtr = 1;
-	sctx.support_identify = 1;
-	sctx.targetid = 0xff;
+	selftest_frame.pointer0 = (uint32_t)selftest_buf;
+	scsi_clock_init();
+	scsi_hal_bus_events_init();
+	scsi_tasks_init();
 }
 
+static int scsi_disconnect_policy(struct scsi_xfer *xfer);
+
 static void scsi_setup_msgs(struct scsi_xfer *xfer)
 {
+	struct scsi_target *t = sctx.target + xfer->id;
 	uint8_t *msg = xfer->outmsgs;
 
 	xfer->outmsgcnt = 0;
 	xfer->outmsgpos = 0;
+	xfer->cdbpos = 0;
 
-	if (!sctx.support_identify)
+	xfer->tag->id = xfer->id;
+	xfer->tag->lun = xfer->lun;
+	xfer->tag->untagged = 1;
+	xfer->tag->privileged = 0;
+	xfer->tag->timing = 0;
+
+	if (!t->support_identify)
 		return;
 
-	if (sctx.support_disconnect && sctx.support_tags)
-			*msg++ = 0xc0 | xfer->lun;
+	/*
+	 * Self-test commands must not come back through reselection. Without
+	 * tags the target may still disconnect, reselection then names the
+	 * command by its LUN.
+	 */
+	if (t->support_disconnect && !xfer->selftest) {
+		xfer->tag->cmd_class = scsi_cmd_class(xfer->cdb[0]);
+		xfer->tag->blocks = 0;
+		if (xfer->tag->cmd_class <= SCSI_CLASS_WRITE)
+			xfer->tag->blocks = scsi_cmd_blocks(xfer->cdb);
+		xfer->tag->data_due = xfer->tag->blocks * t->block_size[xfer->lun];
+		xfer->tag->privileged = scsi_disconnect_policy(xfer);
+		xfer->tag->timing = 1;
+		if (xfer->tag->privileged)
+			scsi_stats.disc_granted++;
 		else
-			*msg++ = 0x80 | xfer->lun;
+			scsi_stats.disc_withheld++;
+	}
+	if (xfer->tag->privileged)
+		*msg++ = 0xc0 | xfer->lun;
+	else
+		*msg++ = 0x80 | xfer->lun;
 	xfer->outmsgcnt++;
 
-	if (sctx.support_tags) {
-		*msg++ = 0x20;
+	if (t->support_tags) {
+		*msg++ = SCSI_MSG_SIMPLE_TAG + xfer->tag->task_attr;
 		*msg++ = xfer->tag->tag;
 		xfer->outmsgcnt+=2;
+		xfer->tag->untagged = 0;
 	}
 }
 
+/* xfer->id and xfer->lun are the target's, scsi_map_lun() set them */
 static void do_xfer(struct scsi_xfer *xfer)
 {
-	int id;
 	do {
 		xfer->retry = 0;
 		xfer->data_act = 0;
 
 		scsi_setup_msgs(xfer);
-
-		if (sctx.targetid == 0xff) {
-			for(id = 7; id >= 0; id--) {
-				if (sctx.hostid == id)
-					continue;
-				printf("Scanning ID %d\n", id);
-				if (!scsi_transfer(id, xfer)) {
-					printf("found device at ID %d\n", id);
-					sctx.targetid = id;
-					printf("Support: Identify: %d Disconnect: %d Tags: %d\n",
-					       sctx.support_identify,
-					       sctx.support_disconnect,
-					       sctx.support_tags);
-					break;
-				}
-			}
-		} else {
-			scsi_transfer(sctx.targetid, xfer);
-		}
+		scsi_transfer(xfer->id, xfer);
 	} while(xfer->retry);
 
-	if (!xfer->disconnect_ok)
+	if (!xfer->disconnect_ok) {
+		scsi_stats.unexpected_disconnects++;
 		SCSI_DEBUG(SCSI_DEBUG_ERROR, "%lx: unexpected disconnect\n", xfer->tag->host_tag);
+	}
 }
 
-static void scsi_uas_request(struct uas_command_iu *iu, int len)
+/*
+ * INQUIRY of the scan, through selftest_frame like the self-test so
+ * the host doesn't see it. -1 if nothing answers the selection.
+ */
+static int scsi_scan_inquiry(int id, int lun)
 {
+	uint8_t cdb[16] = { 0x12, lun << 5, 0, 0, 36 };
 	struct scsi_xfer xfer = { 0 };
-	char tmp[16] = { 0 };
 	int tag;
 
-	if (len < sizeof(struct uas_command_iu)) {
-		SCSI_DEBUG(SCSI_DEBUG_UAS, "%s: short request (%d bytes)\n", __func__, len);
-		return;
+	tag = scsi_insert_tag(0xffffffff);
+	if (tag == -1) {
+		scsi_stats.no_free_tag++;
+		return -1;
 	}
+	xfer.tag = scsi_lookup_tag(tag);
+	xfer.cdb = cdb;
+	xfer.id = id;
+	xfer.lun = lun;
+	xfer.data_exp = 36;
+	xfer.status = 0xff;
+	xfer.selftest = 1;
+	memset(selftest_buf, 0, 36);
+	scsi_setup_msgs(&xfer);
+	if (scsi_transfer(id, &xfer)) {
+		scsi_free_tag(tag);
+		return -1;
+	}
+	return xfer.status;
+}
 
-	SCSI_DEBUG(SCSI_DEBUG_UAS, "%d: ID %d, len %d, lun %d, prio_attr %x, cdb %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x LUN %02x %02x %02x %02x %02x %02x %02x %02x\n",
-	       (iu->tag >> 8) | ((iu->tag & 0xff) << 8), iu->iu_id, iu->len, iu->lun[0], iu->prio_attr,
-	       iu->cdb[0], iu->cdb[1], iu->cdb[2], iu->cdb[3], iu->cdb[4],
-	       iu->cdb[5], iu->cdb[6], iu->cdb[7], iu->cdb[8], iu->cdb[9],
-	       iu->lun[0], iu->lun[1], iu->lun[2], iu->lun[3],
-	       iu->lun[4], iu->lun[5], iu->lun[6], iu->lun[7]);
+/*
+ * Every SCSI ID that answers gets a host LUN for its LUN 0, and one
+ * for each further LUN that has a unit behind it. Those are only
+ * asked for on SCSI-2 devices that take IDENTIFY, older ones tend to
+ * answer for LUN 0 whatever the CDB says.
+ */
+static void scsi_scan(void)
+{
+	struct scsi_target *t;
+	int id, lun, status;
+
+	sctx.luns = 0;
+	memset(sctx.lun_map, 0xff, sizeof(sctx.lun_map));
+	scsi_resp_invalidate(-1);
+	for (id = 0; id < 8; id++) {
+		t = sctx.target + id;
+		memset(t, 0, sizeof(*t));
+		if (id == sctx.hostid)
+			continue;
+		t->support_identify = 1;
+		t->support_tags = 1;
+		t->support_sdtr = 1;
+		t->support_disconnect = 1;
+		t->depth = SCSI_DEPTH_MAX;
+		scsi_stats.queue_depth[id] = t->depth;
+		printf("Scanning ID %d\n", id);
+		for (lun = 0; lun < 8 && sctx.luns < SCSI_LUNS; lun++) {
+			status = scsi_scan_inquiry(id, lun);
+			if (status == -1)
+				break;
+			t->present = 1;
+			if (lun && (status || (selftest_buf[0] & 0xe0)))
+				continue;
+			sctx.lun_map[sctx.luns++] = id << 3 | lun;
+			if (!lun && (status || (selftest_buf[2] & 7) < 2 || !t->support_identify))
+				break;
+		}
+		if (t->present)
+			printf("found device at ID %d, Identify: %d Disconnect: %d Tags: %d\n",
+			       id, t->support_identify, t->support_disconnect, t->support_tags);
+	}
+	scsi_stats.scans++;
+	scsi_stats.luns = sctx.luns;
+	memcpy(scsi_stats.lun_map, sctx.lun_map, sizeof(sctx.lun_map));
+	/* an empty bus is scanned again at the next command */
+	sctx.scanned = sctx.luns > 0;
+}
 
-	if (iu->cdb[0] == 0xa0) {
-		/*
-		 * At least Windows 10 insists on the REPORT LUNS
-		 * command. As most of the devices i have are not
-		 * supporting that, fake a response which contains
-		 * a single LUN. We could of course improve the code
-		 * and figure out whether the device support it.
-		 */
-		transfer_t *t = get_frame(&tx_free_list);
-		tmp[3] = 8;
-		memcpy(transfer_buffer(t), tmp, sizeof(tmp));
-		tx_uas_response(t, UAS_DIN_ENDPOINT, sizeof(tmp));
-		int tag = be16_to_cpu(iu->tag);
-		uas_send_read_ready(tag);
-		uas_send_status(0, tag);
-		return;
+/* and back, sctx.luns if no host LUN is mapped to it */
+static int scsi_host_lun(int id, int lun)
+{
+	int i;
+
+	for (i = 0; i < sctx.luns && sctx.lun_map[i] != (id << 3 | lun); i++);
+	return i;
+}
+
+/* host LUN to SCSI ID and LUN, -1 if the scan found nothing for it */
+static int scsi_map_lun(struct scsi_xfer *xfer)
+{
+	scsi_update_hostid();
+	if (!sctx.scanned)
+		scsi_scan();
+	if (xfer->lun >= sctx.luns)
+		return -1;
+	xfer->id = sctx.lun_map[xfer->lun] >> 3;
+	xfer->lun = sctx.lun_map[xfer->lun] & 7;
+	return 0;
+}
+
+/*
+ * After a CHECK CONDITION the target keeps the sense only until our
+ * next command to the LUN, and a host asking for it later would have
+ * to race the other commands for it. REQUEST SENSE goes as soon as the
+ * connection is over, before anything else gets to the target, HEAD OF
+ * QUEUE if it takes tags. UAS sends the sense in the sense IU with the
+ * status, a BOT host gets it from sense_cache with its next command to
+ * the host LUN, which has to be REQUEST SENSE. Without sense the status
+ * goes as it came.
+ */
+struct scsi_sense {
+	uint8_t len;
+	uint8_t data[SCSI_SENSE_BUFFERSIZE];
+};
+
+static struct scsi_sense sense_cache[SCSI_LUNS];
+
+static void usb_status_sense(struct scsi_xfer *xfer, int lun, const uint8_t *sense, int len)
+{
+	struct scsi_status *s = usb_status_fill(xfer, 0x02);
+
+	if (usb_uas_interface_alt) {
+		memcpy(s->sense, sense, len);
+		s->sense_len = len;
+	} else if (lun < SCSI_LUNS) {
+		memcpy(sense_cache[lun].data, sense, len);
+		sense_cache[lun].len = len;
 	}
+	/* a medium change, a reset, mode parameters another host changed */
+	if (len > 2 && (sense[2] & 0x0f) == 0x06)
+		scsi_resp_invalidate(lun);
+	usb_status_queued();
+}
 
-	xfer.cdb = iu->cdb;
-	xfer.lun = iu->lun[1];
+static void scsi_auto_sense(struct scsi_xfer *xfer)
+{
+	uint8_t cdb[16] = { 0x03, xfer->lun << 5, 0, 0, SCSI_SENSE_BUFFERSIZE };
+	struct scsi_xfer rs = { 0 };
+	int tag, len = 0;
 
-	tag = scsi_insert_tag(be16_to_cpu(iu->tag));
+	xfer->sense = 0;
+	scsi_stats.auto_sense++;
+	tag = scsi_insert_tag(0xffffffff);
 	if (tag == -1) {
-		printf("no free tag\n"); // XXX: return error code
-		return;
+		scsi_stats.no_free_tag++;
+		goto out;
+	}
+	rs.tag = scsi_lookup_tag(tag);
+	rs.tag->task_attr = SCSI_ATTR_HEAD;
+	rs.cdb = cdb;
+	rs.id = xfer->id;
+	rs.lun = xfer->lun;
+	rs.data_exp = SCSI_SENSE_BUFFERSIZE;
+	rs.status = 0xff;
+	rs.selftest = 1;
+	scsi_setup_msgs(&rs);
+	if (scsi_transfer(rs.id, &rs))
+		scsi_free_tag(tag);
+	else if (!rs.status)
+		len = rs.data_act < SCSI_SENSE_BUFFERSIZE ? rs.data_act : SCSI_SENSE_BUFFERSIZE;
+out:
+	if (!len)
+		scsi_stats.auto_sense_failed++;
+	usb_status_sense(xfer, scsi_host_lun(xfer->id, xfer->lun), selftest_buf, len);
+	if (xfer->disconnect_ok) {
+		scsi_free_tag(xfer->tag->tag);
+		xfer->tag = 0;
 	}
-	xfer.tag = scsi_lookup_tag(tag);
-	do_xfer(&xfer);
 }
 
-static void scsi_msc_request(struct usb_msc_cbw *cbw, int len)
+/*
+ * The RAM disk moves its data through the same frames and lists as the
+ * SCSI data phases, just without the bus. BOT hosts send all the DATA
+ * OUT they announced even for a command that fails, so it is drained.
+ */
+static void scsi_ramdisk_request(struct scsi_xfer *xfer, uint32_t bot_dout)
 {
-	struct scsi_xfer xfer = { 0 };
-	int tag;
+	struct scsi_ramdisk_cmd c;
+	uint32_t done, out, n;
+	transfer_t *t;
+	int len;
 
-	if (len < sizeof(struct usb_msc_cbw)) {
-		SCSI_DEBUG(SCSI_DEBUG_ERROR, "%s: short request (%d bytes)\n", __func__, len);
-		return;
+	scsi_ramdisk_setup(xfer->cdb, &c);
+	if (c.din) {
+		if (!usb_uas_interface_alt && c.len > xfer->data_exp)
+			c.len = xfer->data_exp;
+		while (xfer->data_act < c.len) {
+			n = c.len - xfer->data_act;
+			if (n > 16384)
+				n = 16384;
+			t = scsi_get_din_frame(xfer);
+			memcpy(transfer_buffer(t), c.data + xfer->data_act, n);
+			xfer->data_act += n;
+			scsi_put_din_frame(xfer, t, n);
+		}
+		scsi_stats.bytes_in += xfer->data_act;
+	} else {
+		out = usb_uas_interface_alt ? c.len : bot_dout;
+		for (done = 0; done < out; done += len) {
+			t = scsi_get_dout_frame(xfer, &len);
+			if (len > out - done)
+				len = out - done;
+			if (done < c.len) {
+				n = c.len - done < len ? c.len - done : len;
+				memcpy(c.data + done, transfer_buffer(t), n);
+				xfer->data_act += n;
+			}
+			scsi_put_dout_frame(xfer, t);
+			if (!len)
+				break;
+		}
+		scsi_stats.bytes_out += xfer->data_act;
+	}
+	if (c.status == 0x02)
+		scsi_stats.check_conditions++;
+	xfer->status = c.status;
+	if (c.status == 0x02) {
+		/* like scsi_auto_sense(), without the bus */
+		uint8_t cdb[6] = { 0x03, 0, 0, 0, SCSI_SENSE_BUFFERSIZE };
+
+		scsi_ramdisk_setup(cdb, &c);
+		usb_status_sense(xfer, 0, c.data, c.len);
+	} else {
+		usb_status_hook(xfer, c.status);
 	}
+	scsi_free_tag(xfer->tag->tag);
+}
 
-	SCSI_DEBUG(SCSI_DEBUG_MSC, "%ld: len %d, lun %d, cdblen %d, datalen %ld, flags %x, cdb %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-		   cbw->tag, len, cbw->lun & 0xf, cbw->cbwcblen, cbw->datalen, cbw->flags,
-		   cbw->cdb[0], cbw->cdb[1], cbw->cdb[2], cbw->cdb[3], cbw->cdb[4],
-		   cbw->cdb[5], cbw->cdb[6], cbw->cdb[7], cbw->cdb[8], cbw->cdb[9]);
-	xfer.cdb = cbw->cdb;
+/*
+ * Commands taken off USB by the intake task wait here for the session
+ * task, in arrival order. scsi_next_cmd() copies one out and it leaves
+ * the queue before it runs, xfer.cdb then points into the copy. HEAD OF
+ * QUEUE ones and those the target sent back with BUSY or QUEUE FULL go
+ * in at cmd_tail, ahead of the rest.
+ */
+#define SCSI_CMD_QUEUE 32
+
+struct scsi_cmd {
+	struct scsi_xfer xfer;
+	uint8_t cdb[16];
+	uint32_t bot_dout;	/* DATA OUT bytes a BOT host sends */
+	uint32_t queued_us;
+	int bot;
+};
+
+static struct scsi_cmd cmd_queue[SCSI_CMD_QUEUE];
+static unsigned int cmd_head, cmd_tail;
+static int cmd_active;
+
+/*
+ * A bus connection per target, of a host command or a reselection. The
+ * session task runs the one that has the bus a phase at a time, see
+ * scsi_session_run(). The command is copied in once the target is
+ * selected, a reselection of the same target while we wait for the bus
+ * can't come in between.
+ */
+static struct scsi_session {
+	struct scsi_cmd c;
+	int reselected;
+} sessions[8];
+static struct scsi_session *bus_session;
+
+/* a UAS task management IU for the session task, see scsi_task_mgmt() */
+static struct scsi_tm {
+	struct uas_task_mgmt_iu iu;
+	uint32_t queued_us;
+} tm_pending;
+static int tm_waiting;
+
+static int scsi_queue_full(void)
+{
+	/* what comes after it waits until it is answered */
+	if (tm_waiting)
+		return 1;
+	/* BOT DATA OUT comes in on the command pipe, one command at a time */
+	if (!usb_uas_interface_alt)
+		return cmd_head != cmd_tail || cmd_active;
+	/* the active one may have to go back in */
+	return cmd_head - cmd_tail + cmd_active >= SCSI_CMD_QUEUE;
+}
 
-	tag = scsi_insert_tag(cbw->tag);
+static void scsi_flush_queues(void)
+{
+	cmd_tail = cmd_head;
+	status_tail = status_head;
+	scsi_stats.cmd_queued = 0;
+	/* the bus reset ended the connection, USB takes its frame back */
+	bus_session = NULL;
+	cmd_active = 0;
+}
+
+static struct scsi_cmd *scsi_queue_cmd(const uint8_t *cdb, int cdblen, uint32_t host_tag)
+{
+	struct scsi_cmd *c = cmd_queue + cmd_head % SCSI_CMD_QUEUE;
+	int tag;
+
+	tag = scsi_insert_tag(host_tag);
 	if (tag == -1) {
+		scsi_stats.no_free_tag++;
 		printf("no free tag\n"); // XXX: return error code
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
+	memcpy(c->cdb, cdb, cdblen);
+	c->xfer.cdb = c->cdb;
+	c->xfer.tag = scsi_lookup_tag(tag);
+	c->xfer.tag->queued = 1;
+	c->queued_us = micros();
+	scsi_trace_cmd(&c->xfer.tag->trace, cdb, host_tag);
+	cmd_head++;
+	scsi_stats.cmd_queued = cmd_head - cmd_tail;
+	if (scsi_stats.cmd_queued > scsi_stats.cmd_queued_max)
+		scsi_stats.cmd_queued_max = scsi_stats.cmd_queued;
+	return c;
+}
+
+/* out of cmd_queue, the ones before it move up */
+static void scsi_unqueue_cmd(unsigned int i)
+{
+	for (; i != cmd_tail; i--)
+		cmd_queue[i % SCSI_CMD_QUEUE] = cmd_queue[(i - 1) % SCSI_CMD_QUEUE];
+	cmd_tail++;
+	scsi_stats.cmd_queued = cmd_head - cmd_tail;
+}
+
+/* the DATA OUT a BOT host sends anyway, for a command no target gets */
+static void scsi_drop_dout(struct scsi_cmd *c)
+{
+	uint32_t done;
+	transfer_t *t;
+	int n;
+
+	for (done = 0; done < c->bot_dout; done += n) {
+		t = scsi_get_dout_frame(&c->xfer, &n);
+		scsi_put_dout_frame(&c->xfer, t);
+		if (!n)
+			break;
+	}
+}
+
+/* a command the bridge answers itself, with data from buf */
+static void scsi_local_reply(struct scsi_cmd *c, const uint8_t *buf, int len, int status)
+{
+	struct scsi_xfer *xfer = &c->xfer;
+	transfer_t *t;
+
+	if (c->bot && len > xfer->data_exp)
+		len = xfer->data_exp;
+	if (len) {
+		t = scsi_get_din_frame(xfer);
+		memcpy(transfer_buffer(t), buf, len);
+		scsi_put_din_frame(xfer, t, len);
+		xfer->data_act = len;
+	}
+	scsi_drop_dout(c);
+	if (status == 0x02)
+		scsi_stats.check_conditions++;
+	xfer->status = status;
+	usb_status_hook(xfer, status);
+	scsi_free_tag(xfer->tag->tag);
+}
+
+/*
+ * At least Windows 10 insists on the REPORT LUNS command, and the host
+ * LUNs are ours anyway: the ones the scan mapped, or the RAM disk.
+ * LUN 0 is always there.
+ */
+static void scsi_report_luns(struct scsi_cmd *c)
+{
+	uint8_t buf[8 + 8 * SCSI_LUNS] = { 0 };
+	uint32_t alloc = c->cdb[6] << 24 | c->cdb[7] << 16 | c->cdb[8] << 8 | c->cdb[9];
+	int i, n = 1, len;
+
+	if (!scsi_ramdisk_active()) {
+		scsi_update_hostid();
+		if (!sctx.scanned)
+			scsi_scan();
+		if (sctx.luns)
+			n = sctx.luns;
+	}
+	buf[2] = (8 * n) >> 8;
+	buf[3] = 8 * n;
+	for (i = 0; i < n; i++)
+		buf[8 + 8 * i + 1] = i;
+	len = 8 + 8 * n;
+	scsi_local_reply(c, buf, len < alloc ? len : alloc, 0);
+}
+
+/*
+ * Host LUNs nothing was found for: no unit behind it for INQUIRY,
+ * LOGICAL UNIT NOT SUPPORTED for REQUEST SENSE and everything else.
+ */
+static void scsi_no_lun(struct scsi_cmd *c)
+{
+	uint8_t buf[36] = { 0 };
+	int alloc = (c->cdb[3] << 8) | c->cdb[4];
+
+	switch (c->cdb[0]) {
+	case 0x12:
+		buf[0] = 0x7f;
+		buf[2] = 2;
+		buf[3] = 2;
+		buf[4] = 31;
+		scsi_local_reply(c, buf, alloc < 36 ? alloc : 36, 0);
+		break;
+	case 0x03:
+		buf[0] = 0x70;
+		buf[2] = 0x05;
+		buf[7] = 10;
+		buf[12] = 0x25;
+		scsi_local_reply(c, buf, c->cdb[4] < 18 ? c->cdb[4] : 18, 0);
+		break;
+	default:
+		scsi_local_reply(c, buf, 0, 0x02);
+		break;
+	}
+}
+
+/*
+ * The target didn't answer selection: CHECK CONDITION, LOGICAL UNIT
+ * DOES NOT RESPOND TO SELECTION, and the tag is free for the next one.
+ */
+static void scsi_select_failed(struct scsi_cmd *c, int lun)
+{
+	uint8_t sense[18] = { 0x70, 0, 0x02, 0, 0, 0, 0, 10, 0, 0, 0, 0, 0x05 };
+	struct scsi_xfer *xfer = &c->xfer;
+
+	scsi_drop_dout(c);
+	scsi_stats.check_conditions++;
+	xfer->status = 0x02;
+	usb_status_sense(xfer, lun, sense, sizeof(sense));
+	scsi_free_tag(xfer->tag->tag);
+}
+
+/* nonzero if the command was the REQUEST SENSE sense_cache had waited for */
+static int scsi_cached_sense(struct scsi_cmd *c)
+{
+	struct scsi_sense *s;
+	int alloc = c->cdb[4] ? c->cdb[4] : 4;
+
+	if (c->xfer.lun >= SCSI_LUNS || !sense_cache[c->xfer.lun].len)
+		return 0;
+	s = sense_cache + c->xfer.lun;
+	if (c->cdb[0] != 0x03) {
+		s->len = 0;
+		return 0;
+	}
+	scsi_stats.sense_cached++;
+	scsi_local_reply(c, s->data, s->len < alloc ? s->len : alloc, 0);
+	s->len = 0;
+	return 1;
+}
+
+/* the CDB bytes a cached response is kept under, 0 if it isn't kept */
+static int scsi_resp_key(const uint8_t *cdb, uint8_t *key, uint32_t *alloc)
+{
+	memset(key, 0, 4);
+	key[0] = cdb[0];
+	switch (cdb[0]) {
+	case 0x12:	/* INQUIRY, EVPD and page */
+		key[1] = cdb[1] & 0x01;
+		key[2] = cdb[2];
+		*alloc = cdb[4];
+		return 1;
+	case 0x1a:	/* MODE SENSE(6), DBD, page control and page */
+		key[1] = cdb[1] & 0x08;
+		key[2] = cdb[2];
+		key[3] = cdb[3];
+		*alloc = cdb[4];
+		return 1;
+	case 0x5a:	/* MODE SENSE(10), DBD and LLBAA too */
+		key[1] = cdb[1] & 0x18;
+		key[2] = cdb[2];
+		key[3] = cdb[3];
+		*alloc = cdb[7] << 8 | cdb[8];
+		return 1;
+	case 0x25:	/* READ CAPACITY(10), not for PMI */
+		*alloc = 8;
+		return !(cdb[8] & 0x01);
+	case 0x9e:	/* READ CAPACITY(16) */
+		key[1] = cdb[1] & 0x1f;
+		*alloc = cdb[10] << 24 | cdb[11] << 16 | cdb[12] << 8 | cdb[13];
+		return key[1] == 0x10 && !(cdb[14] & 0x01);
+	}
+	return 0;
+}
+
+/*
+ * Nonzero if the command was answered from resp_cache. On a miss it
+ * fills an entry, the free or the least recently used one, unless
+ * another command is filling the same already.
+ */
+static int scsi_resp_cached(struct scsi_cmd *c, int lun)
+{
+	struct scsi_resp *r, *hit = NULL, *victim = NULL;
+	uint8_t key[4];
+	uint32_t alloc;
+
+	if (c->cdb[0] == 0x15 || c->cdb[0] == 0x55 || c->cdb[0] == 0x04) {
+		scsi_resp_invalidate(lun);
+		return 0;
+	}
+	if (!scsi_tunables.resp_cache || !scsi_resp_key(c->cdb, key, &alloc))
+		return 0;
+	if (c->bot && alloc > c->xfer.data_exp)
+		alloc = c->xfer.data_exp;
+	for (r = resp_cache; r < resp_cache + SCSI_RESP_ENTRIES; r++) {
+		if (r->state != SCSI_RESP_FREE && r->lun == lun && !memcmp(r->key, key, 4)) {
+			if (r->state == SCSI_RESP_FILLING)
+				return 0;
+			if (r->len < r->alloc || alloc <= r->len)
+				hit = r;
+			else	/* cut shorter than this one wants, fetched again */
+				victim = r;
+			break;
+		}
+		if (r->state != SCSI_RESP_FILLING && (!victim || r->used < victim->used))
+			victim = r;
+	}
+	if (hit) {
+		hit->used = ++resp_clock;
+		scsi_stats.resp_cache_hits++;
+		scsi_local_reply(c, hit->data, hit->len < alloc ? hit->len : alloc, 0);
+		return 1;
+	}
+	if (!victim)
+		return 0;
+	if (alloc > 0xffff)
+		alloc = 0xffff;
+	victim->state = SCSI_RESP_FILLING;
+	victim->lun = lun;
+	victim->tag = c->xfer.tag->tag;
+	memcpy(victim->key, key, 4);
+	victim->len = 0;
+	victim->alloc = alloc;
+	c->xfer.tag->resp = victim - resp_cache + 1;
+	return 0;
+}
+
+static int scsi_session_start(struct scsi_cmd *c);
+
+static void scsi_execute(struct scsi_cmd *c)
+{
+	struct scsi_xfer *xfer = &c->xfer;
+	int lun = xfer->lun;
+
+	if (c->bot && scsi_cached_sense(c))
+		return;
+	if (c->cdb[0] == 0xa0) {
+		scsi_report_luns(c);
+		return;
+	}
+	if (scsi_ramdisk_active()) {
+		if (xfer->lun)
+			scsi_no_lun(c);
+		else
+			scsi_ramdisk_request(xfer, c->bot_dout);
 		return;
 	}
+	if (scsi_map_lun(xfer)) {
+		scsi_no_lun(c);
+		return;
+	}
+	if (scsi_resp_cached(c, lun))
+		return;
+	scsi_stats.target_commands[xfer->id]++;
+	if (c->bot) {
+		sctx.target[xfer->id].support_tags = 0;
+		sctx.target[xfer->id].support_disconnect = 0;
+	}
+	if (scsi_session_start(c))
+		scsi_select_failed(c, lun);
+}
+
+/*
+ * UAS task attribute and priority onto the tag message the target gets.
+ * SCSI-2 has no ACA, it goes as ORDERED, which keeps its place at
+ * least. A SIMPLE one of the highest priority goes as HEAD OF QUEUE.
+ * The bridge keeps to the same order in cmd_queue: HEAD OF QUEUE goes
+ * to its head, nothing passes an ORDERED one of its LUN, see
+ * scsi_elevator(), and scsi_cmd_waits() keeps the rest in order per
+ * target.
+ */
+#define UAS_ATTR_HEAD		1
+#define UAS_ATTR_ORDERED	2
+#define UAS_ATTR_ACA		4
+#define UAS_PRIO_HIGHEST	1
+
+static void scsi_task_attr(struct scsi_cmd *c, uint8_t prio_attr)
+{
+	struct scsi_tag *tag = c->xfer.tag;
+
+	switch (prio_attr & 7) {
+	case UAS_ATTR_HEAD:
+		tag->task_attr = SCSI_ATTR_HEAD;
+		break;
+	case UAS_ATTR_ORDERED:
+	case UAS_ATTR_ACA:
+		tag->task_attr = SCSI_ATTR_ORDERED;
+		break;
+	default:
+		tag->task_attr = (prio_attr >> 3 & 15) == UAS_PRIO_HIGHEST ?
+			SCSI_ATTR_HEAD : SCSI_ATTR_SIMPLE;
+		break;
+	}
+	scsi_stats.task_attrs[tag->task_attr]++;
+	if (tag->task_attr != SCSI_ATTR_HEAD)
+		return;
+	/* from the far end to the head, the same slot in a full queue */
+	cmd_queue[--cmd_tail % SCSI_CMD_QUEUE] = *c;
+	cmd_head--;
+}
+
+/*
+ * UAS task management, for a host that gave up on its commands: ABORT
+ * TASK, ABORT TASK SET, LOGICAL UNIT RESET and QUERY TASK. The IU waits
+ * in tm_pending for the session task, the bus is free between its
+ * connections, and the intake task takes nothing after it until it is
+ * answered. A queued task just leaves cmd_queue. One the target has
+ * disconnected ends with a selection for ABORT TAG, or ABORT for an
+ * untagged one and for all of a LUN. SCSI-2 has no reset for one LUN,
+ * a LUN reset goes as BUS DEVICE RESET unless another host LUN is
+ * behind the same target. Nothing of an aborted task goes to the host
+ * any more, the RESPONSE IU goes through status_queue, behind the
+ * status of whatever completed before.
+ */
+
+/* a connection just for a message that ends tasks, nonzero if it wasn't taken */
+static int scsi_abort_select(int id, int lun, const struct scsi_tag *task, uint8_t msg)
+{
+	uint8_t cdb[16] = { 0 };	/* TEST UNIT READY, should it want a command */
+	struct scsi_xfer xfer = { 0 };
+	uint8_t *m = xfer.outmsgs;
+	int tag;
+
+	tag = scsi_insert_tag(0xffffffff);
+	if (tag == -1) {
+		scsi_stats.no_free_tag++;
+		return -1;
+	}
 	xfer.tag = scsi_lookup_tag(tag);
-	xfer.lun = cbw->lun & 0xf;
-	xfer.data_exp = cbw->datalen;
-	sctx.support_tags = 0;
-	sctx.support_disconnect = 0;
-	do_xfer(&xfer);
+	xfer.tag->id = id;
+	xfer.tag->lun = lun;
+	xfer.cdb = cdb;
+	xfer.lun = lun;
+	xfer.status = 0xff;
+	xfer.selftest = 1;
+	if (sctx.target[id].support_identify)
+		*m++ = SCSI_MSG_IDENTIFY | lun;
+	if (task && !task->untagged) {
+		*m++ = SCSI_MSG_SIMPLE_TAG + task->task_attr;
+		*m++ = task->tag;
+	}
+	*m++ = msg;
+	xfer.outmsgcnt = m - xfer.outmsgs;
+	if (scsi_transfer(id, &xfer)) {
+		scsi_free_tag(tag);
+		return -1;
+	}
+	/* it went on to status: took the messages for a new command */
+	return xfer.status != 0xff;
 }
 
-static void scsi_check_reselection(void)
+static void scsi_drop_task(struct scsi_tag *tag)
 {
 	struct scsi_xfer xfer = { 0 };
 
-	if (!digitalReadFast(SELI_PIN) &&
-	    !digitalReadFast(IOI_PIN)) {
-		uint8_t ids = scsi_get_data();
-		if (ids & sctx.hostidmsk) {
-			xfer.id = __builtin_ctz(ids & (sctx.hostidmsk-1));
-			SCSI_DEBUG(SCSI_DEBUG_PHASE, "reselection from ID %d\n", xfer.id);
-			digitalWriteFast(BSYO_PIN, HIGH);
-			while(!digitalReadFast(SELI_PIN));
-			digitalWriteFast(BSYO_PIN, LOW);
-			delayNanoseconds(SCSI_BUS_SETTLE_DELAY);
-			while(!digitalReadFast(BSYI_PIN))
-				scsi_handle_phase(&xfer);
-			if (!xfer.disconnect_ok && xfer.tag)
-				scsi_free_tag(xfer.tag->tag);
-			SCSI_DEBUG(SCSI_DEBUG_PHASE, "disconnected\n");
+	if (tag->frame && tag->frame_din)
+		put_frame(&tx_free_list, tag->frame);
+	else if (tag->frame)
+		scsi_put_dout_frame(&xfer, tag->frame);
+	scsi_trace_done(&tag->trace, 0x40);
+	scsi_free_tag(tag->tag);
+	scsi_stats.tasks_aborted++;
+}
+
+/* the host's task on one of its LUNs, *qi is cmd_head unless it is queued */
+static struct scsi_tag *scsi_find_task(uint32_t host_tag, int lun, unsigned int *qi)
+{
+	struct scsi_tag *tag;
+	unsigned int i;
+
+	for (i = cmd_tail; i != cmd_head; i++) {
+		tag = cmd_queue[i % SCSI_CMD_QUEUE].xfer.tag;
+		if (tag->host_tag == host_tag && cmd_queue[i % SCSI_CMD_QUEUE].xfer.lun == lun) {
+			*qi = i;
+			return tag;
 		}
 	}
+	*qi = cmd_head;
+	for (i = 0; i < ARRAY_SIZE(scsi_tags); i++) {
+		tag = scsi_tags + i;
+		if (tag->valid && tag->disconnected && tag->host_tag == host_tag &&
+		    scsi_host_lun(tag->id, tag->lun) == lun)
+			return tag;
+	}
+	return NULL;
 }
 
-void usb_msc_loop(void)
+static int scsi_abort_task(uint32_t host_tag, int lun)
 {
+	struct scsi_tag *tag;
+	unsigned int i;
 
-	transfer_t *t;
-	while (1) {
-		/* check for reselection */
-		scsi_check_reselection();
-		t = get_frame_noblock(&rx_cmd_busy_list);
-		if (t == LIST_END)
-			continue;
-		int len = transfer_length(t);
+	tag = scsi_find_task(host_tag, lun, &i);
+	if (!tag)
+		return UAS_RC_COMPLETE;
+	if (i != cmd_head) {
+		scsi_unqueue_cmd(i);
+		scsi_drop_task(tag);
+		return UAS_RC_COMPLETE;
+	}
+	if (scsi_abort_select(tag->id, tag->lun, tag,
+			      tag->untagged ? SCSI_MSG_ABORT : SCSI_MSG_ABORT_TAG))
+		return UAS_RC_FAILED;
+	/* unless it was reselected and completed while we waited for the bus */
+	if (tag->valid && tag->disconnected && tag->host_tag == host_tag)
+		scsi_drop_task(tag);
+	return UAS_RC_COMPLETE;
+}
 
-		if (len > 0) {
-			if (!usb_uas_interface_alt) {
-				scsi_msc_request(transfer_buffer(t), len);
-			} else {
-				scsi_uas_request(transfer_buffer(t), len);
-			}
-			usb_rx_cmd_ack(t);
-		} else {
-			SCSI_DEBUG(SCSI_DEBUG_ERROR, "ZLP!\n");
-		}
+static int scsi_abort_lun(int lun, int reset)
+{
+	struct scsi_tag *tag;
+	unsigned int i;
+	int id, tlun, bdr = reset, found = 0;
+
+	for (i = cmd_tail; i != cmd_head; i++) {
+		if (cmd_queue[i % SCSI_CMD_QUEUE].xfer.lun != lun)
+			continue;
+		tag = cmd_queue[i % SCSI_CMD_QUEUE].xfer.tag;
+		scsi_unqueue_cmd(i);
+		scsi_drop_task(tag);
+	}
+	if (reset)
+		scsi_stats.lun_resets++;
+	if (!sctx.scanned || lun >= sctx.luns || scsi_ramdisk_active())
+		return UAS_RC_COMPLETE;
+	id = sctx.lun_map[lun] >> 3;
+	tlun = sctx.lun_map[lun] & 7;
+	for (i = 0; i < sctx.luns; i++)
+		if (i != lun && sctx.lun_map[i] >> 3 == id)
+			bdr = 0;
+	for (i = 0; i < ARRAY_SIZE(scsi_tags); i++) {
+		tag = scsi_tags + i;
+		found |= tag->valid && tag->disconnected && tag->id == id && tag->lun == tlun;
+	}
+	if ((bdr || found) &&
+	    scsi_abort_select(id, tlun, NULL, bdr ? SCSI_MSG_BUS_DEVICE_RESET : SCSI_MSG_ABORT))
+		return UAS_RC_FAILED;
+	for (i = 0; i < ARRAY_SIZE(scsi_tags); i++) {
+		tag = scsi_tags + i;
+		if (tag->valid && tag->disconnected && tag->id == id && (bdr || tag->lun == tlun))
+			scsi_drop_task(tag);
+	}
+	return UAS_RC_COMPLETE;
+}
 
+/* before the session task's next command, nonzero if there was one */
+static int scsi_task_mgmt(void)
+{
+	const struct uas_task_mgmt_iu *iu = &tm_pending.iu;
+	unsigned int i;
+	uint32_t us;
+	int lun, code;
+
+	if (!tm_waiting)
+		return 0;
+	lun = iu->lun[0] ? 0xff : iu->lun[1];
+	if (lun && (scsi_ramdisk_active() || lun == 0xff || (sctx.scanned && lun >= sctx.luns))) {
+		code = UAS_RC_INCORRECT_LUN;
+	} else switch (iu->function) {
+	case UAS_TMF_ABORT_TASK:
+		code = scsi_abort_task(be16_to_cpu(iu->task_tag), lun);
+		break;
+	case UAS_TMF_ABORT_TASK_SET:
+	case UAS_TMF_LUN_RESET:
+		code = scsi_abort_lun(lun, iu->function == UAS_TMF_LUN_RESET);
+		break;
+	case UAS_TMF_QUERY_TASK:
+		code = scsi_find_task(be16_to_cpu(iu->task_tag), lun, &i) ?
+			UAS_RC_SUCCEEDED : UAS_RC_COMPLETE;
+		break;
+	default:
+		code = UAS_RC_NOT_SUPPORTED;
+		break;
+	}
+	if (code != UAS_RC_COMPLETE && code != UAS_RC_SUCCEEDED)
+		scsi_stats.task_mgmt_failed++;
+	uas_queue_response(be16_to_cpu(iu->tag), code);
+	us = micros() - tm_pending.queued_us;
+	scsi_stats.task_mgmt_us = us;
+	if (us > scsi_stats.task_mgmt_max_us)
+		scsi_stats.task_mgmt_max_us = us;
+	scsi_stats.task_mgmt_total_us += us;
+	tm_waiting = 0;
+	return 1;
+}
+
+static void scsi_uas_task_mgmt(struct uas_task_mgmt_iu *iu, int len)
+{
+	if (len < sizeof(*iu)) {
+		scsi_stats.short_requests++;
+		SCSI_DEBUG(SCSI_DEBUG_UAS, "%s: short request (%d bytes)\n", __func__, len);
+		return;
+	}
+	SCSI_DEBUG(SCSI_DEBUG_UAS, "%d: task management %02x, task %d\n",
+		   be16_to_cpu(iu->tag), iu->function, be16_to_cpu(iu->task_tag));
+	scsi_stats.task_mgmt++;
+	tm_pending.iu = *iu;
+	tm_pending.queued_us = micros();
+	tm_waiting = 1;
+}
+
+static void scsi_uas_request(struct uas_command_iu *iu, int len)
+{
+	struct scsi_cmd *c;
+
+	if (iu->iu_id == IU_ID_TASK_MGMT) {
+		scsi_uas_task_mgmt((struct uas_task_mgmt_iu *)iu, len);
+		return;
+	}
+	if (len < sizeof(struct uas_command_iu)) {
+		scsi_stats.short_requests++;
+		SCSI_DEBUG(SCSI_DEBUG_UAS, "%s: short request (%d bytes)\n", __func__, len);
+		return;
+	}
+
+	SCSI_DEBUG(SCSI_DEBUG_UAS, "%d: ID %d, len %d, lun %d, prio_attr %x, cdb %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x LUN %02x %02x %02x %02x %02x %02x %02x %02x\n",
+	       (iu->tag >> 8) | ((iu->tag & 0xff) << 8), iu->iu_id, iu->len, iu->lun[0], iu->prio_attr,
+	       iu->cdb[0], iu->cdb[1], iu->cdb[2], iu->cdb[3], iu->cdb[4],
+	       iu->cdb[5], iu->cdb[6], iu->cdb[7], iu->cdb[8], iu->cdb[9],
+	       iu->lun[0], iu->lun[1], iu->lun[2], iu->lun[3],
+	       iu->lun[4], iu->lun[5], iu->lun[6], iu->lun[7]);
+
+	scsi_stats.commands++;
+	scsi_stats.opcodes[iu->cdb[0]]++;
+
+	c = scsi_queue_cmd(iu->cdb, sizeof(iu->cdb), be16_to_cpu(iu->tag));
+	/* single level LUNs only, the others are never mapped */
+	if (!c)
+		return;
+	c->xfer.lun = iu->lun[0] ? 0xff : iu->lun[1];
+	scsi_task_attr(c, iu->prio_attr);
+}
+
+static void scsi_msc_request(struct usb_msc_cbw *cbw, int len)
+{
+	struct scsi_cmd *c;
+
+	if (len < sizeof(struct usb_msc_cbw)) {
+		scsi_stats.short_requests++;
+		SCSI_DEBUG(SCSI_DEBUG_ERROR, "%s: short request (%d bytes)\n", __func__, len);
+		return;
+	}
+
+	SCSI_DEBUG(SCSI_DEBUG_MSC, "%ld: len %d, lun %d, cdblen %d, datalen %ld, flags %x, cdb %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+		   cbw->tag, len, cbw->lun & 0xf, cbw->cbwcblen, cbw->datalen, cbw->flags,
+		   cbw->cdb[0], cbw->cdb[1], cbw->cdb[2], cbw->cdb[3], cbw->cdb[4],
+		   cbw->cdb[5], cbw->cdb[6], cbw->cdb[7], cbw->cdb[8], cbw->cdb[9]);
+
+	scsi_stats.commands++;
+	scsi_stats.opcodes[cbw->cdb[0]]++;
+
+	c = scsi_queue_cmd(cbw->cdb, sizeof(cbw->cdb), cbw->tag);
+	if (!c)
+		return;
+	c->bot = 1;
+	c->bot_dout = cbw->flags & 0x80 ? 0 : cbw->datalen;
+	c->xfer.lun = cbw->lun & 0xf;
+	c->xfer.data_exp = cbw->datalen;
+}
+
+static int scsi_intake_task(struct scsi_task *task)
+{
+	transfer_t *t;
+	int len, busy = 0;
+
+	while (!scsi_queue_full() && !scsi_task_slice_over()) {
+		t = get_frame_noblock(&rx_cmd_busy_list);
+		if (t == LIST_END)
+			break;
+		busy = 1;
+		len = transfer_length(t);
+		if (len <= 0) {
+			SCSI_DEBUG(SCSI_DEBUG_ERROR, "ZLP!\n");
+			continue;
+		}
+		if (!usb_uas_interface_alt)
+			scsi_msc_request(transfer_buffer(t), len);
+		else
+			scsi_uas_request(transfer_buffer(t), len);
+		usb_rx_cmd_ack(t);
+	}
+	return busy;
+}
+
+static struct scsi_selftest_params selftest_params;
+static volatile int selftest_pending;
+/* host LUN the self-test or trace replay runs against */
+static int selftest_lun;
+
+int scsi_selftest_start(const struct scsi_selftest_params *params)
+{
+	if (selftest_pending || scsi_stats.selftest_state == SCSI_SELFTEST_RUNNING)
+		return -1;
+	selftest_params = *params;
+	selftest_pending = 1;
+	return 0;
+}
+
+static int scsi_selftest_cmd(uint8_t *cdb, int len, int *data_act)
+{
+	struct scsi_xfer xfer = { 0 };
+	int tag;
+
+	tag = scsi_insert_tag(0xffffffff);
+	if (tag == -1) {
+		scsi_stats.no_free_tag++;
+		return -1;
+	}
+	xfer.tag = scsi_lookup_tag(tag);
+	xfer.cdb = cdb;
+	xfer.lun = selftest_lun;
+	xfer.data_exp = len;
+	xfer.status = 0xff;
+	xfer.selftest = 1;
+	if (scsi_map_lun(&xfer)) {
+		scsi_free_tag(tag);
+		return -1;
+	}
+	do_xfer(&xfer);
+	if (data_act)
+		*data_act = xfer.data_act;
+	return xfer.status;
+}
+
+static uint32_t selftest_random(void)
+{
+	static uint32_t x = 2463534242;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/*
+ * Self-test and trace replay run in the background task, a command per
+ * turn at most, so host commands keep going in between. Their timings
+ * only count the self-test's own commands.
+ */
+static struct {
+	uint32_t capacity, blocksize;
+	int steps, step;
+	uint8_t pattern[SCSI_SELFTEST_MAX_STEPS];
+	uint32_t size[SCSI_SELFTEST_MAX_STEPS];
+	uint32_t end, lba;
+	uint64_t cycles, data_cycles;
+	/* trace replay */
+	uint32_t mode, start, i, n;
+	uint8_t cdb[16];
+	uint32_t len;		/* of its data */
+} bg;
+
+static uint64_t scsi_data_cycles(void)
+{
+	return scsi_stats.phase_cycles[SCSI_PHASE_DIN] +
+		scsi_stats.phase_cycles[SCSI_PHASE_DOUT];
+}
+
+static void scsi_selftest_add_step(int pattern, uint32_t size)
+{
+	if (bg.steps >= SCSI_SELFTEST_MAX_STEPS)
+		return;
+	bg.pattern[bg.steps] = pattern;
+	bg.size[bg.steps++] = size;
+}
+
+static void scsi_selftest_step_start(void)
+{
+	struct scsi_selftest_result *res = scsi_stats.selftest + bg.step;
+
+	scsi_stats.selftest_steps = bg.step + 1;
+	res->mode = selftest_params.mode;
+	res->pattern = bg.pattern[bg.step];
+	res->xfer_size = bg.size[bg.step];
+	bg.end = millis() + selftest_params.duration_ms;
+	bg.lba = 0;
+	bg.cycles = 0;
+	bg.data_cycles = 0;
+}
+
+/* one command of the current step, 0 once its time is up */
+static int scsi_selftest_step_cmd(void)
+{
+	struct scsi_selftest_result *res = scsi_stats.selftest + bg.step;
+	uint32_t start, nblocks;
+	uint64_t data_cycles;
+	uint8_t cdb[16];
+	int act;
+
+	if ((int32_t)(millis() - bg.end) >= 0)
+		return 0;
+
+	memset(cdb, 0, sizeof(cdb));
+	if (res->mode != SCSI_SELFTEST_TUR) {
+		nblocks = res->xfer_size / bg.blocksize;
+		if (res->pattern == SCSI_SELFTEST_RANDOM)
+			bg.lba = (selftest_random() % (bg.capacity / nblocks)) * nblocks;
+		else if (bg.lba + nblocks > bg.capacity)
+			bg.lba = 0;
+		cdb[0] = res->mode == SCSI_SELFTEST_WRITE ? 0x2a : 0x28;
+		cdb[2] = bg.lba >> 24;
+		cdb[3] = bg.lba >> 16;
+		cdb[4] = bg.lba >> 8;
+		cdb[5] = bg.lba;
+		cdb[7] = nblocks >> 8;
+		cdb[8] = nblocks;
+		bg.lba += nblocks;
+	}
+	act = 0;
+	data_cycles = scsi_data_cycles();
+	start = scsi_hal_cycles();
+	if (scsi_selftest_cmd(cdb, res->xfer_size, &act))
+		res->errors++;
+	bg.cycles += scsi_clock_nominal(scsi_hal_cycles() - start);
+	bg.data_cycles += scsi_data_cycles() - data_cycles;
+	res->commands++;
+	res->bytes += act;
+	return 1;
+}
+
+static void scsi_selftest_step_done(void)
+{
+	struct scsi_selftest_result *res = scsi_stats.selftest + bg.step;
+
+	res->elapsed_us = bg.cycles / (scsi_clock_nominal_hz() / 1000000);
+	if (res->elapsed_us) {
+		res->kbytes_per_sec = res->bytes * 1000 / res->elapsed_us;
+		res->iops = (uint64_t)res->commands * 1000000 / res->elapsed_us;
+	}
+	if (res->commands)
+		res->overhead_ns = (bg.cycles - bg.data_cycles) * 1000 /
+			(scsi_clock_nominal_hz() / 1000000) / res->commands;
+}
+
+static int scsi_selftest_capacity(uint32_t *capacity, uint32_t *blocksize)
+{
+	uint8_t cdb[16] = { 0 };
+
+	cdb[0] = 0x25; // READ CAPACITY(10)
+	if (scsi_selftest_cmd(cdb, 8, NULL))
+		return -1;
+	*capacity = be32_to_cpu(*(uint32_t *)selftest_buf) + 1;
+	*blocksize = be32_to_cpu(*(uint32_t *)(selftest_buf + 4));
+	return *capacity && *blocksize ? 0 : -1;
+}
+
+/* checks the parameters, finds the target and plans the steps */
+static int scsi_selftest_begin(void)
+{
+	struct scsi_selftest_params *p = &selftest_params;
+	uint8_t cdb[16] = { 0 };
+	uint32_t size;
+	int i;
+
+	memset(&scsi_stats.selftest, 0, sizeof(scsi_stats.selftest));
+	scsi_stats.selftest_steps = 0;
+	scsi_stats.selftest_state = SCSI_SELFTEST_RUNNING;
+	bg.steps = 0;
+	selftest_lun = p->lun;
+
+	if (p->mode > SCSI_SELFTEST_TUR || (p->mode == SCSI_SELFTEST_WRITE &&
+	    !(p->flags & SCSI_SELFTEST_ALLOW_WRITE)))
+		return -1;
+
+	/* the first one also scans if that didn't happen yet */
+	if (scsi_selftest_cmd(cdb, 0, NULL) &&
+	    scsi_selftest_cmd(cdb, 0, NULL))
+		return -1;
+
+	if (p->mode == SCSI_SELFTEST_TUR) {
+		scsi_selftest_add_step(0, 0);
+		return 0;
+	}
+
+	if (scsi_selftest_capacity(&bg.capacity, &bg.blocksize))
+		return -1;
+
+	for (i = 0; i < SELFTEST_BUF_SIZE; i++)
+		selftest_buf[i] = i ^ (i >> 8);
+
+	for (i = 0; i < 32; i++) {
+		size = 512 << i;
+		if (!(p->sizes & (1 << i)) || size < bg.blocksize ||
+		    size / bg.blocksize > 0xffff || size / bg.blocksize > bg.capacity)
+			continue;
+		if (p->patterns & SCSI_SELFTEST_SEQUENTIAL)
+			scsi_selftest_add_step(SCSI_SELFTEST_SEQUENTIAL, size);
+		if (p->patterns & SCSI_SELFTEST_RANDOM)
+			scsi_selftest_add_step(SCSI_SELFTEST_RANDOM, size);
+	}
+	return 0;
+}
+
+/* READ(10), WRITE(10) or the command itself for a trace record, 0 to skip it */
+static int scsi_trace_cdb(const struct scsi_trace_rec *r, uint8_t *cdb, int allow_write)
+{
+	memset(cdb, 0, 16);
+	switch (r->opcode) {
+	case 0x00: // TEST UNIT READY
+	case 0x35: // SYNCHRONIZE CACHE(10)
+		cdb[0] = r->opcode;
+		return 1;
+	case 0x08: // READ(6)
+	case 0x28: // READ(10)
+	case 0x88: // READ(16)
+	case 0xa8: // READ(12)
+		cdb[0] = 0x28;
+		break;
+	case 0x0a: // WRITE(6)
+	case 0x2a: // WRITE(10)
+	case 0x8a: // WRITE(16)
+	case 0xaa: // WRITE(12)
+		if (!allow_write)
+			return 0;
+		cdb[0] = 0x2a;
+		break;
+	default:
+		return 0;
+	}
+	if (!r->blocks || r->blocks > 0xffff)
+		return 0;
+	cdb[2] = r->lba >> 24;
+	cdb[3] = r->lba >> 16;
+	cdb[4] = r->lba >> 8;
+	cdb[5] = r->lba;
+	cdb[7] = r->blocks >> 8;
+	cdb[8] = r->blocks;
+	return 1;
+}
+
+/*
+ * Replays the loaded trace through the self-test path, one command at
+ * a time. At original timing a command waits for its arrival time or
+ * for the one before it, so done_us - arrival_us is what the host would
+ * have seen. Back to back the arrival times become the issue times.
+ * TRACE and PUT_TRACE may stop it and load the ring again from the USB
+ * interrupt: a record is only touched with that masked and the mode
+ * still the same.
+ */
+static void scsi_trace_replay_begin(void)
+{
+	scsi_hal_irq_disable();
+	bg.mode = scsi_trace_state;
+	bg.n = scsi_trace_next < SCSI_TRACE_RECORDS ? scsi_trace_next : SCSI_TRACE_RECORDS;
+	scsi_hal_irq_enable();
+	bg.i = 0;
+	selftest_lun = 0;
+	if (scsi_selftest_capacity(&bg.capacity, &bg.blocksize))
+		bg.n = 0;
+	bg.start = micros();
+}
+
+/* finds the next record that can run, its CDB goes to bg.cdb */
+static int scsi_trace_replay_next(void)
+{
+	struct scsi_trace_rec *r;
+	int run;
+
+	for (; bg.i < bg.n; bg.i++) {
+		r = scsi_trace_ring + bg.i;
+		scsi_hal_irq_disable();
+		if (scsi_trace_state != bg.mode) {
+			scsi_hal_irq_enable();
+			break;
+		}
+		r->status = SCSI_TRACE_NOT_RUN;
+		r->done_us = 0;
+		run = scsi_trace_cdb(r, bg.cdb, bg.mode & SCSI_TRACE_ALLOW_WRITE) &&
+			r->lba + r->blocks <= bg.capacity;
+		bg.len = bg.cdb[0] == 0x28 || bg.cdb[0] == 0x2a ? r->blocks * bg.blocksize : 0;
+		scsi_hal_irq_enable();
+		if (run)
+			return 1;
+	}
+	return 0;
+}
+
+static int scsi_trace_replay_due(void)
+{
+	struct scsi_trace_rec *r = scsi_trace_ring + bg.i;
+	int due = 1;
+
+	scsi_hal_irq_disable();
+	if (scsi_trace_state == bg.mode) {
+		if ((bg.mode & SCSI_TRACE_MODE) == SCSI_TRACE_REPLAY_FAST)
+			r->arrival_us = micros() - bg.start;
+		else
+			due = (int32_t)(micros() - bg.start - r->arrival_us) >= 0;
+	}
+	scsi_hal_irq_enable();
+	return due;
+}
+
+static void scsi_trace_replay_cmd(void)
+{
+	struct scsi_trace_rec *r = scsi_trace_ring + bg.i++;
+	int status;
+
+	if (scsi_trace_state != bg.mode)
+		return;
+	status = scsi_selftest_cmd(bg.cdb, bg.len, NULL);
+	scsi_hal_irq_disable();
+	if (scsi_trace_state == bg.mode) {
+		r->status = status;
+		r->done_us = micros() - bg.start;
+	}
+	scsi_hal_irq_enable();
+}
+
+static int scsi_background_task(struct scsi_task *task)
+{
+	/* its connections wait for the bus, not for the session that has it */
+	if (bus_session)
+		return 0;
+	TASK_BEGIN(task);
+	for (;;) {
+		TASK_WAIT_UNTIL(task, selftest_pending ||
+				scsi_trace_state >= SCSI_TRACE_REPLAY);
+		if (selftest_pending) {
+			if (scsi_selftest_begin()) {
+				scsi_stats.selftest_state = SCSI_SELFTEST_FAILED;
+				selftest_pending = 0;
+				continue;
+			}
+			for (bg.step = 0; bg.step < bg.steps; bg.step++) {
+				scsi_selftest_step_start();
+				while (scsi_selftest_step_cmd()) {
+					if (scsi_task_slice_over())
+						TASK_YIELD(task);
+				}
+				scsi_selftest_step_done();
+			}
+			scsi_stats.selftest_state = SCSI_SELFTEST_DONE;
+			selftest_pending = 0;
+			continue;
+		}
+
+		scsi_trace_replay_begin();
+		while (scsi_trace_replay_next()) {
+			TASK_WAIT_UNTIL(task, scsi_trace_replay_due());
+			scsi_trace_replay_cmd();
+			if (scsi_task_slice_over())
+				TASK_YIELD(task);
+		}
+		scsi_hal_irq_disable();
+		if (scsi_trace_state == bg.mode)
+			scsi_trace_state = SCSI_TRACE_OFF;
+		scsi_hal_irq_enable();
+	}
+	TASK_END(task);
+}
+
+/* when the main loop woke up with a target reselecting us */
+static uint32_t wake_cycles;
+static int resel_wake;
+
+static void scsi_resel_latency(void)
+{
+	uint32_t ns = (uint64_t)(scsi_hal_cycles() - wake_cycles) * 1000000000 /
+		scsi_hal_cpu_hz();
+
+	scsi_stats.resel_wakes++;
+	scsi_stats.resel_latency_ns = ns;
+	if (ns > scsi_stats.resel_latency_max_ns)
+		scsi_stats.resel_latency_max_ns = ns;
+}
+
+/* the messages that name the command, what a disconnect costs on top */
+static void scsi_resel_cost(uint32_t start)
+{
+	uint32_t ns = (uint64_t)(scsi_hal_cycles() - start) * 1000000000 /
+		scsi_hal_cpu_hz();
+
+	sctx.resel_ns = sctx.resel_ns ? (sctx.resel_ns * 7 + ns) / 8 : ns;
+	scsi_stats.resel_ns = sctx.resel_ns;
+}
+
+/*
+ * 1 if a target reselected us, its session has the bus then. One that
+ * drives no ID of its own or more than one isn't answered, it times out
+ * without BSY from us and the error is counted once.
+ */
+static int scsi_check_reselection(void)
+{
+	static int rejected;
+	struct scsi_session *s;
+	int ret = 0;
+
+	if (!digitalReadFast(SELI_PIN) &&
+	    !digitalReadFast(IOI_PIN)) {
+		uint8_t ids = scsi_get_data();
+		uint8_t other = ids & ~sctx.hostidmsk;
+		if ((ids & sctx.hostidmsk) && (!other || (other & (other - 1)))) {
+			digitalWriteFast(BSYO_PIN, LOW);
+			if (!rejected) {
+				scsi_stats.resel_rejected++;
+				SCSI_DEBUG(SCSI_DEBUG_ERROR, "reselection with IDs %02x\n", ids);
+			}
+			rejected = 1;
+		} else if (ids & sctx.hostidmsk) {
+			uint32_t start = scsi_hal_cycles();
+
+			rejected = 0;
+			s = sessions + __builtin_ctz(other);
+			memset(s, 0, sizeof(*s));
+			s->c.xfer.id = s - sessions;
+			s->reselected = 1;
+			SCSI_DEBUG(SCSI_DEBUG_PHASE, "reselection from ID %d\n", s->c.xfer.id);
+			digitalWriteFast(BSYO_PIN, HIGH);
+			if (resel_wake)
+				scsi_resel_latency();
+			while(!digitalReadFast(SELI_PIN));
+			digitalWriteFast(BSYO_PIN, LOW);
+			delayNanoseconds(SCSI_BUS_SETTLE_DELAY);
+			if (!digitalReadFast(BSYI_PIN)) {
+				scsi_handle_phase(&s->c.xfer);
+				scsi_resel_cost(start);
+			}
+			s->c.xfer.session = 1;
+			bus_session = s;
+			ret = 1;
+		}
+	} else {
+		rejected = 0;
+	}
+	resel_wake = 0;
+	return ret;
+}
+
+/*
+ * Another device reset the bus. The targets dropped every command they
+ * had disconnected, end them towards the host instead of letting them
+ * time out there.
+ */
+static void scsi_bus_reset_seen(void)
+{
+	struct scsi_xfer xfer = { 0 };
+	int i;
+
+	SCSI_DEBUG(SCSI_DEBUG_ERROR, "bus reset\n");
+	scsi_stats.bus_resets++;
+	while (!digitalReadFast(RSTI_PIN));
+	/* and the release edge */
+	scsi_hal_bus_events();
+	scsi_resp_invalidate(-1);
+	/* the connected one went with the reset, its tag is ended below */
+	if (bus_session) {
+		scsi_flush_frame(&bus_session->c.xfer);
+		bus_session = NULL;
+		cmd_active = 0;
+		digitalWriteFast(LED_PIN, LOW);
+	}
+	for (i = 0; i < ARRAY_SIZE(scsi_tags); i++) {
+		if (!scsi_tags[i].valid || scsi_tags[i].queued)
+			continue;
+		xfer.tag = scsi_tags + i;
+		xfer.frame = scsi_tags[i].frame;
+		xfer.frame_din = scsi_tags[i].frame_din;
+		xfer.frame_pos = scsi_tags[i].frame_pos;
+		scsi_flush_frame(&xfer);
+		usb_status_hook(&xfer, 0x40);	/* TASK ABORTED, hosts retry */
+		scsi_free_tag(i);
+	}
+}
+
+static int usb_msc_busy(void)
+{
+	return rx_cmd_busy_list != LIST_END || cmd_head != cmd_tail ||
+		tm_waiting || status_head != status_tail || selftest_pending ||
+		scsi_trace_state >= SCSI_TRACE_REPLAY || bus_session;
+}
+
+/*
+ * An untagged command can't go to a LUN that still has one disconnected,
+ * the target would take it for an overlapped command. Commands for the
+ * other LUNs go ahead, the ones for its LUN stay in order behind it.
+ * Neither go to a target that holds its depth of our commands already,
+ * or is being held off after BUSY.
+ */
+static int scsi_cmd_waits(const struct scsi_cmd *c)
+{
+	struct scsi_target *t;
+	uint8_t m;
+
+	if (!sctx.scanned || c->xfer.lun >= sctx.luns || scsi_ramdisk_active())
+		return 0;
+	m = sctx.lun_map[c->xfer.lun];
+	t = sctx.target + (m >> 3);
+	if (t->disconnected >= t->depth)
+		return 1;
+	if (t->busy_us && (int32_t)(micros() - t->busy_until) < 0)
+		return 1;
+	return !!(t->untagged & (1 << (m & 7)));
+}
+
+/* BUSY or QUEUE FULL, back to the head of cmd_queue under its host LUN */
+static void scsi_requeue_cmd(struct scsi_cmd *c)
+{
+	struct scsi_tag *tag = c->xfer.tag;
+	int data_exp = c->xfer.data_exp;
+	int lun = scsi_host_lun(c->xfer.id, c->xfer.lun);
+
+	memset(&c->xfer, 0, sizeof(c->xfer));
+	c->xfer.tag = tag;
+	c->xfer.lun = lun;
+	c->xfer.data_exp = data_exp;
+	tag->queued = 1;
+	cmd_queue[--cmd_tail % SCSI_CMD_QUEUE] = *c;
+	scsi_stats.cmd_queued = cmd_head - cmd_tail;
+}
+
+/*
+ * Disconnect privilege, per command. A disconnect costs the DISCONNECT
+ * message, arbitration, reselection and the IDENTIFY and tag messages
+ * again, worth it only while someone else can use the bus meanwhile.
+ * Quick commands keep the bus. READ and WRITE keep it if the target is
+ * expected back within disconnect_us, or within the cost of a
+ * reselection while other commands are waiting for the bus. Long
+ * transfers are let go then, the target may have to refill its buffer
+ * halfway. A target with commands disconnected always gets it, it
+ * may answer BUSY to one that would hold the bus.
+ */
+#define SCSI_DISC_BLOCKS	128
+
+static int scsi_disconnect_policy(struct scsi_xfer *xfer)
+{
+	struct scsi_target *t = sctx.target + xfer->id;
+	int i, class = xfer->tag->cmd_class, others = cmd_head != cmd_tail;
+	uint32_t limit = scsi_tunables.disconnect_us;
+
+	/* it can't run before the ORDERED one, holding the bus meanwhile */
+	if (class == SCSI_CLASS_QUICK && !t->ordered)
+		return 0;
+	if (class == SCSI_CLASS_OTHER || t->disconnected)
+		return 1;
+	for (i = 0; i < ARRAY_SIZE(sctx.target); i++)
+		others |= sctx.target[i].disconnected;
+	if (others) {
+		if (scsi_cmd_blocks(xfer->cdb) > SCSI_DISC_BLOCKS)
+			return 1;
+		limit = scsi_resel_ns() / 1000;
+	}
+	return t->access_us[class] > limit;
+}
+
+/*
+ * A queued command could go to its target now, or a target other than
+ * the one on the bus may want to reselect.
+ */
+static int scsi_bus_wanted(int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sctx.target); i++)
+		if (i != id && sctx.target[i].disconnected)
+			return 1;
+	for (i = cmd_tail; i != cmd_head; i++)
+		if (!scsi_cmd_waits(cmd_queue + i % SCSI_CMD_QUEUE))
+			return 1;
+	return 0;
+}
+
+/*
+ * A target without tagged queueing runs its commands in the order it
+ * gets them, random I/O becomes a seek for each one. Of the READs and
+ * WRITEs queued for one of its LUNs the next one goes by C-LOOK: the
+ * lowest LBA at or past where the last one ended, the lowest of all
+ * once there is none. The oldest one goes once it waited elevator_us.
+ * Nothing passes any other command, like SYNCHRONIZE CACHE, one that
+ * isn't SIMPLE or a write it overlaps.
+ */
+static int scsi_cmd_media(const struct scsi_cmd *c)
+{
+	return scsi_cmd_class(c->cdb[0]) <= SCSI_CLASS_WRITE &&
+		c->xfer.tag->task_attr == SCSI_ATTR_SIMPLE;
+}
+
+/* b may go ahead of a, both media commands for the same LUN */
+static int scsi_cmd_passes(const struct scsi_cmd *a, const struct scsi_cmd *b)
+{
+	uint32_t alba = scsi_cmd_lba(a->cdb), blba = scsi_cmd_lba(b->cdb);
+
+	if (scsi_cmd_class(a->cdb[0]) == SCSI_CLASS_READ &&
+	    scsi_cmd_class(b->cdb[0]) == SCSI_CLASS_READ)
+		return 1;
+	return alba + scsi_cmd_blocks(a->cdb) <= blba ||
+		blba + scsi_cmd_blocks(b->cdb) <= alba;
+}
+
+static uint32_t scsi_seek(uint32_t from, uint32_t to)
+{
+	return from > to ? from - to : to - from;
+}
+
+static unsigned int scsi_elevator(unsigned int first)
+{
+	const struct scsi_cmd *c = cmd_queue + first % SCSI_CMD_QUEUE, *o;
+	unsigned int i, j, best = first;
+	uint32_t head, lba, dist, best_dist;
+	struct scsi_target *t;
+	uint8_t m;
+
+	if (!sctx.scanned || c->xfer.lun >= sctx.luns || scsi_ramdisk_active() ||
+	    !scsi_cmd_media(c))
+		return first;
+	m = sctx.lun_map[c->xfer.lun];
+	t = sctx.target + (m >> 3);
+	if (t->support_tags)
+		return first;
+	head = t->head_lba[m & 7];
+	best_dist = scsi_cmd_lba(c->cdb) - head;
+	if (!scsi_tunables.elevator_us)
+		goto out;
+	if (micros() - c->queued_us >= scsi_tunables.elevator_us) {
+		scsi_stats.elevator_expired++;
+		goto out;
+	}
+	for (i = first + 1; i != cmd_head; i++) {
+		o = cmd_queue + i % SCSI_CMD_QUEUE;
+		if (o->xfer.lun != c->xfer.lun)
+			continue;
+		if (!scsi_cmd_media(o))
+			break;
+		for (j = first; j != i; j++)
+			if (cmd_queue[j % SCSI_CMD_QUEUE].xfer.lun == c->xfer.lun &&
+			    !scsi_cmd_passes(cmd_queue + j % SCSI_CMD_QUEUE, o))
+				break;
+		/* past the head first, unsigned */
+		dist = scsi_cmd_lba(o->cdb) - head;
+		if (j == i && dist < best_dist) {
+			best = i;
+			best_dist = dist;
+		}
+	}
+	if (best != first) {
+		lba = scsi_cmd_lba(cmd_queue[best % SCSI_CMD_QUEUE].cdb);
+		scsi_stats.elevator_reorders++;
+		scsi_stats.elevator_saved += (int64_t)scsi_seek(head, scsi_cmd_lba(c->cdb)) -
+			scsi_seek(head, lba);
+	}
+out:
+	c = cmd_queue + best % SCSI_CMD_QUEUE;
+	t->head_lba[m & 7] = scsi_cmd_lba(c->cdb) + scsi_cmd_blocks(c->cdb);
+	return best;
+}
+
+static int scsi_next_cmd(struct scsi_cmd *c)
+{
+	unsigned int i;
+
+	for (i = cmd_tail; i != cmd_head; i++)
+		if (!scsi_cmd_waits(cmd_queue + i % SCSI_CMD_QUEUE))
+			break;
+	if (i == cmd_head)
+		return 0;
+	i = scsi_elevator(i);
+	*c = cmd_queue[i % SCSI_CMD_QUEUE];
+	scsi_unqueue_cmd(i);
+	return 1;
+}
+
+/* what do_xfer() does after the connection, for a host command */
+static void scsi_cmd_done(struct scsi_cmd *c)
+{
+	if (!c->xfer.disconnect_ok) {
+		scsi_stats.unexpected_disconnects++;
+		SCSI_DEBUG(SCSI_DEBUG_ERROR, "%lx: unexpected disconnect\n", c->xfer.tag->host_tag);
+	}
+	if (c->xfer.requeue)
+		scsi_requeue_cmd(c);
+	cmd_active = 0;
+}
+
+/* selection for a host command, 1 if the target doesn't answer */
+static int scsi_session_start(struct scsi_cmd *c)
+{
+	struct scsi_xfer *xfer = &c->xfer;
+	struct scsi_session *s;
+
+	xfer->retry = 0;
+	xfer->data_act = 0;
+	xfer->session = 1;
+	scsi_setup_msgs(xfer);
+	digitalWriteFast(LED_PIN, HIGH);
+	if (scsi_wait_bus_free() || scsi_select(xfer, xfer->id)) {
+		digitalWriteFast(LED_PIN, LOW);
+		return 1;
+	}
+	s = sessions + xfer->id;
+	s->c = *c;
+	s->c.xfer.cdb = s->c.cdb;
+	s->reselected = 0;
+	bus_session = s;
+	return 0;
+}
+
+/*
+ * The target let go of BSY. What is left to do may take the bus again,
+ * auto sense or a retry, and a reselection may come in while we wait
+ * for it: the session goes first and the rest works on a copy.
+ */
+static void scsi_session_end(struct scsi_session *s)
+{
+	struct scsi_cmd c = s->c;
+	struct scsi_xfer *xfer = &c.xfer;
+	int reselected = s->reselected;
+
+	xfer->cdb = c.cdb;
+	bus_session = NULL;
+	scsi_flush_frame(xfer);
+	if (xfer->sense)
+		scsi_auto_sense(xfer);
+	if (!xfer->disconnect_ok && xfer->tag && (reselected || !xfer->requeue))
+		scsi_free_tag(xfer->tag->tag);
+	digitalWriteFast(LED_PIN, LOW);
+	SCSI_DEBUG(SCSI_DEBUG_PHASE, "disconnected\n");
+	if (reselected)
+		return;
+	if (xfer->retry && !scsi_session_start(&c))
+		return;
+	scsi_cmd_done(&c);
+}
+
+/*
+ * The session that has the bus, a phase at a time until the target
+ * holds REQ or USB has no frame for it, see scsi_xfer_wait(), or the
+ * slice is over. The main loop comes back and it goes on from there,
+ * in the middle of a data phase too. Nothing else gets the bus
+ * meanwhile, the bridge just doesn't sit in a loop with it.
+ */
+static void scsi_session_run(void)
+{
+	struct scsi_xfer *xfer;
+
+	while (bus_session) {
+		xfer = &bus_session->c.xfer;
+		if (digitalReadFast(BSYI_PIN)) {
+			scsi_session_end(bus_session);
+			continue;
+		}
+		scsi_handle_phase(xfer);
+		if (xfer->suspended) {
+			xfer->suspended = 0;
+			scsi_stats.session_waits++;
+			break;
+		}
+		if (scsi_task_slice_over())
+			break;
+	}
+}
+
+/* a reselection while a connection of our own waits for the bus */
+static void scsi_session_sync(void)
+{
+	for (;;) {
+		scsi_session_run();
+		if (!bus_session)
+			break;
+		scsi_task_yield();
+	}
+}
+
+static int scsi_session_task(struct scsi_task *task)
+{
+	struct scsi_cmd c;
+	int busy = 0;
+
+	/* the connected one first, nothing else gets the bus until it lets go */
+	scsi_session_run();
+	if (bus_session)
+		return 1;
+	/* a reselecting target is answered before the next command */
+	if (scsi_check_reselection())
+		scsi_session_run();
+	if (bus_session)
+		return 1;
+	busy = scsi_task_mgmt();
+	while (scsi_next_cmd(&c)) {
+		c.xfer.cdb = c.cdb;
+		c.xfer.tag->queued = 0;
+		cmd_active = 1;
+		scsi_execute(&c);
+		busy = 1;
+		if (bus_session)
+			scsi_session_run();
+		else
+			cmd_active = 0;
+		if (bus_session)
+			break;
+		/* task management goes ahead of the commands it may be about */
+		if (scsi_task_slice_over() || tm_waiting)
+			break;
+	}
+	return busy;
+}
+
+/* the clock changes between bus connections only */
+static int scsi_stats_task(struct scsi_task *task)
+{
+	if (bus_session)
+		return 0;
+	scsi_clock_poll(usb_msc_busy());
+	return 0;
+}
+
+/* session first, a reselecting target is answered before the clock is raised */
+static struct scsi_task scsi_tasks[] = {
+	{ .id = SCSI_TASK_SESSION, .flags = SCSI_TASK_BUS, .fn = scsi_session_task },
+	{ .id = SCSI_TASK_INTAKE, .fn = scsi_intake_task },
+	{ .id = SCSI_TASK_STATUS, .fn = scsi_status_task },
+	{ .id = SCSI_TASK_BACKGROUND, .flags = SCSI_TASK_BUS, .fn = scsi_background_task },
+	{ .id = SCSI_TASK_STATS, .flags = SCSI_TASK_BUS, .fn = scsi_stats_task },
+};
+
+static void scsi_tasks_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(scsi_tasks); i++)
+		scsi_task_add(scsi_tasks + i);
+}
+
+void usb_msc_poll(void)
+{
+	scsi_apply_tunables();
+	scsi_task_run();
+}
+
+/*
+ * Sleep until there is something to do instead of polling: a command
+ * from the host, a disconnected target coming back or the 1ms tick for
+ * the clock governor. Reselection asserts SEL with I/O, the falling
+ * SEL edge wakes us up and the next usb_msc_poll() answers it first.
+ * The target gives up after the 250ms selection timeout, the wake to
+ * BSY time goes to resel_latency_ns.
+ */
+void usb_msc_idle(void)
+{
+	uint32_t start = micros();
+	int events, slept = 0;
+
+	scsi_hal_irq_disable();
+	/* old SEL edges are our own selections, a new one stops the WFI */
+	events = scsi_hal_bus_events();
+	if (!(events & SCSI_HAL_EVENT_RST) && !usb_msc_busy() &&
+	    digitalReadFast(SELI_PIN)) {
+		scsi_hal_wait_event();
+		wake_cycles = scsi_hal_cycles();
+		resel_wake = !digitalReadFast(SELI_PIN) && !digitalReadFast(IOI_PIN);
+		slept = 1;
+	}
+	scsi_hal_irq_enable();
+
+	if (slept) {
+		scsi_stats.idle_sleeps++;
+		scsi_stats.idle_us += micros() - start;
+	}
+	if (events & SCSI_HAL_EVENT_RST)
+		scsi_bus_reset_seen();
+}
+
+void usb_msc_loop(void)
+{
+	while (1) {
+		usb_msc_poll();
+		usb_msc_idle();
 	}
 }
 
@@ -35,6 +35,16 @@ struct uas_response_iu {
 	uint8_t response_code;
 } __attribute__((__packed__));
 
+struct uas_task_mgmt_iu {
+	uint8_t iu_id;
+	uint8_t rsvd1;
+	uint16_t tag;
+	uint8_t function;
+	uint8_t rsvd5;
+	uint16_t task_tag;	/* of the task it is about */
+	uint8_t lun[8];
+} __attribute__((__packed__));
+
 struct uas_sense_iu {
 	uint8_t iu_id;
 	uint8_t rsvd1;
@@ -55,10 +65,23 @@ typedef enum {
 	IU_ID_WRITE_READY = 7,
 } uas_iu_t;
 
+/* task management functions and the response codes for them */
+#define UAS_TMF_ABORT_TASK	0x01
+#define UAS_TMF_ABORT_TASK_SET	0x02
+#define UAS_TMF_LUN_RESET	0x08
+#define UAS_TMF_QUERY_TASK	0x80
+
+#define UAS_RC_COMPLETE		0x00
+#define UAS_RC_NOT_SUPPORTED	0x04
+#define UAS_RC_FAILED		0x05
+#define UAS_RC_SUCCEEDED	0x08
+#define UAS_RC_INCORRECT_LUN	0x09
+
 struct scsi_xfer {
 	struct scsi_tag *tag;
 	uint8_t id;
 	uint8_t *cdb;
+	int cdbpos;
 	uint8_t status;
 	uint8_t outmsgs[16];
 	int outmsgcnt;
@@ -66,19 +89,39 @@ struct scsi_xfer {
 	uint8_t inmsgs[16];
 	int inmsgcnt;
 	int lun;
-	int abortxfr:1;
-	int retry:1;
-	int disconnect_ok:1;
-	int data_act;
+	unsigned int abortxfr:1;
+	unsigned int retry:1;
+	unsigned int disconnect_ok:1;
+	unsigned int selftest:1;
+	unsigned int frame_din:1;
+	unsigned int stalled:1;		/* ATN up, no USB frame for the next byte */
+	unsigned int stall_din:1;
+	unsigned int requeue:1;		/* BUSY or QUEUE FULL, see scsi_queue_status() */
+	unsigned int sense:1;		/* CHECK CONDITION, see scsi_auto_sense() */
+	unsigned int session:1;		/* doesn't wait in a phase, see scsi_session_run() */
+	unsigned int suspended:1;	/* left the phase to wait in the main loop */
+	unsigned int frame_wait:1;	/* for a USB frame, counted once */
+	uint32_t stall_us;	/* when scsi_next_frame() raised ATN */
+	int data_act;		/* the data pointer */
 	int data_exp;
+	int data_done;		/* to or from USB, past data_act after RESTORE POINTERS */
+	struct transfer_struct *frame;	/* the one a data phase didn't finish */
+	int frame_pos;
+	int frame_len;
 };
 
 #define SCSI_MSG_COMPLETE 0x00
+#define SCSI_MSG_SAVE_POINTERS 0x02
+#define SCSI_MSG_RESTORE_POINTERS 0x03
 #define SCSI_MSG_DISCONNECT 0x04
 #define SCSI_MSG_ABORT 0x06
 #define SCSI_MSG_REJECT 0x07
 #define SCSI_MSG_NOP 0x08
+#define SCSI_MSG_BUS_DEVICE_RESET 0x0c
+#define SCSI_MSG_ABORT_TAG 0x0d
 #define SCSI_MSG_SIMPLE_TAG 0x20
+#define SCSI_MSG_HEAD_TAG 0x21
+#define SCSI_MSG_ORDERED_TAG 0x22
 #define SCSI_MSG_IDENTIFY 0x80
 
 #ifdef __cplusplus
@@ -87,6 +130,9 @@ extern "C" {
 
 void scsi_initialize(void);
 void scsi_reset(void);
+void usb_msc_poll(void);
+void usb_msc_idle(void);
+void usb_msc_loop(void);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,92 @@
+#include "scsi_clock.h"
+#include "scsi_stats.h"
+#include "scsi_hal.h"
+
+/* the die temperature is read this often */
+#define TEMP_INTERVAL_MS	100
+/* and the throttle lifts this far below the limit */
+#define TEMP_HYSTERESIS		5
+
+static uint32_t nominal_hz;
+static uint32_t requested_hz;
+static int level = SCSI_CLOCK_NOMINAL;
+static int throttled;
+static uint32_t last_busy, last_account, last_temp;
+
+void scsi_clock_init(void)
+{
+	nominal_hz = requested_hz = scsi_hal_cpu_hz();
+	scsi_stats.clock_hz[SCSI_CLOCK_NOMINAL] = nominal_hz;
+	last_busy = last_account = last_temp = millis();
+}
+
+uint32_t scsi_clock_nominal_hz(void)
+{
+	return nominal_hz;
+}
+
+/* cycles counted at the current clock, as if they ran at the nominal one */
+uint32_t scsi_clock_nominal(uint32_t cycles)
+{
+	uint32_t hz = scsi_hal_cpu_hz();
+
+	if (hz == nominal_hz)
+		return cycles;
+	return (uint64_t)cycles * (nominal_hz / 1000000) / (hz / 1000000);
+}
+
+static uint32_t level_hz(int l)
+{
+	switch (l) {
+	case SCSI_CLOCK_BOOST:
+		return scsi_tunables.clock_boost * 1000000;
+	case SCSI_CLOCK_IDLE:
+		return scsi_tunables.clock_idle * 1000000;
+	}
+	return nominal_hz;
+}
+
+static void check_temp(uint32_t now)
+{
+	int temp;
+
+	if (now - last_temp < TEMP_INTERVAL_MS)
+		return;
+	last_temp = now;
+	temp = scsi_hal_temp();
+	scsi_stats.die_temp = temp;
+	if (!throttled && temp >= (int)scsi_tunables.clock_temp_limit) {
+		throttled = 1;
+		scsi_stats.clock_throttles++;
+	} else if (throttled && temp < (int)scsi_tunables.clock_temp_limit - TEMP_HYSTERESIS) {
+		throttled = 0;
+	}
+}
+
+void scsi_clock_poll(int busy)
+{
+	uint32_t now = millis(), hz;
+	int l;
+
+	if (busy || scsi_stats.tags_in_use)
+		last_busy = now;
+	check_temp(now);
+
+	scsi_stats.clock_ms[level] += now - last_account;
+	last_account = now;
+
+	l = now - last_busy >= scsi_tunables.clock_idle_ms ? SCSI_CLOCK_IDLE : SCSI_CLOCK_BOOST;
+	hz = level_hz(l);
+	if (throttled && hz > nominal_hz) {
+		l = SCSI_CLOCK_NOMINAL;
+		hz = nominal_hz;
+	}
+	level = l;
+	/* set_arm_clock() may round, compare with what was asked for */
+	if (hz != requested_hz) {
+		requested_hz = hz;
+		scsi_hal_set_cpu_hz(hz);
+		scsi_stats.clock_changes++;
+	}
+	scsi_stats.clock_hz[l] = scsi_hal_cpu_hz();
+}
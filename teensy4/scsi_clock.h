@@ -0,0 +1,31 @@
+#ifndef SCSI_CLOCK_H
+#define SCSI_CLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Load-aware ARM clock. The handshake loops are CPU bound, so the core
+ * runs at clock_boost while commands are coming in, drops to
+ * clock_idle after clock_idle_ms without any, and stays at the
+ * nominal F_CPU while the die is at or above clock_temp_limit.
+ *
+ * The clock only changes from the main loop between commands, never
+ * during a bus phase. delayNanoseconds() and micros() follow
+ * F_CPU_ACTUAL, which set_arm_clock() updates, so the bus delays stay
+ * right at every clock.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void scsi_clock_init(void);
+void scsi_clock_poll(int busy);
+uint32_t scsi_clock_nominal_hz(void);
+uint32_t scsi_clock_nominal(uint32_t cycles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
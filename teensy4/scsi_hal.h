@@ -0,0 +1,107 @@
+#ifndef SCSI_HAL_H
+#define SCSI_HAL_H
+
+/*
+ * Hardware access used by the SCSI engine. Pins and delays go through
+ * the usual Arduino calls (digitalReadFast(), delayNanoseconds(),
+ * millis(), ...), the raw register accesses are wrapped here. SCSI_SIM
+ * builds get all of it, including the Arduino calls and the USB frame
+ * API from usb_dev.h, from the bus and host models in sim/.
+ */
+#ifdef SCSI_SIM
+#include "sim_hal.h"
+#else
+#include <core_pins.h>
+#include "wiring.h"
+#include <Arduino.h>
+#include "scsi_pins.h"
+
+/* DB0-7 are read on GPIO6 16-23 and driven on GPIO6 24-31, active low */
+static inline uint8_t scsi_hal_data_read(void)
+{
+	return ~(GPIO6_PSR >> 16);
+}
+
+static inline void scsi_hal_data_write(uint8_t data)
+{
+	GPIO6_DR_CLEAR |= ~data << 24;
+	GPIO6_DR_SET |= data << 24;
+}
+
+static inline void scsi_hal_data_release(void)
+{
+	GPIO6_DR_CLEAR |= (0xff << 24);
+}
+
+/* I/O, C/D and MSG inputs are GPIO7 bits 0-2 */
+static inline int scsi_hal_phase_read(void)
+{
+	return GPIO7_PSR & 7;
+}
+
+#define scsi_hal_cycles()	ARM_DWT_CYCCNT
+#define scsi_hal_cpu_hz()	F_CPU_ACTUAL
+
+uint32_t set_arm_clock(uint32_t frequency);	/* clockspeed.c */
+#define scsi_hal_set_cpu_hz(hz)	set_arm_clock(hz)
+#define scsi_hal_temp()		((int)tempmonGetTemp())
+
+#define scsi_hal_irq_disable()	__disable_irq()
+#define scsi_hal_irq_enable()	__enable_irq()
+
+/*
+ * Falling SEL and both RST edges latch in GPIO7/GPIO8 ISR whether the
+ * interrupt is masked or not. It is only unmasked around the WFI in
+ * scsi_hal_wait_event(), which runs with interrupts off, so the core's
+ * handler never sees an edge and scsi_hal_bus_events() collects them.
+ */
+#define SCSI_HAL_PIN_MASK(pin)	SCSI_HAL_PIN_MASK_(pin)
+#define SCSI_HAL_PIN_MASK_(pin)	CORE_PIN##pin##_BITMASK
+
+#define SCSI_HAL_EVENT_SEL	0x01
+#define SCSI_HAL_EVENT_RST	0x02
+
+static inline void scsi_hal_bus_irq(void)
+{
+}
+
+static inline void scsi_hal_bus_events_init(void)
+{
+	/* sets up ICR/EDGE_SEL, the GPIO6789 vector and the NVIC */
+	attachInterrupt(SELI_PIN, scsi_hal_bus_irq, FALLING);
+	attachInterrupt(RSTI_PIN, scsi_hal_bus_irq, CHANGE);
+	GPIO7_IMR &= ~SCSI_HAL_PIN_MASK(SELI_PIN);
+	GPIO8_IMR &= ~SCSI_HAL_PIN_MASK(RSTI_PIN);
+}
+
+static inline int scsi_hal_bus_events(void)
+{
+	int events = 0;
+
+	if (GPIO7_ISR & SCSI_HAL_PIN_MASK(SELI_PIN)) {
+		GPIO7_ISR = SCSI_HAL_PIN_MASK(SELI_PIN);
+		events |= SCSI_HAL_EVENT_SEL;
+	}
+	if (GPIO8_ISR & SCSI_HAL_PIN_MASK(RSTI_PIN)) {
+		GPIO8_ISR = SCSI_HAL_PIN_MASK(RSTI_PIN);
+		events |= SCSI_HAL_EVENT_RST;
+	}
+	return events;
+}
+
+/*
+ * Sleep until an interrupt is pending: USB, the 1ms systick or a
+ * latched SEL/RST edge. Called with interrupts disabled, whatever woke
+ * us up runs once they are enabled again.
+ */
+static inline void scsi_hal_wait_event(void)
+{
+	GPIO7_IMR |= SCSI_HAL_PIN_MASK(SELI_PIN);
+	GPIO8_IMR |= SCSI_HAL_PIN_MASK(RSTI_PIN);
+	asm volatile("dsb\n\twfi" ::: "memory");
+	GPIO7_IMR &= ~SCSI_HAL_PIN_MASK(SELI_PIN);
+	GPIO8_IMR &= ~SCSI_HAL_PIN_MASK(RSTI_PIN);
+}
+#endif
+
+#endif
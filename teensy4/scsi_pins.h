@@ -0,0 +1,43 @@
+#ifndef SCSI_PINS_H
+#define SCSI_PINS_H
+
+#define BSYI_PIN 2
+#define BSYO_PIN 3
+#define SELI_PIN 6
+#define CDO_PIN 7
+#define IOO_PIN 8
+#define REQI_PIN 9
+#define IOI_PIN 10
+#define MSGI_PIN 11
+#define CDI_PIN 12
+#define ACKO_PIN 24
+#define REQO_PIN 25
+#define DB6O_PIN 26
+#define DB7O_PIN 27
+#define RSTI_PIN 28
+#define DBPI_PIN 30
+#define DBPO_PIN 31
+#define ACKI_PIN 32
+#define SELO_PIN 33
+#define ATNI_PIN 34
+#define MSGO_PIN 35
+#define RSTO_PIN 36
+#define ATNO_PIN 37
+#define DB4O_PIN 38
+#define DB5O_PIN 39
+#define DB4I_PIN 40
+#define DB5I_PIN 41
+#define DB2I_PIN 14
+#define DB3I_PIN 15
+#define DB7I_PIN 16
+#define DB6I_PIN 17
+#define DB1I_PIN 18
+#define DB0I_PIN 19
+#define DB2O_PIN 20
+#define DB3O_PIN 21
+#define DB0O_PIN 22
+#define DB1O_PIN 23
+
+#define LED_PIN 13
+
+#endif
@@ -0,0 +1,227 @@
+#include <string.h>
+#include "scsi_ramdisk.h"
+#include "scsi_stats.h"
+#include "scsi_hal.h"
+
+/* set by startup.c, in MB */
+extern uint8_t external_psram_size;
+
+EXTMEM static uint8_t ramdisk_psram[SCSI_RAMDISK_PSRAM_SIZE] __attribute__((aligned(32)));
+static uint8_t ramdisk_dtcm[SCSI_RAMDISK_DTCM_SIZE] __attribute__((aligned(32)));
+
+static uint8_t *ramdisk;
+static uint32_t ramdisk_size;
+static uint32_t was_active;
+static int attention;
+static uint8_t sense[18];
+static uint8_t resp[36];
+
+static const uint8_t inquiry_data[36] = {
+	0x00,			/* direct access */
+	0x00,
+	0x05,			/* SPC-3 */
+	0x02,
+	sizeof(inquiry_data) - 5,
+	0x00,
+	0x00,
+	0x02,			/* CmdQue */
+	'T', 'E', 'E', 'N', 'S', 'Y', ' ', ' ',
+	'R', 'A', 'M', ' ', 'D', 'I', 'S', 'K',
+	' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+	'1', '.', '0', ' ',
+};
+
+static void ramdisk_init(void)
+{
+	if (external_psram_size * 1024 * 1024 >= SCSI_RAMDISK_PSRAM_SIZE) {
+		ramdisk = ramdisk_psram;
+		ramdisk_size = sizeof(ramdisk_psram);
+	} else {
+		ramdisk = ramdisk_dtcm;
+		ramdisk_size = sizeof(ramdisk_dtcm);
+	}
+	memset(ramdisk, 0, ramdisk_size);
+}
+
+/* switching it on looks like a medium change to the host */
+int scsi_ramdisk_active(void)
+{
+	uint32_t active = scsi_tunables.ramdisk;
+
+	if (active && !was_active) {
+		if (!ramdisk)
+			ramdisk_init();
+		attention = 1;
+	}
+	was_active = active;
+	return active;
+}
+
+uint32_t scsi_ramdisk_blocks(void)
+{
+	return ramdisk_size / SCSI_RAMDISK_BLOCKSIZE;
+}
+
+static void check_condition(struct scsi_ramdisk_cmd *c, int key, int asc, int ascq)
+{
+	memset(sense, 0, sizeof(sense));
+	sense[0] = 0x70;
+	sense[2] = key;
+	sense[7] = sizeof(sense) - 8;
+	sense[12] = asc;
+	sense[13] = ascq;
+	c->data = NULL;
+	c->len = 0;
+	c->status = 0x02;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* response data of len bytes, cut to the allocation length */
+static void respond(struct scsi_ramdisk_cmd *c, uint32_t len, uint32_t alloc)
+{
+	c->data = resp;
+	c->len = len < alloc ? len : alloc;
+}
+
+static void mode_sense(struct scsi_ramdisk_cmd *c, const uint8_t *cdb, int ten)
+{
+	int page = cdb[2] & 0x3f, hdr = ten ? 8 : 4, len = hdr;
+
+	memset(resp, 0, sizeof(resp));
+	if (page == 0x08 || page == 0x3f) {
+		/* caching: no write cache, nothing to flush */
+		resp[len] = 0x08;
+		resp[len + 1] = 0x12;
+		len += 20;
+	} else if (page) {
+		check_condition(c, 0x05, 0x24, 0x00);
+		return;
+	}
+	if (ten) {
+		resp[1] = len - 2;
+		respond(c, len, (cdb[7] << 8) | cdb[8]);
+	} else {
+		resp[0] = len - 1;
+		respond(c, len, cdb[4]);
+	}
+}
+
+static void rw(struct scsi_ramdisk_cmd *c, uint32_t lba, uint32_t blocks, int din)
+{
+	c->din = din;
+	if (lba >= scsi_ramdisk_blocks() || blocks > scsi_ramdisk_blocks() - lba) {
+		check_condition(c, 0x05, 0x21, 0x00);
+		return;
+	}
+	c->data = ramdisk + lba * SCSI_RAMDISK_BLOCKSIZE;
+	c->len = blocks * SCSI_RAMDISK_BLOCKSIZE;
+}
+
+void scsi_ramdisk_setup(const uint8_t *cdb, struct scsi_ramdisk_cmd *c)
+{
+	uint32_t blocks = scsi_ramdisk_blocks();
+
+	c->data = NULL;
+	c->len = 0;
+	c->din = 1;
+	c->status = 0;
+
+	if (attention && cdb[0] != 0x12 && cdb[0] != 0x03 && cdb[0] != 0xa0) {
+		attention = 0;
+		check_condition(c, 0x06, 0x28, 0x00);
+		return;
+	}
+
+	switch (cdb[0]) {
+	case 0x00: // TEST UNIT READY
+	case 0x1b: // START STOP UNIT
+	case 0x1e: // PREVENT ALLOW MEDIUM REMOVAL
+	case 0x2f: // VERIFY(10)
+	case 0x35: // SYNCHRONIZE CACHE(10)
+	case 0x91: // SYNCHRONIZE CACHE(16)
+		break;
+	case 0x03: // REQUEST SENSE
+		memcpy(resp, sense, sizeof(sense));
+		memset(sense, 0, sizeof(sense));
+		resp[0] = 0x70;
+		resp[7] = sizeof(sense) - 8;
+		respond(c, sizeof(sense), cdb[4]);
+		break;
+	case 0x12: // INQUIRY
+		memset(resp, 0, sizeof(resp));
+		if (!(cdb[1] & 1)) {
+			memcpy(resp, inquiry_data, sizeof(inquiry_data));
+		} else if (cdb[2] == 0x00) {
+			resp[3] = 2;
+			resp[5] = 0x80;
+		} else if (cdb[2] == 0x80) {
+			resp[1] = 0x80;
+			resp[3] = 8;
+			memcpy(resp + 4, "RAMDISK0", 8);
+		} else {
+			check_condition(c, 0x05, 0x24, 0x00);
+			break;
+		}
+		respond(c, cdb[1] & 1 ? resp[3] + 4 : sizeof(inquiry_data),
+			(cdb[3] << 8) | cdb[4]);
+		break;
+	case 0x1a: // MODE SENSE(6)
+		mode_sense(c, cdb, 0);
+		break;
+	case 0x5a: // MODE SENSE(10)
+		mode_sense(c, cdb, 1);
+		break;
+	case 0x25: // READ CAPACITY(10)
+		put_be32(resp, blocks - 1);
+		put_be32(resp + 4, SCSI_RAMDISK_BLOCKSIZE);
+		respond(c, 8, 8);
+		break;
+	case 0x9e: // SERVICE ACTION IN(16)
+		if ((cdb[1] & 0x1f) != 0x10) {
+			check_condition(c, 0x05, 0x24, 0x00);
+			break;
+		}
+		memset(resp, 0, 32);
+		put_be32(resp + 4, blocks - 1);
+		put_be32(resp + 8, SCSI_RAMDISK_BLOCKSIZE);
+		respond(c, 32, get_be32(cdb + 10));
+		break;
+	case 0xa0: // REPORT LUNS
+		memset(resp, 0, 16);
+		resp[3] = 8;
+		respond(c, 16, get_be32(cdb + 6));
+		break;
+	case 0x08: // READ(6)
+	case 0x0a: // WRITE(6)
+		rw(c, ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3],
+		   cdb[4] ? cdb[4] : 256, cdb[0] == 0x08);
+		break;
+	case 0x28: // READ(10)
+	case 0x2a: // WRITE(10)
+		rw(c, get_be32(cdb + 2), (cdb[7] << 8) | cdb[8], cdb[0] == 0x28);
+		break;
+	case 0x88: // READ(16)
+	case 0x8a: // WRITE(16)
+		if (get_be32(cdb + 2)) {
+			check_condition(c, 0x05, 0x21, 0x00);
+			break;
+		}
+		rw(c, get_be32(cdb + 6), get_be32(cdb + 10), cdb[0] == 0x88);
+		break;
+	default:
+		check_condition(c, 0x05, 0x20, 0x00);
+		break;
+	}
+}
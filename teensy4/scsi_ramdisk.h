@@ -0,0 +1,34 @@
+#ifndef SCSI_RAMDISK_H
+#define SCSI_RAMDISK_H
+
+#include <stdint.h>
+
+/*
+ * Virtual LUN 0 served from memory instead of the SCSI bus, to measure
+ * the USB side of the bridge on its own. Switched on with the ramdisk
+ * tunable, 8 MB in PSRAM when the board has it, DTCM otherwise.
+ */
+#define SCSI_RAMDISK_BLOCKSIZE	512
+#define SCSI_RAMDISK_PSRAM_SIZE	(8 * 1024 * 1024)
+#define SCSI_RAMDISK_DTCM_SIZE	(128 * 1024)
+
+struct scsi_ramdisk_cmd {
+	uint8_t *data;		/* DATA IN from or DATA OUT to here */
+	uint32_t len;
+	int din;
+	uint8_t status;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int scsi_ramdisk_active(void);
+uint32_t scsi_ramdisk_blocks(void);
+void scsi_ramdisk_setup(const uint8_t *cdb, struct scsi_ramdisk_cmd *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+#include <string.h>
+#include <stddef.h>
+#include "scsi_stats.h"
+#include "scsi_clock.h"
+#include "usb_dev.h"
+#include "scsi_hal.h"
+
+struct scsi_stats scsi_stats;
+
+volatile uint32_t scsi_trace_state;
+/* OCRAM, next to the 448K of USB frames, see SCSI_TRACE_RECORDS */
+DMAMEM struct scsi_trace_rec scsi_trace_ring[SCSI_TRACE_RECORDS];
+uint32_t scsi_trace_next;
+static uint32_t scsi_trace_start_us;
+
+struct scsi_tunables scsi_tunables = {
+	.hostid = 7,
+	.bus_settle_delay = 400,
+	.bus_clear_delay = 800,
+	.arbitration_delay = 2400,
+	.select_timeout = 250,
+	.clock_boost = 816,
+	.clock_idle = 150,
+	.clock_idle_ms = 100,
+	.clock_temp_limit = 80,
+	.task_slice_us = 500,
+	.disconnect_us = 500,
+	.stall_us = 250,
+	.elevator_us = 1000000,
+	.resp_cache = 1,
+};
+
+static const struct {
+	uint32_t *val;
+	uint32_t min;
+	uint32_t max;
+} scsi_tunable_table[SCSI_TUNABLE_MAX] = {
+	[SCSI_TUNABLE_HOSTID] = { &scsi_tunables.hostid, 0, 7 },
+	[SCSI_TUNABLE_BUS_SETTLE_DELAY] = { &scsi_tunables.bus_settle_delay, 100, 100000 },
+	[SCSI_TUNABLE_BUS_CLEAR_DELAY] = { &scsi_tunables.bus_clear_delay, 100, 100000 },
+	[SCSI_TUNABLE_ARBITRATION_DELAY] = { &scsi_tunables.arbitration_delay, 100, 100000 },
+	[SCSI_TUNABLE_SELECT_TIMEOUT] = { &scsi_tunables.select_timeout, 1, 10000 },
+	[SCSI_TUNABLE_RAMDISK] = { &scsi_tunables.ramdisk, 0, 1 },
+	[SCSI_TUNABLE_CLOCK_BOOST] = { &scsi_tunables.clock_boost, 24, 912 },
+	[SCSI_TUNABLE_CLOCK_IDLE] = { &scsi_tunables.clock_idle, 24, 912 },
+	[SCSI_TUNABLE_CLOCK_IDLE_MS] = { &scsi_tunables.clock_idle_ms, 1, 60000 },
+	[SCSI_TUNABLE_CLOCK_TEMP_LIMIT] = { &scsi_tunables.clock_temp_limit, 40, 88 },
+	[SCSI_TUNABLE_TASK_SLICE_US] = { &scsi_tunables.task_slice_us, 10, 100000 },
+	[SCSI_TUNABLE_DISCONNECT_US] = { &scsi_tunables.disconnect_us, 0, 10000000 },
+	[SCSI_TUNABLE_STALL_US] = { &scsi_tunables.stall_us, 0, 1000000 },
+	[SCSI_TUNABLE_ELEVATOR_US] = { &scsi_tunables.elevator_us, 0, 10000000 },
+	[SCSI_TUNABLE_RESP_CACHE] = { &scsi_tunables.resp_cache, 0, 1 },
+};
+
+int scsi_stats_read(void *buf, int len)
+{
+	scsi_stats.version = SCSI_STATS_VERSION;
+	scsi_stats.length = sizeof(scsi_stats);
+	scsi_stats.uptime_ms = millis();
+	scsi_stats.cpu_hz = scsi_clock_nominal_hz();
+	usb_fill_stats(&scsi_stats);
+
+	if (len > sizeof(scsi_stats))
+		len = sizeof(scsi_stats);
+	memcpy(buf, &scsi_stats, len);
+	return len;
+}
+
+void scsi_stats_reset(void)
+{
+	uint32_t tags_in_use = scsi_stats.tags_in_use;
+	uint32_t cmd_queued = scsi_stats.cmd_queued;
+	uint32_t luns = scsi_stats.luns;
+	uint8_t lun_map[SCSI_LUNS];
+	uint32_t queue_depth[8];
+
+	memcpy(lun_map, scsi_stats.lun_map, sizeof(lun_map));
+	memcpy(queue_depth, scsi_stats.queue_depth, sizeof(queue_depth));
+
+	/* self-test results are only replaced by the next run */
+	memset(&scsi_stats, 0, offsetof(struct scsi_stats, selftest_state));
+	memset(scsi_stats.clock_ms, 0, sizeof(scsi_stats.clock_ms));
+	scsi_stats.clock_changes = 0;
+	scsi_stats.clock_throttles = 0;
+	memset(&scsi_stats.idle_sleeps, 0,
+	       sizeof(scsi_stats) - offsetof(struct scsi_stats, idle_sleeps));
+	/* gauges survive a reset, only counters start over */
+	scsi_stats.tags_in_use = tags_in_use;
+	scsi_stats.tags_max = tags_in_use;
+	scsi_stats.cmd_queued = cmd_queued;
+	scsi_stats.cmd_queued_max = cmd_queued;
+	scsi_stats.luns = luns;
+	memcpy(scsi_stats.lun_map, lun_map, sizeof(lun_map));
+	memcpy(scsi_stats.queue_depth, queue_depth, sizeof(queue_depth));
+}
+
+/*
+ * SET_TUNABLE comes in the USB interrupt. The value waits here until
+ * the main loop takes it in scsi_apply_tunables(), so nothing it reads
+ * changes in the middle of a phase. GET_TUNABLE sees it right away.
+ */
+static volatile uint32_t tunables_pending;
+static uint32_t tunables_new[SCSI_TUNABLE_MAX];
+_Static_assert(SCSI_TUNABLE_MAX <= 32, "tunables_pending too small");
+
+int scsi_get_tunable(unsigned int id, uint32_t *val)
+{
+	if (id >= SCSI_TUNABLE_MAX)
+		return -1;
+	if (tunables_pending & (1 << id))
+		*val = tunables_new[id];
+	else
+		*val = *scsi_tunable_table[id].val;
+	return 0;
+}
+
+int scsi_set_tunable(unsigned int id, uint32_t val)
+{
+	if (id >= SCSI_TUNABLE_MAX)
+		return -1;
+	if (val < scsi_tunable_table[id].min || val > scsi_tunable_table[id].max)
+		return -1;
+	tunables_new[id] = val;
+	tunables_pending |= 1 << id;
+	return 0;
+}
+
+void scsi_apply_tunables(void)
+{
+	uint32_t pending;
+	int id;
+
+	if (!tunables_pending)
+		return;
+	scsi_hal_irq_disable();
+	pending = tunables_pending;
+	tunables_pending = 0;
+	for (id = 0; pending; id++, pending >>= 1)
+		if (pending & 1)
+			*scsi_tunable_table[id].val = tunables_new[id];
+	scsi_hal_irq_enable();
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * LBA and transfer length from where READ and WRITE keep them. TRACE
+ * and PUT_TRACE come in the USB interrupt, the state and the ring are
+ * read and written with it masked.
+ */
+void scsi_trace_cmd(struct scsi_trace_rec *r, const uint8_t *cdb, uint16_t tag)
+{
+	scsi_hal_irq_disable();
+	if (scsi_trace_state != SCSI_TRACE_RECORD) {
+		scsi_hal_irq_enable();
+		r->status = SCSI_TRACE_NOT_RUN;
+		return;
+	}
+	r->arrival_us = micros() - scsi_trace_start_us;
+	scsi_hal_irq_enable();
+	r->tag = tag;
+	r->opcode = cdb[0];
+	r->status = 0;
+	switch (cdb[0] >> 5) {
+	case 0:
+		r->lba = ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3];
+		r->blocks = cdb[4];
+		if (!r->blocks && (cdb[0] == 0x08 || cdb[0] == 0x0a))
+			r->blocks = 256;
+		break;
+	case 4:
+		r->lba = get_be32(cdb + 6);
+		r->blocks = get_be32(cdb + 10);
+		break;
+	case 5:
+		r->lba = get_be32(cdb + 2);
+		r->blocks = get_be32(cdb + 6);
+		break;
+	default:
+		r->lba = get_be32(cdb + 2);
+		r->blocks = (cdb[7] << 8) | cdb[8];
+		break;
+	}
+}
+
+void scsi_trace_done(struct scsi_trace_rec *r, uint8_t status)
+{
+	if (r->status == SCSI_TRACE_NOT_RUN)
+		return;
+	scsi_hal_irq_disable();
+	if (scsi_trace_state == SCSI_TRACE_RECORD) {
+		r->done_us = micros() - scsi_trace_start_us;
+		r->status = status;
+		scsi_trace_ring[scsi_trace_next % SCSI_TRACE_RECORDS] = *r;
+		scsi_trace_next++;
+	}
+	scsi_hal_irq_enable();
+}
+
+/* called from the USB interrupt, replay itself runs from the main loop */
+int scsi_trace_control(unsigned int mode)
+{
+	switch (mode & SCSI_TRACE_MODE) {
+	case SCSI_TRACE_OFF:
+		scsi_trace_state = SCSI_TRACE_OFF;
+		return 0;
+	case SCSI_TRACE_RECORD:
+		if (scsi_trace_state != SCSI_TRACE_OFF)
+			return -1;
+		scsi_trace_next = 0;
+		scsi_trace_start_us = micros();
+		scsi_trace_state = SCSI_TRACE_RECORD;
+		return 0;
+	case SCSI_TRACE_REPLAY:
+	case SCSI_TRACE_REPLAY_FAST:
+		if (scsi_trace_state != SCSI_TRACE_OFF || !scsi_trace_next)
+			return -1;
+		scsi_trace_state = mode;
+		return 0;
+	}
+	return -1;
+}
+
+int scsi_trace_read(void *buf, int len, uint32_t seq)
+{
+	struct scsi_trace_hdr *h = buf;
+	struct scsi_trace_rec *r = (struct scsi_trace_rec *)(h + 1);
+	uint32_t next = scsi_trace_next, n, i;
+
+	if (len < sizeof(*h))
+		return -1;
+	if (seq > next)
+		seq = next;
+	if (next - seq > SCSI_TRACE_RECORDS)
+		seq = next - SCSI_TRACE_RECORDS;
+	n = (len - sizeof(*h)) / sizeof(*r);
+	if (n > SCSI_TRACE_CHUNK)
+		n = SCSI_TRACE_CHUNK;
+	if (n > next - seq)
+		n = next - seq;
+	for (i = 0; i < n; i++)
+		memcpy(r + i, scsi_trace_ring + (seq + i) % SCSI_TRACE_RECORDS, sizeof(*r));
+	h->seq = seq;
+	h->next = next;
+	h->count = n;
+	h->state = scsi_trace_state & SCSI_TRACE_MODE;
+	h->rsvd = 0;
+	return sizeof(*h) + n * sizeof(*r);
+}
+
+/* loads a trace for replay, seq 0 starts over */
+int scsi_trace_write(const void *buf, int len, uint32_t seq)
+{
+	uint32_t n = len / sizeof(struct scsi_trace_rec);
+
+	if (scsi_trace_state != SCSI_TRACE_OFF || len % sizeof(struct scsi_trace_rec))
+		return -1;
+	if (!seq)
+		scsi_trace_next = 0;
+	if (seq != scsi_trace_next || seq + n > SCSI_TRACE_RECORDS)
+		return -1;
+	memcpy(scsi_trace_ring + seq, buf, len);
+	scsi_trace_next += n;
+	return 0;
+}
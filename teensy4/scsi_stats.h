@@ -0,0 +1,323 @@
+#ifndef SCSI_STATS_H
+#define SCSI_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Vendor control requests on the default pipe, recipient device. They
+ * are served from the USB interrupt and therefore work while UAS/BOT
+ * traffic is running.
+ */
+#define SCSI_VENDOR_GET_STATS		0x01	/* IN: struct scsi_stats */
+#define SCSI_VENDOR_RESET_STATS		0x02	/* OUT, no data */
+#define SCSI_VENDOR_GET_TUNABLE		0x03	/* IN: uint32_t, wIndex = id */
+#define SCSI_VENDOR_SET_TUNABLE		0x04	/* OUT: uint32_t, wIndex = id */
+#define SCSI_VENDOR_SELFTEST		0x05	/* OUT: struct scsi_selftest_params */
+#define SCSI_VENDOR_TRACE		0x06	/* OUT, no data, wValue = SCSI_TRACE_* */
+#define SCSI_VENDOR_GET_TRACE		0x07	/* IN: struct scsi_trace_hdr and records */
+#define SCSI_VENDOR_PUT_TRACE		0x08	/* OUT: records */
+
+/*
+ * The statistics block only ever grows at the end, version is bumped
+ * whenever fields are added and length tells how much was filled.
+ */
+#define SCSI_STATS_VERSION 17
+
+/*
+ * Raw bus self-test: READ(10)/WRITE(10) or TEST UNIT READY loops run
+ * from the main loop against the current target. Data never touches
+ * USB, DATA IN is discarded and DATA OUT comes from a fixed pattern,
+ * so the results show what the bus side alone can do.
+ */
+#define SCSI_SELFTEST_READ		0
+#define SCSI_SELFTEST_WRITE		1
+#define SCSI_SELFTEST_TUR		2
+
+#define SCSI_SELFTEST_SEQUENTIAL	0x01
+#define SCSI_SELFTEST_RANDOM		0x02
+
+/* writing destroys data on the target, so it has to be asked for */
+#define SCSI_SELFTEST_ALLOW_WRITE	0x01
+
+#define SCSI_SELFTEST_IDLE		0
+#define SCSI_SELFTEST_RUNNING		1
+#define SCSI_SELFTEST_DONE		2
+#define SCSI_SELFTEST_FAILED		3
+
+#define SCSI_SELFTEST_MAX_STEPS		16
+
+struct scsi_selftest_params {
+	uint8_t mode;
+	uint8_t patterns;	/* SCSI_SELFTEST_SEQUENTIAL | RANDOM */
+	uint8_t flags;
+	uint8_t lun;		/* host LUN to test */
+	uint32_t sizes;		/* bit n: transfers of 512 << n bytes */
+	uint32_t duration_ms;	/* per step */
+} __attribute__((__packed__));
+
+struct scsi_selftest_result {
+	uint8_t mode;
+	uint8_t pattern;
+	uint16_t rsvd;
+	uint32_t xfer_size;
+	uint32_t commands;
+	uint32_t errors;
+	uint64_t bytes;
+	uint32_t elapsed_us;
+	uint32_t kbytes_per_sec;
+	uint32_t iops;
+	uint32_t overhead_ns;	/* per command, time outside data phases */
+} __attribute__((__packed__));
+
+/*
+ * Command trace: every host command with its arrival and completion
+ * time goes into a ring of SCSI_TRACE_RECORDS. Sequence numbers count
+ * all records since the trace was started, GET_TRACE and PUT_TRACE
+ * take the first one in wIndex:wValue and move up to SCSI_TRACE_CHUNK
+ * records. GET_TRACE starts at the oldest record still in the ring if
+ * the host fell behind. The ring is 40K of OCRAM beside the USB frames,
+ * the response cache and the self-test buffer, which leaves about 4K of
+ * it, longer traces are replayed in pieces.
+ *
+ * Replay runs the records loaded with PUT_TRACE through the self-test
+ * path, in order at their arrival times or back to back, and fills in
+ * done_us and status of each one. Only reads, TEST UNIT READY and
+ * SYNCHRONIZE CACHE are replayed unless writes are allowed.
+ */
+#define SCSI_TRACE_RECORDS		2048
+#define SCSI_TRACE_CHUNK		64
+
+#define SCSI_TRACE_OFF			0
+#define SCSI_TRACE_RECORD		1
+#define SCSI_TRACE_REPLAY		2
+#define SCSI_TRACE_REPLAY_FAST		3
+#define SCSI_TRACE_MODE			0x00ff
+#define SCSI_TRACE_ALLOW_WRITE		0x0100
+
+#define SCSI_TRACE_NOT_RUN		0xff	/* status of skipped records */
+
+/* clock levels of scsi_clock.c, clock_hz and clock_ms are indexed by them */
+#define SCSI_CLOCK_BOOST		0
+#define SCSI_CLOCK_NOMINAL		1
+#define SCSI_CLOCK_IDLE			2
+#define SCSI_CLOCK_LEVELS		3
+
+/* main loop tasks of scsi_task.c, the task_* arrays are indexed by them */
+#define SCSI_TASK_SESSION		0	/* reselections and queued commands */
+#define SCSI_TASK_INTAKE		1	/* command IUs and CBWs from USB */
+#define SCSI_TASK_STATUS		2	/* status IUs and CSWs to USB */
+#define SCSI_TASK_BACKGROUND		3	/* self-test and trace replay */
+#define SCSI_TASK_STATS			4	/* clock governor */
+#define SCSI_TASKS			5
+
+/* host visible LUNs, the CBW has four bits for it */
+#define SCSI_LUNS			16
+
+struct scsi_trace_rec {
+	uint32_t arrival_us;	/* since the trace was started */
+	uint32_t done_us;
+	uint32_t lba;
+	uint32_t blocks;
+	uint16_t tag;
+	uint8_t opcode;
+	uint8_t status;
+} __attribute__((__packed__));
+
+struct scsi_trace_hdr {
+	uint32_t seq;		/* of the first record that follows */
+	uint32_t next;		/* records written so far */
+	uint16_t count;		/* records that follow */
+	uint8_t state;		/* SCSI_TRACE_* */
+	uint8_t rsvd;
+} __attribute__((__packed__));
+
+struct scsi_stats {
+	uint16_t version;
+	uint16_t length;
+	uint32_t uptime_ms;
+	uint32_t cpu_hz;	/* nominal, phase_cycles are counted at it */
+
+	uint32_t commands;
+	uint32_t opcodes[256];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	uint32_t tags_in_use;
+	uint32_t tags_max;
+	uint32_t cmd_frames_pending;
+	uint32_t dout_frames_pending;
+	uint32_t tx_frames_free;
+	uint32_t tx_frames_total;
+	uint32_t frame_waits;
+
+	uint32_t phase_count[8];
+	uint64_t phase_cycles[8];
+
+	uint32_t select_timeouts;
+	uint32_t unexpected_disconnects;
+	uint32_t rejected_msgs;
+	uint32_t unknown_tags;
+	uint32_t no_free_tag;
+	uint32_t short_requests;
+	uint32_t check_conditions;
+	uint32_t busy_status;
+	uint32_t usb_tx_errors;
+
+	/* version 2 */
+	uint32_t selftest_state;
+	uint32_t selftest_steps;
+	struct scsi_selftest_result selftest[SCSI_SELFTEST_MAX_STEPS];
+
+	/* version 3 */
+	uint32_t clock_hz[SCSI_CLOCK_LEVELS];
+	uint32_t clock_ms[SCSI_CLOCK_LEVELS];	/* time spent at each level */
+	uint32_t clock_changes;
+	uint32_t clock_throttles;	/* boost refused over clock_temp_limit */
+	int32_t die_temp;		/* deg C */
+
+	/* version 4 */
+	uint32_t idle_sleeps;		/* WFI in the main loop */
+	uint64_t idle_us;		/* spent in them */
+	uint32_t resel_wakes;		/* reselections answered out of WFI */
+	uint32_t resel_latency_ns;	/* wake to BSY, last one */
+	uint32_t resel_latency_max_ns;
+	uint32_t bus_resets;		/* RST from another device */
+
+	/* version 5 */
+	uint32_t task_runs[SCSI_TASKS];
+	uint64_t task_cycles[SCSI_TASKS];	/* at the nominal clock, without nested turns */
+	uint32_t task_max_cycles[SCSI_TASKS];	/* longest single turn */
+	uint32_t task_yields;		/* nested turns from inside a connection */
+	uint32_t cmd_queued;		/* commands waiting for the bus */
+	uint32_t cmd_queued_max;
+	uint32_t status_queued_max;	/* status waiting for a USB frame */
+
+	/* version 6 */
+	uint32_t scans;			/* of the bus for targets and LUNs */
+	uint32_t luns;			/* host LUNs the last scan mapped */
+	uint8_t lun_map[SCSI_LUNS];	/* host LUN: SCSI ID << 3 | LUN */
+	uint32_t target_commands[8];	/* by SCSI ID */
+
+	/* version 7 */
+	uint32_t saved_pointers;	/* SAVE DATA POINTERS */
+	uint32_t restored_pointers;	/* back to the saved pointer, implied or not */
+	uint32_t lost_pointers;		/* DATA OUT to send again had gone back to USB */
+
+	/* version 8 */
+	uint32_t disc_granted;		/* IDENTIFY with disconnect privilege */
+	uint32_t disc_withheld;		/* without, the target was expected back soon */
+	uint32_t disc_withheld_slow;	/* and held the bus over disconnect_us */
+	uint32_t disc_granted_fast;	/* disconnected, back before a reselection paid off */
+	uint32_t resel_ns;		/* reselection messages, average, 0 before the first */
+	uint64_t disc_saved_ns;		/* reselection cost for each withheld one that was quick */
+
+	/* version 9 */
+	uint32_t stalls;		/* ATN in a data phase, USB had no frame ready */
+	uint32_t stall_disconnects;	/* none within stall_us, DISCONNECT sent */
+	uint32_t stall_refused;		/* the target rejected it */
+
+	/* version 10 */
+	uint32_t requeued;		/* BUSY or QUEUE FULL, kept from the host */
+	uint32_t queue_depth[8];	/* by SCSI ID, what QUEUE FULL left of it */
+	uint32_t queue_depth_max[8];	/* most commands a target held at once */
+
+	/* version 11 */
+	uint32_t elevator_reorders;	/* commands that went ahead of older ones */
+	uint32_t elevator_expired;	/* the oldest went, it waited elevator_us */
+	int64_t elevator_saved;		/* blocks of seeking, against arrival order */
+
+	/* version 12 */
+	uint32_t task_attrs[3];		/* UAS commands as SIMPLE, HEAD OF QUEUE, ORDERED */
+
+	/* version 13 */
+	uint32_t task_mgmt;		/* UAS task management IUs */
+	uint32_t task_mgmt_failed;	/* answered other than COMPLETE or SUCCEEDED */
+	uint32_t tasks_aborted;		/* queued or disconnected ones they ended */
+	uint32_t lun_resets;		/* BUS DEVICE RESET or ABORT for them */
+	uint32_t task_mgmt_us;		/* IU to RESPONSE IU, last one */
+	uint32_t task_mgmt_max_us;
+	uint64_t task_mgmt_total_us;
+
+	/* version 14 */
+	uint32_t auto_sense;		/* REQUEST SENSE after a CHECK CONDITION */
+	uint32_t auto_sense_failed;	/* the status went without sense */
+	uint32_t sense_cached;		/* BOT REQUEST SENSE answered from the cache */
+
+	/* version 15 */
+	uint32_t resp_cache_hits;	/* INQUIRY, READ CAPACITY, MODE SENSE from RAM */
+	uint32_t resp_cache_fills;	/* responses that went into the cache */
+	uint32_t resp_cache_invalidated;	/* dropped by UNIT ATTENTION, reset, MODE SELECT */
+
+	/* version 16 */
+	uint32_t session_waits;		/* a connection went back to the main loop */
+
+	/* version 17 */
+	uint32_t resel_rejected;	/* no other ID or more than one, not answered */
+} __attribute__((__packed__));
+
+enum scsi_tunable_id {
+	SCSI_TUNABLE_HOSTID,
+	SCSI_TUNABLE_BUS_SETTLE_DELAY,		/* ns */
+	SCSI_TUNABLE_BUS_CLEAR_DELAY,		/* ns */
+	SCSI_TUNABLE_ARBITRATION_DELAY,		/* ns */
+	SCSI_TUNABLE_SELECT_TIMEOUT,		/* ms */
+	SCSI_TUNABLE_RAMDISK,			/* 1: LUN 0 from RAM, see scsi_ramdisk.h */
+	SCSI_TUNABLE_CLOCK_BOOST,		/* MHz, see scsi_clock.h */
+	SCSI_TUNABLE_CLOCK_IDLE,		/* MHz */
+	SCSI_TUNABLE_CLOCK_IDLE_MS,		/* ms */
+	SCSI_TUNABLE_CLOCK_TEMP_LIMIT,		/* deg C */
+	SCSI_TUNABLE_TASK_SLICE_US,		/* us, see scsi_task.h */
+	SCSI_TUNABLE_DISCONNECT_US,		/* us, see scsi_disconnect_policy() */
+	SCSI_TUNABLE_STALL_US,			/* us, see scsi_stall_msg() */
+	SCSI_TUNABLE_ELEVATOR_US,		/* us, see scsi_elevator(), 0: off */
+	SCSI_TUNABLE_RESP_CACHE,		/* 1: see scsi_resp_cached() */
+	SCSI_TUNABLE_MAX,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct scsi_tunables {
+	uint32_t hostid;
+	uint32_t bus_settle_delay;
+	uint32_t bus_clear_delay;
+	uint32_t arbitration_delay;
+	uint32_t select_timeout;
+	uint32_t ramdisk;
+	uint32_t clock_boost;
+	uint32_t clock_idle;
+	uint32_t clock_idle_ms;
+	uint32_t clock_temp_limit;
+	uint32_t task_slice_us;
+	uint32_t disconnect_us;
+	uint32_t stall_us;
+	uint32_t elevator_us;
+	uint32_t resp_cache;
+};
+
+extern struct scsi_stats scsi_stats;
+extern struct scsi_tunables scsi_tunables;
+
+int scsi_stats_read(void *buf, int len);
+void scsi_stats_reset(void);
+int scsi_get_tunable(unsigned int id, uint32_t *val);
+int scsi_set_tunable(unsigned int id, uint32_t val);
+void scsi_apply_tunables(void);
+int scsi_selftest_start(const struct scsi_selftest_params *params);
+
+extern volatile uint32_t scsi_trace_state;
+extern struct scsi_trace_rec scsi_trace_ring[SCSI_TRACE_RECORDS];
+extern uint32_t scsi_trace_next;
+
+void scsi_trace_cmd(struct scsi_trace_rec *r, const uint8_t *cdb, uint16_t tag);
+void scsi_trace_done(struct scsi_trace_rec *r, uint8_t status);
+int scsi_trace_control(unsigned int mode);
+int scsi_trace_read(void *buf, int len, uint32_t seq);
+int scsi_trace_write(const void *buf, int len, uint32_t seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+#include "scsi_task.h"
+#include "scsi_stats.h"
+#include "scsi_clock.h"
+#include "scsi_hal.h"
+
+static struct scsi_task *tasks[SCSI_TASKS];
+static int ntasks;
+static int nested;
+static uint32_t slice_start;
+/* cycles of nested turns, not charged to the task they ran inside */
+static uint32_t nested_cycles;
+
+void scsi_task_add(struct scsi_task *task)
+{
+	if (ntasks < SCSI_TASKS)
+		tasks[ntasks++] = task;
+}
+
+static int scsi_task_turn(struct scsi_task *task)
+{
+	uint32_t outer_start = slice_start, outer_nested = nested_cycles;
+	uint32_t start = scsi_hal_cycles(), cycles, own;
+	int ret;
+
+	task->running = 1;
+	slice_start = start;
+	nested_cycles = 0;
+	ret = task->fn(task);
+	cycles = scsi_hal_cycles() - start;
+	task->running = 0;
+
+	own = scsi_clock_nominal(cycles - nested_cycles);
+	scsi_stats.task_runs[task->id]++;
+	scsi_stats.task_cycles[task->id] += own;
+	if (own > scsi_stats.task_max_cycles[task->id])
+		scsi_stats.task_max_cycles[task->id] = own;
+	slice_start = outer_start;
+	nested_cycles = outer_nested + cycles;
+	return ret;
+}
+
+/* one turn for every task, nonzero if any of them had work */
+int scsi_task_run(void)
+{
+	int i, busy = 0;
+
+	for (i = 0; i < ntasks; i++)
+		if (!tasks[i]->running)
+			busy |= scsi_task_turn(tasks[i]);
+	return busy;
+}
+
+/* called while a bus connection or a frame wait can't go on yet */
+void scsi_task_yield(void)
+{
+	int i;
+
+	if (nested)
+		return;
+	nested = 1;
+	scsi_stats.task_yields++;
+	for (i = 0; i < ntasks; i++)
+		if (!(tasks[i]->flags & SCSI_TASK_BUS) && !tasks[i]->running)
+			scsi_task_turn(tasks[i]);
+	nested = 0;
+}
+
+int scsi_task_slice_over(void)
+{
+	return scsi_hal_cycles() - slice_start >
+		scsi_tunables.task_slice_us * (scsi_hal_cpu_hz() / 1000000);
+}
@@ -0,0 +1,61 @@
+#ifndef SCSI_TASK_H
+#define SCSI_TASK_H
+
+#include <stdint.h>
+
+/*
+ * Cooperative tasks of the main loop. scsi_task_run() gives every task
+ * one turn, a task does what it can without blocking and returns, or
+ * yields once scsi_task_slice_over() says its tunable time slice is
+ * used up. Tasks that resume in the middle of a longer job use the
+ * protothread style TASK_* macros: the switch jumps back to the line
+ * they yielded at, so locals don't survive a yield, the state lives in
+ * statics.
+ *
+ * Host commands and reselections run as sessions of the session task,
+ * one per target, that return to the main loop whenever the target or
+ * USB is to be waited for, see scsi_session_run() in scsi.c. The
+ * bridge's own connections, the scan, auto sense, aborts and the
+ * self-test, still wait where they are: scsi_task_yield() runs the
+ * tasks that never touch the bus meanwhile.
+ */
+#define SCSI_TASK_BUS		0x01	/* owns the bus, never run nested */
+
+struct scsi_task {
+	uint8_t id;		/* SCSI_TASK_* of scsi_stats.h */
+	uint8_t flags;
+	uint8_t running;
+	int line;		/* where a TASK_* task resumes */
+	int (*fn)(struct scsi_task *task);	/* nonzero while it has work */
+};
+
+#define TASK_BEGIN(task)	switch ((task)->line) { case 0:
+#define TASK_YIELD(task)						\
+	do {								\
+		(task)->line = __LINE__;				\
+		return 1;						\
+	case __LINE__:;							\
+	} while (0)
+#define TASK_WAIT_UNTIL(task, cond)					\
+	do {								\
+		(task)->line = __LINE__;				\
+	case __LINE__:							\
+		if (!(cond))						\
+			return 0;					\
+	} while (0)
+#define TASK_END(task)		} (task)->line = 0; return 0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void scsi_task_add(struct scsi_task *task);
+int scsi_task_run(void);
+void scsi_task_yield(void);
+int scsi_task_slice_over(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
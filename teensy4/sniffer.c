@@ -0,0 +1,362 @@
+#include <scsi.h>
+#include "scsi_pins.h"
+#include "sniffer.h"
+#include <core_pins.h>
+#include <stdio.h>
+#include <string.h>
+#include "usb_dev.h"
+#include "usb_desc.h"
+#include <Arduino.h>
+
+/*
+ * Passive bus monitor. All bus outputs stay released, the bus is only
+ * observed through the *I_PIN input buffers and every transaction is
+ * cut into records (see sniffer.h) which are streamed to the host on
+ * the bulk DATA IN endpoint. Only asynchronous transfers can be
+ * followed, synchronous REQ/ACK offsets are too fast to be polled.
+ *
+ * All control lines we need for the handshake live in GPIO7 so one
+ * port read gives REQ, ACK, SEL, ATN and the phase, the data lines are
+ * GPIO6 16..23, BSY is GPIO9 and only RST and DBP are GPIO8.
+ */
+
+#define PIN_MASK(pin) PIN_MASK_(pin)
+#define PIN_MASK_(pin) CORE_PIN##pin##_BITMASK
+#define PIN_BIT(pin) PIN_BIT_(pin)
+#define PIN_BIT_(pin) CORE_PIN##pin##_BIT
+
+#define BUS_REQ PIN_MASK(REQI_PIN)
+#define BUS_ACK PIN_MASK(ACKI_PIN)
+#define BUS_SEL PIN_MASK(SELI_PIN)
+#define BUS_IO PIN_MASK(IOI_PIN)
+#define BUS_BSY PIN_MASK(BSYI_PIN)
+#define BUS_RST PIN_MASK(RSTI_PIN)
+#define BUS_ATN PIN_MASK(ATNI_PIN)
+#define BUS_DBP PIN_MASK(DBPI_PIN)
+
+#define BUS_PHASE(x) ((x) & 7)
+#define BUS_DATA() ((uint8_t)~(GPIO6_PSR >> 16))
+
+#define bsy_asserted() (!(GPIO9_PSR & BUS_BSY))
+#define rst_asserted() (!(GPIO8_PSR & BUS_RST))
+
+#define SNIFF_FRAME_SIZE 16384
+#define SNIFF_PHASE_DIN 6
+#define SNIFF_PHASE_DOUT 7
+
+static transfer_t *sniff_frame;
+static uint8_t *sniff_buf, *sniff_wp, *sniff_end;
+static struct sniff_record *sniff_cur;
+static uint32_t sniff_phase_total;
+static int sniff_phase;
+static uint8_t sniff_parity[256];
+static struct sniff_stats sniff_stats;
+static int sniff_lost;
+static uint32_t sniff_last_event;
+
+extern volatile uint8_t usb_configuration;
+
+/* bytes of each data phase which are copied, 0 for everything */
+uint32_t sniff_data_limit;
+
+static void sniff_send_frame(void)
+{
+	int len;
+
+	if (!sniff_frame)
+		return;
+
+	len = sniff_wp - sniff_buf;
+	if (len && len < SNIFF_FRAME_SIZE && !(len % tx_packet_size)) {
+		/* end the transfer with a short packet */
+		memset(sniff_wp, 0, sizeof(struct sniff_record));
+		len += sizeof(struct sniff_record);
+	}
+	tx_uas_response(sniff_frame, UAS_DIN_ENDPOINT, len);
+	sniff_frame = NULL;
+}
+
+static int sniff_get_frame(void)
+{
+	transfer_t *t;
+
+	if (sniff_frame)
+		return 1;
+
+	t = get_frame_noblock(&tx_free_list);
+	if (t == LIST_END)
+		return 0;
+
+	sniff_frame = t;
+	sniff_buf = transfer_buffer(t);
+	sniff_wp = sniff_buf;
+	/* keep room for the total count of a truncated phase */
+	sniff_end = sniff_buf + SNIFF_FRAME_SIZE - 4;
+	return 1;
+}
+
+static void *sniff_reserve(int len)
+{
+	if (!sniff_get_frame())
+		return NULL;
+
+	if (sniff_end - sniff_wp < len) {
+		sniff_send_frame();
+		if (!sniff_get_frame())
+			return NULL;
+	}
+
+	if (sniff_lost) {
+		struct sniff_record *rec = (struct sniff_record *)sniff_wp;
+
+		/* tell the host about the gap before anything else */
+		sniff_lost = 0;
+		rec->type = SNIFF_REC_STATS;
+		rec->arg = 0;
+		rec->len = sizeof(sniff_stats);
+		rec->cycles = ARM_DWT_CYCCNT;
+		memcpy(rec + 1, &sniff_stats, sizeof(sniff_stats));
+		sniff_wp += sizeof(*rec) + sizeof(sniff_stats);
+		if (sniff_end - sniff_wp < len) {
+			sniff_send_frame();
+			if (!sniff_get_frame())
+				return NULL;
+		}
+	}
+	return sniff_wp;
+}
+
+static struct sniff_record *sniff_alloc(int type, int arg, int len, uint32_t cycles)
+{
+	struct sniff_record *rec;
+
+	rec = sniff_reserve(sizeof(*rec) + ((len + 3) & ~3));
+	if (!rec) {
+		sniff_stats.dropped_records++;
+		sniff_lost = 1;
+		return NULL;
+	}
+	rec->type = type;
+	rec->arg = arg;
+	rec->len = len;
+	rec->cycles = cycles;
+	sniff_wp += sizeof(*rec) + ((len + 3) & ~3);
+	sniff_stats.records++;
+	sniff_last_event = ARM_DWT_CYCCNT;
+	return rec;
+}
+
+static void sniff_event(int type, int arg, uint32_t cycles)
+{
+	sniff_alloc(type, arg, 0, cycles);
+}
+
+static void sniff_emit_stats(void)
+{
+	struct sniff_record *rec;
+
+	sniff_stats.cpu_hz = F_CPU_ACTUAL;
+	rec = sniff_alloc(SNIFF_REC_STATS, 0, sizeof(sniff_stats), ARM_DWT_CYCCNT);
+	if (rec)
+		memcpy(rec + 1, &sniff_stats, sizeof(sniff_stats));
+}
+
+static void sniff_close_phase(void)
+{
+	struct sniff_record *rec = sniff_cur;
+	uint32_t captured;
+
+	if (!rec)
+		return;
+
+	captured = sniff_wp - (uint8_t *)(rec + 1);
+	if (sniff_data_limit && sniff_phase_total > sniff_data_limit) {
+		memcpy(sniff_wp, &sniff_phase_total, 4);
+		sniff_wp += 4;
+		captured += 4;
+		rec->type |= SNIFF_FLAG_TRUNC;
+	}
+	rec->len = captured;
+	while ((uint32_t)sniff_wp & 3)
+		*sniff_wp++ = 0;
+	sniff_cur = NULL;
+}
+
+static void sniff_open_phase(int phase, int flags)
+{
+	sniff_cur = sniff_alloc(SNIFF_REC_PHASE | flags, phase, 0, ARM_DWT_CYCCNT);
+	sniff_phase = phase;
+	if (!(flags & SNIFF_FLAG_CONT))
+		sniff_phase_total = 0;
+}
+
+static inline void sniff_put(uint8_t data)
+{
+	sniff_stats.bytes++;
+	if (!sniff_cur) {
+		sniff_stats.dropped_bytes++;
+		return;
+	}
+
+	if (sniff_data_limit && sniff_phase >= SNIFF_PHASE_DIN &&
+	    sniff_phase_total++ >= sniff_data_limit)
+		return;
+
+	*sniff_wp++ = data;
+	if (sniff_wp == sniff_end) {
+		sniff_close_phase();
+		sniff_send_frame();
+		sniff_open_phase(sniff_phase, SNIFF_FLAG_CONT);
+	}
+}
+
+static void sniff_connected(void)
+{
+	uint32_t g7;
+	uint8_t data;
+	int phase = -1;
+
+	GPIO7_ISR = BUS_ACK;
+	for (;;) {
+		do {
+			g7 = GPIO7_PSR;
+			if (!bsy_asserted() || rst_asserted())
+				goto out;
+		} while (g7 & BUS_REQ);
+
+		/* an ACK edge without a REQ we have seen: bytes were lost */
+		if (GPIO7_ISR & BUS_ACK)
+			sniff_stats.overruns++;
+
+		if (BUS_PHASE(g7) != phase) {
+			sniff_close_phase();
+			phase = BUS_PHASE(g7);
+			sniff_open_phase(phase, 0);
+		}
+
+		while (GPIO7_PSR & BUS_ACK) {
+			if (!bsy_asserted())
+				goto out;
+		}
+		data = BUS_DATA();
+		if (sniff_cur && sniff_parity[data] == !!(GPIO8_PSR & BUS_DBP))
+			sniff_cur->type |= SNIFF_FLAG_PARITY;
+		GPIO7_ISR = BUS_ACK;
+		sniff_put(data);
+
+		while (!(GPIO7_PSR & BUS_REQ)) {
+			if (!bsy_asserted())
+				goto out;
+		}
+	}
+out:
+	sniff_close_phase();
+	if (!bsy_asserted())
+		sniff_event(SNIFF_REC_BUS_FREE, 0, ARM_DWT_CYCCNT);
+}
+
+static void sniff_selection(void)
+{
+	uint32_t start = ARM_DWT_CYCCNT;
+	uint32_t g7 = GPIO7_PSR;
+	int ids = 0, flags = 0, type;
+
+	/* the arbitration winner releases BSY after driving both IDs */
+	while (bsy_asserted()) {
+		if (GPIO7_PSR & BUS_SEL)
+			return;
+	}
+
+	while (!bsy_asserted()) {
+		g7 = GPIO7_PSR;
+		if (g7 & BUS_SEL) {
+			sniff_event(SNIFF_REC_SEL_TIMEOUT, ids, start);
+			return;
+		}
+		ids = BUS_DATA();
+		flags = (g7 & BUS_ATN) ? 0 : SNIFF_FLAG_ATN;
+	}
+
+	type = (g7 & BUS_IO) ? SNIFF_REC_SELECTION : SNIFF_REC_RESELECTION;
+	sniff_event(type | flags, ids, start);
+
+	while (!(GPIO7_PSR & BUS_SEL)) {
+		if (!bsy_asserted())
+			return;
+	}
+	sniff_connected();
+}
+
+static void sniff_arbitration(void)
+{
+	uint32_t start = ARM_DWT_CYCCNT;
+	uint32_t timeout = F_CPU_ACTUAL / 100000;
+	uint32_t g7;
+	int ids = 0;
+
+	for (;;) {
+		g7 = GPIO7_PSR;
+		if (!(g7 & BUS_SEL))
+			break;
+		if (!bsy_asserted())
+			return;
+		/* REQ or a long busy bus means we missed the selection */
+		if (!(g7 & BUS_REQ) || ARM_DWT_CYCCNT - start > timeout) {
+			sniff_connected();
+			return;
+		}
+		ids |= BUS_DATA();
+	}
+	sniff_event(SNIFF_REC_ARBITRATION, ids, start);
+	sniff_selection();
+}
+
+static void sniff_reset(void)
+{
+	sniff_close_phase();
+	sniff_event(SNIFF_REC_RESET, 0, ARM_DWT_CYCCNT);
+	while (rst_asserted());
+}
+
+void scsi_sniffer_loop(void)
+{
+	uint32_t last_stats = ARM_DWT_CYCCNT;
+	int i;
+
+	sniff_stats.cpu_hz = F_CPU_ACTUAL;
+	for (i = 0; i < 256; i++)
+		sniff_parity[i] = !__builtin_parity(i);
+
+	/* latch falling ACK edges in GPIO7_ISR without raising an interrupt */
+	GPIO7_IMR &= ~BUS_ACK;
+	GPIO7_EDGE_SEL &= ~BUS_ACK;
+	GPIO7_ICR1 = (GPIO7_ICR1 & ~(3 << (2 * PIN_BIT(ACKI_PIN)))) |
+		(3 << (2 * PIN_BIT(ACKI_PIN)));
+
+	for (;;) {
+		if (rst_asserted()) {
+			sniff_reset();
+			continue;
+		}
+
+		if (!(GPIO7_PSR & BUS_SEL)) {
+			sniff_selection();
+			continue;
+		}
+
+		if (bsy_asserted()) {
+			sniff_arbitration();
+			continue;
+		}
+
+		/* bus free: push out partial frames and report counters */
+		if (ARM_DWT_CYCCNT - last_stats > F_CPU_ACTUAL && usb_configuration) {
+			last_stats = ARM_DWT_CYCCNT;
+			sniff_emit_stats();
+			sniff_send_frame();
+		} else if (sniff_frame && sniff_wp != sniff_buf &&
+			   ARM_DWT_CYCCNT - sniff_last_event > F_CPU_ACTUAL / 1000) {
+			sniff_send_frame();
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef SCSI_SNIFFER_H
+#define SCSI_SNIFFER_H
+
+#include <stdint.h>
+
+/*
+ * Record stream sent on the bulk DATA IN endpoint while the firmware
+ * runs in sniffer mode. Every record starts with a sniff_record header
+ * followed by len payload bytes, padded to a multiple of four.
+ */
+struct sniff_record {
+	uint8_t type;
+	uint8_t arg;
+	uint16_t len;
+	uint32_t cycles;
+} __attribute__((__packed__));
+
+struct sniff_stats {
+	uint32_t records;
+	uint32_t bytes;
+	uint32_t dropped_records;
+	uint32_t dropped_bytes;
+	uint32_t overruns;
+	uint32_t cpu_hz;
+} __attribute__((__packed__));
+
+#define SNIFF_REC_PAD		0x00
+#define SNIFF_REC_BUS_FREE	0x01
+#define SNIFF_REC_ARBITRATION	0x02	/* arg: ids seen on the data lines */
+#define SNIFF_REC_SELECTION	0x03	/* arg: initiator | target id */
+#define SNIFF_REC_RESELECTION	0x04	/* arg: target | initiator id */
+#define SNIFF_REC_PHASE		0x05	/* arg: phase, payload: bus bytes */
+#define SNIFF_REC_RESET		0x06
+#define SNIFF_REC_STATS		0x07	/* payload: struct sniff_stats */
+#define SNIFF_REC_SEL_TIMEOUT	0x08	/* arg: ids, selection not answered */
+#define SNIFF_REC_TYPE_MASK	0x0f
+
+#define SNIFF_FLAG_ATN		0x10	/* ATN asserted during (re)selection */
+#define SNIFF_FLAG_CONT		0x20	/* continues the previous phase record */
+#define SNIFF_FLAG_PARITY	0x40	/* parity error seen in payload */
+#define SNIFF_FLAG_TRUNC	0x80	/* payload truncated, last 4 bytes hold total */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void scsi_sniffer_loop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,11 +2,17 @@
 #include "usb_dev.h"
 #define USB_DESC_LIST_DEFINE
 #include "usb_desc.h"
+#ifdef SCSI_SIM
+#include "sim_usb.h"
+#else
 #include "core_pins.h" // for delay()
 #include "avr/pgmspace.h"
-#include <string.h>
 #include "debug/printf.h"
+#endif
+#include <string.h>
 #include "scsi.h"
+#include "scsi_stats.h"
+#include "scsi_task.h"
 
 typedef struct endpoint_struct endpoint_t;
 
@@ -58,6 +64,9 @@ extern const uint8_t usb_config_descriptor_480[];
 extern const uint8_t usb_config_descriptor_12[];
 
 static uint8_t reply_buffer[8];
+static uint8_t vendor_buffer[sizeof(struct scsi_stats)] __attribute__ ((aligned(32)));
+_Static_assert(sizeof(vendor_buffer) >= sizeof(struct scsi_trace_hdr) +
+	       SCSI_TRACE_CHUNK * sizeof(struct scsi_trace_rec), "vendor_buffer too small");
 int usb_uas_interface_alt;
 
 transfer_t *tx_free_list = LIST_END;
@@ -84,6 +93,8 @@ typedef union {
 	uint64_t bothwords;
 } setup_t;
 
+static setup_t endpoint0_setupdata;
+
 static void show_desc(const char *prefix, transfer_t *t)
 {
 	printf("%s %08x: NEXT %08x STATUS %08x P0 %08x P1 %08x P2 %08x P3 %08x P4 %08x PARAM %08x\n",
@@ -117,6 +128,7 @@ struct transfer_struct *get_frame(struct transfer_struct **list)
 {
 	struct transfer_struct *ret = LIST_END;
 	uint32_t start = millis();
+	int waited = 0;
 
 	do {
 		__disable_irq();
@@ -125,6 +137,11 @@ struct transfer_struct *get_frame(struct transfer_struct **list)
 			*list = (*list)->next;
 		}
 		__enable_irq();
+		if (ret == LIST_END) {
+			if (!waited++)
+				scsi_stats.frame_waits++;
+			scsi_task_yield();
+		}
 	} while(ret == LIST_END);
 	return ret;
 }
@@ -141,6 +158,27 @@ struct transfer_struct *get_frame_noblock(struct transfer_struct **list)
 	return ret;
 }
 
+static uint32_t count_frames(struct transfer_struct *list)
+{
+	uint32_t cnt = 0;
+
+	while (list && list != LIST_END) {
+		cnt++;
+		list = list->next;
+	}
+	return cnt;
+}
+
+void usb_fill_stats(struct scsi_stats *stats)
+{
+	__disable_irq();
+	stats->cmd_frames_pending = count_frames(rx_cmd_busy_list);
+	stats->dout_frames_pending = count_frames(rx_dout_busy_list);
+	stats->tx_frames_free = count_frames(tx_free_list);
+	__enable_irq();
+	stats->tx_frames_total = TX_NUM;
+}
+
 void put_frame(struct transfer_struct **list, struct transfer_struct *t)
 {
 	struct transfer_struct *tmp;
@@ -191,6 +229,7 @@ int tx_uas_response(transfer_t *xfer, int ep, int len)
 	if (!(status & 0x80)) {
 		if (status & 0x68) {
 			// TODO: what if status has errors???
+			scsi_stats.usb_tx_errors++;
 			printf("ERROR status = %x, ms=%u\n",
 			       status, systick_millis_count);
 		}
@@ -383,13 +422,27 @@ static void endpoint0_receive(void *data, uint32_t len, int notify)
 
 static void endpoint0_complete(void)
 {
+	setup_t setup;
+	uint32_t val;
+
+	setup.bothwords = endpoint0_setupdata.bothwords;
+	if (setup.wRequestAndType == 0x0440) { // vendor SET_TUNABLE, the main loop applies it
+		memcpy(&val, endpoint0_buffer, sizeof(val));
+		scsi_set_tunable(setup.wIndex, val);
+	} else if (setup.wRequestAndType == 0x0540) { // vendor SELFTEST
+		scsi_selftest_start((struct scsi_selftest_params *)vendor_buffer);
+	} else if (setup.wRequestAndType == 0x0840) { // vendor PUT_TRACE
+		scsi_trace_write(vendor_buffer, setup.wLength,
+				 setup.wValue | (setup.wIndex << 16));
+	}
 }
 
 static void endpoint0_setup(uint64_t setupdata)
 {
 	setup_t setup;
-	uint32_t endpoint, dir, ctrl;
+	uint32_t endpoint, dir, ctrl, val;
 	const usb_descriptor_list_t *list;
+	int len;
 
 	setup.bothwords = setupdata;
 	switch (setup.wRequestAndType) {
@@ -513,6 +566,57 @@ static void endpoint0_setup(uint64_t setupdata)
 		  endpoint0_buffer[0] = usb_uas_interface_alt;
 		  endpoint0_transmit(endpoint0_buffer, 1, 0);
 		  return;
+	  case 0xFEA1: // BOT GET MAX LUN
+		// the scan only runs at the first command, unmapped LUNs
+		// answer INQUIRY with peripheral qualifier 3
+		endpoint0_buffer[0] = SCSI_LUNS - 1;
+		endpoint0_transmit(endpoint0_buffer, 1, 0);
+		return;
+	  case 0x01C0: // vendor GET_STATS
+		len = scsi_stats_read(vendor_buffer, setup.wLength);
+		endpoint0_transmit(vendor_buffer, len, 0);
+		return;
+	  case 0x0240: // vendor RESET_STATS
+		scsi_stats_reset();
+		endpoint0_receive(NULL, 0, 0);
+		return;
+	  case 0x03C0: // vendor GET_TUNABLE
+		if (setup.wLength < sizeof(val) || scsi_get_tunable(setup.wIndex, &val))
+			break;
+		memcpy(reply_buffer, &val, sizeof(val));
+		endpoint0_transmit(reply_buffer, sizeof(val), 0);
+		return;
+	  case 0x0440: // vendor SET_TUNABLE
+		if (setup.wLength != sizeof(val) || scsi_get_tunable(setup.wIndex, &val))
+			break;
+		endpoint0_setupdata.bothwords = setupdata;
+		endpoint0_receive(endpoint0_buffer, sizeof(val), 1);
+		return;
+	  case 0x0540: // vendor SELFTEST
+		if (setup.wLength != sizeof(struct scsi_selftest_params))
+			break;
+		endpoint0_setupdata.bothwords = setupdata;
+		endpoint0_receive(vendor_buffer, setup.wLength, 1);
+		return;
+	  case 0x0640: // vendor TRACE
+		if (scsi_trace_control(setup.wValue))
+			break;
+		endpoint0_receive(NULL, 0, 0);
+		return;
+	  case 0x07C0: // vendor GET_TRACE
+		len = scsi_trace_read(vendor_buffer, setup.wLength > sizeof(vendor_buffer) ?
+				      sizeof(vendor_buffer) : setup.wLength,
+				      setup.wValue | (setup.wIndex << 16));
+		if (len < 0)
+			break;
+		endpoint0_transmit(vendor_buffer, len, 0);
+		return;
+	  case 0x0840: // vendor PUT_TRACE
+		if (!setup.wLength || setup.wLength > SCSI_TRACE_CHUNK * sizeof(struct scsi_trace_rec))
+			break;
+		endpoint0_setupdata.bothwords = setupdata;
+		endpoint0_receive(vendor_buffer, setup.wLength, 1);
+		return;
 	}
         USB1_ENDPTCTRL0 = 0x000010001; // stall
 }
@@ -635,14 +739,31 @@ void usb_prepare_transfer(transfer_t *transfer, uint32_t len)
 	transfer->pointer1 &= ~0xfff;
 }
 
+/*
+ * ENDPTSTATUS reads schedule_transfer() spends on an endpoint whose list
+ * was reaped before the controller let go of it. That takes a dTD fetch,
+ * one that is still busy after this many is primed anyway.
+ */
+#define ENDPT_IDLE_SPINS 1000
+
 static void schedule_transfer(endpoint_t *endpoint, uint32_t epmask, transfer_t *transfer)
 {
 	volatile uint32_t status;
+	transfer_t *last;
+	int spins = ENDPT_IDLE_SPINS;
 
 	transfer->status |= (1<<15);
 
-	__disable_irq();
-	transfer_t *last = endpoint->last_transfer;
+	// the list can be reaped before the controller is done fetching
+	// past its end, don't touch the dQH until it is; interrupts are
+	// on between the reads
+	for (;;) {
+		__disable_irq();
+		last = endpoint->last_transfer;
+		if (last || !(USB1_ENDPTSTATUS & epmask) || !--spins)
+			break;
+		__enable_irq();
+	}
 	if (last) {
 		last->next = transfer;
 
@@ -658,12 +779,22 @@ static void schedule_transfer(endpoint_t *endpoint, uint32_t epmask, transfer_t
 
 		if (status & epmask)
 			goto end;
+		// Active is clear: the controller got here through last->next
+		// before it went idle and has retired this dTD too. It stays
+		// on the list, its completion interrupt is pending and
+		// run_callbacks() finds it from first_transfer, and the next
+		// one linked behind it gets primed. Priming this one would end
+		// the list before anything linked while PRIME is set.
+		if (!(transfer->status & (1<<7)))
+			goto end;
 	}
 
 	endpoint->next = transfer;
 	endpoint->status = 0;
 	USB1_ENDPTPRIME |= epmask;
-	endpoint->first_transfer = transfer;
+	// completed dTDs still waiting for run_callbacks() stay on the list
+	if (!last)
+		endpoint->first_transfer = transfer;
 end:
 	endpoint->last_transfer = transfer;
 	__enable_irq();
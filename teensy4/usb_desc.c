@@ -36,7 +36,11 @@
 #include "usb_names.h"
 #include "imxrt.h"
 #include "avr_functions.h"
+#ifdef SCSI_SIM
+#include "sim_usb.h"
+#else
 #include "avr/pgmspace.h"
+#endif
 
 // At very slow CPU speeds, the OCRAM just isn't fast enough for
 // USB to work reliably.  But the precious/limited DTCM is.  So
@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include "scsi_names.h"
+
+const char *scsi_opcode_name(uint8_t op)
+{
+	switch (op) {
+	case 0x00: return "TEST UNIT READY";
+	case 0x03: return "REQUEST SENSE";
+	case 0x04: return "FORMAT UNIT";
+	case 0x08: return "READ(6)";
+	case 0x0a: return "WRITE(6)";
+	case 0x12: return "INQUIRY";
+	case 0x15: return "MODE SELECT(6)";
+	case 0x1a: return "MODE SENSE(6)";
+	case 0x1b: return "START STOP UNIT";
+	case 0x1e: return "PREVENT ALLOW MEDIUM REMOVAL";
+	case 0x25: return "READ CAPACITY";
+	case 0x28: return "READ(10)";
+	case 0x2a: return "WRITE(10)";
+	case 0x35: return "SYNCHRONIZE CACHE";
+	case 0x43: return "READ TOC";
+	case 0x55: return "MODE SELECT(10)";
+	case 0x5a: return "MODE SENSE(10)";
+	case 0xa0: return "REPORT LUNS";
+	default: return "";
+	}
+}
+
+const char *scsi_status_name(uint8_t status)
+{
+	switch (status) {
+	case 0x00: return "GOOD";
+	case 0x02: return "CHECK CONDITION";
+	case 0x04: return "CONDITION MET";
+	case 0x08: return "BUSY";
+	case 0x18: return "RESERVATION CONFLICT";
+	case 0x28: return "QUEUE FULL";
+	default: return "";
+	}
+}
@@ -0,0 +1,9 @@
+#ifndef TOOLS_SCSI_NAMES_H
+#define TOOLS_SCSI_NAMES_H
+
+#include <stdint.h>
+
+const char *scsi_opcode_name(uint8_t op);
+const char *scsi_status_name(uint8_t status);
+
+#endif
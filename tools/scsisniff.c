@@ -0,0 +1,274 @@
+/*
+ * Host side of the passive bus monitor (teensy4/sniffer.c): reads the
+ * record stream from the bulk DATA IN endpoint and prints the decoded
+ * bus transactions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "usbdev.h"
+#include "scsi_names.h"
+#include "../teensy4/sniffer.h"
+
+#define FRAME_SIZE 16384
+#define DIN_EP 0x82
+
+static const char *phase_names[] = {
+	"MSG IN", "MSG OUT", "PHASE 5", "PHASE 4",
+	"STATUS", "COMMAND", "DATA IN", "DATA OUT",
+};
+
+static uint64_t last_cycles;
+static uint32_t cpu_hz = 600000000;
+static int hexdump;
+
+static double timestamp(uint32_t cycles)
+{
+	uint32_t delta = cycles - (uint32_t)last_cycles;
+
+	last_cycles += delta;
+	return (double)last_cycles / cpu_hz;
+}
+
+static void print_msgs(const uint8_t *p, int len)
+{
+	int i = 0;
+
+	while (i < len) {
+		uint8_t msg = p[i];
+
+		if (msg & 0x80) {
+			printf(" IDENTIFY(lun %d%s)", msg & 7, msg & 0x40 ? ",disc" : "");
+			i++;
+		} else if (msg >= 0x20 && msg <= 0x2f && i + 1 < len) {
+			printf(" %s(%02x)", msg == 0x20 ? "SIMPLE TAG" :
+			       msg == 0x21 ? "HEAD OF QUEUE TAG" :
+			       msg == 0x22 ? "ORDERED TAG" : "TAG", p[i + 1]);
+			i += 2;
+		} else if (msg == 0x01 && i + 1 < len) {
+			printf(" EXTENDED(%02x)", i + 2 < len ? p[i + 2] : 0);
+			i += p[i + 1] + 2;
+		} else {
+			switch (msg) {
+			case 0x00: printf(" COMMAND COMPLETE"); break;
+			case 0x02: printf(" SAVE DATA POINTERS"); break;
+			case 0x03: printf(" RESTORE POINTERS"); break;
+			case 0x04: printf(" DISCONNECT"); break;
+			case 0x06: printf(" ABORT"); break;
+			case 0x07: printf(" MESSAGE REJECT"); break;
+			case 0x08: printf(" NOP"); break;
+			case 0x0c: printf(" BUS DEVICE RESET"); break;
+			case 0x0d: printf(" ABORT TAG"); break;
+			default: printf(" %02x", msg); break;
+			}
+			i++;
+		}
+	}
+}
+
+static void print_hex(const uint8_t *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (!(i % 16))
+			printf("\n\t\t   %04x:", i);
+		printf(" %02x", p[i]);
+	}
+}
+
+static void print_ids(uint8_t ids)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		if (ids & (1 << i))
+			printf(" %d", i);
+}
+
+static void print_phase(const struct sniff_record *rec, const uint8_t *p)
+{
+	int i, len = rec->len;
+	uint32_t total = len;
+
+	if (rec->type & SNIFF_FLAG_TRUNC) {
+		len -= 4;
+		memcpy(&total, p + len, 4);
+	}
+
+	printf("  %-8s", phase_names[rec->arg & 7]);
+	switch (rec->arg & 7) {
+	case 0:
+	case 1:
+		print_msgs(p, len);
+		break;
+	case 4:
+		if (len)
+			printf(" %02x %s", p[0], scsi_status_name(p[0]));
+		break;
+	case 5:
+		for (i = 0; i < len; i++)
+			printf(" %02x", p[i]);
+		if (len)
+			printf(" %s", scsi_opcode_name(p[0]));
+		break;
+	default:
+		printf(" %u bytes%s", total,
+		       rec->type & SNIFF_FLAG_CONT ? " (cont)" : "");
+		if (hexdump)
+			print_hex(p, len);
+		break;
+	}
+	if (rec->type & SNIFF_FLAG_PARITY)
+		printf(" PARITY ERROR");
+	printf("\n");
+}
+
+static void print_record(const struct sniff_record *rec, const uint8_t *p)
+{
+	const struct sniff_stats *stats = (const void *)p;
+	double t = timestamp(rec->cycles);
+
+	switch (rec->type & SNIFF_REC_TYPE_MASK) {
+	case SNIFF_REC_BUS_FREE:
+		printf("%12.6f BUS FREE\n", t);
+		break;
+	case SNIFF_REC_ARBITRATION:
+		printf("%12.6f ARBITRATION", t);
+		print_ids(rec->arg);
+		printf("\n");
+		break;
+	case SNIFF_REC_SELECTION:
+	case SNIFF_REC_RESELECTION:
+		printf("%12.6f %s", t, (rec->type & SNIFF_REC_TYPE_MASK) ==
+		       SNIFF_REC_SELECTION ? "SELECTION" : "RESELECTION");
+		print_ids(rec->arg);
+		printf("%s\n", rec->type & SNIFF_FLAG_ATN ? " ATN" : "");
+		break;
+	case SNIFF_REC_SEL_TIMEOUT:
+		printf("%12.6f SELECTION TIMEOUT", t);
+		print_ids(rec->arg);
+		printf("\n");
+		break;
+	case SNIFF_REC_RESET:
+		printf("%12.6f BUS RESET\n", t);
+		break;
+	case SNIFF_REC_PHASE:
+		printf("%12.6f", t);
+		print_phase(rec, p);
+		break;
+	case SNIFF_REC_STATS:
+		if (rec->len < sizeof(*stats))
+			break;
+		if (stats->cpu_hz)
+			cpu_hz = stats->cpu_hz;
+		printf("%12.6f STATS records %u bytes %u dropped records %u dropped bytes %u overruns %u\n",
+		       t, stats->records, stats->bytes, stats->dropped_records,
+		       stats->dropped_bytes, stats->overruns);
+		break;
+	default:
+		break;
+	}
+}
+
+static void parse_frame(const uint8_t *buf, int len)
+{
+	const struct sniff_record *rec;
+	int pos = 0;
+
+	while (pos + (int)sizeof(*rec) <= len) {
+		rec = (const void *)(buf + pos);
+		pos += sizeof(*rec);
+		if (rec->type == SNIFF_REC_PAD)
+			continue;
+		if (pos + rec->len > len) {
+			fprintf(stderr, "truncated record\n");
+			return;
+		}
+		print_record(rec, buf + pos);
+		pos += (rec->len + 3) & ~3;
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-x] [-w file] [-r file]\n"
+		"  -x       hexdump data phases\n"
+		"  -w file  save the raw record stream\n"
+		"  -r file  decode a saved record stream\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[FRAME_SIZE];
+	FILE *in = NULL, *out = NULL;
+	int fd = -1, len, c;
+
+	while ((c = getopt(argc, argv, "xw:r:h")) != -1) {
+		switch (c) {
+		case 'x':
+			hexdump = 1;
+			break;
+		case 'w':
+			out = fopen(optarg, "wb");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			in = fopen(optarg, "rb");
+			if (!in) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!in) {
+		fd = usbdev_open(BRIDGE_VID, BRIDGE_PID);
+		if (fd < 0) {
+			fprintf(stderr, "no bridge found\n");
+			return 1;
+		}
+		if (usbdev_claim(fd, 0) < 0) {
+			perror("claim interface");
+			return 1;
+		}
+	}
+
+	for (;;) {
+		if (in) {
+			uint16_t flen;
+
+			if (fread(&flen, sizeof(flen), 1, in) != 1 ||
+			    flen > sizeof(buf) || fread(buf, flen, 1, in) != 1)
+				break;
+			len = flen;
+		} else {
+			len = usbdev_bulk(fd, DIN_EP, buf, sizeof(buf), 0);
+			if (len < 0) {
+				perror("bulk read");
+				break;
+			}
+		}
+		if (out) {
+			uint16_t flen = len;
+
+			fwrite(&flen, sizeof(flen), 1, out);
+			fwrite(buf, len, 1, out);
+		}
+		parse_frame(buf, len);
+		fflush(stdout);
+	}
+	if (out)
+		fclose(out);
+	return 0;
+}
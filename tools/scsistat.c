@@ -0,0 +1,444 @@
+/*
+ * Poll the bridge statistics, get/set runtime tunables and run the raw
+ * bus self-test through the vendor control requests in teensy4/usb.c.
+ * Only device directed control transfers are used, so the tool works
+ * while the kernel uas or usb-storage driver owns the interface.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "usbdev.h"
+#include "scsi_names.h"
+#include "../teensy4/scsi_stats.h"
+
+#define VENDOR_IN 0xc0
+#define VENDOR_OUT 0x40
+#define TIMEOUT 1000
+
+static const char *tunable_names[SCSI_TUNABLE_MAX] = {
+	[SCSI_TUNABLE_HOSTID] = "hostid",
+	[SCSI_TUNABLE_BUS_SETTLE_DELAY] = "bus_settle_delay",
+	[SCSI_TUNABLE_BUS_CLEAR_DELAY] = "bus_clear_delay",
+	[SCSI_TUNABLE_ARBITRATION_DELAY] = "arbitration_delay",
+	[SCSI_TUNABLE_SELECT_TIMEOUT] = "select_timeout",
+	[SCSI_TUNABLE_RAMDISK] = "ramdisk",
+	[SCSI_TUNABLE_CLOCK_BOOST] = "clock_boost",
+	[SCSI_TUNABLE_CLOCK_IDLE] = "clock_idle",
+	[SCSI_TUNABLE_CLOCK_IDLE_MS] = "clock_idle_ms",
+	[SCSI_TUNABLE_CLOCK_TEMP_LIMIT] = "clock_temp_limit",
+	[SCSI_TUNABLE_TASK_SLICE_US] = "task_slice_us",
+	[SCSI_TUNABLE_DISCONNECT_US] = "disconnect_us",
+	[SCSI_TUNABLE_STALL_US] = "stall_us",
+	[SCSI_TUNABLE_ELEVATOR_US] = "elevator_us",
+	[SCSI_TUNABLE_RESP_CACHE] = "resp_cache",
+};
+
+static const char *phase_names[] = {
+	"msg in", "msg out", "phase 5", "phase 4",
+	"status", "command", "data in", "data out",
+};
+
+static int read_stats(int fd, struct scsi_stats *s)
+{
+	int len;
+
+	memset(s, 0, sizeof(*s));
+	len = usbdev_control(fd, VENDOR_IN, SCSI_VENDOR_GET_STATS, 0, 0,
+			     s, sizeof(*s), TIMEOUT);
+	if (len < 4) {
+		perror("GET_STATS");
+		return -1;
+	}
+	if (s->length > len)
+		s->length = len;
+	if (s->version != SCSI_STATS_VERSION)
+		fprintf(stderr, "warning: firmware stats version %d, tool version %d\n",
+			s->version, SCSI_STATS_VERSION);
+	return 0;
+}
+
+static const char *selftest_modes[] = { "read", "write", "tur" };
+static const char *selftest_states[] = { "idle", "running", "done", "failed" };
+
+static void print_selftest(const struct scsi_stats *s)
+{
+	const struct scsi_selftest_result *r;
+	int i;
+
+	printf("self-test %s\n", s->selftest_state < 4 ?
+	       selftest_states[s->selftest_state] : "?");
+	if (!s->selftest_steps)
+		return;
+	printf("  mode  pattern     size   commands errors     MB/s     IOPS  overhead us\n");
+	for (i = 0; i < s->selftest_steps && i < SCSI_SELFTEST_MAX_STEPS; i++) {
+		r = s->selftest + i;
+		printf("  %-5s %-7s %8u %10u %6u %8.2f %8u %12.2f\n",
+		       r->mode < 3 ? selftest_modes[r->mode] : "?",
+		       r->pattern == SCSI_SELFTEST_RANDOM ? "random" :
+		       r->pattern == SCSI_SELFTEST_SEQUENTIAL ? "seq" : "-",
+		       r->xfer_size, r->commands, r->errors,
+		       r->kbytes_per_sec / 1000.0, r->iops, r->overhead_ns / 1000.0);
+	}
+}
+
+static int run_selftest(int fd, const char *mode, struct scsi_selftest_params *p)
+{
+	struct scsi_stats s;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (!strcmp(mode, selftest_modes[i]))
+			break;
+	if (i == 3) {
+		fprintf(stderr, "unknown self-test %s\n", mode);
+		return -1;
+	}
+	p->mode = i;
+	if (usbdev_control(fd, VENDOR_OUT, SCSI_VENDOR_SELFTEST, 0, 0,
+			   p, sizeof(*p), TIMEOUT) < 0) {
+		perror("SELFTEST");
+		return -1;
+	}
+	/* the firmware starts it from its main loop */
+	do {
+		usleep(200000);
+		if (read_stats(fd, &s))
+			return -1;
+	} while (s.selftest_state == SCSI_SELFTEST_IDLE ||
+		 s.selftest_state == SCSI_SELFTEST_RUNNING);
+	print_selftest(&s);
+	return s.selftest_state == SCSI_SELFTEST_DONE ? 0 : -1;
+}
+
+static double rate(uint64_t now, uint64_t prev, double secs)
+{
+	return secs > 0 ? (now - prev) / secs : 0;
+}
+
+static void print_stats(const struct scsi_stats *s, const struct scsi_stats *prev)
+{
+	double secs = prev ? (s->uptime_ms - prev->uptime_ms) / 1000.0 : 0;
+	int i;
+
+	printf("uptime %u.%03us, cpu %u MHz\n", s->uptime_ms / 1000,
+	       s->uptime_ms % 1000, s->cpu_hz / 1000000);
+
+	printf("commands %u", s->commands);
+	if (prev)
+		printf(" (%.0f/s)", rate(s->commands, prev->commands, secs));
+	printf("\nbytes in %llu out %llu", (unsigned long long)s->bytes_in,
+	       (unsigned long long)s->bytes_out);
+	if (prev)
+		printf(" (%.2f / %.2f MB/s)",
+		       rate(s->bytes_in, prev->bytes_in, secs) / 1e6,
+		       rate(s->bytes_out, prev->bytes_out, secs) / 1e6);
+	printf("\n");
+
+	for (i = 0; i < 256; i++) {
+		if (!s->opcodes[i])
+			continue;
+		printf("  %02x %-28s %u\n", i, scsi_opcode_name(i), s->opcodes[i]);
+	}
+
+	printf("tags in use %u (max %u), pending cmd frames %u, pending dout frames %u\n",
+	       s->tags_in_use, s->tags_max, s->cmd_frames_pending, s->dout_frames_pending);
+	printf("tx frames free %u/%u, frame waits %u\n",
+	       s->tx_frames_free, s->tx_frames_total, s->frame_waits);
+
+	printf("phase        count     avg us\n");
+	for (i = 0; i < 8; i++) {
+		if (!s->phase_count[i])
+			continue;
+		printf("  %-8s %9u %10.2f\n", phase_names[i], s->phase_count[i],
+		       s->cpu_hz ? (double)s->phase_cycles[i] / s->phase_count[i] /
+		       s->cpu_hz * 1e6 : 0);
+	}
+
+	printf("errors: select timeouts %u, unexpected disconnects %u, rejected msgs %u,\n"
+	       "        unknown tags %u, no free tag %u, short requests %u,\n"
+	       "        check conditions %u, busy/queue full %u, usb tx errors %u\n",
+	       s->select_timeouts, s->unexpected_disconnects, s->rejected_msgs,
+	       s->unknown_tags, s->no_free_tag, s->short_requests,
+	       s->check_conditions, s->busy_status, s->usb_tx_errors);
+
+	if (s->length >= offsetof(struct scsi_stats, clock_hz) &&
+	    s->selftest_state != SCSI_SELFTEST_IDLE)
+		print_selftest(s);
+
+	if (s->length >= offsetof(struct scsi_stats, idle_sleeps)) {
+		static const char *levels[] = { "boost", "nominal", "idle" };
+
+		printf("clock        MHz    seconds, %u changes, %u throttles, die %d C\n",
+		       s->clock_changes, s->clock_throttles, s->die_temp);
+		for (i = 0; i < SCSI_CLOCK_LEVELS; i++)
+			printf("  %-8s %5u %10.3f\n", levels[i], s->clock_hz[i] / 1000000,
+			       s->clock_ms[i] / 1000.0);
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, task_runs)) {
+		printf("idle: %u sleeps, %.3f s, bus resets %u\n",
+		       s->idle_sleeps, s->idle_us / 1e6, s->bus_resets);
+		printf("reselection: %u woken up for, latency %.2f us, max %.2f us\n",
+		       s->resel_wakes, s->resel_latency_ns / 1e3,
+		       s->resel_latency_max_ns / 1e3);
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, scans)) {
+		static const char *tasks[] = {
+			"session", "intake", "status", "backgrnd", "stats"
+		};
+
+		printf("task          runs         ms     max us\n");
+		for (i = 0; i < SCSI_TASKS; i++)
+			printf("  %-8s %9u %10.3f %10.2f\n", tasks[i], s->task_runs[i],
+			       s->cpu_hz ? s->task_cycles[i] * 1e3 / s->cpu_hz : 0,
+			       s->cpu_hz ? s->task_max_cycles[i] * 1e6 / s->cpu_hz : 0);
+		printf("yields %u, queued commands %u (max %u), queued status max %u\n",
+		       s->task_yields, s->cmd_queued, s->cmd_queued_max,
+		       s->status_queued_max);
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, saved_pointers)) {
+		printf("scans %u, luns %u:", s->scans, s->luns);
+		for (i = 0; i < s->luns && i < SCSI_LUNS; i++)
+			printf(" %u=%u:%u", i, s->lun_map[i] >> 3, s->lun_map[i] & 7);
+		printf("\ncommands by ID:");
+		for (i = 0; i < 8; i++)
+			printf(" %u", s->target_commands[i]);
+		printf("\n");
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, disc_granted))
+		printf("data pointers: %u saved, %u restored, %u lost\n",
+		       s->saved_pointers, s->restored_pointers, s->lost_pointers);
+
+	if (s->length >= offsetof(struct scsi_stats, stalls))
+		printf("disconnect: %u granted, %u back early, %u withheld, %u slow,\n"
+		       "  reselection %.2f us, %.3f ms saved\n",
+		       s->disc_granted, s->disc_granted_fast, s->disc_withheld,
+		       s->disc_withheld_slow, s->resel_ns / 1e3, s->disc_saved_ns / 1e6);
+
+	if (s->length >= offsetof(struct scsi_stats, requeued))
+		printf("usb stalls: %u, %u disconnected, %u refused\n",
+		       s->stalls, s->stall_disconnects, s->stall_refused);
+
+	if (s->length >= offsetof(struct scsi_stats, elevator_reorders)) {
+		printf("busy or queue full: %u requeued\nqueue depth by ID:", s->requeued);
+		for (i = 0; i < 8; i++)
+			printf(" %u/%u", s->queue_depth[i], s->queue_depth_max[i]);
+		printf("\n");
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, task_attrs)) {
+		printf("elevator: %u reordered, %u expired, %lld blocks of seeking saved",
+		       s->elevator_reorders, s->elevator_expired,
+		       (long long)s->elevator_saved);
+		if (prev && secs > 0)
+			printf(" (%.0f/s)", (s->elevator_saved - prev->elevator_saved) / secs);
+		printf("\n");
+	}
+
+	if (s->length >= offsetof(struct scsi_stats, task_mgmt))
+		printf("task attributes: %u simple, %u head of queue, %u ordered\n",
+		       s->task_attrs[0], s->task_attrs[1], s->task_attrs[2]);
+
+	if (s->length >= offsetof(struct scsi_stats, auto_sense))
+		printf("task management: %u, %u failed, %u tasks aborted, %u lun resets,\n"
+		       "  recovery %.3f ms, avg %.3f ms, max %.3f ms\n",
+		       s->task_mgmt, s->task_mgmt_failed, s->tasks_aborted, s->lun_resets,
+		       s->task_mgmt_us / 1e3,
+		       s->task_mgmt ? s->task_mgmt_total_us / 1e3 / s->task_mgmt : 0.0,
+		       s->task_mgmt_max_us / 1e3);
+
+	if (s->length >= offsetof(struct scsi_stats, resp_cache_hits))
+		printf("auto sense: %u, %u without sense, %u bot requests from the cache\n",
+		       s->auto_sense, s->auto_sense_failed, s->sense_cached);
+
+	if (s->length >= offsetof(struct scsi_stats, session_waits))
+		printf("response cache: %u hits, %u filled, %u invalidated\n",
+		       s->resp_cache_hits, s->resp_cache_fills, s->resp_cache_invalidated);
+
+	if (s->length >= offsetof(struct scsi_stats, resel_rejected))
+		printf("sessions: %u back to the main loop\n", s->session_waits);
+
+	if (s->length >= sizeof(*s))
+		printf("reselections: %u rejected for their IDs\n", s->resel_rejected);
+}
+
+static int find_tunable(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SCSI_TUNABLE_MAX; i++)
+		if (tunable_names[i] && !strcmp(tunable_names[i], name))
+			return i;
+	fprintf(stderr, "unknown tunable %s\n", name);
+	return -1;
+}
+
+static int get_tunable(int fd, int id, uint32_t *val)
+{
+	if (usbdev_control(fd, VENDOR_IN, SCSI_VENDOR_GET_TUNABLE, 0, id,
+			   val, sizeof(*val), TIMEOUT) != sizeof(*val)) {
+		perror("GET_TUNABLE");
+		return -1;
+	}
+	return 0;
+}
+
+static int set_tunable(int fd, const char *arg)
+{
+	char name[64];
+	uint32_t val, readback;
+	const char *eq = strchr(arg, '=');
+	int id;
+
+	if (!eq || eq - arg >= sizeof(name)) {
+		fprintf(stderr, "expected name=value\n");
+		return -1;
+	}
+	memcpy(name, arg, eq - arg);
+	name[eq - arg] = '\0';
+	id = find_tunable(name);
+	if (id < 0)
+		return -1;
+	val = strtoul(eq + 1, NULL, 0);
+	if (usbdev_control(fd, VENDOR_OUT, SCSI_VENDOR_SET_TUNABLE, 0, id,
+			   &val, sizeof(val), TIMEOUT) < 0) {
+		perror("SET_TUNABLE");
+		return -1;
+	}
+	/* out of range values are dropped by the firmware */
+	if (get_tunable(fd, id, &readback))
+		return -1;
+	if (readback != val) {
+		fprintf(stderr, "%s: value %u rejected, still %u\n", name, val, readback);
+		return -1;
+	}
+	return 0;
+}
+
+static void list_tunables(int fd)
+{
+	uint32_t val;
+	int i;
+
+	for (i = 0; i < SCSI_TUNABLE_MAX; i++)
+		if (!get_tunable(fd, i, &val))
+			printf("%-20s %u\n", tunable_names[i], val);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-w secs] [-R] [-l] [-g name] [-s name=value]\n"
+		"          [-d ms] [-p seq|random|both] [-z sizemask] [-L lun] [-W]\n"
+		"          [-T read|write|tur]\n"
+		"  -w secs       poll statistics every secs seconds\n"
+		"  -R            reset counters\n"
+		"  -l            list tunables\n"
+		"  -g name       print a tunable\n"
+		"  -s name=value set a tunable\n"
+		"  -T test       run the raw bus self-test, options must come first:\n"
+		"  -d ms         duration of each step (default 1000)\n"
+		"  -p pattern    access pattern (default both)\n"
+		"  -z sizemask   bit n selects 512 << n byte transfers (default 0x1a9:\n"
+		"                512, 4k, 16k, 64k, 128k)\n"
+		"  -L lun        host LUN to test (default 0)\n"
+		"  -W            allow the write test, destroys data on the target\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct scsi_selftest_params st = {
+		.patterns = SCSI_SELFTEST_SEQUENTIAL | SCSI_SELFTEST_RANDOM,
+		.sizes = 0x1a9,
+		.duration_ms = 1000,
+	};
+	struct scsi_stats cur, prev;
+	int fd, c, interval = 0, done = 0;
+	uint32_t val;
+
+	fd = usbdev_open(BRIDGE_VID, BRIDGE_PID);
+	if (fd < 0) {
+		fprintf(stderr, "no bridge found\n");
+		return 1;
+	}
+
+	while ((c = getopt(argc, argv, "w:Rlg:s:d:p:z:L:WT:h")) != -1) {
+		switch (c) {
+		case 'w':
+			interval = atoi(optarg);
+			break;
+		case 'R':
+			if (usbdev_control(fd, VENDOR_OUT, SCSI_VENDOR_RESET_STATS,
+					   0, 0, NULL, 0, TIMEOUT) < 0) {
+				perror("RESET_STATS");
+				return 1;
+			}
+			done = 1;
+			break;
+		case 'l':
+			list_tunables(fd);
+			done = 1;
+			break;
+		case 'g':
+			c = find_tunable(optarg);
+			if (c < 0 || get_tunable(fd, c, &val))
+				return 1;
+			printf("%u\n", val);
+			done = 1;
+			break;
+		case 's':
+			if (set_tunable(fd, optarg))
+				return 1;
+			done = 1;
+			break;
+		case 'd':
+			st.duration_ms = atoi(optarg);
+			break;
+		case 'p':
+			st.patterns = !strcmp(optarg, "seq") ? SCSI_SELFTEST_SEQUENTIAL :
+				!strcmp(optarg, "random") ? SCSI_SELFTEST_RANDOM :
+				SCSI_SELFTEST_SEQUENTIAL | SCSI_SELFTEST_RANDOM;
+			break;
+		case 'z':
+			st.sizes = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			st.lun = atoi(optarg);
+			break;
+		case 'W':
+			st.flags |= SCSI_SELFTEST_ALLOW_WRITE;
+			break;
+		case 'T':
+			if (run_selftest(fd, optarg, &st))
+				return 1;
+			done = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (done && !interval)
+		return 0;
+
+	if (read_stats(fd, &cur))
+		return 1;
+	print_stats(&cur, NULL);
+
+	while (interval) {
+		sleep(interval);
+		prev = cur;
+		if (read_stats(fd, &cur))
+			return 1;
+		printf("\n");
+		print_stats(&cur, &prev);
+	}
+	return 0;
+}
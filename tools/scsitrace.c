@@ -0,0 +1,237 @@
+/*
+ * Record command traces from the bridge, replay them against the
+ * target through the self-test path and report throughput and latency
+ * percentiles. gen writes synthetic workloads that the simulation
+ * (sim/scsisim -t) and replay both take.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "usbdev.h"
+#include "trace.h"
+
+#define VENDOR_IN 0xc0
+#define VENDOR_OUT 0x40
+#define TIMEOUT 1000
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int trace_ctl(int fd, unsigned int mode)
+{
+	if (usbdev_control(fd, VENDOR_OUT, SCSI_VENDOR_TRACE, mode, 0, NULL, 0, TIMEOUT) < 0) {
+		perror("TRACE");
+		return -1;
+	}
+	return 0;
+}
+
+/* up to SCSI_TRACE_CHUNK records from seq on, returns the header */
+static int get_trace(int fd, uint32_t seq, struct scsi_trace_hdr *h, struct scsi_trace_rec *r)
+{
+	uint8_t buf[sizeof(*h) + SCSI_TRACE_CHUNK * sizeof(*r)];
+	int len;
+
+	len = usbdev_control(fd, VENDOR_IN, SCSI_VENDOR_GET_TRACE, seq & 0xffff, seq >> 16,
+			     buf, sizeof(buf), TIMEOUT);
+	if (len < (int)sizeof(*h)) {
+		perror("GET_TRACE");
+		return -1;
+	}
+	memcpy(h, buf, sizeof(*h));
+	if (h->count > SCSI_TRACE_CHUNK || sizeof(*h) + h->count * sizeof(*r) > len) {
+		fprintf(stderr, "GET_TRACE: bad reply\n");
+		return -1;
+	}
+	memcpy(r, buf + sizeof(*h), h->count * sizeof(*r));
+	return 0;
+}
+
+static int record(int fd, const char *path, int secs, uint32_t blocksize)
+{
+	struct scsi_trace_rec r[SCSI_TRACE_CHUNK];
+	struct scsi_trace_hdr h;
+	struct trace t = { .blocksize = blocksize };
+	uint32_t seq = 0, lost = 0;
+	time_t end = time(NULL) + secs;
+	int draining = 0;
+
+	if (trace_ctl(fd, SCSI_TRACE_OFF) || trace_ctl(fd, SCSI_TRACE_RECORD))
+		return -1;
+	signal(SIGINT, on_signal);
+	fprintf(stderr, "recording, ^C to stop\n");
+	for (;;) {
+		if (!draining && (stop || (secs && time(NULL) >= end))) {
+			if (trace_ctl(fd, SCSI_TRACE_OFF))
+				return -1;
+			draining = 1;
+		}
+		if (get_trace(fd, seq, &h, r))
+			return -1;
+		if (h.seq != seq)
+			lost += h.seq - seq;
+		trace_append(&t, r, h.count);
+		seq = h.seq + h.count;
+		if (h.count)
+			continue;
+		if (draining)
+			break;
+		usleep(20000);
+	}
+	if (lost)
+		fprintf(stderr, "%u records lost, poll faster or trace less\n", lost);
+	if (trace_save(&t, path))
+		return -1;
+	trace_report(&t, stdout);
+	return 0;
+}
+
+static int put_window(int fd, const struct scsi_trace_rec *r, uint32_t n)
+{
+	uint32_t seq, k;
+
+	for (seq = 0; seq < n; seq += k) {
+		k = n - seq < SCSI_TRACE_CHUNK ? n - seq : SCSI_TRACE_CHUNK;
+		if (usbdev_control(fd, VENDOR_OUT, SCSI_VENDOR_PUT_TRACE, seq & 0xffff, seq >> 16,
+				   (void *)(r + seq), k * sizeof(*r), TIMEOUT) < 0) {
+			perror("PUT_TRACE");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The firmware holds SCSI_TRACE_RECORDS at a time, longer traces run
+ * in windows one after the other.
+ */
+static int replay(int fd, const char *path, const char *out, unsigned int mode)
+{
+	struct scsi_trace_rec win[SCSI_TRACE_RECORDS];
+	struct scsi_trace_hdr h;
+	struct trace t;
+	uint32_t w, n, i, base, offset = 0, end = 0, seq;
+
+	if (trace_load(&t, path))
+		return -1;
+	if (trace_ctl(fd, SCSI_TRACE_OFF))
+		return -1;
+	for (w = 0; w < t.count; w += n) {
+		n = t.count - w < SCSI_TRACE_RECORDS ? t.count - w : SCSI_TRACE_RECORDS;
+		base = t.rec[w].arrival_us;
+		for (i = 0; i < n; i++) {
+			win[i] = t.rec[w + i];
+			win[i].arrival_us -= base;
+		}
+		if (put_window(fd, win, n) || trace_ctl(fd, mode))
+			return -1;
+		do {
+			usleep(100000);
+			if (get_trace(fd, 0, &h, win))
+				return -1;
+		} while (h.state != SCSI_TRACE_OFF);
+		for (seq = 0; seq < n; seq += h.count) {
+			if (get_trace(fd, seq, &h, win + seq))
+				return -1;
+			if (!h.count || h.seq != seq) {
+				fprintf(stderr, "replay results incomplete\n");
+				return -1;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			t.rec[w + i].arrival_us = win[i].arrival_us + offset;
+			t.rec[w + i].done_us = win[i].done_us + offset;
+			t.rec[w + i].status = win[i].status;
+			if (win[i].status != SCSI_TRACE_NOT_RUN && t.rec[w + i].done_us > end)
+				end = t.rec[w + i].done_us;
+		}
+		offset = end;
+	}
+	if (out && trace_save(&t, out))
+		return -1;
+	trace_report(&t, stdout);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s record [-d secs] [-b blocksize] file\n"
+		"       %s replay [-f] [-W] [-o results] file\n"
+		"       %s report file\n"
+		"       %s gen [-c blocks] [-n count] [-S seed] workload file\n"
+		"  -d secs       stop recording after secs seconds instead of ^C\n"
+		"  -b bytes      block size for the byte counts (default 512)\n"
+		"  -f            replay back to back instead of at the original times\n"
+		"  -W            replay writes too, destroys data on the target\n"
+		"  -o file       save the replayed trace with its new times\n"
+		"  -c blocks     capacity to spread the workload over (default 262144)\n"
+		"  -n count      commands (default 10000)\n"
+		"workloads: %s\n", name, name, name, name, trace_workloads());
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int mode = SCSI_TRACE_REPLAY;
+	uint32_t blocksize = 512, capacity = 262144, count = 10000, seed = 0;
+	const char *out = NULL, *cmd;
+	struct trace t;
+	int c, secs = 0, fd;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	cmd = argv[1];
+	optind = 2;
+	while ((c = getopt(argc, argv, "d:b:fWo:c:n:S:h")) != -1) {
+		switch (c) {
+		case 'd': secs = atoi(optarg); break;
+		case 'b': blocksize = strtoul(optarg, NULL, 0); break;
+		case 'f': mode = (mode & ~SCSI_TRACE_MODE) | SCSI_TRACE_REPLAY_FAST; break;
+		case 'W': mode |= SCSI_TRACE_ALLOW_WRITE; break;
+		case 'o': out = optarg; break;
+		case 'c': capacity = strtoul(optarg, NULL, 0); break;
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		case 'S': seed = strtoul(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!strcmp(cmd, "report") && optind + 1 == argc) {
+		if (trace_load(&t, argv[optind]))
+			return 1;
+		trace_report(&t, stdout);
+		return 0;
+	}
+	if (!strcmp(cmd, "gen") && optind + 2 == argc) {
+		if (trace_generate(&t, argv[optind], capacity, count, seed)) {
+			fprintf(stderr, "unknown workload %s\n", argv[optind]);
+			return 1;
+		}
+		return trace_save(&t, argv[optind + 1]) ? 1 : 0;
+	}
+	if ((strcmp(cmd, "record") && strcmp(cmd, "replay")) || optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = usbdev_open(BRIDGE_VID, BRIDGE_PID);
+	if (fd < 0) {
+		fprintf(stderr, "no bridge found\n");
+		return 1;
+	}
+	if (!strcmp(cmd, "record"))
+		return record(fd, argv[optind], secs, blocksize) ? 1 : 0;
+	return replay(fd, argv[optind], out, mode) ? 1 : 0;
+}
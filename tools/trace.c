@@ -0,0 +1,301 @@
+/*
+ * Command trace files: loading, saving, synthetic workloads and the
+ * throughput and latency report shared by scsitrace and the simulation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+int trace_load(struct trace *t, const char *path)
+{
+	struct trace_file_hdr h;
+	FILE *f;
+
+	memset(t, 0, sizeof(*t));
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC ||
+	    h.version != TRACE_VERSION || h.rec_size != sizeof(struct scsi_trace_rec)) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		fclose(f);
+		return -1;
+	}
+	t->rec = malloc((uint64_t)h.count * sizeof(*t->rec) + 1);
+	if (!t->rec || fread(t->rec, sizeof(*t->rec), h.count, f) != h.count) {
+		fprintf(stderr, "%s: short trace\n", path);
+		fclose(f);
+		trace_free(t);
+		return -1;
+	}
+	fclose(f);
+	t->count = t->alloc = h.count;
+	t->blocksize = h.blocksize;
+	return 0;
+}
+
+int trace_save(const struct trace *t, const char *path)
+{
+	struct trace_file_hdr h = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.rec_size = sizeof(struct scsi_trace_rec),
+		.count = t->count,
+		.blocksize = t->blocksize,
+	};
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(t->rec, sizeof(*t->rec), t->count, f) != t->count || fclose(f)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+void trace_append(struct trace *t, const struct scsi_trace_rec *r, uint32_t n)
+{
+	if (t->count + n > t->alloc) {
+		t->alloc = (t->count + n) * 2;
+		t->rec = realloc(t->rec, t->alloc * sizeof(*t->rec));
+		if (!t->rec) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(t->rec + t->count, r, n * sizeof(*r));
+	t->count += n;
+}
+
+void trace_free(struct trace *t)
+{
+	free(t->rec);
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Synthetic stand-ins for captured workloads, until real captures take
+ * their place: the shape of the access pattern and of the arrival
+ * times, not any particular system.
+ */
+static uint32_t seed_x;
+
+static uint32_t rnd(void)
+{
+	seed_x ^= seed_x << 13;
+	seed_x ^= seed_x >> 17;
+	seed_x ^= seed_x << 5;
+	return seed_x;
+}
+
+static void add(struct trace *t, uint32_t *now, uint32_t gap_us, uint8_t opcode,
+		uint32_t lba, uint32_t blocks, uint32_t capacity)
+{
+	struct scsi_trace_rec r = { 0 };
+
+	*now += gap_us;
+	if (blocks > capacity)
+		blocks = capacity;
+	if (lba + blocks > capacity)
+		lba = capacity - blocks;
+	r.arrival_us = *now;
+	r.lba = lba;
+	r.blocks = blocks;
+	r.opcode = opcode;
+	r.tag = t->count;
+	r.status = SCSI_TRACE_NOT_RUN;
+	trace_append(t, &r, 1);
+}
+
+/*
+ * OS boot: mostly reads of 4 to 16 KB clustered in the system area
+ * at the start of the disk, some long sequential runs for the kernel
+ * and libraries, a few log writes, bursts separated by CPU time.
+ */
+static void gen_boot(struct trace *t, uint32_t capacity, uint32_t count)
+{
+	uint32_t now = 0, area = capacity / 4, lba, n, run;
+
+	while (t->count < count) {
+		if (rnd() % 20 == 0) {
+			/* burst over, the CPU works for 5 to 50 ms */
+			now += 5000 + rnd() % 45000;
+		}
+		if (rnd() % 60 == 0) {
+			lba = rnd() % area;
+			for (run = 4 + rnd() % 12; run && t->count < count; run--) {
+				add(t, &now, 4000 + rnd() % 6000, 0x28, lba, 128, capacity);
+				lba += 128;
+			}
+			continue;
+		}
+		n = 8 << (rnd() % 3);
+		if (rnd() % 30 == 0)
+			add(t, &now, 500 + rnd() % 4000, 0x2a, area + rnd() % 1024, 8, capacity);
+		else
+			add(t, &now, 500 + rnd() % 4000, 0x28, rnd() % area / n * n, n, capacity);
+	}
+}
+
+/*
+ * big sequential copy: 64 KB reads from one half, writes to the other,
+ * about 2.7 MB/s each way
+ */
+static void gen_copy(struct trace *t, uint32_t capacity, uint32_t count)
+{
+	uint32_t now = 0, half = capacity / 2, pos = 0;
+
+	while (t->count < count) {
+		if (pos + 128 > half)
+			pos = 0;
+		add(t, &now, 12000, 0x28, pos, 128, capacity);
+		add(t, &now, 12000, 0x2a, half + pos, 128, capacity);
+		pos += 128;
+	}
+}
+
+/*
+ * Small files: 4 to 16 KB, 70% reads, a third of them on the metadata
+ * at the start of the disk, a SYNCHRONIZE CACHE every 100 commands,
+ * about 500 commands per second.
+ */
+static void gen_mixed(struct trace *t, uint32_t capacity, uint32_t count)
+{
+	uint32_t now = 0, meta = capacity / 100 + 8, lba, n;
+	uint8_t op;
+
+	while (t->count < count) {
+		if (t->count % 100 == 99) {
+			add(t, &now, 500, 0x35, 0, 0, capacity);
+			continue;
+		}
+		n = 8 << (rnd() % 3);
+		op = rnd() % 10 < 7 ? 0x28 : 0x2a;
+		lba = rnd() % 3 ? meta + rnd() % (capacity - meta) : rnd() % meta;
+		add(t, &now, rnd() % 4000, op, lba / 8 * 8, n, capacity);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*gen)(struct trace *t, uint32_t capacity, uint32_t count);
+} workloads[] = {
+	{ "boot", gen_boot },
+	{ "copy", gen_copy },
+	{ "mixed", gen_mixed },
+};
+
+const char *trace_workloads(void)
+{
+	return "boot, copy, mixed";
+}
+
+int trace_generate(struct trace *t, const char *workload, uint32_t capacity,
+		   uint32_t count, uint32_t seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (strcmp(workloads[i].name, workload))
+			continue;
+		memset(t, 0, sizeof(*t));
+		t->blocksize = 512;
+		seed_x = seed ? seed : 2463534242;
+		workloads[i].gen(t, capacity, count);
+		return 0;
+	}
+	return -1;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t u = *(const uint32_t *)a, v = *(const uint32_t *)b;
+
+	return u < v ? -1 : u > v;
+}
+
+enum { CLASS_READ, CLASS_WRITE, CLASS_OTHER, CLASS_ALL, CLASSES };
+
+static int rec_class(const struct scsi_trace_rec *r)
+{
+	switch (r->opcode) {
+	case 0x08: case 0x28: case 0x88: case 0xa8:
+		return CLASS_READ;
+	case 0x0a: case 0x2a: case 0x8a: case 0xaa:
+		return CLASS_WRITE;
+	default:
+		return CLASS_OTHER;
+	}
+}
+
+static uint32_t pct(const uint32_t *v, uint32_t n, double p)
+{
+	uint32_t i = n * p;
+
+	return v[i < n ? i : n - 1];
+}
+
+/* latency is done - arrival, so it includes waiting behind earlier commands */
+void trace_report(const struct trace *t, FILE *f)
+{
+	static const char *names[CLASSES] = { "read", "write", "other", "all" };
+	uint32_t *lat[CLASSES], n[CLASSES] = { 0 }, first = UINT32_MAX, last = 0;
+	uint32_t i, c, skipped = 0, errors = 0;
+	uint64_t bytes[CLASSES] = { 0 };
+	double span;
+
+	for (c = 0; c < CLASSES; c++) {
+		lat[c] = malloc((t->count + 1) * sizeof(uint32_t));
+		if (!lat[c]) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < t->count; i++) {
+		const struct scsi_trace_rec *r = t->rec + i;
+		uint32_t l = r->done_us - r->arrival_us;
+
+		if (r->status == SCSI_TRACE_NOT_RUN) {
+			skipped++;
+			continue;
+		}
+		if (r->status)
+			errors++;
+		if (r->arrival_us < first)
+			first = r->arrival_us;
+		if (r->done_us > last)
+			last = r->done_us;
+		c = rec_class(r);
+		lat[c][n[c]++] = l;
+		lat[CLASS_ALL][n[CLASS_ALL]++] = l;
+		if (c != CLASS_OTHER) {
+			bytes[c] += (uint64_t)r->blocks * t->blocksize;
+			bytes[CLASS_ALL] += (uint64_t)r->blocks * t->blocksize;
+		}
+	}
+	span = n[CLASS_ALL] ? (last - first) / 1e6 : 0;
+	fprintf(f, "%u records, %u run, %u skipped, %u errors, %.3f s\n",
+		t->count, n[CLASS_ALL], skipped, errors, span);
+	if (n[CLASS_ALL])
+		fprintf(f, "  class    count       MB     MB/s     IOPS   p50 us   p90 us   p99 us p99.9 us   max us\n");
+	for (c = 0; c < CLASSES; c++) {
+		if (!n[c])
+			continue;
+		qsort(lat[c], n[c], sizeof(uint32_t), cmp_u32);
+		fprintf(f, "  %-6s %7u %8.2f %8.2f %8.0f %8u %8u %8u %8u %8u\n", names[c], n[c],
+			bytes[c] / 1e6, span > 0 ? bytes[c] / 1e6 / span : 0,
+			span > 0 ? n[c] / span : 0,
+			pct(lat[c], n[c], 0.5), pct(lat[c], n[c], 0.9), pct(lat[c], n[c], 0.99),
+			pct(lat[c], n[c], 0.999), lat[c][n[c] - 1]);
+	}
+	for (c = 0; c < CLASSES; c++)
+		free(lat[c]);
+}
@@ -0,0 +1,39 @@
+#ifndef TOOLS_TRACE_H
+#define TOOLS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../teensy4/scsi_stats.h"
+
+/*
+ * Trace files are a header followed by the firmware's own records, see
+ * SCSI_VENDOR_GET_TRACE. Everything is little endian like the Teensy.
+ */
+#define TRACE_MAGIC	0x43525453	/* "STRC" */
+#define TRACE_VERSION	1
+
+struct trace_file_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t count;
+	uint32_t blocksize;	/* for the byte counts in reports */
+} __attribute__((__packed__));
+
+struct trace {
+	struct scsi_trace_rec *rec;
+	uint32_t count;
+	uint32_t alloc;
+	uint32_t blocksize;
+};
+
+int trace_load(struct trace *t, const char *path);
+int trace_save(const struct trace *t, const char *path);
+void trace_append(struct trace *t, const struct scsi_trace_rec *r, uint32_t n);
+void trace_free(struct trace *t);
+int trace_generate(struct trace *t, const char *workload, uint32_t capacity,
+		   uint32_t count, uint32_t seed);
+const char *trace_workloads(void);
+void trace_report(const struct trace *t, FILE *f);
+
+#endif
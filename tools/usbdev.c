@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include "usbdev.h"
+
+static int read_sysfs(const char *dev, const char *attr, unsigned int *val, int base)
+{
+	char path[512], buf[32];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dev, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*val = strtoul(buf, NULL, base);
+	return 0;
+}
+
+int usbdev_open(uint16_t vid, uint16_t pid)
+{
+	unsigned int v, p, bus, dev;
+	struct dirent *de;
+	char path[64];
+	DIR *dir;
+	int fd = -1;
+
+	dir = opendir("/sys/bus/usb/devices");
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (read_sysfs(de->d_name, "idVendor", &v, 16) ||
+		    read_sysfs(de->d_name, "idProduct", &p, 16))
+			continue;
+		if (v != vid || p != pid)
+			continue;
+		if (read_sysfs(de->d_name, "busnum", &bus, 10) ||
+		    read_sysfs(de->d_name, "devnum", &dev, 10))
+			continue;
+		snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", bus, dev);
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			perror(path);
+		break;
+	}
+	closedir(dir);
+	return fd;
+}
+
+/* detach usb-storage/uas from the interface and claim it for us */
+int usbdev_claim(int fd, int intf)
+{
+	struct usbdevfs_ioctl cmd = {
+		.ifno = intf,
+		.ioctl_code = USBDEVFS_DISCONNECT,
+	};
+
+	ioctl(fd, USBDEVFS_IOCTL, &cmd);
+	return ioctl(fd, USBDEVFS_CLAIMINTERFACE, &intf);
+}
+
+int usbdev_control(int fd, uint8_t type, uint8_t req, uint16_t value,
+		   uint16_t index, void *data, uint16_t len, int timeout)
+{
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = type,
+		.bRequest = req,
+		.wValue = value,
+		.wIndex = index,
+		.wLength = len,
+		.timeout = timeout,
+		.data = data,
+	};
+
+	return ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+int usbdev_bulk(int fd, uint8_t ep, void *data, int len, int timeout)
+{
+	struct usbdevfs_bulktransfer bulk = {
+		.ep = ep,
+		.len = len,
+		.timeout = timeout,
+		.data = data,
+	};
+
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
@@ -0,0 +1,15 @@
+#ifndef TOOLS_USBDEV_H
+#define TOOLS_USBDEV_H
+
+#include <stdint.h>
+
+#define BRIDGE_VID 0x16c0
+#define BRIDGE_PID 0x0483
+
+int usbdev_open(uint16_t vid, uint16_t pid);
+int usbdev_claim(int fd, int intf);
+int usbdev_control(int fd, uint8_t type, uint8_t req, uint16_t value,
+		   uint16_t index, void *data, uint16_t len, int timeout);
+int usbdev_bulk(int fd, uint8_t ep, void *data, int len, int timeout);
+
+#endif